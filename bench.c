@@ -0,0 +1,1226 @@
+#include "gpnvm.h"
+#include "gpnvm_backend.h"
+#include "gpnvm_crc32c.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+
+/* declared attributes of the static layout benchmark */
+typedef struct {
+	UInt8 data[32];
+} bench_Config;
+
+#define GPNVM_SCHEMA(X) \
+	X(counter, 0xf0, UInt32) \
+	X(config, 0xf1, bench_Config)
+#include "gpnvm_static.h"
+
+/** SECTION: bench
+ * @title: gpnvm benchmarks
+ *
+ * Each benchmark prints one line per measurement: benchmark name, then
+ * parameters and results as key=value pairs, separated by spaces. Keys
+ * are only ever added, so the output can be compared between releases.
+ *
+ * Usage: bench [-q] [-b benchmark] [directory...]
+ *
+ * The stores are created in each directory given, by default in the
+ * current directory and in /dev/shm, a tmpfs, if it is writable, and
+ * once in memory with the memory backend. -q runs
+ * fewer rounds, -b runs only the named benchmark: crc32c, flash,
+ * lookup, getset, threads, durable, shared, recover, async, bulk,
+ * snapshot, toc, static, notify, delta or free.
+ */
+
+/* operations per measurement, and seconds per thread measurement */
+static unsigned long bench_rounds = 200000;
+static double bench_seconds = 0.5;
+
+/* benchmark selected with -b, NULL for all */
+static const char *bench_only;
+
+/* directory the stores are created in, and the store path */
+static const char *bench_dir = ".";
+static char bench_file[4096];
+
+/**
+ * bench_Now:
+ *
+ * Returns: monotonic time in seconds
+ */
+static double bench_Now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+/**
+ * bench_Selected:
+ * @name: benchmark name
+ *
+ * Returns: non zero if @name is to run
+ */
+static int bench_Selected(const char *name)
+{
+	return !bench_only || !strcmp(bench_only, name);
+}
+
+/**
+ * bench_Mode:
+ * @options: open options of the store
+ *
+ * Returns: name of the storage mode in the output
+ */
+static const char *bench_Mode(const gpNvm_Options *options)
+{
+	if (options->backend == &gpNvm_MemoryBackend)
+		return "memory";
+	return options->flags & GPNVM_OPEN_MMAP ? "mmap" : "file";
+}
+
+/**
+ * bench_Id:
+ * @i: key number
+ *
+ * Spread key numbers over the whole attribute ID range; the multiplier is
+ * odd, so distinct numbers below the range give distinct IDs.
+ *
+ * Returns: attribute ID of key @i
+ */
+static gpNvm_AttrId bench_Id(unsigned long i)
+{
+	return (gpNvm_AttrId)(i * 2654435761u);
+}
+
+/**
+ * bench_CompareDouble:
+ * @a: first value
+ * @b: second value
+ *
+ * qsort() helper ordering latencies.
+ *
+ * Returns: <0, 0 or >0
+ */
+static int bench_CompareDouble(const void *a, const void *b)
+{
+	double x = *(const double *)a, y = *(const double *)b;
+
+	return (x > y) - (x < y);
+}
+
+/**
+ * bench_Report:
+ * @lat: latency of every operation in seconds, sorted in place
+ * @n: number of operations
+ * @total: seconds taken by all operations
+ *
+ * Print ops/sec and latency percentiles in nanoseconds to end the line
+ * of a measurement.
+ */
+static void bench_Report(double *lat, unsigned long n, double total)
+{
+	qsort(lat, n, sizeof *lat, bench_CompareDouble);
+	printf(" ops_per_sec=%.0f p50_ns=%.0f p90_ns=%.0f p99_ns=%.0f p999_ns=%.0f max_ns=%.0f\n",
+		n / total, lat[n / 2] * 1e9, lat[n * 9 / 10] * 1e9, lat[n * 99 / 100] * 1e9,
+		lat[n * 999 / 1000] * 1e9, lat[n - 1] * 1e9);
+}
+
+/**
+ * bench_Keys:
+ * @keys: returns @n key numbers below @count
+ * @n: number of keys
+ * @count: number of keys in the store
+ * @pattern: "seq", "random" or "zipf"
+ *
+ * Access pattern: keys in turn, uniformly random, or Zipf distributed
+ * with exponent 0.99 so a few keys take most of the accesses.
+ */
+static void bench_Keys(unsigned long *keys, unsigned long n, unsigned long count, const char *pattern)
+{
+	unsigned long i, lo, hi;
+	double *cdf, sum = 0;
+
+	if (!strcmp(pattern, "seq")) {
+		for (i = 0; i != n; i++)
+			keys[i] = i % count;
+		return;
+	}
+	if (!strcmp(pattern, "random")) {
+		for (i = 0; i != n; i++)
+			keys[i] = (unsigned long)rand() % count;
+		return;
+	}
+
+	cdf = malloc(count * sizeof *cdf);
+	if (!cdf) {
+		memset(keys, 0, n * sizeof *keys);
+		return;
+	}
+	for (i = 0; i != count; i++)
+		cdf[i] = sum += 1.0 / pow(i + 1, 0.99);
+	for (i = 0; i != n; i++) {
+		double u = (double)rand() / RAND_MAX * sum;
+
+		for (lo = 0, hi = count - 1; lo < hi; ) {
+			unsigned long mid = (lo + hi) / 2;
+
+			if (cdf[mid] < u)
+				lo = mid + 1;
+			else
+				hi = mid;
+		}
+		keys[i] = lo;
+	}
+	free(cdf);
+}
+
+/**
+ * bench_Crc32c:
+ *
+ * Throughput of both CRC32C implementations over a buffer that stays in
+ * cache and over single record sized pieces.
+ */
+static void bench_Crc32c(void)
+{
+	static const unsigned long sizes[] = { 16, 64, 256, 4096, 65536 };
+	static const struct {
+		const char *name;
+		UInt32 (*crc)(UInt32, const void *, unsigned long);
+	} impls[] = {
+		{ "slice8", gpNvm_Crc32cSlice8 },
+		{ "sse42", gpNvm_Crc32cSse42 },
+	};
+	unsigned long total = bench_rounds << 12, i, n, rounds;
+	volatile UInt32 sink = 0;
+	UInt8 *buf = malloc(65536);
+	double start, elapsed;
+	int s, k;
+
+	if (!buf)
+		return;
+	for (i = 0; i != 65536; i++)
+		buf[i] = rand();
+
+	for (k = 0; k != sizeof impls / sizeof *impls; k++) {
+		if (impls[k].crc == gpNvm_Crc32cSse42 && !gpNvm_Crc32cHardware())
+			continue;
+		for (s = 0; s != sizeof sizes / sizeof *sizes; s++) {
+			n = sizes[s];
+			rounds = total / n;
+			start = bench_Now();
+			for (i = 0; i != rounds; i++)
+				sink ^= impls[k].crc(sink, buf, n);
+			elapsed = bench_Now() - start;
+			printf("crc32c impl=%s size=%lu gbps=%.2f\n",
+				impls[k].name, n, rounds * n / elapsed / 1e9);
+		}
+	}
+
+	free(buf);
+}
+
+/**
+ * bench_Lookup:
+ * @options: open options of the store
+ *
+ * Time of a read hit, copied out and as a view, as the number of
+ * attributes in the store grows, as far as the attribute ID width of the
+ * build allows. IDs are spread over the whole ID range.
+ */
+static void bench_Lookup(const gpNvm_Options *options)
+{
+	static const unsigned long counts[] = { 10, 100, 1000, 10000, 100000 };
+	unsigned long rounds = bench_rounds, i, n;
+	gpNvm_Handle *handle;
+	UInt8 value[16] = { 0 };
+	const UInt8 *view;
+	UInt8 length;
+	double start, elapsed, viewed;
+	int c;
+
+	for (c = 0; c != sizeof counts / sizeof *counts; c++) {
+		n = counts[c];
+		if (n > 1UL << (8 * sizeof(gpNvm_AttrId)))
+			break;
+		unlink(bench_file);
+		if (gpNvm_Open(&handle, bench_file, options))
+			return;
+		for (i = 0; i != n; i++)
+			gpNvm_Set(handle, bench_Id(i), sizeof value, value);
+
+		start = bench_Now();
+		for (i = 0; i != rounds; i++) {
+			length = sizeof value;
+			gpNvm_Get(handle, bench_Id(i * 40503 % n), &length, value);
+		}
+		elapsed = bench_Now() - start;
+
+		start = bench_Now();
+		for (i = 0; i != rounds; i++)
+			gpNvm_GetView(handle, bench_Id(i * 40503 % n), &view, &length);
+		viewed = bench_Now() - start;
+
+		printf("lookup dir=%s mode=%s idbits=%d keys=%lu ns_per_get=%.1f ns_per_view=%.1f\n",
+			bench_dir, bench_Mode(options),
+			(int)(8 * sizeof(gpNvm_AttrId)), n, elapsed / rounds * 1e9,
+			viewed / rounds * 1e9);
+
+		gpNvm_Close(handle);
+	}
+	unlink(bench_file);
+}
+
+/**
+ * bench_GetSet:
+ * @options: open options of the store
+ *
+ * Latency percentiles and ops/sec of gpNvm_GetAttribute() hits and
+ * misses and of gpNvm_SetAttribute() in place, across the number of
+ * attributes, the payload size and the access pattern. Misses ask for
+ * IDs of the same spread that are not in the store.
+ */
+static void bench_GetSet(const gpNvm_Options *options)
+{
+	static const unsigned long counts[] = { 16, 128, 1024, 16384 };
+	static const int payloads[] = { 1, 16, 64, 253 };
+	static const char *patterns[] = { "seq", "random", "zipf" };
+	static const char *ops[] = { "get_hit", "get_miss", "set" };
+	unsigned long n = bench_rounds / 10, count, i;
+	unsigned long *keys = malloc(n * sizeof *keys);
+	double *lat = malloc(n * sizeof *lat);
+	UInt8 value[255] = { 0 };
+	UInt8 length;
+	double start, total, t;
+	int c, p, a, o;
+
+	if (!keys || !lat)
+		goto out;
+
+	for (c = 0; c != sizeof counts / sizeof *counts; c++) {
+		count = counts[c];
+		if (2 * count > 1UL << (8 * sizeof(gpNvm_AttrId)))
+			break;
+		for (p = 0; p != sizeof payloads / sizeof *payloads; p++) {
+			unlink(bench_file);
+			if (gpNvm_OpenFileEx(bench_file, options))
+				goto out;
+			for (i = 0; i != count; i++)
+				gpNvm_SetAttribute(bench_Id(i), payloads[p], value);
+
+			for (a = 0; a != sizeof patterns / sizeof *patterns; a++) {
+				bench_Keys(keys, n, count, patterns[a]);
+				for (o = 0; o != sizeof ops / sizeof *ops; o++) {
+					total = 0;
+					for (i = 0; i != n; i++) {
+						length = payloads[p];
+						start = bench_Now();
+						if (o == 0)
+							gpNvm_GetAttribute(bench_Id(keys[i]), &length, value);
+						else if (o == 1)
+							gpNvm_GetAttribute(bench_Id(count + keys[i]), &length, value);
+						else
+							gpNvm_SetAttribute(bench_Id(keys[i]), length, value);
+						t = bench_Now() - start;
+						lat[i] = t;
+						total += t;
+					}
+					printf("getset dir=%s mode=%s idbits=%d keys=%lu payload=%d pattern=%s op=%s",
+						bench_dir, bench_Mode(options), (int)(8 * sizeof(gpNvm_AttrId)),
+						count, payloads[p], patterns[a], ops[o]);
+					bench_Report(lat, n, total);
+				}
+			}
+			gpNvm_CloseFile();
+		}
+	}
+	unlink(bench_file);
+out:
+	free(keys);
+	free(lat);
+}
+
+/* state shared by the threads of bench_Threads() */
+typedef struct {
+	gpNvm_Handle *handle;
+	int writer;
+	int *stop;
+	unsigned long ops;
+} bench_Thread;
+
+static void *bench_ThreadRun(void *p)
+{
+	bench_Thread *t = p;
+	UInt8 value[16];
+	UInt8 length;
+	unsigned long i;
+
+	for (i = 0; !__atomic_load_n(t->stop, __ATOMIC_RELAXED); i++) {
+		gpNvm_AttrId attrId = i * 7 % 64;
+
+		if (t->writer) {
+			memset(value, i, sizeof value);
+			gpNvm_Set(t->handle, attrId, sizeof value, value);
+		} else {
+			length = sizeof value;
+			gpNvm_Get(t->handle, attrId, &length, value);
+		}
+	}
+	t->ops = i;
+	return NULL;
+}
+
+/**
+ * bench_Threads:
+ * @options: open options of the store
+ *
+ * Reads per second of 1 to 8 threads reading the same store, on their
+ * own and next to one thread writing in place.
+ */
+static void bench_Threads(const gpNvm_Options *options)
+{
+	bench_Thread t[9];
+	pthread_t threads[9];
+	gpNvm_Handle *handle;
+	UInt8 value[16] = { 0 };
+	unsigned long reads;
+	int readers, writers, stop, i;
+	double start, elapsed;
+
+	unlink(bench_file);
+	if (gpNvm_Open(&handle, bench_file, options))
+		return;
+	for (i = 0; i != 64; i++)
+		gpNvm_Set(handle, i, sizeof value, value);
+
+	for (writers = 0; writers != 2; writers++) {
+		for (readers = 1; readers <= 8; readers *= 2) {
+			stop = 0;
+			for (i = 0; i != readers + writers; i++) {
+				t[i].handle = handle;
+				t[i].writer = i >= readers;
+				t[i].stop = &stop;
+				t[i].ops = 0;
+			}
+			start = bench_Now();
+			for (i = 0; i != readers + writers; i++)
+				pthread_create(&threads[i], NULL, bench_ThreadRun, &t[i]);
+			usleep(bench_seconds * 1e6);
+			__atomic_store_n(&stop, 1, __ATOMIC_RELAXED);
+			for (i = 0; i != readers + writers; i++)
+				pthread_join(threads[i], NULL);
+			elapsed = bench_Now() - start;
+
+			for (i = 0, reads = 0; i != readers; i++)
+				reads += t[i].ops;
+			printf("threads dir=%s mode=%s readers=%d writers=%d reads_per_sec=%.0f\n",
+				bench_dir, bench_Mode(options), readers, writers, reads / elapsed);
+		}
+	}
+
+	gpNvm_Close(handle);
+	unlink(bench_file);
+}
+
+static void *bench_DurableRun(void *p)
+{
+	bench_Thread *t = p;
+	UInt8 value[16];
+	unsigned long i;
+
+	for (i = 0; !__atomic_load_n(t->stop, __ATOMIC_RELAXED); i++) {
+		memset(value, i, sizeof value);
+		gpNvm_Set(t->handle, t->writer * 8 + i % 8, sizeof value, value);
+	}
+	t->ops = i;
+	return NULL;
+}
+
+/**
+ * bench_Durable:
+ * @options: open options of the store
+ *
+ * Writes per second of 1 to 8 threads writing in place at each
+ * durability level, and how many writes share one persist.
+ */
+static void bench_Durable(const gpNvm_Options *options)
+{
+	static const char *levels[] = { "none", "data", "full" };
+	gpNvm_Options durable = *options;
+	gpNvm_WriteCounters counters;
+	bench_Thread t[8];
+	pthread_t threads[8];
+	gpNvm_Handle *handle;
+	UInt8 value[16] = { 0 };
+	unsigned long writes, persists;
+	int level, writers, stop, i;
+	double start, elapsed;
+
+  /* nothing to persist in memory */
+	if (options->backend)
+		return;
+
+	for (level = GPNVM_DURABILITY_NONE; level <= GPNVM_DURABILITY_FULL; level++) {
+		for (writers = 1; writers <= 8; writers *= 2) {
+			unlink(bench_file);
+			durable.durability = level;
+			if (gpNvm_Open(&handle, bench_file, &durable))
+				return;
+			for (i = 0; i != 64; i++)
+				gpNvm_Set(handle, i, sizeof value, value);
+			gpNvm_GetWriteCounters(handle, &counters);
+
+			stop = 0;
+			for (i = 0; i != writers; i++) {
+				t[i].handle = handle;
+				t[i].writer = i;
+				t[i].stop = &stop;
+				t[i].ops = 0;
+			}
+			persists = counters.persists;
+			start = bench_Now();
+			for (i = 0; i != writers; i++)
+				pthread_create(&threads[i], NULL, bench_DurableRun, &t[i]);
+			usleep(bench_seconds * 1e6);
+			__atomic_store_n(&stop, 1, __ATOMIC_RELAXED);
+			for (i = 0; i != writers; i++)
+				pthread_join(threads[i], NULL);
+			elapsed = bench_Now() - start;
+			gpNvm_GetWriteCounters(handle, &counters);
+			persists = counters.persists - persists;
+
+			for (i = 0, writes = 0; i != writers; i++)
+				writes += t[i].ops;
+			printf("durable dir=%s mode=%s level=%s writers=%d writes_per_sec=%.0f writes_per_persist=%.2f\n",
+				bench_dir, bench_Mode(options), levels[level], writers, writes / elapsed,
+				persists ? (double)writes / persists : 0.0);
+			gpNvm_Close(handle);
+		}
+	}
+	unlink(bench_file);
+}
+
+/**
+ * bench_SharedRun:
+ * @options: open options of the store, shared
+ * @writer: non zero to write in place, zero to read
+ * @out: pipe to report on
+ *
+ * One process of bench_Shared(): open the store on its own, read or
+ * write its attributes for bench_seconds and report whether it wrote,
+ * the operations done and the reads done again.
+ */
+static void bench_SharedRun(const gpNvm_Options *options, int writer, int out)
+{
+	unsigned long report[3] = { writer, 0, 0 };
+	gpNvm_Handle *handle;
+	gpNvm_Stats stats;
+	UInt8 value[16];
+	UInt8 length;
+	double start;
+	int i;
+
+	if (gpNvm_Open(&handle, bench_file, options))
+		_exit(1);
+	start = bench_Now();
+	while (bench_Now() - start < bench_seconds) {
+		for (i = 0; i != 64; i++, report[1]++) {
+			if (writer) {
+				memset(value, report[1], sizeof value);
+				gpNvm_Set(handle, i, sizeof value, value);
+			} else {
+				length = sizeof value;
+				gpNvm_Get(handle, i, &length, value);
+			}
+		}
+	}
+	memset(&stats, 0, sizeof stats);
+	gpNvm_GetStats(handle, &stats);
+	report[2] = stats.sharedRetries;
+	gpNvm_Close(handle);
+	_exit(write(out, report, sizeof report) != sizeof report);
+}
+
+/**
+ * bench_Shared:
+ * @options: open options of the store
+ *
+ * Reads per second of 1 to 8 processes reading the same shared store,
+ * on their own and next to one process writing in place, and the share
+ * of reads done again as a write overlapped them.
+ */
+static void bench_Shared(const gpNvm_Options *options)
+{
+	gpNvm_Options shared = *options;
+	gpNvm_Handle *handle;
+	UInt8 value[16] = { 0 };
+	unsigned long report[3], reads, retries;
+	char segment[sizeof bench_file + 8];
+	int fds[2], readers, writers, n, i;
+	pid_t pids[9];
+
+  /* a mapping, or memory, is not shared between processes */
+	if (options->backend || (options->flags & GPNVM_OPEN_MMAP))
+		return;
+	shared.flags |= GPNVM_OPEN_SHARED;
+	snprintf(segment, sizeof segment, "%s.shm", bench_file);
+
+	unlink(bench_file);
+	unlink(segment);
+	if (gpNvm_Open(&handle, bench_file, &shared))
+		return;
+	for (i = 0; i != 64; i++)
+		gpNvm_Set(handle, i, sizeof value, value);
+
+	for (writers = 0; writers != 2; writers++) {
+		for (readers = 1; readers <= 8; readers *= 2) {
+			if (pipe(fds))
+				goto out;
+			n = readers + writers;
+			for (i = 0; i != n; i++) {
+				pids[i] = fork();
+				if (!pids[i])
+					bench_SharedRun(&shared, i >= readers, fds[1]);
+			}
+			close(fds[1]);
+			reads = retries = 0;
+			while (read(fds[0], report, sizeof report) == sizeof report) {
+				if (!report[0])
+					reads += report[1];
+				retries += report[2];
+			}
+			close(fds[0]);
+			for (i = 0; i != n; i++)
+				waitpid(pids[i], NULL, 0);
+
+			printf("shared dir=%s mode=%s readers=%d writers=%d reads_per_sec=%.0f retry_rate=%.4f\n",
+				bench_dir, bench_Mode(options), readers, writers,
+				reads / bench_seconds, reads ? (double)retries / reads : 0.0);
+		}
+	}
+out:
+	gpNvm_Close(handle);
+	unlink(bench_file);
+	unlink(segment);
+}
+
+/**
+ * bench_Async:
+ * @options: open options of the store
+ *
+ * Caller latency of gpNvm_Set() against gpNvm_SetAsync() over a few
+ * keys, and the time gpNvm_Flush() then takes to write out the queue.
+ */
+static void bench_Async(const gpNvm_Options *options)
+{
+	static const unsigned long counts[] = { 16, 256 };
+	unsigned long n = bench_rounds / 10, count, i;
+	double *lat = malloc(n * sizeof *lat);
+	gpNvm_Handle *handle;
+	UInt8 value[16] = { 0 };
+	double start, total, t;
+	int c, o;
+
+	if (!lat)
+		return;
+
+	for (c = 0; c != sizeof counts / sizeof *counts; c++) {
+		count = counts[c];
+		if (count > 1UL << (8 * sizeof(gpNvm_AttrId)))
+			break;
+		unlink(bench_file);
+		if (gpNvm_Open(&handle, bench_file, options))
+			break;
+		for (i = 0; i != count; i++)
+			gpNvm_Set(handle, bench_Id(i), sizeof value, value);
+
+		for (o = 0; o != 2; o++) {
+			total = 0;
+			for (i = 0; i != n; i++) {
+				memcpy(value, &i, sizeof i);
+				start = bench_Now();
+				if (o)
+					gpNvm_SetAsync(handle, bench_Id(i % count), sizeof value, value, NULL, NULL);
+				else
+					gpNvm_Set(handle, bench_Id(i % count), sizeof value, value);
+				t = bench_Now() - start;
+				lat[i] = t;
+				total += t;
+			}
+			printf("async dir=%s mode=%s keys=%lu op=%s",
+				bench_dir, bench_Mode(options), count, o ? "set_async" : "set");
+			bench_Report(lat, n, total);
+		}
+
+		start = bench_Now();
+		gpNvm_Flush(handle);
+		printf("async dir=%s mode=%s keys=%lu op=flush flush_ms=%.3f\n",
+			bench_dir, bench_Mode(options), count, (bench_Now() - start) * 1e3);
+		gpNvm_Close(handle);
+	}
+	unlink(bench_file);
+	free(lat);
+}
+
+/**
+ * bench_Bulk:
+ * @options: open options of the store
+ *
+ * Loading and storing a profile of attributes one gpNvm_Get() or
+ * gpNvm_Set() at a time against one gpNvm_GetMany() or gpNvm_SetMany(),
+ * the profile spread over a store of 256 attributes.
+ */
+static void bench_Bulk(const gpNvm_Options *options)
+{
+	static const int sizes[] = { 8, 32, 128 };
+	static const char *ops[] = { "get", "get_many", "set", "set_many" };
+	unsigned long n = bench_rounds / 100, count = 256, i;
+	double *lat = malloc(n * sizeof *lat);
+	gpNvm_AttrId attrIds[128];
+	UInt8 lengths[128], *values[128], data[128][16];
+	gpNvm_Handle *handle;
+	double start, total, t;
+	int s, o, k;
+
+	if (!lat || count > 1UL << (8 * sizeof(gpNvm_AttrId)))
+		goto out;
+
+	unlink(bench_file);
+	if (gpNvm_Open(&handle, bench_file, options))
+		goto out;
+	memset(data, 0, sizeof data);
+	for (i = 0; i != count; i++)
+		gpNvm_Set(handle, bench_Id(i), sizeof data[0], data[0]);
+
+	for (s = 0; s != sizeof sizes / sizeof *sizes; s++) {
+		for (k = 0; k != sizes[s]; k++) {
+			attrIds[k] = bench_Id(k * count / sizes[s]);
+			lengths[k] = sizeof data[k];
+			values[k] = data[k];
+		}
+		for (o = 0; o != sizeof ops / sizeof *ops; o++) {
+			total = 0;
+			for (i = 0; i != n; i++) {
+				start = bench_Now();
+				if (o == 1)
+					gpNvm_GetMany(handle, sizes[s], attrIds, lengths, values, NULL);
+				else if (o == 3)
+					gpNvm_SetMany(handle, sizes[s], attrIds, lengths, values, NULL);
+				for (k = 0; o == 0 && k != sizes[s]; k++)
+					gpNvm_Get(handle, attrIds[k], &lengths[k], values[k]);
+				for (k = 0; o == 2 && k != sizes[s]; k++)
+					gpNvm_Set(handle, attrIds[k], lengths[k], values[k]);
+				t = bench_Now() - start;
+				lat[i] = t;
+				total += t;
+			}
+			printf("bulk dir=%s mode=%s keys=%lu profile=%d op=%s",
+				bench_dir, bench_Mode(options), count, sizes[s], ops[o]);
+			bench_Report(lat, n, total);
+		}
+	}
+	gpNvm_Close(handle);
+	unlink(bench_file);
+out:
+	free(lat);
+}
+
+/**
+ * bench_Snapshot:
+ * @options: open options of the store
+ *
+ * Provisioning a fresh store with a full configuration: replaying
+ * gpNvm_Set() per attribute against importing a snapshot, and the time
+ * to export that snapshot.
+ */
+static void bench_Snapshot(const gpNvm_Options *options)
+{
+	static const unsigned long counts[] = { 64, 256 };
+	char snapshot[4096];
+	unsigned long count, i;
+	gpNvm_Handle *handle;
+	UInt8 value[32] = { 0 };
+	double start, replay, import, export;
+	int c;
+
+	snprintf(snapshot, sizeof snapshot, "%s/bench.snap", bench_dir);
+	for (c = 0; c != sizeof counts / sizeof *counts; c++) {
+		count = counts[c];
+		if (count > 1UL << (8 * sizeof(gpNvm_AttrId)))
+			break;
+
+		unlink(bench_file);
+		if (gpNvm_Open(&handle, bench_file, options))
+			break;
+		start = bench_Now();
+		for (i = 0; i != count; i++)
+			gpNvm_Set(handle, bench_Id(i), sizeof value, value);
+		replay = bench_Now() - start;
+		start = bench_Now();
+		gpNvm_ExportSnapshot(handle, snapshot);
+		export = bench_Now() - start;
+		gpNvm_Close(handle);
+
+		unlink(bench_file);
+		if (gpNvm_Open(&handle, bench_file, options))
+			break;
+		start = bench_Now();
+		gpNvm_ImportSnapshot(handle, snapshot);
+		import = bench_Now() - start;
+		gpNvm_Close(handle);
+
+		printf("snapshot dir=%s mode=%s keys=%lu payload=%d replay_ms=%.3f import_ms=%.3f export_ms=%.3f\n",
+			bench_dir, bench_Mode(options), count, (int)sizeof value,
+			replay * 1e3, import * 1e3, export * 1e3);
+	}
+	unlink(snapshot);
+	unlink(bench_file);
+}
+
+/**
+ * bench_Recover:
+ * @options: open options of the store
+ *
+ * Time to open a large log of records, the scan at open, intact and
+ * with bytes damaged at random places, the first few hits then more.
+ * The scan resynchronizes past each damaged header.
+ */
+static void bench_Recover(const gpNvm_Options *options)
+{
+	static const unsigned long divs[] = { 20, 2 };
+	static const int damages[] = { 0, 1, 16, 256 };
+	gpNvm_Options logged = *options;
+	unsigned long n, i;
+	gpNvm_Handle *handle;
+	gpNvm_Stats stats;
+	UInt8 value[16] = { 0 };
+	struct stat st;
+	double start, elapsed;
+	int c, d, done;
+	FILE *f;
+
+  /* the memory backend does not keep a store to open again */
+	if (options->backend)
+		return;
+	logged.flags |= GPNVM_OPEN_LOG;
+	logged.compactThreshold = 100;
+
+	for (c = 0; c != sizeof divs / sizeof *divs; c++) {
+		n = bench_rounds * 10 / divs[c];
+		unlink(bench_file);
+		if (gpNvm_Open(&handle, bench_file, &logged))
+			return;
+		for (i = 0; i != n; i++) {
+			if (i % 256 == 0)
+				gpNvm_BeginBatch(handle);
+			memcpy(value, &i, sizeof i);
+			gpNvm_Set(handle, i % 256, sizeof value, value);
+			if (i % 256 == 255 || i == n - 1)
+				gpNvm_CommitBatch(handle);
+		}
+		gpNvm_Close(handle);
+		if (stat(bench_file, &st))
+			return;
+
+		for (d = 0, done = 0; d != sizeof damages / sizeof *damages; d++) {
+			f = fopen(bench_file, "r+");
+			if (!f)
+				return;
+			for (; done < damages[d]; done++) {
+				fseek(f, 8 + rand() % (st.st_size - 8), SEEK_SET);
+				fputc(rand() | 1, f);
+			}
+			fclose(f);
+
+			start = bench_Now();
+			if (gpNvm_Open(&handle, bench_file, &logged))
+				return;
+			elapsed = bench_Now() - start;
+			gpNvm_GetStats(handle, &stats);
+			gpNvm_Close(handle);
+
+			printf("recover dir=%s mode=%s idbits=%d records=%lu bytes=%ld damage=%d open_ms=%.2f header_failures=%lu skipped_bytes=%lu\n",
+				bench_dir, bench_Mode(options), (int)(8 * sizeof(gpNvm_AttrId)),
+				n, (long)st.st_size, damages[d], elapsed * 1e3,
+				stats.headerFailures, stats.skipped);
+		}
+	}
+	unlink(bench_file);
+}
+
+/**
+ * bench_Toc:
+ * @options: open options of the store
+ *
+ * Time to open a large log of records with and without a table of
+ * contents, and what keeping the table up to date costs each write.
+ */
+static void bench_Toc(const gpNvm_Options *options)
+{
+	static const UInt32 tocs[] = { 0, GPNVM_OPEN_TOC };
+	gpNvm_Options logged = *options;
+	unsigned long n = bench_rounds / 2, i;
+	gpNvm_Handle *handle;
+	gpNvm_Stats stats;
+	UInt8 value[16] = { 0 };
+	double start, set, open;
+	int t;
+
+  /* the memory backend does not keep a store to open again */
+	if (options->backend)
+		return;
+	logged.compactThreshold = 100;
+
+	for (t = 0; t != sizeof tocs / sizeof *tocs; t++) {
+		logged.flags = options->flags | GPNVM_OPEN_LOG | tocs[t];
+		unlink(bench_file);
+		if (gpNvm_Open(&handle, bench_file, &logged))
+			return;
+		start = bench_Now();
+		for (i = 0; i != n; i++) {
+			memcpy(value, &i, sizeof i);
+			gpNvm_Set(handle, i % 256, sizeof value, value);
+		}
+		set = bench_Now() - start;
+		gpNvm_Close(handle);
+
+		start = bench_Now();
+		if (gpNvm_Open(&handle, bench_file, &logged))
+			return;
+		open = bench_Now() - start;
+		gpNvm_GetStats(handle, &stats);
+		gpNvm_Close(handle);
+
+		printf("toc dir=%s mode=%s toc=%d records=%lu set_us=%.2f open_ms=%.3f scanned=%lu\n",
+			bench_dir, bench_Mode(options), !!tocs[t], n,
+			set * 1e6 / n, open * 1e3, stats.scanned);
+	}
+	unlink(bench_file);
+}
+
+/**
+ * bench_Static:
+ * @options: open options of the store
+ *
+ * Time of a read of a declared attribute with GPNVM_STATIC_GET(), at its
+ * fixed offset, against gpNvm_Get() of the same attribute through the
+ * index, in a store that holds other attributes as well.
+ */
+static void bench_Static(const gpNvm_Options *options)
+{
+	gpNvm_Options laid = *options;
+	unsigned long rounds = bench_rounds, i;
+	gpNvm_Handle *handle;
+	bench_Config config = { { 0 } }, copy;
+	UInt32 counter = 1;
+	UInt8 length, value[16] = { 0 };
+	double start, indexed, fixed;
+
+	GPNVM_STATIC_OPTIONS(&laid);
+	unlink(bench_file);
+	if (gpNvm_Open(&handle, bench_file, &laid))
+		return;
+	for (i = 0; i != 100; i++)
+		gpNvm_Set(handle, i, sizeof value, value);
+	GPNVM_STATIC_SET(handle, counter, &counter);
+	GPNVM_STATIC_SET(handle, config, &config);
+
+	start = bench_Now();
+	for (i = 0; i != rounds; i++) {
+		length = sizeof copy;
+		gpNvm_Get(handle, gpNvm_StaticId_config, &length, (UInt8 *)&copy);
+	}
+	indexed = bench_Now() - start;
+
+	start = bench_Now();
+	for (i = 0; i != rounds; i++)
+		GPNVM_STATIC_GET(handle, config, &copy);
+	fixed = bench_Now() - start;
+
+	printf("static dir=%s mode=%s payload=%d ns_per_get=%.1f ns_per_static_get=%.1f\n",
+		bench_dir, bench_Mode(options), (int)sizeof copy,
+		indexed / rounds * 1e9, fixed / rounds * 1e9);
+
+	gpNvm_Close(handle);
+	unlink(bench_file);
+}
+
+static void bench_NotifyCount(gpNvm_Handle *handle, gpNvm_AttrId attrId, void *arg)
+{
+	(*(unsigned long *)arg)++;
+}
+
+/**
+ * bench_Notify:
+ * @options: open options of the store
+ *
+ * Writes per second in place with no one watching, a subscription per
+ * attribute and a notification descriptor, writing new values or the
+ * values already there, and the notifications that came of them.
+ */
+static void bench_Notify(const gpNvm_Options *options)
+{
+	static const char *watches[] = { "none", "callback", "fd" };
+	gpNvm_Handle *handle;
+	gpNvm_AttrId ids[64];
+	UInt8 value[16] = { 0 };
+	unsigned long writes, notified;
+	int watch, fresh, fd, count, i;
+	double start, elapsed;
+
+	for (watch = 0; watch != 3; watch++) {
+		for (fresh = 0; fresh != 2; fresh++) {
+			unlink(bench_file);
+			if (gpNvm_Open(&handle, bench_file, options))
+				return;
+			memset(value, 0, sizeof value);
+			for (i = 0; i != 64; i++)
+				gpNvm_Set(handle, i, sizeof value, value);
+			notified = 0;
+			for (i = 0; watch == 1 && i != 64; i++)
+				gpNvm_Subscribe(handle, i, bench_NotifyCount, &notified);
+			if (watch == 2 && gpNvm_GetNotifyFd(handle, &fd)) {
+				gpNvm_Close(handle);
+				continue;
+			}
+
+			start = bench_Now();
+			for (writes = 0; (elapsed = bench_Now() - start) < bench_seconds; ) {
+				for (i = 0; i != 64; i++, writes++) {
+					if (fresh)
+						memset(value, writes, sizeof value);
+					gpNvm_Set(handle, i, sizeof value, value);
+				}
+				count = 64;
+				if (watch == 2 && !gpNvm_ReadChanges(handle, ids, &count))
+					notified += count < 0 ? 64 : count;
+			}
+			printf("notify dir=%s mode=%s watch=%s values=%s writes_per_sec=%.0f notifications=%lu\n",
+				bench_dir, bench_Mode(options), watches[watch],
+				fresh ? "new" : "same", writes / elapsed, notified);
+			gpNvm_Close(handle);
+		}
+	}
+	unlink(bench_file);
+}
+
+/**
+ * bench_Delta:
+ * @options: open options of the store
+ *
+ * Writes per second of a 200 byte attribute written in place with the
+ * value it has, with one byte changed and with every byte changed, and
+ * the record bytes each write did not have to write.
+ */
+static void bench_Delta(const gpNvm_Options *options)
+{
+	static const char *changes[] = { "none", "byte", "all" };
+	gpNvm_WriteCounters before, after;
+	gpNvm_Handle *handle;
+	UInt8 value[200] = { 0 };
+	unsigned long writes;
+	int change, i;
+	double start, elapsed;
+
+	for (change = 0; change != 3; change++) {
+		unlink(bench_file);
+		if (gpNvm_Open(&handle, bench_file, options))
+			return;
+		for (i = 0; i != 64; i++)
+			gpNvm_Set(handle, i, sizeof value, value);
+		gpNvm_GetWriteCounters(handle, &before);
+
+		start = bench_Now();
+		for (writes = 0; (elapsed = bench_Now() - start) < bench_seconds; ) {
+			for (i = 0; i != 64; i++, writes++) {
+				if (change == 1)
+					value[100] = writes / 64;
+				else if (change == 2)
+					memset(value, writes / 64, sizeof value);
+				gpNvm_Set(handle, i, sizeof value, value);
+			}
+		}
+		gpNvm_GetWriteCounters(handle, &after);
+		printf("delta dir=%s mode=%s change=%s writes_per_sec=%.0f suppressed=%lu bytes_saved_per_write=%.1f\n",
+			bench_dir, bench_Mode(options), changes[change], writes / elapsed,
+			after.suppressed - before.suppressed,
+			(double)(after.bytesSaved - before.bytesSaved) / writes);
+		gpNvm_Close(handle);
+	}
+	unlink(bench_file);
+}
+
+/**
+ * bench_Free:
+ * @options: open options of the store
+ *
+ * Churn of 256 attributes: a random one deleted and another written with
+ * a random length in its place, as operations per second, the writes
+ * that went to free space and the size of the file it left.
+ */
+static void bench_Free(const gpNvm_Options *options)
+{
+	gpNvm_WriteCounters counters;
+	gpNvm_Handle *handle;
+	UInt8 value[128] = { 0 };
+	struct stat st;
+	unsigned long ops;
+	int i;
+	double start, elapsed;
+
+	unlink(bench_file);
+	if (gpNvm_Open(&handle, bench_file, options))
+		return;
+	for (i = 0; i != 256; i++)
+		gpNvm_Set(handle, bench_Id(i), 1 + rand() % sizeof value, value);
+
+	start = bench_Now();
+	for (ops = 0; (elapsed = bench_Now() - start) < bench_seconds; ops++) {
+		gpNvm_Delete(handle, bench_Id(rand() % 256));
+		gpNvm_Set(handle, bench_Id(rand() % 256), 1 + rand() % sizeof value, value);
+	}
+	gpNvm_GetWriteCounters(handle, &counters);
+	gpNvm_Close(handle);
+	if (stat(bench_file, &st))
+		st.st_size = 0;
+	printf("free dir=%s mode=%s ops_per_sec=%.0f deletes=%lu reused=%lu file_bytes=%ld\n",
+		bench_dir, bench_Mode(options), ops / elapsed, counters.deletes,
+		counters.reused, (long)st.st_size);
+	unlink(bench_file);
+}
+
+/**
+ * bench_Flash:
+ *
+ * Wear and write amplification of the layouts and flush policies on a
+ * simulated flash part: random updates of a set of attributes, counted
+ * as bytes programmed against data bytes set, sector erases and the
+ * erase and program time the part would take.
+ */
+static void bench_Flash(void)
+{
+	static const struct {
+		const char *name;
+		gpNvm_Options options;
+	} policies[] = {
+		{ "inplace", { 0 } },
+		{ "log", { GPNVM_OPEN_LOG } },
+		{ "inplace_wb16", { GPNVM_OPEN_WRITEBACK, 0, 16 } },
+		{ "log_wb16", { GPNVM_OPEN_LOG | GPNVM_OPEN_WRITEBACK, 0, 16 } },
+	};
+	static const int payloads[] = { 4, 16, 64 };
+	unsigned long n = bench_rounds / 100, i;
+	gpNvm_Options options;
+	gpNvm_WriteCounters counters;
+	gpNvm_FlashStats stats;
+	gpNvm_Flash *flash;
+	gpNvm_Handle *handle;
+	UInt8 value[64];
+	int p, s;
+
+	for (s = 0; s != sizeof policies / sizeof *policies; s++) {
+		for (p = 0; p != sizeof payloads / sizeof *payloads; p++) {
+			if (gpNvm_FlashCreate(&flash, NULL))
+				return;
+			options = policies[s].options;
+			options.backend = &gpNvm_FlashBackend;
+			options.backendArg = flash;
+			if (gpNvm_Open(&handle, NULL, &options)) {
+				gpNvm_FlashDestroy(flash);
+				return;
+			}
+			for (i = 0; i != n; i++) {
+				memset(value, i, sizeof value);
+				gpNvm_Set(handle, bench_Id(rand() % 32), payloads[p], value);
+			}
+			gpNvm_GetWriteCounters(handle, &counters);
+			gpNvm_Close(handle);
+			gpNvm_FlashGetStats(flash, &stats);
+			gpNvm_FlashDestroy(flash);
+
+			printf("flash policy=%s idbits=%d keys=32 payload=%d sets=%lu data_bytes=%lu programmed_bytes=%lu amplification=%.1f erases=%lu max_erases=%lu busy_ms=%.1f\n",
+				policies[s].name, (int)(8 * sizeof(gpNvm_AttrId)),
+				payloads[p], n, counters.bytes, stats.programmed,
+				counters.bytes ? (double)stats.programmed / counters.bytes : 0,
+				stats.erases, stats.maxErases, stats.busyUs / 1e3);
+		}
+	}
+}
+
+int main(int argc, char *argv[])
+{
+	static const gpNvm_Options modes[] = {
+		{ 0 }, { GPNVM_OPEN_MMAP }, { .backend = &gpNvm_MemoryBackend },
+	};
+	const char *dirs[] = { ".", "/dev/shm" };
+	int opt, d, m, ndirs;
+
+	while ((opt = getopt(argc, argv, "qb:")) != -1) {
+		switch (opt) {
+		case 'q':
+			bench_rounds /= 10;
+			bench_seconds /= 5;
+			break;
+		case 'b':
+			bench_only = optarg;
+			break;
+		default:
+			fprintf(stderr, "usage: %s [-q] [-b benchmark] [directory...]\n", argv[0]);
+			return 1;
+		}
+	}
+	ndirs = access(dirs[1], W_OK) ? 1 : 2;
+
+	if (bench_Selected("crc32c"))
+		bench_Crc32c();
+	if (bench_Selected("flash"))
+		bench_Flash();
+
+	for (d = 0; d != (optind < argc ? argc - optind : ndirs); d++) {
+		bench_dir = optind < argc ? argv[optind + d] : dirs[d];
+		snprintf(bench_file, sizeof bench_file, "%s/bench.nvm", bench_dir);
+
+		for (m = 0; m != sizeof modes / sizeof *modes; m++) {
+  /* a store in memory is the same in every directory */
+			if (modes[m].backend && d)
+				continue;
+			if (bench_Selected("lookup"))
+				bench_Lookup(&modes[m]);
+			if (bench_Selected("getset"))
+				bench_GetSet(&modes[m]);
+			if (bench_Selected("threads"))
+				bench_Threads(&modes[m]);
+			if (bench_Selected("durable"))
+				bench_Durable(&modes[m]);
+			if (bench_Selected("shared"))
+				bench_Shared(&modes[m]);
+			if (bench_Selected("recover"))
+				bench_Recover(&modes[m]);
+			if (bench_Selected("async"))
+				bench_Async(&modes[m]);
+			if (bench_Selected("bulk"))
+				bench_Bulk(&modes[m]);
+			if (bench_Selected("snapshot"))
+				bench_Snapshot(&modes[m]);
+			if (bench_Selected("toc"))
+				bench_Toc(&modes[m]);
+			if (bench_Selected("static"))
+				bench_Static(&modes[m]);
+			if (bench_Selected("notify"))
+				bench_Notify(&modes[m]);
+			if (bench_Selected("delta"))
+				bench_Delta(&modes[m]);
+			if (bench_Selected("free"))
+				bench_Free(&modes[m]);
+		}
+	}
+	return 0;
+}
@@ -1,8 +1,26 @@
+#define _GNU_SOURCE
+
 #include "gpnvm.h"
+#include "gpnvm_backend.h"
+#include "gpnvm_crc32c.h"
 
+#include <stddef.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 #include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sched.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#ifdef __linux__
+#include <stdint.h>
+#include <sys/eventfd.h>
+#include <sys/inotify.h>
+#endif
 
 /** SECTION: gpnvm
  * @title: Simple Non-Volatile Memory Storage
@@ -29,109 +47,829 @@
  * or a CRC is corrupt, there is always a backup config.
  */
 
-/* file pointer */
-static FILE *fp;
+/* superblock of headered files: magic, format version, format flags and
+ * a check over the preceding bytes. Files without it are in the original
+ * headerless layout, format version 0. */
+#define GPNVM_MAGIC "GPNV"
+#define GPNVM_SUPER_SIZE 8
+
+/* snapshot trailer: magic, size of the image before it and a CRC32C
+ * over that image */
+#define GPNVM_SNAPSHOT_MAGIC "GPNS"
+#define GPNVM_SNAPSHOT_TRAILER 12
+
+/* format versions: 1 protects records with 16-bit additive sums, like
+ * the original layout, 2 with CRC32C */
+#define GPNVM_VERSION_LEGACY 0
+#define GPNVM_VERSION_HEADERED 1
+#define GPNVM_VERSION_CRC32C 2
+
+/* format flags: records carry a sequence number, newest record wins */
+#define GPNVM_FMT_LOG 0x01
+/* format flags: attribute IDs are 16 or 32 bits wide, 8 without either */
+#define GPNVM_FMT_ID16 0x02
+#define GPNVM_FMT_ID32 0x04
+/* format flags: a table of contents after the superblock locates every
+ * live record, so open does not have to scan them */
+#define GPNVM_FMT_TOC 0x08
+
+/* ID width flag of this build, the width records are written in */
+#define GPNVM_FMT_ID (sizeof(gpNvm_AttrId) == 4 ? GPNVM_FMT_ID32 : \
+	sizeof(gpNvm_AttrId) == 2 ? GPNVM_FMT_ID16 : 0)
+
+/* table of contents, at GPNVM_TOC_START: its number of entries and a
+ * CRC32C over that, set when the file is written as a whole; then the
+ * part every write updates: number of entries used, end of the records,
+ * next sequence number, dead bytes and a check, the CRC32C of these
+ * plus the sum of those of the entries; then the entries: attribute ID,
+ * offset, sequence number and length. All fields are 32 bits but the
+ * length. */
+#define GPNVM_TOC_START GPNVM_SUPER_SIZE
+#define GPNVM_TOC_FIXED 8
+#define GPNVM_TOC_HEADER 20
+#define GPNVM_TOC_ENTRY 13
+#define GPNVM_TOC_ENTRIES (GPNVM_TOC_START + GPNVM_TOC_FIXED + GPNVM_TOC_HEADER)
+
+/* smallest number of table of contents entries, a full table doubles */
+#ifndef GPNVM_TOC_MIN
+#define GPNVM_TOC_MIN 64
+#endif
+
+/* shared mode: the segment is a file next to the store, its path with
+ * GPNVM_SHARED_SUFFIX added: a header page, then a copy of the index.
+ * The writer holds a lock on its first byte, every attached handle a
+ * shared lock on the second */
+#define GPNVM_SHARED_MAGIC "GPNI"
+#define GPNVM_SHARED_SUFFIX ".shm"
+#define GPNVM_SHARED_HEADER 4096
+#define GPNVM_SHARED_WRITER 0
+#define GPNVM_SHARED_ATTACH 1
+
+/* reads wait this many yields for a write in progress before they test
+ * whether its writer is still there */
+#ifndef GPNVM_SHARED_SPINS
+#define GPNVM_SHARED_SPINS 64
+#endif
+
+/* shared mode takes open file description locks, without them it is not
+ * available */
+#ifdef F_OFD_SETLK
+#define GPNVM_SHARED_LOCKS 1
+#else
+#define GPNVM_SHARED_LOCKS 0
+#define F_OFD_SETLK F_SETLK
+#define F_OFD_SETLKW F_SETLKW
+#endif
+
+/* change notification descriptors: an eventfd, in shared mode inotify on
+ * the segment; without them there is no descriptor to wait on */
+#ifdef __linux__
+#define GPNVM_NOTIFY_FDS 1
+#else
+#define GPNVM_NOTIFY_FDS 0
+#endif
+
+/* changes kept for the readers of the descriptor, one that falls further
+ * behind loses them */
+#ifndef GPNVM_NOTIFY_RING
+#define GPNVM_NOTIFY_RING 256
+#endif
+
+/* orders the reads of a shared read before the second load of @gen, the
+ * generation; ThreadSanitizer does not support fences, an update that
+ * changes nothing orders them as well */
+#if defined(__SANITIZE_THREAD__)
+#define GPNVM_SHARED_FENCE(gen) ((void)__atomic_fetch_add((gen), 0, __ATOMIC_ACQ_REL))
+#else
+#define GPNVM_SHARED_FENCE(gen) __atomic_thread_fence(__ATOMIC_ACQUIRE)
+#endif
+
+/* first byte of every record in headered files */
+#define GPNVM_TAG_RECORD 0xa5
+
+/* first byte of free space in headered files, see gpNvm_PackFree() */
+#define GPNVM_TAG_FREE 0x5a
+
+/* first byte of the marker of a block of records written as one unit,
+ * see gpNvm_PackMark(): pending until all of them are written, then
+ * committed, which only clears bits so flash needs no erase for it */
+#define GPNVM_TAG_PENDING 0xe7
+#define GPNVM_TAG_COMMIT 0x24
+
+/* data of a marker: size of its block and its sequence number */
+#define GPNVM_MARK_DATA 8
+
+/* largest record header: tag, attribute ID, length, sequence number and
+ * header check */
+#define GPNVM_HEADER_MAX (1 + sizeof(gpNvm_AttrId) + 1 + 4 + 4)
+
+/* largest record: header, 8-bit length worth of data and checksum */
+#define GPNVM_RECORD_MAX (GPNVM_HEADER_MAX + 0xff + 4)
+
+/* log mode compacts once this percentage of the records is dead ... */
+#ifndef GPNVM_COMPACT_THRESHOLD
+#define GPNVM_COMPACT_THRESHOLD 50
+#endif
+
+/* ... and the records take at least this many bytes */
+#ifndef GPNVM_COMPACT_MIN
+#define GPNVM_COMPACT_MIN 4096
+#endif
+
+/* a record replaced in place is written from its first to its last
+ * changed byte, in pieces where this many bytes in between did not */
+#ifndef GPNVM_DELTA_GAP
+#define GPNVM_DELTA_GAP 256
+#endif
+
+/* initial number of index slots, the index doubles when 3/4 full */
+#ifndef GPNVM_INDEX_MIN
+#define GPNVM_INDEX_MIN 64
+#endif
+
+/* number of record locks, attribute IDs are spread over them */
+#ifndef GPNVM_LOCK_STRIPES
+#define GPNVM_LOCK_STRIPES 16
+#endif
+
+/* largest read of the records of gpNvm_GetMany() in one go, the gaps
+ * between them included */
+#ifndef GPNVM_READ_RUN
+#define GPNVM_READ_RUN 4096
+#endif
+
+/* runtime statistics: relaxed atomic adds to the counters of the handle,
+ * nothing at all with GPNVM_STATS set to 0 */
+#if GPNVM_STATS
+#define GPNVM_STATS_ADD(h, field, n) \
+	__atomic_add_fetch(&(h)->stats.field, (n), __ATOMIC_RELAXED)
+#define GPNVM_STATS_NOW() gpNvm_StatsNow()
+#define GPNVM_STATS_CLOCK() gpNvm_StatsClock()
+#define GPNVM_STATS_TIME(h, histogram, start) \
+	gpNvm_StatsTime((h)->stats.histogram, (start))
+#else
+#define GPNVM_STATS_ADD(h, field, n) do { } while (0)
+#define GPNVM_STATS_NOW() 0L
+#define GPNVM_STATS_CLOCK() 0L
+#define GPNVM_STATS_TIME(h, histogram, start) ((void)(start))
+#endif
 
 /**
- * gpNvm_OpenFile:
- * @filename: file to open
+ * gpNvm_Format:
+ * @version: format version, %GPNVM_VERSION_LEGACY if there is no superblock
+ * @flags: GPNVM_FMT_* flags
+ * @toc: number of table of contents entries, with %GPNVM_FMT_TOC
+ *
+ * On-disk format of a file, it sets the record layout.
+ */
+typedef struct {
+	UInt8 version;
+	UInt8 flags;
+	UInt32 toc;
+} gpNvm_Format;
+
+/**
+ * gpNvm_IndexEntry:
+ * @offset: file offset of the record header
+ * @seq: sequence number of the record, log format only
+ * @slot: entry of the attribute in the table of contents
+ * @view: checked data handed out by gpNvm_GetView(), NULL until then;
+ * points into the image if the storage is in memory, to a copy otherwise
+ * @check: check of the data, if @checked
+ * @attrId: attribute ID (key)
+ * @length: length of the data
+ * @valid: non zero if the attribute is present in the file, zero for a
+ * free slot
+ * @checked: non zero if the check of the data is known, as this handle
+ * wrote the record
  *
- * Open the file, if the file is not present, return a fp to an newly
- * created file.
+ * Location of one attribute in the file, so lookups do not have to scan
+ * the record headers. One slot of the open addressing index.
+ */
+typedef struct {
+	long offset;
+	UInt32 seq;
+	UInt32 slot;
+	UInt8 *view;
+	UInt32 check;
+	gpNvm_AttrId attrId;
+	UInt8 length;
+	UInt8 valid;
+	UInt8 checked;
+} gpNvm_IndexEntry;
+
+/**
+ * gpNvm_Extent:
+ * @offset: file offset
+ * @size: size in bytes
  *
- * Returns: custom error code
+ * A range of the file, one piece of free space.
  */
-gpNvm_Result gpNvm_OpenFile(const char *filename)
-{
-	if (fp || !filename)
-		return 1;
+typedef struct {
+	long offset;
+	long size;
+} gpNvm_Extent;
+
+/**
+ * gpNvm_SharedEntry:
+ * @offset: file offset of the record header
+ * @seq: sequence number of the record, log format only
+ * @slot: entry of the attribute in the table of contents
+ * @attrId: attribute ID (key)
+ * @length: length of the data
+ * @valid: non zero if the slot is used
+ *
+ * One slot of the index in the segment of a shared store, a
+ * gpNvm_IndexEntry without the view, which is local to a process.
+ */
+typedef struct {
+	long offset;
+	UInt32 seq;
+	UInt32 slot;
+	gpNvm_AttrId attrId;
+	UInt8 length;
+	UInt8 valid;
+} gpNvm_SharedEntry;
+
+/**
+ * gpNvm_SharedState:
+ *
+ * What the handles of a shared store must agree on besides the index:
+ * the fields of the handle by the same name, and the number of times an
+ * image was swapped in, after which the others open the file again.
+ * Kept zero filled apart from the fields, so states compare as memory.
+ */
+typedef struct {
+	long end;
+	long dead;
+	unsigned long replaced;
+	UInt32 seq;
+	UInt32 toc;
+	UInt32 tocUsed;
+	UInt32 tocSum;
+	UInt32 tocMin;
+	UInt32 indexSize;
+	UInt32 indexCount;
+	int staticOk;
+	UInt8 version;
+	UInt8 flags;
+} gpNvm_SharedState;
+
+/**
+ * gpNvm_NotifyRing:
+ * @count: changes noted so far, the last %GPNVM_NOTIFY_RING of them are
+ * kept
+ * @reset: value of @count after the last change to everything, an import
+ * @ids: attribute IDs of the changes, change n at n modulo the size
+ *
+ * Changes read through the notification descriptor. Written under the
+ * notify mutex, and in shared mode the writer lock as well, read without
+ * a lock: a reader takes @count, copies the IDs before it and takes
+ * @count again to see whether they were overwritten meanwhile.
+ */
+typedef struct {
+	unsigned long count;
+	unsigned long reset;
+	UInt32 ids[GPNVM_NOTIFY_RING];
+} gpNvm_NotifyRing;
+
+/**
+ * gpNvm_SharedHeader:
+ * @magic: %GPNVM_SHARED_MAGIC once set up
+ * @idSize: size of attribute IDs of the builds sharing the store
+ * @valid: non zero if the index and the state are those of the file
+ * @generation: odd while a write is in progress, moved on by every write
+ * @layout: moved on every time the index or the state changes
+ * @state: state of the store
+ * @watchers: handles with a notification descriptor, writes note their
+ * changes in @ring only while there are any
+ * @ring: changes of all processes
+ * @touch: written to wake the readers of the descriptors, which watch
+ * the segment for changes
+ *
+ * Start of the segment of a shared store, mapped by every handle. Reads
+ * go on without a lock: they take the generation before and after, and
+ * are done again if it moved, a sequence lock.
+ */
+typedef struct {
+	char magic[4];
+	UInt32 idSize;
+	int valid;
+	unsigned long generation;
+	unsigned long layout;
+	gpNvm_SharedState state;
+	unsigned long watchers;
+	gpNvm_NotifyRing ring;
+	UInt8 touch;
+} gpNvm_SharedHeader;
+
+/**
+ * gpNvm_Staged:
+ * @attrId: attribute ID (key)
+ * @length: length of the data
+ * @offset: file offset the record is written to, set at commit
+ * @seq: sequence number of the record, set at commit
+ * @check: check of the data, set at commit
+ * @value: copy of the data
+ *
+ * One record waiting to be written, either by a batch or by a single
+ * gpNvm_Set().
+ */
+typedef struct {
+	gpNvm_AttrId attrId;
+	UInt8 length;
+	long offset;
+	UInt32 seq;
+	UInt32 check;
+	UInt8 value[0xff];
+} gpNvm_Staged;
+
+/**
+ * gpNvm_StagedSet:
+ * @records: staged records, one per attribute
+ * @count: number of records
+ * @size: number of records allocated
+ *
+ * Records held in memory until they are written: those of an open batch,
+ * and the dirty records of the write-back cache.
+ */
+typedef struct {
+	gpNvm_Staged *records;
+	int count;
+	int size;
+} gpNvm_StagedSet;
+
+/**
+ * gpNvm_Fetch:
+ * @offset: file offset of the record header
+ * @attrId: attribute ID (key)
+ * @length: length of the data
+ * @entry: position of the attribute in the arguments
+ *
+ * One record read by gpNvm_GetMany().
+ */
+typedef struct {
+	long offset;
+	gpNvm_AttrId attrId;
+	UInt8 length;
+	int entry;
+} gpNvm_Fetch;
+
+/**
+ * gpNvm_Completion:
+ * @callback: called with the result of the write, NULL for none
+ * @arg: passed to @callback
+ * @attrId: attribute ID (key)
+ * @length: length of the data
+ *
+ * One gpNvm_SetAsync() call waiting for its write.
+ */
+typedef struct {
+	gpNvm_Callback callback;
+	void *arg;
+	gpNvm_AttrId attrId;
+	UInt8 length;
+} gpNvm_Completion;
+
+/**
+ * gpNvm_Subscription:
+ * @notify: called for every change of the attribute
+ * @arg: passed to @notify
+ * @attrId: attribute ID (key)
+ *
+ * One gpNvm_Subscribe() call.
+ */
+typedef struct {
+	gpNvm_Notify notify;
+	void *arg;
+	gpNvm_AttrId attrId;
+} gpNvm_Subscription;
+
+/**
+ * gpNvm_Queue:
+ * @records: queued records, one per attribute with its newest value
+ * @completions: one per call, in call order
+ * @count: number of completions
+ * @size: number of completions allocated
+ *
+ * Writes queued by gpNvm_SetAsync(), or being written by the worker.
+ */
+typedef struct {
+	gpNvm_StagedSet records;
+	gpNvm_Completion *completions;
+	int count;
+	int size;
+} gpNvm_Queue;
+
+/**
+ * gpNvm_Handle:
+ *
+ * One open store. A handle owns its storage, index and buffers; handles
+ * share no state, so several stores can be used side by side.
+ */
+struct gpNvm_Handle {
+	/* storage backend, and its context: NULL while nothing is attached */
+	const gpNvm_Backend *backend;
+	void *ctx;
+	/* contents of the storage if the backend has them in memory, views
+	 * point into it; NULL otherwise */
+	UInt8 *image;
+
+	/* offset index, hashed on attribute ID with linear probing, built at
+	 * open: a power of two number of slots, of which count are used */
+	gpNvm_IndexEntry *index;
+	UInt32 indexSize;
+	UInt32 indexCount;
 
-	fp = fopen(filename, "r+");
-	if (!fp)
-		fp = fopen(filename, "w+");
+	/* end of the last valid record: new records are appended here */
+	long end;
 
-	return fp == NULL;
+	/* free space of the in-place format: extents of deleted and moved
+	 * records, sorted by offset, adjacent ones merged as far as one free
+	 * header covers them. Found from the gaps between the records by the
+	 * first write that needs them, holesKnown is non zero once they are */
+	gpNvm_Extent *holes;
+	int holeCount;
+	int holeSize;
+	int holesKnown;
+	/* committed marker of the last block written, freed by the next
+	 * write once that no longer needs it; -1 if none */
+	long batchMark;
+
+	/* format of the file, and the format records are written in: a file
+	 * in another format is rewritten on the first write */
+	gpNvm_Format format;
+	gpNvm_Format want;
+
+	/* log format: next sequence number and bytes taken by dead records */
+	UInt32 seq;
+	long dead;
+	UInt8 threshold;
+
+	/* bytes the scan at open skipped over damaged records */
+	long damaged;
+
+	/* table of contents: entries used, more than there are if it is not
+	 * kept up to date, and the sum of the CRC32C of the entries; the
+	 * smallest number of entries of the next image written */
+	UInt32 tocUsed;
+	UInt32 tocSum;
+	UInt32 tocMin;
+	/* attribute of each entry used, for tocIdsSize entries, so a removed
+	 * entry finds the last one to move into its place */
+	gpNvm_AttrId *tocIds;
+	UInt32 tocIdsSize;
+
+	/* static layout: the declared attributes, and their IDs sorted to
+	 * find them; non zero if their records are laid out, from staticBase
+	 * to staticEnd */
+	const gpNvm_StaticAttr *schema;
+	int schemaCount;
+	gpNvm_AttrId *staticIds;
+	int staticOk;
+	long staticBase;
+	long staticEnd;
+
+	/* shared mode: the segment, its header mapped while the store is
+	 * open and its table for sharedMapped slots; the layout of the
+	 * segment the index was copied from or published as last, and the
+	 * image swaps seen. Non zero while the writer lock is held, if the
+	 * index changed since it was published, and if no other handle had
+	 * the store open at attach. The path and the backend argument open
+	 * the file again after another handle swapped it */
+	gpNvm_SharedHeader *shared;
+	gpNvm_SharedEntry *sharedTable;
+	UInt32 sharedMapped;
+	int sharedFd;
+	unsigned long sharedLayout;
+	unsigned long sharedReplaced;
+	int sharedHeld;
+	int sharedDirty;
+	int sharedFirst;
+	char *path;
+	void *backendArg;
+
+	/* open flags */
+	UInt32 flags;
+
+	/* records staged by the open batch */
+	gpNvm_StagedSet batch;
+	/* non zero between gpNvm_BeginBatch() and commit or abort */
+	int batching;
+
+	/* write-back cache: records written since the last flush, flushed
+	 * after flushWrites writes, or by the flusher thread every flushMs */
+	gpNvm_StagedSet dirty;
+	UInt32 flushWrites;
+	UInt32 flushMs;
+	/* writes taken by the cache since the last flush */
+	UInt32 pending;
+	/* flusher thread, it sleeps on the condition until stopped */
+	pthread_t flusher;
+	int flusherRunning;
+	int flusherStop;
+	pthread_mutex_t flusherMutex;
+	pthread_cond_t flusherCond;
+
+	/* asynchronous writes: gpNvm_SetAsync() queues them under the queue
+	 * mutex only, the worker thread swaps the queue with the drain set
+	 * under the structure lock and writes it out. Calls are numbered:
+	 * queued were accepted, drained are done, so gpNvm_Flush() waits for
+	 * the calls before it */
+	gpNvm_Queue queue;
+	gpNvm_Queue drain;
+	unsigned long queued;
+	unsigned long drained;
+	int queueFailed;
+	pthread_t worker;
+	int workerRunning;
+	int workerStop;
+	pthread_mutex_t queueMutex;
+	pthread_cond_t queueCond;
+	pthread_cond_t drainCond;
+
+	/* durability level of the writes, and group commit: write passes are
+	 * counted, one thread at a time persists up to the count when it
+	 * started while the others wait on the condition. Counts made
+	 * durable at the data and the full level, and the count the last
+	 * failed persist was to cover */
+	UInt8 durability;
+	unsigned long commitWritten;
+	unsigned long commitSynced[2];
+	unsigned long commitFailed;
+	int committing;
+	pthread_mutex_t commitMutex;
+	pthread_cond_t commitCond;
+
+	/* change notification, under the notify mutex: the subscriptions,
+	 * and the attributes written with a new value for them since the
+	 * last delivery; non zero if an import changed them all, if the
+	 * descriptors are to be woken and if there is anything to deliver.
+	 * The ring of changes, the one in the handle or, in shared mode, in
+	 * the segment; the descriptor, -1 for none, and the count of the
+	 * ring its reader is at */
+	gpNvm_Subscription *subs;
+	int subCount;
+	int subSize;
+	gpNvm_AttrId *noted;
+	int notedCount;
+	int notedSize;
+	int notifyAll;
+	int notifySignal;
+	int notifyDue;
+	gpNvm_NotifyRing ringLocal;
+	gpNvm_NotifyRing *ring;
+	int notifyFd;
+	unsigned long notifyRead;
+	pthread_mutex_t notifyMutex;
+
+	/* counted with atomic adds, see gpNvm_GetWriteCounters() */
+	gpNvm_WriteCounters counters;
+#if GPNVM_STATS
+	/* counted with atomic adds, see gpNvm_GetStats() */
+	gpNvm_Stats stats;
+#endif
+
+	/* structure lock: shared by reads and by writes that replace a
+	 * record in place, exclusive for anything that moves records, grows
+	 * the file or touches the batch */
+	pthread_rwlock_t lock;
+	/* record locks, taken under the shared structure lock: shared by
+	 * reads, exclusive by the in place write of one of its records */
+	pthread_rwlock_t stripes[GPNVM_LOCK_STRIPES];
+};
+
+/* handle behind the original API, gpNvm_OpenFile() to gpNvm_CloseFile() */
+static gpNvm_Handle *gpNvm_default;
+
+/* write-back cache, used by open and close */
+static int gpNvm_FlusherStart(gpNvm_Handle *h);
+static void gpNvm_FlusherStop(gpNvm_Handle *h);
+static int gpNvm_FlushDirty(gpNvm_Handle *h);
+
+/* rewrite, used by open to repair */
+static int gpNvm_Rewrite(gpNvm_Handle *h);
+
+/* asynchronous writes, used by reads, writes and close */
+static gpNvm_Staged *gpNvm_QueueFind(gpNvm_Handle *h, gpNvm_AttrId attrId, gpNvm_Staged *copy);
+static void gpNvm_WorkerStop(gpNvm_Handle *h);
+
+#if GPNVM_STATS
+/* operations of this thread, to time one in GPNVM_STATS_SAMPLE */
+static __thread unsigned gpNvm_statsTick;
+
+/**
+ * gpNvm_StatsClock:
+ *
+ * Returns: monotonic time in nanoseconds
+ */
+static long gpNvm_StatsClock(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000L + ts.tv_nsec;
 }
 
 /**
- * gpNvm_CloseFile:
+ * gpNvm_StatsNow:
  *
- * Close the file global handle
+ * Start timing a read or write, if it is one of the sample. Reading the
+ * clock costs about as much as a cached read itself.
  *
- * Returns: custom error code
+ * Returns: monotonic time in nanoseconds, 0 if not timed
  */
-gpNvm_Result gpNvm_CloseFile(void)
+static long gpNvm_StatsNow(void)
 {
-	gpNvm_Result ret = fp ? fclose(fp) : 1;
-	fp = NULL;
-	return ret;
+	if (++gpNvm_statsTick % GPNVM_STATS_SAMPLE)
+		return 0;
+
+	return gpNvm_StatsClock();
+}
+
+/**
+ * gpNvm_StatsTime:
+ * @histogram: latency histogram of GPNVM_STATS_BUCKETS buckets
+ * @start: start time of the operation, from gpNvm_StatsNow()
+ *
+ * Count a timed operation in the bucket of the log2 of its duration in
+ * nanoseconds; the last bucket takes all longer ones.
+ */
+static void gpNvm_StatsTime(unsigned long *histogram, long start)
+{
+	unsigned long ns;
+	int bucket;
+
+	if (!start)
+		return;
+
+	ns = gpNvm_StatsClock() - start;
+	bucket = ns ? 8 * sizeof ns - 1 - __builtin_clzl(ns) : 0;
+
+	if (bucket >= GPNVM_STATS_BUCKETS)
+		bucket = GPNVM_STATS_BUCKETS - 1;
+	__atomic_add_fetch(&histogram[bucket], 1, __ATOMIC_RELAXED);
 }
+#endif
 
 /**
- * gpNvm_Read:
+ * gpNvm_ReadAt:
+ * @h: handle of the store
+ * @offset: storage offset to read from
  * @ptr: location to read
  * @len: length to read
  *
- * Simple wrapper around fread, read byte wise
- *
- * Returns: custom error code and mask the bytes read return code
- * from fread. Success if number of bytes asked to read is number of
- * bytes read.
+ * Returns: 1 if the number of bytes asked to read is the number of
+ * bytes read, 0 otherwise.
  */
-static int gpNvm_Read(void *ptr, int len)
+static int gpNvm_ReadAt(gpNvm_Handle *h, long offset, void *ptr, int len)
 {
-	return fread(ptr, 1, len, fp) == len;
+	if (h->backend->readAt(h->ctx, offset, ptr, len))
+		return 0;
+
+	GPNVM_STATS_ADD(h, bytesRead, len);
+	return 1;
 }
 
 /**
- * gpNvm_Write:
+ * gpNvm_WriteAt:
+ * @h: handle of the store
+ * @offset: storage offset to write to
  * @ptr: location to the byte array to write
  * @len: number of elements to write
  *
- * Simple wrapper around fwrite, write byte wise
+ * Returns: 1 if all bytes are written, 0 otherwise.
+ */
+static int gpNvm_WriteAt(gpNvm_Handle *h, long offset, const void *ptr, int len)
+{
+	if (h->backend->writeAt(h->ctx, offset, ptr, len))
+		return 0;
+
+	GPNVM_STATS_ADD(h, bytesWritten, len);
+	return 1;
+}
+
+/**
+ * gpNvm_SyncAt:
+ * @h: handle of the store
+ * @offset: storage offset of the written range
+ * @len: length of the written range
+ *
+ * Push a written range to storage.
  *
- * Returns: custom error code ad mask bytes write. Success if number of
- * bytes pass is number of bytes written.
+ * Returns: 0 if success
  */
-static int gpNvm_Write(void *ptr, int len)
+static int gpNvm_SyncAt(gpNvm_Handle *h, long offset, int len)
 {
-	return fwrite(ptr, 1, len, fp) == len;
+	long now = GPNVM_STATS_CLOCK();
+	int ret = h->backend->sync(h->ctx, offset, len);
+
+	GPNVM_STATS_ADD(h, flushes, 1);
+	GPNVM_STATS_TIME(h, flushLatency, now);
+	return ret;
 }
 
 /**
- * gpNvm_SeekFile:
- * @key: key to search
- * @pLength:
+ * gpNvm_Written:
+ * @h: handle of the store
  *
- * Returns: -1
+ * Returns: number of write passes done so far; taken before the locks
+ * of a write are released, it covers that write for gpNvm_Commit()
  */
-static int gpNvm_SeekFile(gpNvm_AttrId key, UInt8 *pLength)
+static unsigned long gpNvm_Written(gpNvm_Handle *h)
 {
-	gpNvm_AttrId attrId;
-	UInt16 sum;
-	UInt8 len;
+	return __atomic_load_n(&h->commitWritten, __ATOMIC_ACQUIRE);
+}
 
-	rewind(fp);
+/**
+ * gpNvm_Commit:
+ * @h: handle of the store
+ * @ticket: write passes to make durable, from gpNvm_Written()
+ * @level: GPNVM_DURABILITY_* level to make them durable at
+ *
+ * Group commit, called with no lock held: one caller at a time persists,
+ * covering every write pass done by the time it starts. Callers that
+ * arrive meanwhile wait for it, and if their writes came too late, one
+ * of them persists for all of them next. Concurrent writers so share
+ * one sync instead of taking one each.
+ *
+ * Returns: 0 if success, 1 if the persist covering the writes failed
+ */
+static int gpNvm_Commit(gpNvm_Handle *h, unsigned long ticket, int level)
+{
+	unsigned long target;
+	int full, failed, ret = 0;
 
-	while (1) {
-		if (!gpNvm_Read(&attrId, sizeof attrId))
-			return -1;
-		if (!gpNvm_Read(&len, sizeof len))
-			return -1;
-		if (!gpNvm_Read(&sum, sizeof sum))
-			return -1;
-		if (sum != attrId + len)
-			return -1;
+	if (level == GPNVM_DURABILITY_NONE)
+		return 0;
+	full = level == GPNVM_DURABILITY_FULL;
 
-    /* stop condition */
-		if (attrId == key)
-			return *pLength = len, ftell(fp);
-		if (fseek(fp, len, SEEK_CUR) != 0)
-			return -1;
+	pthread_mutex_lock(&h->commitMutex);
+	for (;;) {
+		if (h->commitFailed >= ticket) {
+			ret = 1;
+			break;
+		}
+		if (h->commitSynced[full] >= ticket)
+			break;
+		if (h->committing) {
+			pthread_cond_wait(&h->commitCond, &h->commitMutex);
+			continue;
+		}
+
+		h->committing = 1;
+		target = gpNvm_Written(h);
+		pthread_mutex_unlock(&h->commitMutex);
+		failed = h->backend->persist(h->ctx, full);
+		__atomic_add_fetch(&h->counters.persists, 1, __ATOMIC_RELAXED);
+		pthread_mutex_lock(&h->commitMutex);
+
+  /* a full persist covers the data as well */
+		h->committing = 0;
+		if (failed)
+			h->commitFailed = target;
+		else if (full)
+			h->commitSynced[0] = h->commitSynced[1] = target;
+		else
+			h->commitSynced[0] = target;
+		pthread_cond_broadcast(&h->commitCond);
 	}
+	pthread_mutex_unlock(&h->commitMutex);
+	return ret;
+}
+
+/**
+ * gpNvm_CommitHold:
+ * @h: handle of the store
+ *
+ * Keep gpNvm_Commit() from persisting while the storage it works on is
+ * swapped, waiting for a persist in flight.
+ */
+static void gpNvm_CommitHold(gpNvm_Handle *h)
+{
+	pthread_mutex_lock(&h->commitMutex);
+	while (h->committing)
+		pthread_cond_wait(&h->commitCond, &h->commitMutex);
+	h->committing = 1;
+	pthread_mutex_unlock(&h->commitMutex);
+}
 
-	// uh?
-	return -1;
+/**
+ * gpNvm_CommitRelease:
+ * @h: handle of the store
+ * @durable: non zero if the storage now in place holds every write so
+ * far durably
+ *
+ * Let gpNvm_Commit() persist again after gpNvm_CommitHold().
+ */
+static void gpNvm_CommitRelease(gpNvm_Handle *h, int durable)
+{
+	pthread_mutex_lock(&h->commitMutex);
+	h->committing = 0;
+	if (durable)
+		h->commitSynced[0] = h->commitSynced[1] = gpNvm_Written(h);
+	pthread_cond_broadcast(&h->commitCond);
+	pthread_mutex_unlock(&h->commitMutex);
 }
 
 /**
@@ -154,76 +892,5344 @@ static UInt16 gpNvm_checksum(UInt8 *pValue, UInt8 length)
 }
 
 /**
- * gpNvm_GetAttribute:
- * @attrId: attribute ID (key)
- * @Length: length of data to read
- * @pValue: pointer to memory
+ * gpNvm_CheckSize:
+ * @format: file format
  *
- * Returns: 0 if success
+ * Returns: size of the header and data checks in @format
  */
-gpNvm_Result gpNvm_GetAttribute(gpNvm_AttrId attrId, UInt8 *pLength, UInt8 *pValue)
+static int gpNvm_CheckSize(const gpNvm_Format *format)
+{
+	return format->version >= GPNVM_VERSION_CRC32C ? sizeof(UInt32) : sizeof(UInt16);
+}
+
+/**
+ * gpNvm_Check:
+ * @format: file format
+ * @data: bytes to check
+ * @length: number of bytes
+ *
+ * Returns: CRC32C of @data from format version 2 on, the 16-bit additive
+ * sum before
+ */
+static UInt32 gpNvm_Check(const gpNvm_Format *format, const UInt8 *data, int length)
+{
+	if (format->version >= GPNVM_VERSION_CRC32C)
+		return gpNvm_Crc32c(0, data, length);
+
+	return gpNvm_checksum((UInt8 *)data, length);
+}
+
+/**
+ * gpNvm_PutCheck:
+ * @format: file format
+ * @dst: location of the check in a record
+ * @check: value of the check
+ *
+ * Store a check in the width of @format.
+ */
+static void gpNvm_PutCheck(const gpNvm_Format *format, UInt8 *dst, UInt32 check)
+{
+	UInt16 sum = check;
+
+	if (gpNvm_CheckSize(format) == sizeof check)
+		memcpy(dst, &check, sizeof check);
+	else
+		memcpy(dst, &sum, sizeof sum);
+}
+
+/**
+ * gpNvm_GetCheck:
+ * @format: file format
+ * @src: location of the check in a record
+ *
+ * Returns: the check stored at @src in the width of @format
+ */
+static UInt32 gpNvm_GetCheck(const gpNvm_Format *format, const UInt8 *src)
 {
+	UInt32 check;
 	UInt16 sum;
-	UInt8 len;
 
-	if (!pLength || !*pLength || !pValue || !fp || fileno(fp) < 0)
-		return 1;
+	if (gpNvm_CheckSize(format) == sizeof check) {
+		memcpy(&check, src, sizeof check);
+		return check;
+	}
 
-  /* Search for attribute */
-	if (gpNvm_SeekFile(attrId, &len) < 0 || len != *pLength + sizeof sum)
-		return 1;
-  /* read data */
-	if (!gpNvm_Read(pValue, *pLength))
-		return 1;
-  /* read check sum */
-	if (!gpNvm_Read(&sum, sizeof sum))
-		return 1;
+	memcpy(&sum, src, sizeof sum);
+	return sum;
+}
 
-  /* test checksum */
-	return sum != gpNvm_checksum(pValue, *pLength);
+/**
+ * gpNvm_IdSize:
+ * @format: file format
+ *
+ * The original layout has 8-bit attribute IDs, headered files record the
+ * width in their format flags.
+ *
+ * Returns: size of an attribute ID in @format
+ */
+static int gpNvm_IdSize(const gpNvm_Format *format)
+{
+	if (format->flags & GPNVM_FMT_ID32)
+		return sizeof(UInt32);
+	if (format->flags & GPNVM_FMT_ID16)
+		return sizeof(UInt16);
+	return sizeof(UInt8);
 }
 
 /**
- * gpNvm_SetAttribute:
- * @attrId: attribute ID (key)
- * @length: length of data to write
- * @pValue: pointer to memory
+ * gpNvm_PutId:
+ * @format: file format
+ * @dst: location of the attribute ID in a record
+ * @attrId: attribute ID
+ */
+static void gpNvm_PutId(const gpNvm_Format *format, UInt8 *dst, gpNvm_AttrId attrId)
+{
+	UInt32 id32 = attrId;
+	UInt16 id16 = attrId;
+	UInt8 id8 = attrId;
+
+	if (gpNvm_IdSize(format) == sizeof id32)
+		memcpy(dst, &id32, sizeof id32);
+	else if (gpNvm_IdSize(format) == sizeof id16)
+		memcpy(dst, &id16, sizeof id16);
+	else
+		memcpy(dst, &id8, sizeof id8);
+}
+
+/**
+ * gpNvm_GetId:
+ * @format: file format
+ * @src: location of the attribute ID in a record
  *
- * Write settings to storage
+ * Returns: the attribute ID stored at @src in the width of @format
+ */
+static gpNvm_AttrId gpNvm_GetId(const gpNvm_Format *format, const UInt8 *src)
+{
+	UInt32 id32;
+	UInt16 id16;
+	UInt8 id8;
+
+	if (gpNvm_IdSize(format) == sizeof id32) {
+		memcpy(&id32, src, sizeof id32);
+		return id32;
+	}
+	if (gpNvm_IdSize(format) == sizeof id16) {
+		memcpy(&id16, src, sizeof id16);
+		return id16;
+	}
+	memcpy(&id8, src, sizeof id8);
+	return id8;
+}
+
+/**
+ * gpNvm_HeaderSize:
+ * @format: file format
  *
- * Returns: 0 if success
+ * Returns: size of a record header in @format
  */
-gpNvm_Result gpNvm_SetAttribute(gpNvm_AttrId attrId, UInt8 length, UInt8 *pValue)
+static int gpNvm_HeaderSize(const gpNvm_Format *format)
 {
-	UInt16 sum = attrId + length + sizeof sum;
-	UInt8 len = length + sizeof sum;
+	if (format->version == GPNVM_VERSION_LEGACY)
+		return gpNvm_IdSize(format) + sizeof(UInt8) + sizeof(UInt16);
 
-	if (!length || !pValue || !fp || fileno(fp) < 0)
-		return 1;
+	return 1 + gpNvm_IdSize(format) + sizeof(UInt8) +
+		(format->flags & GPNVM_FMT_LOG ? sizeof(UInt32) : 0) + gpNvm_CheckSize(format);
+}
 
-  /* seek and replace, if not present continue */
-	if (gpNvm_SeekFile(attrId, &len) > 0 && len != length + sizeof sum)
-		return 1;
-  /* write attribute ID */
-	if (!gpNvm_Write(&attrId, sizeof attrId))
-		return 1;
-  /* write length of data to follow: the length of the data and the sum
-   * test */
-	if (!gpNvm_Write(&len, sizeof len))
-		return 1;
-  /* write the sum: custom test of attribute id with length and sum test
-   * length */
-	if (!gpNvm_Write(&sum, sizeof sum))
-		return 1;
-  /* write data */
-	if (!gpNvm_Write(pValue, length))
-		return 1;
+/**
+ * gpNvm_RecordSize:
+ * @format: file format
+ * @length: length of the data
+ *
+ * Returns: size of a record holding @length bytes of data in @format
+ */
+static long gpNvm_RecordSize(const gpNvm_Format *format, int length)
+{
+	return gpNvm_HeaderSize(format) + length + gpNvm_CheckSize(format);
+}
 
-  /* compute checksum and write */
-	sum = gpNvm_checksum(pValue, length);
-	if (!gpNvm_Write(&sum, sizeof sum))
-		return 1;
+/**
+ * gpNvm_DataStart:
+ * @format: file format
+ *
+ * Returns: file offset of the first record in @format
+ */
+static long gpNvm_DataStart(const gpNvm_Format *format)
+{
+	if (format->version == GPNVM_VERSION_LEGACY)
+		return 0;
+	if (format->flags & GPNVM_FMT_TOC)
+		return GPNVM_TOC_ENTRIES + (long)format->toc * GPNVM_TOC_ENTRY;
+	return GPNVM_SUPER_SIZE;
+}
 
-  /* flush to make certain the kernel schedules the write to storage */
-	return !!fflush(fp);
+/**
+ * gpNvm_MaxLength:
+ * @format: file format
+ *
+ * The original layout stores the length of the data plus its checksum
+ * in 8 bits, headered files store the length of the data.
+ *
+ * Returns: largest data length a record in @format can hold
+ */
+static int gpNvm_MaxLength(const gpNvm_Format *format)
+{
+	return format->version == GPNVM_VERSION_LEGACY ? 0xff - sizeof(UInt16) : 0xff;
+}
+
+/**
+ * gpNvm_PackSuper:
+ * @super: buffer of GPNVM_SUPER_SIZE bytes
+ * @format: file format
+ *
+ * Assemble the superblock of a headered file, its check is the low 16
+ * bits of the format check.
+ */
+static void gpNvm_PackSuper(UInt8 *super, const gpNvm_Format *format)
+{
+	UInt16 sum;
+
+	memcpy(super, GPNVM_MAGIC, 4);
+	super[4] = format->version;
+	super[5] = format->flags;
+	sum = gpNvm_Check(format, super, 6);
+	memcpy(super + 6, &sum, sizeof sum);
+}
+
+/**
+ * gpNvm_TocPackFixed:
+ * @dst: returns the fixed part of the table of contents
+ * @format: file format, with the number of entries
+ */
+static void gpNvm_TocPackFixed(UInt8 *dst, const gpNvm_Format *format)
+{
+	UInt32 crc;
+
+	memcpy(dst, &format->toc, 4);
+	crc = gpNvm_Crc32c(0, dst, 4);
+	memcpy(dst + 4, &crc, 4);
+}
+
+/**
+ * gpNvm_TocFixed:
+ * @h: handle of the store
+ * @format: file format, returns the number of entries
+ *
+ * Read the fixed part of the table of contents, it sets where the
+ * records start.
+ *
+ * Returns: 0 if success, 1 if it can not be read or is corrupt
+ */
+static int gpNvm_TocFixed(gpNvm_Handle *h, gpNvm_Format *format)
+{
+	UInt8 fixed[GPNVM_TOC_FIXED];
+	UInt32 toc, crc;
+
+	if (!gpNvm_ReadAt(h, GPNVM_TOC_START, fixed, sizeof fixed))
+		return 1;
+	memcpy(&toc, fixed, 4);
+	memcpy(&crc, fixed + 4, 4);
+	if (crc != gpNvm_Crc32c(0, fixed, 4) || toc > 0x1000000)
+		return 1;
+
+	format->toc = toc;
+	return 0;
+}
+
+/**
+ * gpNvm_ParseSuper:
+ * @super: superblock, starting with the magic
+ * @format: returns the file format
+ *
+ * Returns: 0 if success, 1 if the superblock is corrupt, of a newer
+ * format version or with wider attribute IDs than this build has
+ */
+static int gpNvm_ParseSuper(const UInt8 *super, gpNvm_Format *format)
+{
+	gpNvm_Format found;
+	UInt16 sum;
+
+	found.version = super[4];
+	found.flags = super[5];
+	memcpy(&sum, super + 6, sizeof sum);
+	if (found.version < GPNVM_VERSION_HEADERED || found.version > GPNVM_VERSION_CRC32C)
+		return 1;
+	if (sum != (UInt16)gpNvm_Check(&found, super, 6))
+		return 1;
+	if (gpNvm_IdSize(&found) > sizeof(gpNvm_AttrId))
+		return 1;
+
+	*format = found;
+	return 0;
+}
+
+/**
+ * gpNvm_ReadSuper:
+ * @h: handle of the store
+ * @format: returns the file format
+ *
+ * A file that does not start with the magic is in the original layout,
+ * this includes empty files. With a table of contents, its size is read
+ * as well.
+ *
+ * Returns: 0 if success, 1 if the superblock is corrupt, of a newer
+ * format version or with wider attribute IDs than this build has
+ */
+static int gpNvm_ReadSuper(gpNvm_Handle *h, gpNvm_Format *format)
+{
+	UInt8 super[GPNVM_SUPER_SIZE];
+
+	format->version = GPNVM_VERSION_LEGACY;
+	format->flags = 0;
+
+	if (!gpNvm_ReadAt(h, 0, super, sizeof super) || memcmp(super, GPNVM_MAGIC, 4))
+		return 0;
+
+	if (gpNvm_ParseSuper(super, format))
+		return 1;
+	return (format->flags & GPNVM_FMT_TOC) && gpNvm_TocFixed(h, format);
+}
+
+/**
+ * gpNvm_ParseHeader:
+ * @format: file format
+ * @header: record header as read from the file
+ * @staged: returns attribute ID, data length and sequence number
+ *
+ * A header is valid when its check matches and it holds at least one
+ * byte of data. In the original layout the length includes the checksum,
+ * the sum is attribute ID plus length. Headered records start with a tag
+ * and the check covers all preceding header bytes. The header of free
+ * space and that of a marker, with their own tags, are valid as well;
+ * see gpNvm_PackFree() and gpNvm_PackMark() for their fields, the first
+ * byte of @header tells them apart. The check of a committed marker is
+ * that of the pending one.
+ *
+ * Returns: 1 if the header is valid, 0 otherwise
+ */
+static int gpNvm_ParseHeader(const gpNvm_Format *format, const UInt8 *header, gpNvm_Staged *staged)
+{
+	int size = gpNvm_HeaderSize(format) - gpNvm_CheckSize(format);
+	UInt32 check = gpNvm_GetCheck(format, header + size);
+	UInt8 len, pending[GPNVM_HEADER_MAX];
+
+	staged->seq = 0;
+
+	if (format->version == GPNVM_VERSION_LEGACY) {
+		staged->attrId = gpNvm_GetId(format, header);
+		memcpy(&len, header + gpNvm_IdSize(format), sizeof len);
+		if (check != staged->attrId + len || len <= sizeof(UInt16))
+			return 0;
+		staged->length = len - sizeof(UInt16);
+		return 1;
+	}
+
+	if (header[0] == GPNVM_TAG_COMMIT) {
+		memcpy(pending, header, size);
+		pending[0] = GPNVM_TAG_PENDING;
+		if (check != gpNvm_Check(format, pending, size))
+			return 0;
+	} else if ((header[0] != GPNVM_TAG_RECORD && header[0] != GPNVM_TAG_FREE &&
+		    header[0] != GPNVM_TAG_PENDING) ||
+		   check != gpNvm_Check(format, header, size)) {
+		return 0;
+	}
+	staged->attrId = gpNvm_GetId(format, header + 1);
+	memcpy(&staged->length, header + 1 + gpNvm_IdSize(format), sizeof staged->length);
+	if (format->flags & GPNVM_FMT_LOG)
+		memcpy(&staged->seq, header + 2 + gpNvm_IdSize(format), sizeof staged->seq);
+	return staged->length != 0 || header[0] == GPNVM_TAG_FREE;
+}
+
+/**
+ * gpNvm_PackRecord:
+ * @format: file format
+ * @record: buffer of at least GPNVM_RECORD_MAX bytes
+ * @staged: record to assemble
+ *
+ * Assemble a record. In the original layout: attribute ID, length of
+ * data to follow (the length of the data and the sum test), the sum
+ * (custom test of attribute id with length and sum test length), data and
+ * checksum. Headered records: tag, attribute ID, length of the data,
+ * sequence number for the log format, check of the preceding header
+ * bytes, data and check of the data.
+ *
+ * Returns: size of the record
+ */
+static int gpNvm_PackRecord(const gpNvm_Format *format, UInt8 *record, const gpNvm_Staged *staged)
+{
+	int size = gpNvm_HeaderSize(format) - gpNvm_CheckSize(format);
+	UInt8 len;
+
+	if (format->version == GPNVM_VERSION_LEGACY) {
+		len = staged->length + sizeof(UInt16);
+		gpNvm_PutId(format, record, staged->attrId);
+		memcpy(record + gpNvm_IdSize(format), &len, sizeof len);
+		gpNvm_PutCheck(format, record + size, staged->attrId + len);
+	} else {
+		record[0] = GPNVM_TAG_RECORD;
+		gpNvm_PutId(format, record + 1, staged->attrId);
+		memcpy(record + 1 + gpNvm_IdSize(format), &staged->length, sizeof staged->length);
+		if (format->flags & GPNVM_FMT_LOG)
+			memcpy(record + 2 + gpNvm_IdSize(format), &staged->seq, sizeof staged->seq);
+		gpNvm_PutCheck(format, record + size, gpNvm_Check(format, record, size));
+	}
+	size += gpNvm_CheckSize(format);
+
+	memcpy(record + size, staged->value, staged->length);
+	gpNvm_PutCheck(format, record + size + staged->length,
+			gpNvm_Check(format, staged->value, staged->length));
+
+	return size + staged->length + gpNvm_CheckSize(format);
+}
+
+/**
+ * gpNvm_PackMark:
+ * @format: file format, headered
+ * @record: buffer of at least GPNVM_RECORD_MAX bytes
+ * @span: size of the block, marker included
+ * @seq: sequence number of the block
+ *
+ * Assemble the marker that starts a block of records written as one
+ * unit, pending: a record with its own tag, of attribute ID 0, whose
+ * data holds @span and @seq. A scan skips the block while the marker is
+ * pending; once committed, the records of the block win over any other
+ * records of their attributes. Only the tag changes, the header check
+ * stays that of the pending marker, so committing takes the write of
+ * the first byte alone, which is not torn.
+ *
+ * Returns: size of the marker
+ */
+static int gpNvm_PackMark(const gpNvm_Format *format, UInt8 *record, UInt32 span, UInt32 seq)
+{
+	int n = gpNvm_HeaderSize(format) - gpNvm_CheckSize(format), size;
+	gpNvm_Staged mark;
+
+	mark.attrId = 0;
+	mark.length = GPNVM_MARK_DATA;
+	mark.seq = seq;
+	memcpy(mark.value, &span, 4);
+	memcpy(mark.value + 4, &seq, 4);
+	size = gpNvm_PackRecord(format, record, &mark);
+	record[0] = GPNVM_TAG_PENDING;
+	gpNvm_PutCheck(format, record + n, gpNvm_Check(format, record, n));
+	return size;
+}
+
+/**
+ * gpNvm_FreeMax:
+ * @format: file format
+ *
+ * Returns: size of the largest extent one free header covers in @format
+ */
+static long gpNvm_FreeMax(const gpNvm_Format *format)
+{
+	return gpNvm_RecordSize(format, 0) + (gpNvm_IdSize(format) == 1 ? 0xffff : 0xffffff);
+}
+
+/**
+ * gpNvm_FreeSize:
+ * @format: file format
+ * @staged: free header, from gpNvm_ParseHeader()
+ *
+ * Returns: size of the free space the header covers
+ */
+static long gpNvm_FreeSize(const gpNvm_Format *format, const gpNvm_Staged *staged)
+{
+	if (format->flags & GPNVM_FMT_LOG)
+		return gpNvm_RecordSize(format, 0);
+	return gpNvm_RecordSize(format, 0) + ((long)staged->attrId << 8 | staged->length);
+}
+
+/**
+ * gpNvm_PackFree:
+ * @format: file format, headered
+ * @header: buffer of at least GPNVM_RECORD_MAX bytes
+ * @attrId: attribute ID the tombstone deletes, log format only
+ * @size: size of the free space, from an empty record up to
+ * gpNvm_FreeMax()
+ * @seq: sequence number, log format only
+ *
+ * Assemble the header of free space: that of a record, with the free
+ * tag. In the in-place format it covers @size bytes, of which those
+ * past an empty record go in the attribute ID and length fields; the
+ * bytes after the header are not read. In the log format free space is
+ * not reused, the header is that of a tombstone instead: an empty
+ * record that deletes @attrId, complete with its data check.
+ *
+ * Returns: number of bytes to write, the header or the tombstone
+ */
+static int gpNvm_PackFree(const gpNvm_Format *format, UInt8 *header, gpNvm_AttrId attrId, long size, UInt32 seq)
+{
+	int n = gpNvm_HeaderSize(format) - gpNvm_CheckSize(format);
+	int log = format->flags & GPNVM_FMT_LOG;
+	long span = size - gpNvm_RecordSize(format, 0);
+	UInt8 len = span & 0xff;
+
+	header[0] = GPNVM_TAG_FREE;
+	gpNvm_PutId(format, header + 1, log ? attrId : (gpNvm_AttrId)(span >> 8));
+	memcpy(header + 1 + gpNvm_IdSize(format), &len, sizeof len);
+	if (log)
+		memcpy(header + 2 + gpNvm_IdSize(format), &seq, sizeof seq);
+	gpNvm_PutCheck(format, header + n, gpNvm_Check(format, header, n));
+	n += gpNvm_CheckSize(format);
+	if (!log)
+		return n;
+
+	gpNvm_PutCheck(format, header + n, gpNvm_Check(format, header, 0));
+	return n + gpNvm_CheckSize(format);
+}
+
+/**
+ * gpNvm_ReadData:
+ * @h: handle of the store
+ * @offset: file offset of the record header
+ * @length: length of the data
+ * @pValue: returns the data
+ *
+ * Read the data of a record and test its check.
+ *
+ * Returns: 1 if the data is read and intact, 0 otherwise
+ */
+static int gpNvm_ReadData(gpNvm_Handle *h, long offset, UInt8 length, UInt8 *pValue)
+{
+	long data = offset + gpNvm_HeaderSize(&h->format);
+	UInt8 check[sizeof(UInt32)];
+
+	if (!gpNvm_ReadAt(h, data, pValue, length))
+		return 0;
+	if (!gpNvm_ReadAt(h, data + length, check, gpNvm_CheckSize(&h->format)))
+		return 0;
+
+	if (gpNvm_GetCheck(&h->format, check) != gpNvm_Check(&h->format, pValue, length)) {
+		GPNVM_STATS_ADD(h, checkFailures, 1);
+		return 0;
+	}
+	return 1;
+}
+
+/**
+ * gpNvm_IndexHome:
+ * @attrId: attribute ID (key)
+ *
+ * Returns: hash of @attrId, its home slot once masked by the index size
+ */
+static UInt32 gpNvm_IndexHome(gpNvm_AttrId attrId)
+{
+	UInt32 i = (UInt32)attrId * 0x9e3779b1u;
+
+	return i ^ i >> 16;
+}
+
+/**
+ * gpNvm_IndexSlot:
+ * @h: handle of the store
+ * @attrId: attribute ID (key)
+ *
+ * Probe the index from the home slot of @attrId on. The index is never
+ * more than 3/4 full, so the probe ends at a free slot at the latest.
+ *
+ * Returns: the slot of @attrId, or the free slot it would go in; NULL
+ * if the index has no slots yet
+ */
+static gpNvm_IndexEntry *gpNvm_IndexSlot(gpNvm_Handle *h, gpNvm_AttrId attrId)
+{
+	UInt32 mask = h->indexSize - 1;
+	UInt32 i = gpNvm_IndexHome(attrId);
+
+	if (!h->indexSize)
+		return NULL;
+
+	for (; ; i++) {
+		gpNvm_IndexEntry *entry = &h->index[i & mask];
+
+		if (!entry->valid || entry->attrId == attrId)
+			return entry;
+	}
+}
+
+/**
+ * gpNvm_IndexLookup:
+ * @h: handle of the store
+ * @attrId: attribute ID (key)
+ *
+ * Returns: the index entry of @attrId, or NULL if it is not present
+ */
+static gpNvm_IndexEntry *gpNvm_IndexLookup(gpNvm_Handle *h, gpNvm_AttrId attrId)
+{
+	gpNvm_IndexEntry *entry = gpNvm_IndexSlot(h, attrId);
+
+	GPNVM_STATS_ADD(h, lookups, 1);
+	if (entry)
+		GPNVM_STATS_ADD(h, probes,
+			((entry - h->index - gpNvm_IndexHome(attrId)) & (h->indexSize - 1)) + 1);
+	return entry && entry->valid ? entry : NULL;
+}
+
+/**
+ * gpNvm_IndexReserve:
+ * @h: handle of the store
+ * @count: number of attributes about to be added
+ *
+ * Grow the index, by doubling and rehashing, until @count more entries
+ * keep it at most 3/4 full; gpNvm_IndexSet() can not fail afterwards.
+ *
+ * Returns: 0 if success
+ */
+static int gpNvm_IndexReserve(gpNvm_Handle *h, int count)
+{
+	gpNvm_IndexEntry *old = h->index, *entry;
+	UInt32 oldSize = h->indexSize, size = oldSize ? oldSize : GPNVM_INDEX_MIN;
+	UInt32 i;
+
+	while (4 * ((unsigned long)h->indexCount + count) > 3 * (unsigned long)size)
+		size *= 2;
+	if (size == oldSize)
+		return 0;
+
+	h->index = calloc(size, sizeof *h->index);
+	if (!h->index) {
+		h->index = old;
+		return 1;
+	}
+	h->indexSize = size;
+	h->sharedDirty = 1;
+
+	for (i = 0; i != oldSize; i++) {
+		if (!old[i].valid)
+			continue;
+		entry = gpNvm_IndexSlot(h, old[i].attrId);
+		*entry = old[i];
+	}
+	free(old);
+	return 0;
+}
+
+/**
+ * gpNvm_ViewDrop:
+ * @h: handle of the store
+ * @entry: index entry whose data changes or goes away
+ *
+ * End the view of an attribute, freeing its copy if the storage is not
+ * in memory.
+ */
+static void gpNvm_ViewDrop(gpNvm_Handle *h, gpNvm_IndexEntry *entry)
+{
+	if (!h->image)
+		free(entry->view);
+	entry->view = NULL;
+}
+
+/**
+ * gpNvm_IndexSet:
+ * @h: handle of the store
+ * @entry: slot returned by gpNvm_IndexSlot()
+ * @staged: record now holding the attribute
+ *
+ * Point the index entry of an attribute at its record, taking a free
+ * slot if the attribute is new. The view of the old record ends, and
+ * the check of its data is no longer known. A record that moved marks
+ * the index to be published in shared mode.
+ */
+static void gpNvm_IndexSet(gpNvm_Handle *h, gpNvm_IndexEntry *entry, const gpNvm_Staged *staged)
+{
+	if (!entry->valid || entry->offset != staged->offset || entry->length != staged->length ||
+	    ((h->format.flags & GPNVM_FMT_LOG) && entry->seq != staged->seq))
+		h->sharedDirty = 1;
+	if (!entry->valid)
+		h->indexCount++;
+	gpNvm_ViewDrop(h, entry);
+	entry->offset = staged->offset;
+	entry->seq = staged->seq;
+	entry->attrId = staged->attrId;
+	entry->length = staged->length;
+	entry->valid = 1;
+	entry->checked = 0;
+}
+
+/**
+ * gpNvm_IndexRemove:
+ * @h: handle of the store
+ * @entry: index entry of an attribute that is present
+ *
+ * Take an attribute out of the index, ending its view. The entries of
+ * the probe run after it move back into the slot it frees, where their
+ * home slot allows, so lookups need no markers of removed entries.
+ */
+static void gpNvm_IndexRemove(gpNvm_Handle *h, gpNvm_IndexEntry *entry)
+{
+	UInt32 mask = h->indexSize - 1, i = entry - h->index, j;
+
+	gpNvm_ViewDrop(h, entry);
+	for (j = i + 1; h->index[j & mask].valid; j++) {
+		gpNvm_IndexEntry *next = &h->index[j & mask];
+
+		if (((j - gpNvm_IndexHome(next->attrId)) & mask) >= ((j - i) & mask)) {
+			h->index[i & mask] = *next;
+			i = j;
+		}
+	}
+	memset(&h->index[i & mask], 0, sizeof *entry);
+	h->indexCount--;
+	h->sharedDirty = 1;
+}
+
+/**
+ * gpNvm_IndexClear:
+ * @h: handle of the store
+ *
+ * Empty the index, which ends all views. The free space is found again
+ * from the next index.
+ */
+static void gpNvm_IndexClear(gpNvm_Handle *h)
+{
+	UInt32 i;
+
+	for (i = 0; i != h->indexSize; i++)
+		gpNvm_ViewDrop(h, &h->index[i]);
+	if (h->index)
+		memset(h->index, 0, h->indexSize * sizeof *h->index);
+	h->indexCount = 0;
+	h->sharedDirty = 1;
+	h->holeCount = 0;
+	h->holesKnown = 0;
+	h->batchMark = -1;
+}
+
+/**
+ * gpNvm_TocCapacity:
+ * @h: handle of the store
+ * @count: number of attributes
+ *
+ * Returns: number of table of contents entries of a new image: twice
+ * @count rounded up to a power of two, at least %GPNVM_TOC_MIN and the
+ * minimum asked for by gpNvm_TocReserve()
+ */
+static UInt32 gpNvm_TocCapacity(gpNvm_Handle *h, UInt32 count)
+{
+	UInt32 size = GPNVM_TOC_MIN;
+
+	while (size < 2 * count || size < h->tocMin)
+		size *= 2;
+	return size;
+}
+
+/**
+ * gpNvm_TocPackEntry:
+ * @format: file format
+ * @dst: returns the table of contents entry
+ * @entry: index entry of the attribute
+ *
+ * Returns: CRC32C of the entry
+ */
+static UInt32 gpNvm_TocPackEntry(const gpNvm_Format *format, UInt8 *dst, const gpNvm_IndexEntry *entry)
+{
+	UInt32 attrId = entry->attrId, offset = entry->offset;
+	UInt32 seq = format->flags & GPNVM_FMT_LOG ? entry->seq : 0;
+
+	memcpy(dst, &attrId, 4);
+	memcpy(dst + 4, &offset, 4);
+	memcpy(dst + 8, &seq, 4);
+	dst[12] = entry->length;
+	return gpNvm_Crc32c(0, dst, GPNVM_TOC_ENTRY);
+}
+
+/**
+ * gpNvm_TocPackHeader:
+ * @dst: returns the header of the table of contents
+ * @count: number of entries used
+ * @end: end of the records
+ * @seq: next sequence number
+ * @dead: bytes taken by dead records
+ * @sum: sum of the CRC32C of the entries
+ */
+static void gpNvm_TocPackHeader(UInt8 *dst, UInt32 count, long end, UInt32 seq, long dead, UInt32 sum)
+{
+	UInt32 fields[4] = { count, end, seq, dead };
+	UInt32 check;
+
+	memcpy(dst, fields, sizeof fields);
+	check = gpNvm_Crc32c(0, dst, sizeof fields) + sum;
+	memcpy(dst + sizeof fields, &check, 4);
+}
+
+/**
+ * gpNvm_TocGrow:
+ * @h: handle of the store
+ * @count: number of entries used
+ *
+ * Make room in tocIds for the attributes of @count entries.
+ *
+ * Returns: 0 if success
+ */
+static int gpNvm_TocGrow(gpNvm_Handle *h, UInt32 count)
+{
+	UInt32 size = h->tocIdsSize ? h->tocIdsSize : GPNVM_TOC_MIN;
+	gpNvm_AttrId *ids;
+
+	if (count <= h->tocIdsSize)
+		return 0;
+	while (size < count)
+		size *= 2;
+	ids = realloc(h->tocIds, size * sizeof *ids);
+	if (!ids)
+		return 1;
+	h->tocIds = ids;
+	h->tocIdsSize = size;
+	return 0;
+}
+
+/**
+ * gpNvm_TocLoad:
+ * @h: handle of the store
+ *
+ * Fill the index from the table of contents instead of the records, if
+ * its check holds and its entries fit in the records. The data of the
+ * records is still checked when it is read.
+ *
+ * Returns: 0 if success, 1 if the table has to be rebuilt by a scan
+ */
+static int gpNvm_TocLoad(gpNvm_Handle *h)
+{
+	UInt8 header[GPNVM_TOC_HEADER], *entries;
+	UInt32 fields[4], check, sum = 0, i;
+	long data = gpNvm_DataStart(&h->format);
+	gpNvm_IndexEntry *entry;
+	gpNvm_Staged staged;
+	int ret = 1;
+
+	gpNvm_IndexClear(h);
+	if (!gpNvm_ReadAt(h, GPNVM_TOC_START + GPNVM_TOC_FIXED, header, sizeof header))
+		return 1;
+	memcpy(fields, header, sizeof fields);
+	memcpy(&check, header + sizeof fields, 4);
+	if (fields[0] > h->format.toc || fields[1] < data || fields[1] > h->backend->size(h->ctx))
+		return 1;
+
+	entries = malloc(fields[0] * GPNVM_TOC_ENTRY + 1);
+	if (!entries)
+		return 1;
+	if (fields[0] && !gpNvm_ReadAt(h, GPNVM_TOC_ENTRIES, entries, fields[0] * GPNVM_TOC_ENTRY))
+		goto out;
+	for (i = 0; i != fields[0]; i++)
+		sum += gpNvm_Crc32c(0, entries + i * GPNVM_TOC_ENTRY, GPNVM_TOC_ENTRY);
+	if (check != gpNvm_Crc32c(0, header, sizeof fields) + sum ||
+	    gpNvm_IndexReserve(h, fields[0]) || gpNvm_TocGrow(h, fields[0]))
+		goto out;
+
+	for (i = 0; i != fields[0]; i++) {
+		const UInt8 *src = entries + i * GPNVM_TOC_ENTRY;
+		UInt32 attrId, offset;
+
+		memcpy(&attrId, src, 4);
+		memcpy(&offset, src + 4, 4);
+		memcpy(&staged.seq, src + 8, 4);
+		staged.attrId = attrId;
+		staged.length = src[12];
+		staged.offset = offset;
+		if (staged.attrId != attrId || offset < data ||
+		    offset + gpNvm_RecordSize(&h->format, staged.length) > fields[1])
+			goto out;
+		entry = gpNvm_IndexSlot(h, staged.attrId);
+		if (entry->valid)
+			goto out;
+		gpNvm_IndexSet(h, entry, &staged);
+		entry->slot = i;
+		h->tocIds[i] = staged.attrId;
+	}
+
+	h->end = fields[1];
+	h->seq = fields[2];
+	h->dead = fields[3];
+	h->damaged = 0;
+	h->tocUsed = fields[0];
+	h->tocSum = sum;
+	ret = 0;
+out:
+	if (ret)
+		gpNvm_IndexClear(h);
+	free(entries);
+	return ret;
+}
+
+/**
+ * gpNvm_TocCommit:
+ * @h: handle of the store
+ *
+ * Write the header of the table of contents and flush the table, after
+ * the records and entries it covers are written. A table that is not
+ * kept up to date is left alone: its check fails and open scans.
+ *
+ * Returns: 0 if success
+ */
+static int gpNvm_TocCommit(gpNvm_Handle *h)
+{
+	UInt8 header[GPNVM_TOC_HEADER];
+
+	if (!(h->format.flags & GPNVM_FMT_TOC) || h->tocUsed > h->format.toc)
+		return 0;
+
+	gpNvm_TocPackHeader(header, h->tocUsed, h->end, h->seq, h->dead, h->tocSum);
+	if (!gpNvm_WriteAt(h, GPNVM_TOC_START + GPNVM_TOC_FIXED, header, sizeof header))
+		return 1;
+	return gpNvm_SyncAt(h, GPNVM_TOC_START, gpNvm_DataStart(&h->format) - GPNVM_TOC_START);
+}
+
+/**
+ * gpNvm_TocWrite:
+ * @h: handle of the store
+ *
+ * Write the whole table of contents from the index, after a scan. If
+ * the attributes do not fit, the table is not kept up to date until the
+ * next write rewrites the file with a larger one.
+ *
+ * Returns: 0 if success
+ */
+static int gpNvm_TocWrite(gpNvm_Handle *h)
+{
+	long size = GPNVM_TOC_HEADER + (long)h->format.toc * GPNVM_TOC_ENTRY;
+	UInt8 *toc;
+	UInt32 i, count = 0, sum = 0;
+	int ret;
+
+	h->tocUsed = h->format.toc + 1;
+	if (h->indexCount > h->format.toc || gpNvm_TocGrow(h, h->indexCount) ||
+	    !(toc = malloc(size)))
+		return 1;
+
+	for (i = 0; i != h->indexSize; i++) {
+		if (!h->index[i].valid)
+			continue;
+		h->index[i].slot = count;
+		h->tocIds[count] = h->index[i].attrId;
+		sum += gpNvm_TocPackEntry(&h->format, toc + GPNVM_TOC_HEADER + count * GPNVM_TOC_ENTRY, &h->index[i]);
+		count++;
+	}
+	gpNvm_TocPackHeader(toc, count, h->end, h->seq, h->dead, sum);
+
+	ret = !gpNvm_WriteAt(h, GPNVM_TOC_START + GPNVM_TOC_FIXED, toc, GPNVM_TOC_HEADER + count * GPNVM_TOC_ENTRY) ||
+		gpNvm_SyncAt(h, GPNVM_TOC_START, gpNvm_DataStart(&h->format) - GPNVM_TOC_START);
+	if (!ret) {
+		h->tocUsed = count;
+		h->tocSum = sum;
+	}
+	free(toc);
+	return ret;
+}
+
+/**
+ * gpNvm_TocDrop:
+ * @h: handle of the store
+ *
+ * Stop keeping the table of contents after an entry failed to write, as
+ * if it had overflowed. Its header is zeroed, if the storage still takes
+ * it, so that open does not trust entries that are out of date but
+ * scans and writes a new table.
+ */
+static void gpNvm_TocDrop(gpNvm_Handle *h)
+{
+	UInt8 header[GPNVM_TOC_HEADER] = { 0 };
+
+	h->tocUsed = h->format.toc + 1;
+	gpNvm_WriteAt(h, GPNVM_TOC_START + GPNVM_TOC_FIXED, header, sizeof header);
+}
+
+/**
+ * gpNvm_TocUpdate:
+ * @h: handle of the store
+ * @entry: index entry of the attribute, before it is set
+ * @staged: record just written for it
+ *
+ * Write the table of contents entry of a record, if it changed; a new
+ * attribute takes the next free entry. The header follows with
+ * gpNvm_TocCommit(); if the entry fails to write the table is dropped.
+ */
+static void gpNvm_TocUpdate(gpNvm_Handle *h, gpNvm_IndexEntry *entry, const gpNvm_Staged *staged)
+{
+	UInt8 old[GPNVM_TOC_ENTRY], packed[GPNVM_TOC_ENTRY];
+	gpNvm_IndexEntry next;
+
+	if (!(h->format.flags & GPNVM_FMT_TOC) || h->tocUsed > h->format.toc)
+		return;
+	if (!entry->valid && h->tocUsed == h->format.toc) {
+		h->tocUsed++;
+		return;
+	}
+	if (!entry->valid && gpNvm_TocGrow(h, h->tocUsed + 1)) {
+		gpNvm_TocDrop(h);
+		return;
+	}
+
+	next.attrId = staged->attrId;
+	next.offset = staged->offset;
+	next.seq = staged->seq;
+	next.length = staged->length;
+	next.slot = entry->valid ? entry->slot : h->tocUsed++;
+	if (entry->valid)
+		h->tocSum -= gpNvm_TocPackEntry(&h->format, old, entry);
+	h->tocSum += gpNvm_TocPackEntry(&h->format, packed, &next);
+	if ((!entry->valid || memcmp(old, packed, sizeof packed)) &&
+	    !gpNvm_WriteAt(h, GPNVM_TOC_ENTRIES + (long)next.slot * GPNVM_TOC_ENTRY, packed, sizeof packed)) {
+		gpNvm_TocDrop(h);
+		return;
+	}
+	entry->slot = next.slot;
+	h->tocIds[next.slot] = next.attrId;
+}
+
+/**
+ * gpNvm_TocRemove:
+ * @h: handle of the store
+ * @entry: index entry of an attribute about to be removed
+ *
+ * Take an attribute out of the table of contents: the last entry moves
+ * into its place, so the entries used stay at the start. The header
+ * follows with gpNvm_TocCommit(); if the move fails to write the table
+ * is dropped.
+ */
+static void gpNvm_TocRemove(gpNvm_Handle *h, const gpNvm_IndexEntry *entry)
+{
+	UInt8 packed[GPNVM_TOC_ENTRY];
+	gpNvm_IndexEntry *last;
+
+	if (!(h->format.flags & GPNVM_FMT_TOC) || h->tocUsed > h->format.toc)
+		return;
+
+	h->tocSum -= gpNvm_TocPackEntry(&h->format, packed, entry);
+	if (entry->slot == --h->tocUsed)
+		return;
+	last = gpNvm_IndexSlot(h, h->tocIds[h->tocUsed]);
+	if (!last || !last->valid || last->slot != h->tocUsed) {
+		gpNvm_TocDrop(h);
+		return;
+	}
+	gpNvm_TocPackEntry(&h->format, packed, last);
+	if (!gpNvm_WriteAt(h, GPNVM_TOC_ENTRIES + (long)entry->slot * GPNVM_TOC_ENTRY, packed, sizeof packed)) {
+		gpNvm_TocDrop(h);
+		return;
+	}
+	last->slot = entry->slot;
+	h->tocIds[entry->slot] = last->attrId;
+}
+
+/**
+ * gpNvm_Resync:
+ * @h: handle of the store
+ * @offset: first offset to try
+ * @pNext: returns the offset of the next intact record
+ *
+ * Find the first record at or after @offset whose header and data both
+ * check out, skipping damage. Headered records start with a tag, so only
+ * offsets holding it are tried; the original layout has no tag and every
+ * offset is tried. The storage is searched a block at a time.
+ *
+ * Returns: 0 if a record is found, 1 if none is left
+ */
+static int gpNvm_Resync(gpNvm_Handle *h, long offset, long *pNext)
+{
+	int size = gpNvm_HeaderSize(&h->format);
+	int legacy = h->format.version == GPNVM_VERSION_LEGACY;
+	long end = h->backend->size(h->ctx);
+	UInt8 block[4096], copy[GPNVM_HEADER_MAX], *found, *header;
+	gpNvm_Staged staged;
+	long n, i;
+
+	while (offset + size <= end) {
+		n = end - offset < sizeof block ? end - offset : sizeof block;
+		if (!gpNvm_ReadAt(h, offset, block, n))
+			return 1;
+
+		for (i = 0; i != n; i = found - block + 1) {
+			found = legacy ? block + i : memchr(block + i, GPNVM_TAG_RECORD, n - i);
+			if (!found)
+				break;
+			header = found;
+			if (found + size > block + n) {
+				header = copy;
+				if (!gpNvm_ReadAt(h, offset + (found - block), copy, size))
+					continue;
+			}
+			if (gpNvm_ParseHeader(&h->format, header, &staged) &&
+			    gpNvm_ReadData(h, offset + (found - block), staged.length, staged.value)) {
+				*pNext = offset + (found - block);
+				return 0;
+			}
+		}
+		offset += n;
+	}
+	return 1;
+}
+
+/**
+ * gpNvm_Scan:
+ * @h: handle of the store
+ * @offset: file offset to start at
+ *
+ * Scan the record headers once and add them to the offset index. A
+ * header that is not valid is damage: the scan resynchronizes on the
+ * next intact record and goes on, so one bad record does not hide the
+ * ones after it.
+ * The scan stops at the end of the file, at a zero filled or erased
+ * tail, or at damage with no intact record after it; that position
+ * becomes the append offset.
+ *
+ * In the log format the newest record with intact data wins, older and
+ * damaged records are counted as dead space; a tombstone newer than the
+ * record of its attribute deletes it, both are dead space. Otherwise,
+ * should an attribute be present more than once, the first record wins,
+ * as it did for the linear search, unless a later one is in a newer
+ * committed block; free space is skipped.
+ *
+ * A block whose marker is still pending was cut short, its records are
+ * skipped, see gpNvm_PackMark(); in the log format they and the
+ * markers are dead space.
+ *
+ * Returns: 0 if success
+ */
+static int gpNvm_Scan(gpNvm_Handle *h, long offset)
+{
+	int size = gpNvm_HeaderSize(&h->format);
+	int log = h->format.flags & GPNVM_FMT_LOG;
+	UInt8 header[GPNVM_HEADER_MAX];
+	gpNvm_IndexEntry *entry;
+	gpNvm_Staged staged;
+	long spanEnd = 0;
+	UInt32 spanSeq = 0;
+
+	while (gpNvm_ReadAt(h, offset, header, size)) {
+		UInt32 span, seq;
+		long next;
+		int spare;
+
+		GPNVM_STATS_ADD(h, scanned, 1);
+		if (!gpNvm_ParseHeader(&h->format, header, &staged)) {
+  /* a zero filled or erased tail is no failure */
+			for (next = 0; next != size && header[next] == header[0]; next++)
+				;
+			if (header[0] && header[0] != 0xff)
+				next = 0;
+			if (next == size)
+				break;
+			GPNVM_STATS_ADD(h, headerFailures, 1);
+			if (gpNvm_Resync(h, offset + 1, &next))
+				break;
+			GPNVM_STATS_ADD(h, skipped, next - offset);
+			h->damaged += next - offset;
+			offset = next;
+			continue;
+		}
+		if (h->format.version != GPNVM_VERSION_LEGACY &&
+		    (header[0] == GPNVM_TAG_PENDING || header[0] == GPNVM_TAG_COMMIT)) {
+			next = offset + gpNvm_RecordSize(&h->format, staged.length);
+			if (staged.length != GPNVM_MARK_DATA ||
+			    !gpNvm_ReadData(h, offset, staged.length, staged.value)) {
+				h->damaged += next - offset;
+				offset = next;
+				continue;
+			}
+			memcpy(&span, staged.value, 4);
+			memcpy(&seq, staged.value + 4, 4);
+			if (seq >= h->seq)
+				h->seq = seq + 1;
+			if (header[0] == GPNVM_TAG_COMMIT) {
+				spanEnd = offset + span;
+				spanSeq = seq;
+			} else if (span > next - offset) {
+				next = offset + span;
+			}
+			if (next > h->backend->size(h->ctx))
+				break;
+			if (log)
+				h->dead += next - offset;
+			offset = next;
+			continue;
+		}
+		spare = h->format.version != GPNVM_VERSION_LEGACY && header[0] == GPNVM_TAG_FREE;
+		if (spare && !log) {
+			next = offset + gpNvm_FreeSize(&h->format, &staged);
+			if (next > h->backend->size(h->ctx))
+				break;
+			offset = next;
+			continue;
+		}
+		next = offset + gpNvm_RecordSize(&h->format, staged.length);
+		if (gpNvm_IndexReserve(h, 1))
+			return 1;
+		entry = gpNvm_IndexSlot(h, staged.attrId);
+
+		if (spare && log) {
+			if (staged.seq >= h->seq)
+				h->seq = staged.seq + 1;
+			h->dead += next - offset;
+			if (entry->valid && entry->seq < staged.seq) {
+				h->dead += gpNvm_RecordSize(&h->format, entry->length);
+				gpNvm_IndexRemove(h, entry);
+			}
+			offset = next;
+			continue;
+		}
+		if (log) {
+			if (!gpNvm_ReadData(h, offset, staged.length, staged.value)) {
+				h->dead += next - offset;
+				offset = next;
+				continue;
+			}
+			if (staged.seq >= h->seq)
+				h->seq = staged.seq + 1;
+			if (entry->valid && entry->seq > staged.seq) {
+				h->dead += next - offset;
+				offset = next;
+				continue;
+			}
+			if (entry->valid)
+				h->dead += gpNvm_RecordSize(&h->format, entry->length);
+		}
+
+		if (!log)
+			staged.seq = offset < spanEnd ? spanSeq : 0;
+		if (!entry->valid || log || staged.seq > entry->seq) {
+			staged.offset = offset;
+			gpNvm_IndexSet(h, entry, &staged);
+		}
+
+		offset = next;
+	}
+
+	h->end = offset;
+	return 0;
+}
+
+/**
+ * gpNvm_BuildIndex:
+ * @h: handle of the store
+ *
+ * Fill the offset index from scratch, scanning all records.
+ *
+ * Returns: 0 if success
+ */
+static int gpNvm_BuildIndex(gpNvm_Handle *h)
+{
+	gpNvm_IndexClear(h);
+	h->seq = 0;
+	h->dead = 0;
+	h->damaged = 0;
+
+	return gpNvm_Scan(h, gpNvm_DataStart(&h->format));
+}
+
+/**
+ * gpNvm_CompareId:
+ * @a: first attribute ID
+ * @b: second attribute ID
+ *
+ * qsort() and bsearch() helper ordering attribute IDs.
+ *
+ * Returns: <0, 0 or >0
+ */
+static int gpNvm_CompareId(const void *a, const void *b)
+{
+	gpNvm_AttrId ai = *(const gpNvm_AttrId *)a;
+	gpNvm_AttrId bi = *(const gpNvm_AttrId *)b;
+
+	return (ai > bi) - (ai < bi);
+}
+
+/**
+ * gpNvm_StaticFormat:
+ * @format: file format
+ *
+ * Returns: non zero if records of @format can have the static layout:
+ * the in-place format of this build, the one gpnvm_static.h sizes them in
+ */
+static int gpNvm_StaticFormat(const gpNvm_Format *format)
+{
+	return format->version == GPNVM_VERSION_CRC32C && !(format->flags & GPNVM_FMT_LOG) &&
+		gpNvm_IdSize(format) == sizeof(gpNvm_AttrId);
+}
+
+/**
+ * gpNvm_StaticSetup:
+ * @h: handle of the store, with the format it wants
+ * @schema: declared attributes
+ * @count: number of declared attributes
+ *
+ * Take the schema of the static layout. The attributes must be unique
+ * and their offsets those of their records laid out one after the other.
+ *
+ * Returns: 0 if success, 1 if the schema does not fit the wanted format
+ */
+static int gpNvm_StaticSetup(gpNvm_Handle *h, const gpNvm_StaticAttr *schema, int count)
+{
+	long offset = 0;
+	int i;
+
+	if (!gpNvm_StaticFormat(&h->want))
+		return 1;
+	for (i = 0; i != count; i++) {
+		if (schema[i].offset != offset || !schema[i].size)
+			return 1;
+		offset += gpNvm_RecordSize(&h->want, schema[i].size);
+	}
+
+	h->staticIds = malloc(count * sizeof *h->staticIds);
+	if (!h->staticIds)
+		return 1;
+	for (i = 0; i != count; i++)
+		h->staticIds[i] = schema[i].attrId;
+	qsort(h->staticIds, count, sizeof *h->staticIds, gpNvm_CompareId);
+	for (i = 1; i < count; i++)
+		if (h->staticIds[i] == h->staticIds[i - 1])
+			return 1;
+
+	h->schema = schema;
+	h->schemaCount = count;
+	return 0;
+}
+
+/**
+ * gpNvm_StaticFind:
+ * @h: handle of the store
+ * @attrId: attribute ID (key)
+ *
+ * Returns: non zero if @attrId is declared in the schema
+ */
+static int gpNvm_StaticFind(gpNvm_Handle *h, gpNvm_AttrId attrId)
+{
+	return h->schemaCount &&
+		bsearch(&attrId, h->staticIds, h->schemaCount, sizeof attrId, gpNvm_CompareId);
+}
+
+/**
+ * gpNvm_StaticCheck:
+ * @h: handle of the store, with its index built
+ *
+ * Check that every declared attribute has its record where the schema
+ * puts it, so it can be read there without a lookup. A file that is not
+ * laid out yet is rewritten on the first write.
+ */
+static void gpNvm_StaticCheck(gpNvm_Handle *h)
+{
+	long base = gpNvm_DataStart(&h->format);
+	gpNvm_IndexEntry *entry;
+	int i;
+
+	h->staticOk = 0;
+	if (!h->schema || !gpNvm_StaticFormat(&h->format))
+		return;
+	for (i = 0; i != h->schemaCount; i++) {
+		entry = gpNvm_IndexLookup(h, h->schema[i].attrId);
+		if (!entry || entry->offset != base + h->schema[i].offset ||
+		    entry->length != h->schema[i].size)
+			return;
+	}
+
+	h->staticBase = base;
+	h->staticEnd = base;
+	if (h->schemaCount)
+		h->staticEnd += h->schema[i - 1].offset + gpNvm_RecordSize(&h->format, h->schema[i - 1].size);
+	h->staticOk = 1;
+}
+
+/**
+ * gpNvm_Current:
+ * @h: handle of the store
+ *
+ * Returns: non zero if the file is in the wanted format, with the static
+ * layout if it is to have one
+ */
+static int gpNvm_Current(gpNvm_Handle *h)
+{
+	return h->format.version == h->want.version && h->format.flags == h->want.flags &&
+		(!h->schema || h->staticOk);
+}
+
+/**
+ * gpNvm_Reload:
+ * @h: handle of the store
+ *
+ * Read the superblock and build the index from the storage as it is,
+ * from the table of contents if there is a valid one.
+ *
+ * Returns: 0 if success
+ */
+static int gpNvm_Reload(gpNvm_Handle *h)
+{
+	long end = -1;
+
+	h->image = h->backend->image(h->ctx);
+	if (gpNvm_ReadSuper(h, &h->format))
+		return 1;
+
+  /* trust a valid table of contents, scan only for records written after
+   * it was; rewrite it if the scan found any, or had to do all */
+	if (!(h->format.flags & GPNVM_FMT_TOC)) {
+		if (gpNvm_BuildIndex(h))
+			return 1;
+	} else if (!gpNvm_TocLoad(h)) {
+		end = h->end;
+		if (gpNvm_Scan(h, end))
+			return 1;
+		if (h->end != end)
+			gpNvm_TocWrite(h);
+	} else {
+		if (gpNvm_BuildIndex(h))
+			return 1;
+		gpNvm_TocWrite(h);
+	}
+
+	gpNvm_StaticCheck(h);
+	return 0;
+}
+
+/**
+ * gpNvm_SharedFcntl:
+ * @fd: segment file
+ * @cmd: F_OFD_SETLK, or F_OFD_SETLKW to wait for the lock
+ * @type: F_RDLCK, F_WRLCK or F_UNLCK
+ * @start: byte to lock, %GPNVM_SHARED_WRITER or %GPNVM_SHARED_ATTACH
+ *
+ * Lock one byte of the segment. Open file description locks belong to
+ * the open file, not to the process: two handles in one process exclude
+ * each other as two processes do, and the locks of a handle go when it
+ * closes the segment or its process dies.
+ *
+ * Returns: 0 if success
+ */
+static int gpNvm_SharedFcntl(int fd, int cmd, short type, long start)
+{
+	struct flock lock;
+
+	memset(&lock, 0, sizeof lock);
+	lock.l_type = type;
+	lock.l_whence = SEEK_SET;
+	lock.l_start = start;
+	lock.l_len = 1;
+	while (fcntl(fd, cmd, &lock) != 0)
+		if (errno != EINTR)
+			return 1;
+	return 0;
+}
+
+/**
+ * gpNvm_SharedGetState:
+ * @h: handle of the store
+ * @state: returns the state of the store
+ *
+ * The sequence number only matters in the log format, in the others it
+ * is left out so writes in place do not change the state.
+ */
+static void gpNvm_SharedGetState(gpNvm_Handle *h, gpNvm_SharedState *state)
+{
+	memset(state, 0, sizeof *state);
+	state->end = h->end;
+	state->dead = h->dead;
+	state->replaced = h->sharedReplaced;
+	state->seq = h->format.flags & GPNVM_FMT_LOG ? h->seq : 0;
+	state->toc = h->format.toc;
+	state->tocUsed = h->tocUsed;
+	state->tocSum = h->tocSum;
+	state->tocMin = h->tocMin;
+	state->indexSize = h->indexSize;
+	state->indexCount = h->indexCount;
+	state->staticOk = h->staticOk;
+	state->version = h->format.version;
+	state->flags = h->format.flags;
+}
+
+/**
+ * gpNvm_SharedMap:
+ * @h: handle of the store
+ * @size: number of index slots the table is to hold
+ * @grow: non zero to grow the segment if it is too small
+ *
+ * Map the table of the segment for @size slots. Only the writer grows
+ * the segment; readers refuse a size it does not have, they read it
+ * without a lock and may have seen it torn.
+ *
+ * Returns: 0 if success
+ */
+static int gpNvm_SharedMap(gpNvm_Handle *h, UInt32 size, int grow)
+{
+	long bytes = GPNVM_SHARED_HEADER + (long)size * sizeof(gpNvm_SharedEntry);
+	struct stat st;
+	void *table;
+
+	if (size <= h->sharedMapped)
+		return 0;
+	if (fstat(h->sharedFd, &st) != 0)
+		return 1;
+	if (st.st_size < bytes && (!grow || ftruncate(h->sharedFd, bytes) != 0))
+		return 1;
+
+	table = mmap(NULL, bytes - GPNVM_SHARED_HEADER, PROT_READ | PROT_WRITE,
+			MAP_SHARED, h->sharedFd, GPNVM_SHARED_HEADER);
+	if (table == MAP_FAILED)
+		return 1;
+	if (h->sharedTable)
+		munmap(h->sharedTable, h->sharedMapped * sizeof *h->sharedTable);
+	h->sharedTable = table;
+	h->sharedMapped = size;
+	return 0;
+}
+
+/**
+ * gpNvm_SharedPublish:
+ * @h: handle of the store, with the writer lock and an odd generation
+ * @state: state of the store, from gpNvm_SharedGetState()
+ *
+ * Copy the index and the state to the segment and move its layout on,
+ * so the other handles take the copy on their next access. If the table
+ * can not be mapped the segment is marked not valid instead: the next
+ * handle to take the writer lock rebuilds it from the file.
+ */
+static void gpNvm_SharedPublish(gpNvm_Handle *h, const gpNvm_SharedState *state)
+{
+	gpNvm_SharedHeader *s = h->shared;
+	UInt32 i;
+
+	if (gpNvm_SharedMap(h, h->indexSize, 1)) {
+		__atomic_store_n(&s->valid, 0, __ATOMIC_RELEASE);
+	} else {
+		for (i = 0; i != h->indexSize; i++) {
+			gpNvm_SharedEntry *to = &h->sharedTable[i];
+			const gpNvm_IndexEntry *from = &h->index[i];
+
+			to->offset = from->offset;
+			to->seq = from->seq;
+			to->slot = from->slot;
+			to->attrId = from->attrId;
+			to->length = from->length;
+			to->valid = from->valid;
+		}
+		memcpy(&s->state, state, sizeof *state);
+		__atomic_store_n(&s->valid, 1, __ATOMIC_RELEASE);
+	}
+	__atomic_store_n(&h->sharedLayout,
+		__atomic_add_fetch(&s->layout, 1, __ATOMIC_RELEASE), __ATOMIC_RELEASE);
+	h->sharedDirty = 0;
+}
+
+/**
+ * gpNvm_SharedReopen:
+ * @h: handle of the store
+ *
+ * Open the file again after another handle swapped in a new image, this
+ * handle still has the old one open. The swap made all writes so far
+ * durable, those of this handle included.
+ *
+ * Returns: 0 if success, on failure the store is left detached
+ */
+static int gpNvm_SharedReopen(gpNvm_Handle *h)
+{
+	gpNvm_CommitHold(h);
+	if (h->ctx)
+		h->backend->close(h->ctx, h->end);
+	h->ctx = h->backend->open(h->path, h->flags, h->backendArg);
+	h->image = h->ctx ? h->backend->image(h->ctx) : NULL;
+	gpNvm_CommitRelease(h, h->ctx != NULL);
+	return !h->ctx;
+}
+
+/**
+ * gpNvm_SharedRefresh:
+ * @h: handle of the store, with the structure lock held exclusive
+ *
+ * Copy the index and the state from the segment if another handle
+ * changed them since this one last did. The copy is taken without the
+ * writer lock: if the generation moved while it was taken it is thrown
+ * away. Views end, as the index they hang off is replaced.
+ *
+ * Returns: 0 if success, 1 if the copy is to be taken again
+ */
+static int gpNvm_SharedRefresh(gpNvm_Handle *h)
+{
+	gpNvm_SharedHeader *s = h->shared;
+	gpNvm_SharedState state;
+	gpNvm_IndexEntry *index = NULL;
+	unsigned long gen, layout;
+	UInt32 i;
+
+	gen = __atomic_load_n(&s->generation, __ATOMIC_ACQUIRE);
+	if ((gen & 1) || !__atomic_load_n(&s->valid, __ATOMIC_ACQUIRE))
+		return 1;
+	layout = __atomic_load_n(&s->layout, __ATOMIC_ACQUIRE);
+	if (layout == h->sharedLayout)
+		return 0;
+
+	memcpy(&state, &s->state, sizeof state);
+	if (state.indexSize & (state.indexSize - 1) ||
+	    gpNvm_SharedMap(h, state.indexSize, 0) ||
+	    (state.tocUsed <= state.toc && gpNvm_TocGrow(h, state.tocUsed)) ||
+	    (state.indexSize && !(index = calloc(state.indexSize, sizeof *index))))
+		return 1;
+	for (i = 0; i != state.indexSize; i++) {
+		const gpNvm_SharedEntry *from = &h->sharedTable[i];
+
+		index[i].offset = from->offset;
+		index[i].seq = from->seq;
+		index[i].slot = from->slot;
+		index[i].attrId = from->attrId;
+		index[i].length = from->length;
+		index[i].valid = from->valid;
+	}
+	GPNVM_SHARED_FENCE(&s->generation);
+	if (__atomic_load_n(&s->generation, __ATOMIC_ACQUIRE) != gen) {
+		free(index);
+		return 1;
+	}
+
+	gpNvm_IndexClear(h);
+	free(h->index);
+	h->index = index;
+	h->indexSize = state.indexSize;
+	h->indexCount = state.indexCount;
+	h->format.version = state.version;
+	h->format.flags = state.flags;
+	h->format.toc = state.toc;
+	h->end = state.end;
+	h->dead = state.dead;
+	if (state.flags & GPNVM_FMT_LOG)
+		h->seq = state.seq;
+	h->tocUsed = state.tocUsed;
+	h->tocSum = state.tocSum;
+	h->tocMin = state.tocMin;
+	for (i = 0; h->tocUsed <= h->format.toc && i != h->indexSize; i++) {
+		if (index[i].valid && index[i].slot < h->tocUsed)
+			h->tocIds[index[i].slot] = index[i].attrId;
+	}
+	h->staticOk = state.staticOk;
+	h->sharedDirty = 0;
+	__atomic_store_n(&h->sharedLayout, layout, __ATOMIC_RELEASE);
+	GPNVM_STATS_ADD(h, sharedRefreshes, 1);
+
+	if (state.replaced != h->sharedReplaced) {
+		h->sharedReplaced = state.replaced;
+		gpNvm_SharedReopen(h);
+	}
+	return 0;
+}
+
+/**
+ * gpNvm_SharedSettle:
+ * @h: handle of the store, with the writer lock
+ *
+ * Bring the index up to date now that no one else writes. An odd
+ * generation means the writer before died holding the lock, part way
+ * through a write, and a segment that is not valid could not be
+ * published: either way the file is the truth. It is opened again, as
+ * that writer may have swapped it, and scanned as at open after a
+ * crash; the index is published again once the lock goes.
+ *
+ * Returns: 0 if success
+ */
+static int gpNvm_SharedSettle(gpNvm_Handle *h)
+{
+	gpNvm_SharedHeader *s = h->shared;
+
+	if (!(__atomic_load_n(&s->generation, __ATOMIC_ACQUIRE) & 1) &&
+	    __atomic_load_n(&s->valid, __ATOMIC_ACQUIRE))
+		return gpNvm_SharedRefresh(h);
+
+	h->sharedReplaced++;
+	if (gpNvm_SharedReopen(h) || gpNvm_Reload(h)) {
+		__atomic_store_n(&s->valid, 0, __ATOMIC_RELEASE);
+		return 1;
+	}
+	h->sharedDirty = 1;
+	return 0;
+}
+
+/**
+ * gpNvm_SharedRelease:
+ * @h: handle of the store, with the writer lock
+ *
+ * End the write, making the generation even, and drop the writer lock.
+ */
+static void gpNvm_SharedRelease(gpNvm_Handle *h)
+{
+	gpNvm_SharedHeader *s = h->shared;
+
+	if (__atomic_load_n(&s->generation, __ATOMIC_RELAXED) & 1)
+		__atomic_add_fetch(&s->generation, 1, __ATOMIC_RELEASE);
+	gpNvm_SharedFcntl(h->sharedFd, F_OFD_SETLK, F_UNLCK, GPNVM_SHARED_WRITER);
+	h->sharedHeld = 0;
+}
+
+/**
+ * gpNvm_SharedUnlock:
+ * @h: handle of the store
+ *
+ * Publish the index if it or the state changed while the writer lock
+ * was held, then release it; nothing if the lock is not held.
+ */
+static void gpNvm_SharedUnlock(gpNvm_Handle *h)
+{
+	gpNvm_SharedHeader *s = h->shared;
+	gpNvm_SharedState state;
+
+	if (!h->sharedHeld)
+		return;
+
+	gpNvm_SharedGetState(h, &state);
+	if (h->ctx && (h->sharedDirty || memcmp(&state, &s->state, sizeof state))) {
+		if (!(__atomic_load_n(&s->generation, __ATOMIC_RELAXED) & 1))
+			__atomic_add_fetch(&s->generation, 1, __ATOMIC_SEQ_CST);
+		gpNvm_SharedPublish(h, &state);
+	}
+	gpNvm_SharedRelease(h);
+}
+
+/**
+ * gpNvm_SharedLock:
+ * @h: handle of the store, with the structure lock held exclusive
+ *
+ * Take the writer lock, waiting for the writer of another handle, bring
+ * the index up to date and make the generation odd: reads elsewhere see
+ * a write is in progress.
+ *
+ * Returns: 0 if success
+ */
+static int gpNvm_SharedLock(gpNvm_Handle *h)
+{
+	gpNvm_SharedHeader *s = h->shared;
+
+	if (gpNvm_SharedFcntl(h->sharedFd, F_OFD_SETLKW, F_WRLCK, GPNVM_SHARED_WRITER))
+		return 1;
+	h->sharedHeld = 1;
+	if (gpNvm_SharedSettle(h)) {
+		gpNvm_SharedRelease(h);
+		return 1;
+	}
+	if (!(__atomic_load_n(&s->generation, __ATOMIC_RELAXED) & 1))
+		__atomic_add_fetch(&s->generation, 1, __ATOMIC_SEQ_CST);
+	return 0;
+}
+
+/**
+ * gpNvm_SharedBegin:
+ * @h: handle of the store
+ *
+ * Start a read in shared mode: wait for an even generation, no write in
+ * progress, and copy the index if another handle changed it. Reads take
+ * no file lock, so they never wait for one another; they wait for a
+ * writer as long as it writes, and take over from one that died holding
+ * the lock. See gpNvm_SharedRetry().
+ *
+ * Returns: the generation the read is made at, 0 if not shared
+ */
+static unsigned long gpNvm_SharedBegin(gpNvm_Handle *h)
+{
+	gpNvm_SharedHeader *s = h->shared;
+	unsigned long gen, last = 0;
+	int spins = 0;
+
+	if (!s)
+		return 0;
+
+	for (;;) {
+		gen = __atomic_load_n(&s->generation, __ATOMIC_ACQUIRE);
+		if (!(gen & 1) && __atomic_load_n(&s->valid, __ATOMIC_ACQUIRE)) {
+			if (__atomic_load_n(&s->layout, __ATOMIC_ACQUIRE) ==
+			    __atomic_load_n(&h->sharedLayout, __ATOMIC_ACQUIRE))
+				return gen;
+			pthread_rwlock_wrlock(&h->lock);
+			gpNvm_SharedRefresh(h);
+			pthread_rwlock_unlock(&h->lock);
+			continue;
+		}
+
+  /* a writer at work: if it holds on, test whether it is still there */
+		if (gen != last) {
+			last = gen;
+			spins = 0;
+		} else if (++spins == GPNVM_SHARED_SPINS) {
+			spins = 0;
+			pthread_rwlock_wrlock(&h->lock);
+			if (!gpNvm_SharedFcntl(h->sharedFd, F_OFD_SETLK, F_WRLCK, GPNVM_SHARED_WRITER)) {
+				h->sharedHeld = 1;
+				if (gpNvm_SharedSettle(h))
+					gpNvm_SharedRelease(h);
+				else
+					gpNvm_SharedUnlock(h);
+			}
+			pthread_rwlock_unlock(&h->lock);
+		}
+		sched_yield();
+	}
+}
+
+/**
+ * gpNvm_SharedRetry:
+ * @h: handle of the store
+ * @gen: generation from gpNvm_SharedBegin()
+ *
+ * End a read in shared mode: it saw the store as it was if no write
+ * started meanwhile, otherwise it is to be done again; a write in place
+ * by another process may have torn the data it read.
+ *
+ * Returns: non zero if the read is to be done again
+ */
+static int gpNvm_SharedRetry(gpNvm_Handle *h, unsigned long gen)
+{
+	if (!h->shared)
+		return 0;
+	GPNVM_SHARED_FENCE(&h->shared->generation);
+	if (__atomic_load_n(&h->shared->generation, __ATOMIC_ACQUIRE) == gen)
+		return 0;
+	GPNVM_STATS_ADD(h, sharedRetries, 1);
+	return 1;
+}
+
+/**
+ * gpNvm_SharedOpen:
+ * @h: handle of the store
+ * @path: file of the store
+ *
+ * Attach to the segment of a store opened in shared mode, creating it if
+ * there is none, and take its writer lock while the index is built. The
+ * attach lock tells whether other handles have the store open: it is
+ * tried exclusive, then held shared until close. Shared mode takes the
+ * file backend without memory mapping: a mapping can not follow the file
+ * as another process grows it.
+ *
+ * Returns: 0 if success
+ */
+static int gpNvm_SharedOpen(gpNvm_Handle *h, const char *path)
+{
+	gpNvm_SharedHeader *s;
+	struct stat st;
+	char *name;
+
+	h->sharedFd = -1;
+	if (!GPNVM_SHARED_LOCKS || !path || h->backend != &gpNvm_FileBackend ||
+	    (h->flags & GPNVM_OPEN_MMAP))
+		return 1;
+
+	h->path = strdup(path);
+	name = malloc(strlen(path) + sizeof GPNVM_SHARED_SUFFIX);
+	if (!h->path || !name) {
+		free(name);
+		return 1;
+	}
+	sprintf(name, "%s" GPNVM_SHARED_SUFFIX, path);
+	h->sharedFd = open(name, O_RDWR | O_CREAT, 0666);
+	free(name);
+	if (h->sharedFd < 0 ||
+	    gpNvm_SharedFcntl(h->sharedFd, F_OFD_SETLKW, F_WRLCK, GPNVM_SHARED_WRITER))
+		return 1;
+	h->sharedHeld = 1;
+	h->sharedFirst = !gpNvm_SharedFcntl(h->sharedFd, F_OFD_SETLK, F_WRLCK, GPNVM_SHARED_ATTACH);
+	if (gpNvm_SharedFcntl(h->sharedFd, F_OFD_SETLK, F_RDLCK, GPNVM_SHARED_ATTACH) ||
+	    fstat(h->sharedFd, &st) != 0 ||
+	    (st.st_size < GPNVM_SHARED_HEADER && ftruncate(h->sharedFd, GPNVM_SHARED_HEADER) != 0))
+		return 1;
+
+	s = mmap(NULL, GPNVM_SHARED_HEADER, PROT_READ | PROT_WRITE, MAP_SHARED, h->sharedFd, 0);
+	if (s == MAP_FAILED)
+		return 1;
+	h->shared = s;
+
+  /* the stores of builds with other IDs can not share an index; a new
+   * segment, or one no one has open any more, is set up afresh */
+	if (memcmp(s->magic, GPNVM_SHARED_MAGIC, 4) || s->idSize != sizeof(gpNvm_AttrId)) {
+		if (!h->sharedFirst && !memcmp(s->magic, GPNVM_SHARED_MAGIC, 4))
+			return 1;
+		memset(s, 0, sizeof *s);
+		memcpy(s->magic, GPNVM_SHARED_MAGIC, 4);
+		s->idSize = sizeof(gpNvm_AttrId);
+	}
+	h->sharedReplaced = s->state.replaced;
+	h->ring = &s->ring;
+	return 0;
+}
+
+/**
+ * gpNvm_SharedLoad:
+ * @h: handle of the store, with the writer lock of gpNvm_SharedOpen()
+ *
+ * Build the index of a store opened in shared mode. The first handle to
+ * attach scans the file, the segment may be left from an earlier run
+ * and the file changed since; the others copy the index from the
+ * segment, unless a writer died holding the lock.
+ *
+ * Returns: 0 if success
+ */
+static int gpNvm_SharedLoad(gpNvm_Handle *h)
+{
+	h->image = h->backend->image(h->ctx);
+	if (!h->sharedFirst)
+		return gpNvm_SharedSettle(h);
+
+	h->sharedDirty = 1;
+	return gpNvm_Reload(h);
+}
+
+/**
+ * gpNvm_SharedClose:
+ * @h: handle of the store
+ *
+ * Detach from the segment; closing it drops the locks of the handle.
+ */
+static void gpNvm_SharedClose(gpNvm_Handle *h)
+{
+	if (h->sharedTable)
+		munmap(h->sharedTable, h->sharedMapped * sizeof *h->sharedTable);
+	if (h->shared)
+		munmap(h->shared, GPNVM_SHARED_HEADER);
+	if (h->sharedFd >= 0)
+		close(h->sharedFd);
+	free(h->path);
+}
+
+/**
+ * gpNvm_Attach:
+ * @h: handle of the store
+ * @path: storage to open
+ * @arg: backend argument
+ *
+ * Open the storage of the handle and build the index, in shared mode
+ * with the index of the segment if it can.
+ *
+ * Returns: 0 if success
+ */
+static int gpNvm_Attach(gpNvm_Handle *h, const char *path, void *arg)
+{
+	h->ctx = h->backend->open(path, h->flags, arg);
+	if (!h->ctx)
+		return 1;
+
+	if (h->shared ? gpNvm_SharedLoad(h) : gpNvm_Reload(h)) {
+		gpNvm_IndexClear(h);
+		h->backend->close(h->ctx, 0);
+		h->ctx = NULL;
+		h->image = NULL;
+		return 1;
+	}
+
+	return 0;
+}
+
+/**
+ * gpNvm_Detach:
+ * @h: handle of the store
+ *
+ * Close the storage and clear the index.
+ *
+ * Returns: 0 if success
+ */
+static int gpNvm_Detach(gpNvm_Handle *h)
+{
+	int ret;
+
+  /* views point into the image, clear them before it goes */
+	gpNvm_IndexClear(h);
+	ret = h->backend->close(h->ctx, h->end);
+
+	h->ctx = NULL;
+	h->image = NULL;
+	h->end = 0;
+	return ret;
+}
+
+/**
+ * gpNvm_LockInit:
+ * @h: handle of the store
+ *
+ * Set up the structure and record locks, and the queue of asynchronous
+ * writes. Where the C library allows it the structure lock prefers
+ * writers, so a steady stream of readers can not hold back an append
+ * forever.
+ */
+static void gpNvm_LockInit(gpNvm_Handle *h)
+{
+	pthread_rwlockattr_t attr;
+	int i;
+
+	pthread_rwlockattr_init(&attr);
+#if defined(__GLIBC__)
+	pthread_rwlockattr_setkind_np(&attr, PTHREAD_RWLOCK_PREFER_WRITER_NONRECURSIVE_NP);
+#endif
+	pthread_rwlock_init(&h->lock, &attr);
+	pthread_rwlockattr_destroy(&attr);
+
+	for (i = 0; i != GPNVM_LOCK_STRIPES; i++)
+		pthread_rwlock_init(&h->stripes[i], NULL);
+
+	pthread_mutex_init(&h->queueMutex, NULL);
+	pthread_cond_init(&h->queueCond, NULL);
+	pthread_cond_init(&h->drainCond, NULL);
+
+	pthread_mutex_init(&h->commitMutex, NULL);
+	pthread_cond_init(&h->commitCond, NULL);
+
+	pthread_mutex_init(&h->notifyMutex, NULL);
+}
+
+/**
+ * gpNvm_LockDestroy:
+ * @h: handle of the store
+ */
+static void gpNvm_LockDestroy(gpNvm_Handle *h)
+{
+	int i;
+
+	pthread_rwlock_destroy(&h->lock);
+	for (i = 0; i != GPNVM_LOCK_STRIPES; i++)
+		pthread_rwlock_destroy(&h->stripes[i]);
+
+	pthread_mutex_destroy(&h->queueMutex);
+	pthread_cond_destroy(&h->queueCond);
+	pthread_cond_destroy(&h->drainCond);
+
+	pthread_mutex_destroy(&h->commitMutex);
+	pthread_cond_destroy(&h->commitCond);
+
+	pthread_mutex_destroy(&h->notifyMutex);
+}
+
+/**
+ * gpNvm_Notifying:
+ * @h: handle of the store
+ *
+ * Test whether anyone is to be told of changes: a subscription, or a
+ * descriptor of this handle or, in shared mode, of any handle.
+ *
+ * Returns: non zero if changes are noted
+ */
+static int gpNvm_Notifying(gpNvm_Handle *h)
+{
+	return __atomic_load_n(&h->subCount, __ATOMIC_RELAXED) ||
+		(h->shared ? __atomic_load_n(&h->shared->watchers, __ATOMIC_RELAXED) :
+		 __atomic_load_n(&h->notifyFd, __ATOMIC_RELAXED) >= 0);
+}
+
+/**
+ * gpNvm_NotifyPut:
+ * @h: handle of the store
+ * @attrId: attribute ID (key) of the change, anything for a reset
+ * @reset: non zero if everything changed
+ *
+ * Add a change to the ring if any descriptor reads it, with the notify
+ * mutex held and in shared mode the writer lock.
+ */
+static void gpNvm_NotifyPut(gpNvm_Handle *h, gpNvm_AttrId attrId, int reset)
+{
+	gpNvm_NotifyRing *ring = h->ring;
+	unsigned long n = ring->count;
+
+	if (h->shared ? !__atomic_load_n(&h->shared->watchers, __ATOMIC_RELAXED) : h->notifyFd < 0)
+		return;
+	__atomic_store_n(&ring->ids[n % GPNVM_NOTIFY_RING], (UInt32)attrId, __ATOMIC_RELAXED);
+	if (reset)
+		__atomic_store_n(&ring->reset, n + 1, __ATOMIC_RELAXED);
+	__atomic_store_n(&ring->count, n + 1, __ATOMIC_RELEASE);
+	h->notifySignal = 1;
+}
+
+/**
+ * gpNvm_NotifyNote:
+ * @h: handle of the store
+ * @attrId: attribute ID (key)
+ *
+ * Note that a write gave an attribute a new value, for the subscriptions
+ * and the descriptors. They are told by gpNvm_NotifyDeliver() once the
+ * write is done. To be called with the lock the write took.
+ */
+static void gpNvm_NotifyNote(gpNvm_Handle *h, gpNvm_AttrId attrId)
+{
+	pthread_mutex_lock(&h->notifyMutex);
+	if (h->subCount) {
+		if (h->notedCount == h->notedSize) {
+			int size = h->notedSize ? 2 * h->notedSize : 16;
+			gpNvm_AttrId *noted = realloc(h->noted, size * sizeof *noted);
+
+  /* out of memory: tell every subscription rather than none */
+			if (noted) {
+				h->noted = noted;
+				h->notedSize = size;
+			} else {
+				h->notifyAll = 1;
+			}
+		}
+		if (h->notedCount != h->notedSize)
+			h->noted[h->notedCount++] = attrId;
+	}
+	gpNvm_NotifyPut(h, attrId, 0);
+	__atomic_store_n(&h->notifyDue, 1, __ATOMIC_RELEASE);
+	pthread_mutex_unlock(&h->notifyMutex);
+}
+
+/**
+ * gpNvm_NotifyReset:
+ * @h: handle of the store
+ *
+ * Note that every attribute may have changed, after an import: every
+ * subscription is told and the readers of the descriptors learn that
+ * they lost track. To be called with the store locked for writing.
+ */
+static void gpNvm_NotifyReset(gpNvm_Handle *h)
+{
+	pthread_mutex_lock(&h->notifyMutex);
+	h->notifyAll = 1;
+	gpNvm_NotifyPut(h, 0, 1);
+	__atomic_store_n(&h->notifyDue, 1, __ATOMIC_RELEASE);
+	pthread_mutex_unlock(&h->notifyMutex);
+}
+
+/**
+ * gpNvm_NotifyWake:
+ * @h: handle of the store
+ *
+ * Wake the readers of the descriptors: those of the handle, or in shared
+ * mode those of all handles, watching the segment.
+ *
+ * Returns: 0 if success
+ */
+static int gpNvm_NotifyWake(gpNvm_Handle *h)
+{
+#if GPNVM_NOTIFY_FDS
+	UInt8 touch = 0;
+	uint64_t one = 1;
+
+	if (h->shared)
+		return pwrite(h->sharedFd, &touch, 1, offsetof(gpNvm_SharedHeader, touch)) != 1;
+	return h->notifyFd >= 0 && write(h->notifyFd, &one, sizeof one) != sizeof one;
+#else
+	return 1;
+#endif
+}
+
+/**
+ * gpNvm_NotifyDeliver:
+ * @h: handle of the store
+ *
+ * Tell what the writes done since the last delivery changed: wake the
+ * descriptors once, then call the subscriptions of every change. Called
+ * once a write is done, with no lock held, so one write, a batch or
+ * a pass of queued writes wakes the descriptors once.
+ */
+static void gpNvm_NotifyDeliver(gpNvm_Handle *h)
+{
+	gpNvm_Subscription scratch[16], *calls = scratch;
+	int i, j, n, count = 0, signal;
+
+	if (!__atomic_load_n(&h->notifyDue, __ATOMIC_ACQUIRE))
+		return;
+
+  /* take the calls under the mutex, the callbacks may subscribe; an
+   * import calls every subscription once */
+	pthread_mutex_lock(&h->notifyMutex);
+	n = h->notifyAll ? 1 : h->notedCount;
+	for (j = 0; j != n; j++)
+		for (i = 0; i != h->subCount; i++)
+			count += h->notifyAll || h->subs[i].attrId == h->noted[j];
+	if (count > (int)(sizeof scratch / sizeof *scratch) &&
+	    !(calls = malloc(count * sizeof *calls)))
+		n = 0;
+	for (j = 0, count = 0; j != n; j++)
+		for (i = 0; i != h->subCount; i++)
+			if (h->notifyAll || h->subs[i].attrId == h->noted[j])
+				calls[count++] = h->subs[i];
+	signal = h->notifySignal;
+	h->notedCount = 0;
+	h->notifyAll = 0;
+	h->notifySignal = 0;
+	__atomic_store_n(&h->notifyDue, 0, __ATOMIC_RELAXED);
+	pthread_mutex_unlock(&h->notifyMutex);
+
+  /* a failed wake is not undone, the change is found with the next */
+	if (signal)
+		gpNvm_NotifyWake(h);
+	for (i = 0; i != count; i++)
+		calls[i].notify(h, calls[i].attrId, calls[i].arg);
+	if (calls != scratch)
+		free(calls);
+}
+
+/**
+ * gpNvm_WriteLock:
+ * @h: handle of the store
+ *
+ * Take the structure lock exclusive for a write and, in shared mode, the
+ * writer lock of the segment, see gpNvm_SharedLock(). The structure lock
+ * is held even if the writer lock can not be had.
+ *
+ * Returns: 0 if success
+ */
+static int gpNvm_WriteLock(gpNvm_Handle *h)
+{
+	pthread_rwlock_wrlock(&h->lock);
+	return h->shared && gpNvm_SharedLock(h);
+}
+
+/**
+ * gpNvm_WriteUnlock:
+ * @h: handle of the store
+ *
+ * Publish the index if the write changed it, drop the locks of
+ * gpNvm_WriteLock() and tell what the write changed.
+ */
+static void gpNvm_WriteUnlock(gpNvm_Handle *h)
+{
+	if (h->shared)
+		gpNvm_SharedUnlock(h);
+	pthread_rwlock_unlock(&h->lock);
+	gpNvm_NotifyDeliver(h);
+}
+
+/**
+ * gpNvm_Stripe:
+ * @h: handle of the store
+ * @attrId: attribute ID (key)
+ *
+ * Returns: the record lock that covers @attrId
+ */
+static pthread_rwlock_t *gpNvm_Stripe(gpNvm_Handle *h, gpNvm_AttrId attrId)
+{
+	return &h->stripes[attrId % GPNVM_LOCK_STRIPES];
+}
+
+/**
+ * gpNvm_Resolve:
+ * @handle: handle passed by the caller
+ *
+ * Returns: @handle, or the handle of the original API if @handle is NULL
+ */
+static gpNvm_Handle *gpNvm_Resolve(gpNvm_Handle *handle)
+{
+	return handle ? handle : gpNvm_default;
+}
+
+/**
+ * gpNvm_Open:
+ * @pHandle: returns the handle of the store
+ * @path: file to open, not used by the memory backend
+ * @options: open options, NULL for the defaults
+ *
+ * Open the file, if the file is not present, a new file is created.
+ * With %GPNVM_OPEN_MMAP in the options flags the file is memory mapped
+ * and attributes are accessed in place. Damaged records found at open
+ * are skipped; with %GPNVM_OPEN_REPAIR the file is then rewritten
+ * without them. With @options->backend set to
+ * &gpNvm_MemoryBackend the store is held in memory only, see
+ * gpnvm_backend.h for other storage. With %GPNVM_OPEN_LOG records are
+ * written in the log format: every update is appended and the file is
+ * compacted once the dead records take @options->compactThreshold
+ * percent of it. With %GPNVM_OPEN_TOC the file keeps a checksummed table
+ * of contents that open loads instead of scanning the records; only the
+ * records written after it was are scanned, and all of them if its
+ * check fails.
+ * With @options->schema set the declared attributes of gpnvm_static.h
+ * are kept first in the file, at the offsets of the schema; it takes the
+ * in-place format and is refused with %GPNVM_OPEN_LOG.
+ * With @options->durability above %GPNVM_DURABILITY_NONE every write is
+ * persisted at that level before it returns; writers that wait at the
+ * same time share one persist.
+ * With %GPNVM_OPEN_SHARED several processes can have the file open, all
+ * with the same options: writers take turns under a lock on a segment
+ * next to the file, which also holds the index, so a process notices
+ * the writes of the others without scanning the file. Reads take no
+ * lock. It takes the file backend and is refused with %GPNVM_OPEN_MMAP.
+ *
+ * Records are written in format version 2, protected by CRC32C. Files in
+ * an older format are read as they are; a file in another format than
+ * the one asked for is rewritten in that format on the first write.
+ *
+ * Returns: custom error code
+ */
+gpNvm_Result gpNvm_Open(gpNvm_Handle **pHandle, const char *path, const gpNvm_Options *options)
+{
+	gpNvm_Handle *h;
+
+	if (!pHandle)
+		return 1;
+
+	h = calloc(1, sizeof *h);
+	if (!h)
+		return 1;
+	h->ring = &h->ringLocal;
+	h->notifyFd = -1;
+	h->batchMark = -1;
+	h->backend = options && options->backend ? options->backend : &gpNvm_FileBackend;
+	h->flags = options ? options->flags : 0;
+	h->threshold = options && options->compactThreshold ?
+		options->compactThreshold : GPNVM_COMPACT_THRESHOLD;
+	h->durability = options ? options->durability : GPNVM_DURABILITY_NONE;
+	if (h->durability > GPNVM_DURABILITY_FULL) {
+		free(h);
+		return 1;
+	}
+	if (h->flags & GPNVM_OPEN_WRITEBACK) {
+		h->flushWrites = options->flushWrites;
+		h->flushMs = options->flushMs;
+	}
+	h->backendArg = options ? options->backendArg : NULL;
+
+	h->want.version = GPNVM_VERSION_CRC32C;
+	h->want.flags = (h->flags & GPNVM_OPEN_LOG ? GPNVM_FMT_LOG : 0) |
+		(h->flags & GPNVM_OPEN_TOC ? GPNVM_FMT_TOC : 0) | GPNVM_FMT_ID;
+
+	if ((options && options->schema &&
+	     gpNvm_StaticSetup(h, options->schema, options->schemaCount)) ||
+	    ((h->flags & GPNVM_OPEN_SHARED) && gpNvm_SharedOpen(h, path)) ||
+	    gpNvm_Attach(h, path, h->backendArg)) {
+		if (h->flags & GPNVM_OPEN_SHARED)
+			gpNvm_SharedClose(h);
+		free(h->staticIds);
+		free(h->index);
+		free(h->tocIds);
+		free(h);
+		return 1;
+	}
+	if (h->shared)
+		gpNvm_SharedUnlock(h);
+	gpNvm_LockInit(h);
+
+  /* a failed repair leaves the store as the scan recovered it */
+	if ((h->flags & GPNVM_OPEN_REPAIR) && h->damaged) {
+		gpNvm_Format format = h->want;
+
+		if (!gpNvm_WriteLock(h)) {
+			h->want = h->format;
+			gpNvm_Rewrite(h);
+			h->want = format;
+		}
+		gpNvm_WriteUnlock(h);
+	}
+
+	if (gpNvm_FlusherStart(h)) {
+		gpNvm_Close(h);
+		return 1;
+	}
+
+	*pHandle = h;
+	return 0;
+}
+
+/**
+ * gpNvm_Close:
+ * @handle: handle of the store, NULL for the store of gpNvm_OpenFile()
+ *
+ * Close the store and free the handle; an open batch is dropped, queued
+ * asynchronous writes are written and the write-back cache is flushed.
+ *
+ * Returns: custom error code
+ */
+gpNvm_Result gpNvm_Close(gpNvm_Handle *handle)
+{
+	gpNvm_Handle *h = handle;
+	gpNvm_Result ret;
+
+	if (!h)
+		return gpNvm_CloseFile();
+
+	gpNvm_WorkerStop(h);
+	gpNvm_FlusherStop(h);
+	ret = 1;
+	if (h->ctx) {
+		ret = gpNvm_WriteLock(h) || gpNvm_FlushDirty(h);
+		gpNvm_WriteUnlock(h);
+	}
+	ret |= h->ctx ? gpNvm_Commit(h, gpNvm_Written(h), h->durability) : 1;
+	ret |= h->ctx ? gpNvm_Detach(h) : 1;
+	if (h->notifyFd >= 0) {
+		close(h->notifyFd);
+		if (h->shared)
+			__atomic_sub_fetch(&h->shared->watchers, 1, __ATOMIC_RELAXED);
+	}
+	if (h->flags & GPNVM_OPEN_SHARED)
+		gpNvm_SharedClose(h);
+	gpNvm_AbortBatch(h);
+	free(h->dirty.records);
+	free(h->queue.records.records);
+	free(h->queue.completions);
+	free(h->drain.records.records);
+	free(h->drain.completions);
+	free(h->subs);
+	free(h->noted);
+	gpNvm_LockDestroy(h);
+	free(h->staticIds);
+	free(h->index);
+	free(h->holes);
+	free(h->tocIds);
+	free(h);
+	return ret;
+}
+
+/**
+ * gpNvm_OpenFileEx:
+ * @filename: file to open
+ * @options: open options, NULL for the defaults
+ *
+ * Open the store behind the original API, see gpNvm_Open().
+ *
+ * Returns: custom error code
+ */
+gpNvm_Result gpNvm_OpenFileEx(const char *filename, const gpNvm_Options *options)
+{
+	if (gpNvm_default)
+		return 1;
+
+	return gpNvm_Open(&gpNvm_default, filename, options);
+}
+
+/**
+ * gpNvm_OpenFile:
+ * @filename: file to open
+ *
+ * Open the file with the default options, see gpNvm_OpenFileEx().
+ *
+ * Returns: custom error code
+ */
+gpNvm_Result gpNvm_OpenFile(const char *filename)
+{
+	return gpNvm_OpenFileEx(filename, NULL);
+}
+
+/**
+ * gpNvm_CloseFile:
+ *
+ * Close the file global handle
+ *
+ * Returns: custom error code
+ */
+gpNvm_Result gpNvm_CloseFile(void)
+{
+	gpNvm_Result ret;
+
+	if (!gpNvm_default)
+		return 1;
+
+	ret = gpNvm_Close(gpNvm_default);
+	gpNvm_default = NULL;
+	return ret;
+}
+
+/**
+ * gpNvm_Assemble:
+ * @h: handle of the store
+ * @want: format to assemble the image in, the table of contents is sized
+ * here
+ * @extra: bytes to leave free after the image
+ * @pImage: returns the image, to be freed
+ * @pSize: returns the size of the image, without @extra
+ *
+ * Assemble the superblock, the table of contents if the format has one
+ * and the live records in a fresh image, the declared attributes of a
+ * static layout first. Records with damaged data are left out.
+ *
+ * Returns: 0 if success
+ */
+static int gpNvm_Assemble(gpNvm_Handle *h, const gpNvm_Format *want, long extra, UInt8 **pImage, long *pSize)
+{
+	gpNvm_Format format = *want;
+	gpNvm_IndexEntry packed, *entry;
+	gpNvm_Staged staged;
+	long size, offset;
+	UInt32 count = 0, sum = 0;
+	UInt8 *image;
+	int i, toc = format.flags & GPNVM_FMT_TOC;
+	int fixed = h->schema && gpNvm_StaticFormat(&format) ? h->schemaCount : 0;
+
+	format.toc = toc ? gpNvm_TocCapacity(h, h->indexCount + fixed) : 0;
+	size = offset = gpNvm_DataStart(&format);
+	for (i = 0; i != fixed; i++)
+		size += gpNvm_RecordSize(&format, h->schema[i].size);
+	for (i = 0; i != h->indexSize; i++) {
+		if (!h->index[i].valid || (fixed && gpNvm_StaticFind(h, h->index[i].attrId)))
+			continue;
+		if (h->index[i].length > gpNvm_MaxLength(&format))
+			return 1;
+		size += gpNvm_RecordSize(&format, h->index[i].length);
+	}
+
+	image = calloc(1, size + extra);
+	if (!image)
+		return 1;
+
+	if (format.version != GPNVM_VERSION_LEGACY)
+		gpNvm_PackSuper(image, &format);
+
+  /* the declared attributes first, in schema order: their value if it is
+   * present with the declared size, zeros otherwise */
+	for (i = 0; i != h->indexSize + fixed; i++) {
+		if (i < fixed) {
+			staged.attrId = h->schema[i].attrId;
+			staged.length = h->schema[i].size;
+			staged.seq = 0;
+			entry = gpNvm_IndexLookup(h, staged.attrId);
+			if (!entry || entry->length != staged.length ||
+			    !gpNvm_ReadData(h, entry->offset, staged.length, staged.value))
+				memset(staged.value, 0, staged.length);
+		} else {
+			entry = &h->index[i - fixed];
+			if (!entry->valid || (fixed && gpNvm_StaticFind(h, entry->attrId)))
+				continue;
+			staged.attrId = entry->attrId;
+			staged.length = entry->length;
+			staged.seq = entry->seq;
+			if (!gpNvm_ReadData(h, entry->offset, staged.length, staged.value))
+				continue;
+		}
+
+		if (toc) {
+			packed.attrId = staged.attrId;
+			packed.offset = offset;
+			packed.seq = staged.seq;
+			packed.length = staged.length;
+			sum += gpNvm_TocPackEntry(&format, image + GPNVM_TOC_ENTRIES + count++ * GPNVM_TOC_ENTRY, &packed);
+		}
+		offset += gpNvm_PackRecord(&format, image + offset, &staged);
+	}
+	if (toc) {
+		gpNvm_TocPackFixed(image + GPNVM_TOC_START, &format);
+		gpNvm_TocPackHeader(image + GPNVM_TOC_START + GPNVM_TOC_FIXED, count, offset, h->seq, 0, sum);
+	}
+
+	*pImage = image;
+	*pSize = offset;
+	return 0;
+}
+
+/**
+ * gpNvm_Replace:
+ * @h: handle of the store
+ * @image: new contents of the storage
+ * @size: size of @image
+ *
+ * Have the backend swap in a new image, with no persist of gpNvm_Commit()
+ * in flight: the swap changes the storage it works on. The image is
+ * durable once swapped in, and so are the writes it holds.
+ *
+ * Returns: 0 if success
+ */
+static int gpNvm_Replace(gpNvm_Handle *h, const UInt8 *image, long size)
+{
+	int ret;
+
+	gpNvm_CommitHold(h);
+	ret = h->backend->replace(h->ctx, image, size);
+	gpNvm_CommitRelease(h, !ret);
+
+  /* the other handles of a shared store have the old image open */
+	if (!ret)
+		h->sharedReplaced++;
+	return ret;
+}
+
+/**
+ * gpNvm_Rewrite:
+ * @h: handle of the store
+ *
+ * Assemble the superblock and the live records, in the wanted format, in
+ * a fresh image and have the backend swap it in. Records with damaged
+ * data are left out. The index is rebuilt from the new image afterwards,
+ * or from the old one if the swap failed.
+ *
+ * Returns: 0 if success
+ */
+static int gpNvm_Rewrite(gpNvm_Handle *h)
+{
+	UInt8 *image;
+	long offset, now;
+	int ret;
+
+	if (gpNvm_Assemble(h, &h->want, 0, &image, &offset))
+		return 1;
+
+  /* views point into the old image, clear them before it goes */
+	gpNvm_IndexClear(h);
+	now = GPNVM_STATS_CLOCK();
+	ret = gpNvm_Replace(h, image, offset);
+	if (!ret) {
+		GPNVM_STATS_ADD(h, bytesWritten, offset);
+		GPNVM_STATS_ADD(h, flushes, 1);
+		GPNVM_STATS_TIME(h, flushLatency, now);
+	}
+	free(image);
+
+	return gpNvm_Reload(h) || ret;
+}
+
+/**
+ * gpNvm_Migrate:
+ * @h: handle of the store
+ *
+ * Bring the file into the wanted format before it is written. A file
+ * without records only needs a new superblock, and an empty table of
+ * contents if it is to have one; others are rewritten, and so are files
+ * that are to have the static layout.
+ *
+ * Returns: 0 if success
+ */
+static int gpNvm_Migrate(gpNvm_Handle *h)
+{
+	UInt8 super[GPNVM_SUPER_SIZE];
+	gpNvm_Format format;
+	int ret;
+
+	if (gpNvm_Current(h))
+		return 0;
+
+	if (h->indexCount || h->schema)
+		return gpNvm_Rewrite(h);
+
+	format = h->want;
+	format.toc = format.flags & GPNVM_FMT_TOC ? gpNvm_TocCapacity(h, 0) : 0;
+	if (format.version != GPNVM_VERSION_LEGACY) {
+		gpNvm_PackSuper(super, &format);
+		if (!gpNvm_WriteAt(h, 0, super, sizeof super))
+			return 1;
+	}
+	if (format.flags & GPNVM_FMT_TOC) {
+		UInt8 *toc = calloc(1, gpNvm_DataStart(&format) - GPNVM_TOC_START);
+
+		if (!toc)
+			return 1;
+		gpNvm_TocPackFixed(toc, &format);
+		ret = gpNvm_WriteAt(h, GPNVM_TOC_START, toc, gpNvm_DataStart(&format) - GPNVM_TOC_START);
+		free(toc);
+		if (!ret)
+			return 1;
+	}
+	h->format = format;
+	h->end = gpNvm_DataStart(&h->format);
+	h->dead = 0;
+	h->tocUsed = 0;
+	h->tocSum = 0;
+	return gpNvm_TocCommit(h);
+}
+
+/**
+ * gpNvm_TocReserve:
+ * @h: handle of the store
+ * @count: number of attributes about to be added
+ *
+ * Make room in the table of contents before a write adds attributes: a
+ * full table is replaced by a larger one, rewriting the file.
+ *
+ * Returns: 0 if success
+ */
+static int gpNvm_TocReserve(gpNvm_Handle *h, UInt32 count)
+{
+	if (!(h->format.flags & GPNVM_FMT_TOC) || h->tocUsed + count <= h->format.toc)
+		return 0;
+
+	h->tocMin = gpNvm_TocCapacity(h, h->indexCount + count);
+	return gpNvm_Rewrite(h);
+}
+
+/**
+ * gpNvm_Compact:
+ * @handle: handle of the store, NULL for the store of gpNvm_OpenFile()
+ *
+ * Rewrite the file with only its live records. In the log format this
+ * happens by itself once the dead records pass the threshold given at
+ * open; it can be done at any time, in any format.
+ *
+ * Returns: 0 if success
+ */
+gpNvm_Result gpNvm_Compact(gpNvm_Handle *handle)
+{
+	gpNvm_Handle *h = gpNvm_Resolve(handle);
+	gpNvm_Format format;
+	gpNvm_Result ret;
+
+	if (!h)
+		return 1;
+	if (gpNvm_WriteLock(h) || !h->ctx) {
+		gpNvm_WriteUnlock(h);
+		return 1;
+	}
+	format = h->want;
+
+  /* compaction keeps the format, migration is left to the first write */
+	h->want = h->format;
+	ret = gpNvm_Rewrite(h);
+	h->want = format;
+	gpNvm_WriteUnlock(h);
+	return ret;
+}
+
+/**
+ * gpNvm_ExportSnapshot:
+ * @handle: handle of the store, NULL for the store of gpNvm_OpenFile()
+ * @path: file to write the snapshot to, replaced if present
+ *
+ * Write all live attributes, as reads see them, to a snapshot: a clean
+ * image of the store in the current format, the records packed one
+ * after the other, followed by a trailer with the size of the image and
+ * a CRC32C over it. Writes queued by gpNvm_SetAsync() and the write-back
+ * cache are written first; an open batch is not part of the snapshot.
+ * The snapshot is assembled in memory and written in one go, then
+ * synced.
+ *
+ * Returns: 0 if success
+ */
+gpNvm_Result gpNvm_ExportSnapshot(gpNvm_Handle *handle, const char *path)
+{
+	gpNvm_Handle *h = gpNvm_Resolve(handle);
+	UInt8 *image;
+	UInt32 length, crc;
+	long size;
+	FILE *f;
+	int ret;
+
+	if (!h || !path)
+		return 1;
+
+	gpNvm_Flush(h);
+	ret = gpNvm_WriteLock(h) || !h->ctx || gpNvm_FlushDirty(h) ||
+		gpNvm_Assemble(h, &h->want, GPNVM_SNAPSHOT_TRAILER, &image, &size);
+	gpNvm_WriteUnlock(h);
+	if (ret)
+		return 1;
+
+	length = size;
+	crc = gpNvm_Crc32c(0, image, size);
+	memcpy(image + size, GPNVM_SNAPSHOT_MAGIC, 4);
+	memcpy(image + size + 4, &length, sizeof length);
+	memcpy(image + size + 8, &crc, sizeof crc);
+
+	f = fopen(path, "wb");
+	ret = !f || fwrite(image, size + GPNVM_SNAPSHOT_TRAILER, 1, f) != 1 ||
+		fflush(f) || fsync(fileno(f));
+	if (f && fclose(f))
+		ret = 1;
+	free(image);
+	return ret;
+}
+
+/**
+ * gpNvm_ImportSnapshot:
+ * @handle: handle of the store, NULL for the store of gpNvm_OpenFile()
+ * @path: snapshot written by gpNvm_ExportSnapshot()
+ *
+ * Replace the whole store with a snapshot. The snapshot is read and its
+ * trailer and superblock checked before anything changes; the backend
+ * then swaps it in as one image, like compaction does, so the store
+ * holds either its old contents or the snapshot. Writes queued by
+ * gpNvm_SetAsync() before the call are written first and then replaced
+ * too. A snapshot in another format than the one asked for at open is
+ * migrated on the first write.
+ *
+ * Returns: 0 if success, 1 if the snapshot is damaged or a batch is open
+ */
+gpNvm_Result gpNvm_ImportSnapshot(gpNvm_Handle *handle, const char *path)
+{
+	gpNvm_Handle *h = gpNvm_Resolve(handle);
+	gpNvm_Format format;
+	UInt8 *image = NULL;
+	UInt32 length, crc;
+	long size = -1, now;
+	FILE *f;
+	int ret;
+
+	if (!h || !path)
+		return 1;
+
+	f = fopen(path, "rb");
+	if (!f)
+		return 1;
+	if (!fseek(f, 0, SEEK_END) && (size = ftell(f)) >= GPNVM_SUPER_SIZE + GPNVM_SNAPSHOT_TRAILER &&
+	    !fseek(f, 0, SEEK_SET) && (image = malloc(size)) && fread(image, size, 1, f) != 1) {
+		free(image);
+		image = NULL;
+	}
+	fclose(f);
+	if (!image)
+		return 1;
+
+  /* check the trailer, then the superblock of the image it covers */
+	size -= GPNVM_SNAPSHOT_TRAILER;
+	memcpy(&length, image + size + 4, sizeof length);
+	memcpy(&crc, image + size + 8, sizeof crc);
+	if (memcmp(image + size, GPNVM_SNAPSHOT_MAGIC, 4) || length != size ||
+	    crc != gpNvm_Crc32c(0, image, size) ||
+	    memcmp(image, GPNVM_MAGIC, 4) || gpNvm_ParseSuper(image, &format)) {
+		free(image);
+		return 1;
+	}
+
+	gpNvm_Flush(h);
+	if (gpNvm_WriteLock(h) || !h->ctx || h->batching) {
+		gpNvm_WriteUnlock(h);
+		free(image);
+		return 1;
+	}
+	h->dirty.count = 0;
+	h->pending = 0;
+
+  /* views point into the old image, clear them before it goes */
+	gpNvm_IndexClear(h);
+	now = GPNVM_STATS_CLOCK();
+	ret = gpNvm_Replace(h, image, size);
+	if (!ret) {
+		GPNVM_STATS_ADD(h, bytesWritten, size);
+		GPNVM_STATS_ADD(h, flushes, 1);
+		GPNVM_STATS_TIME(h, flushLatency, now);
+	}
+	ret = gpNvm_Reload(h) || ret;
+	gpNvm_NotifyReset(h);
+	gpNvm_WriteUnlock(h);
+	free(image);
+	return ret;
+}
+
+/**
+ * gpNvm_CompareOffset:
+ * @a: first staged record
+ * @b: second staged record
+ *
+ * qsort() helper ordering staged records by file offset.
+ *
+ * Returns: <0, 0 or >0
+ */
+static int gpNvm_CompareOffset(const void *a, const void *b)
+{
+	long ao = ((const gpNvm_Staged *)a)->offset;
+	long bo = ((const gpNvm_Staged *)b)->offset;
+
+	return (ao > bo) - (ao < bo);
+}
+
+/**
+ * gpNvm_CompareExtent:
+ * @a: first extent
+ * @b: second extent
+ *
+ * qsort() helper ordering extents by file offset.
+ *
+ * Returns: <0, 0 or >0
+ */
+static int gpNvm_CompareExtent(const void *a, const void *b)
+{
+	long ao = ((const gpNvm_Extent *)a)->offset;
+	long bo = ((const gpNvm_Extent *)b)->offset;
+
+	return (ao > bo) - (ao < bo);
+}
+
+/**
+ * gpNvm_FreeLabel:
+ * @h: handle of the store
+ * @offset: file offset of the free space
+ * @size: size of the free space
+ *
+ * Write the free header of an extent, so scans skip it.
+ *
+ * Returns: 0 if success
+ */
+static int gpNvm_FreeLabel(gpNvm_Handle *h, long offset, long size)
+{
+	UInt8 header[GPNVM_RECORD_MAX];
+	int n = gpNvm_PackFree(&h->format, header, 0, size, 0);
+
+	return !gpNvm_WriteAt(h, offset, header, n);
+}
+
+/**
+ * gpNvm_FreeInsert:
+ * @h: handle of the store
+ * @at: position in the free list
+ * @offset: file offset of the extent
+ * @size: size of the extent
+ *
+ * Insert an extent in the free list, at the position that keeps it
+ * sorted.
+ *
+ * Returns: 0 if success
+ */
+static int gpNvm_FreeInsert(gpNvm_Handle *h, int at, long offset, long size)
+{
+	if (h->holeCount == h->holeSize) {
+		int n = h->holeSize ? 2 * h->holeSize : 16;
+		gpNvm_Extent *holes = realloc(h->holes, n * sizeof *holes);
+
+		if (!holes)
+			return 1;
+		h->holes = holes;
+		h->holeSize = n;
+	}
+	memmove(&h->holes[at + 1], &h->holes[at], (h->holeCount - at) * sizeof *h->holes);
+	h->holes[at].offset = offset;
+	h->holes[at].size = size;
+	h->holeCount++;
+	return 0;
+}
+
+/**
+ * gpNvm_FreeTrim:
+ * @h: handle of the store
+ *
+ * Give back the free space at the end of the records: the append offset
+ * moves down to where it starts and it is erased, so scans stop there.
+ *
+ * Returns: 0 if success
+ */
+static int gpNvm_FreeTrim(gpNvm_Handle *h)
+{
+	long end = h->end;
+
+	while (h->holeCount && h->holes[h->holeCount - 1].offset + h->holes[h->holeCount - 1].size == end)
+		end = h->holes[--h->holeCount].offset;
+	if (end == h->end)
+		return 0;
+
+	if (h->backend->erase(h->ctx, end, h->end - end) || gpNvm_SyncAt(h, end, h->end - end)) {
+		h->holesKnown = 0;
+		return 1;
+	}
+	h->end = end;
+	return 0;
+}
+
+/**
+ * gpNvm_FreeBuild:
+ * @h: handle of the store, in the in-place format
+ *
+ * Find the free space: walk the gaps between the records of the index,
+ * header by header. Free space is taken, and so are the markers of
+ * blocks and records of attributes the index has elsewhere, left by a
+ * write cut short between writing the new record of an attribute and
+ * freeing the old one: they are labeled free, lest a later scan find
+ * them. Anything else is damage, the rest of its gap stays unused until
+ * compaction. Adjacent extents are merged and labeled as one, and free
+ * space at the end of the records is trimmed.
+ */
+static void gpNvm_FreeBuild(gpNvm_Handle *h)
+{
+	int size = gpNvm_HeaderSize(&h->format), written = 0;
+	long min = gpNvm_RecordSize(&h->format, 0), max = gpNvm_FreeMax(&h->format);
+	long offset = gpNvm_DataStart(&h->format), stop, n, first = 0;
+	UInt8 header[GPNVM_HEADER_MAX];
+	gpNvm_Extent *live, *hole;
+	gpNvm_Staged staged;
+	UInt32 i, count = 0;
+
+	h->holeCount = 0;
+	h->batchMark = -1;
+	live = malloc((h->indexCount + 1) * sizeof *live);
+	if (!live)
+		return;
+	for (i = 0; i != h->indexSize; i++) {
+		if (!h->index[i].valid)
+			continue;
+		live[count].offset = h->index[i].offset;
+		live[count++].size = gpNvm_RecordSize(&h->format, h->index[i].length);
+	}
+	qsort(live, count, sizeof *live, gpNvm_CompareExtent);
+	live[count].offset = h->end;
+	live[count].size = 0;
+
+	for (i = 0; i <= count; offset = live[i].offset + live[i].size, i++) {
+		for (stop = live[i].offset; offset + min <= stop; offset += n) {
+			if (!gpNvm_ReadAt(h, offset, header, size) ||
+			    !gpNvm_ParseHeader(&h->format, header, &staged))
+				break;
+			n = header[0] == GPNVM_TAG_FREE ? gpNvm_FreeSize(&h->format, &staged) :
+				gpNvm_RecordSize(&h->format, staged.length);
+			if (offset + n > stop ||
+			    (header[0] != GPNVM_TAG_FREE && gpNvm_FreeLabel(h, offset, n)))
+				break;
+			written |= header[0] != GPNVM_TAG_FREE;
+
+			hole = h->holeCount ? &h->holes[h->holeCount - 1] : NULL;
+			if (hole && hole->offset + hole->size == offset && hole->size + n <= max) {
+				hole->size += n;
+				continue;
+			}
+			if (hole && hole->size != first)
+				written |= !gpNvm_FreeLabel(h, hole->offset, hole->size);
+			if (gpNvm_FreeInsert(h, h->holeCount, offset, n)) {
+				h->holeCount = 0;
+				free(live);
+				return;
+			}
+			first = n;
+		}
+	}
+	hole = h->holeCount ? &h->holes[h->holeCount - 1] : NULL;
+	if (hole && hole->size != first)
+		written |= !gpNvm_FreeLabel(h, hole->offset, hole->size);
+	free(live);
+
+	if (written)
+		gpNvm_SyncAt(h, gpNvm_DataStart(&h->format), h->end - gpNvm_DataStart(&h->format));
+	h->holesKnown = 1;
+	gpNvm_FreeTrim(h);
+}
+
+/**
+ * gpNvm_FreeTake:
+ * @h: handle of the store, its free space known
+ * @size: size of the record to place
+ *
+ * Place a record in free space, best fit: in the smallest extent it
+ * fills, or leaves room for a free header in. What is left of the
+ * extent is labeled free at once; the label is not seen before the
+ * record is written over the header of the extent, so the file is
+ * consistent whether the record gets written or not.
+ *
+ * Returns: file offset for the record, -1 if no extent fits
+ */
+static long gpNvm_FreeTake(gpNvm_Handle *h, long size)
+{
+	long min = gpNvm_RecordSize(&h->format, 0), offset;
+	gpNvm_Extent *hole;
+	int i, best = -1;
+
+	for (i = 0; i != h->holeCount; i++) {
+		hole = &h->holes[i];
+		if ((hole->size == size || hole->size >= size + min) &&
+		    (best < 0 || hole->size < h->holes[best].size))
+			best = i;
+		if (best >= 0 && h->holes[best].size == size)
+			break;
+	}
+	if (best < 0)
+		return -1;
+
+	hole = &h->holes[best];
+	offset = hole->offset;
+	if (hole->size == size) {
+		memmove(hole, hole + 1, (--h->holeCount - best) * sizeof *hole);
+	} else {
+		if (gpNvm_FreeLabel(h, offset + size, hole->size - size))
+			return -1;
+		hole->offset += size;
+		hole->size -= size;
+	}
+	return offset;
+}
+
+/**
+ * gpNvm_FreeAdd:
+ * @h: handle of the store
+ * @offset: file offset of a record no longer used
+ * @size: size of the record
+ * @pLabel: returns the file offset of the label written, -1 if none
+ *
+ * Turn a record into free space: it is merged with the free space next
+ * to it as far as one header covers them and labeled, or trimmed if it
+ * ends the records, see gpNvm_FreeTrim(). If the free space is not
+ * known only the label is written. The label is not synced: a write
+ * that frees several records syncs their labels together.
+ *
+ * Returns: 0 if success
+ */
+static int gpNvm_FreeAdd(gpNvm_Handle *h, long offset, long size, long *pLabel)
+{
+	long max = gpNvm_FreeMax(&h->format);
+	int at = 0;
+
+	if (h->holesKnown) {
+		while (at != h->holeCount && h->holes[at].offset < offset)
+			at++;
+		if (at != h->holeCount && offset + size == h->holes[at].offset &&
+		    size + h->holes[at].size <= max) {
+			size += h->holes[at].size;
+			memmove(&h->holes[at], &h->holes[at + 1], (--h->holeCount - at) * sizeof *h->holes);
+		}
+		if (at && h->holes[at - 1].offset + h->holes[at - 1].size == offset &&
+		    h->holes[at - 1].size + size <= max) {
+			offset = h->holes[--at].offset;
+			size += h->holes[at].size;
+			h->holes[at].size = size;
+		} else if (gpNvm_FreeInsert(h, at, offset, size)) {
+			h->holesKnown = 0;
+		}
+		if (h->holesKnown && offset + size == h->end) {
+			*pLabel = -1;
+			return gpNvm_FreeTrim(h);
+		}
+	}
+
+	*pLabel = offset;
+	return gpNvm_FreeLabel(h, offset, size);
+}
+
+/**
+ * gpNvm_CompactDue:
+ * @h: handle of the store
+ *
+ * Returns: non zero if the store is a log whose dead records passed the
+ * threshold, and is to be compacted
+ */
+static int gpNvm_CompactDue(gpNvm_Handle *h)
+{
+	long data = h->end - gpNvm_DataStart(&h->format);
+
+	return (h->format.flags & GPNVM_FMT_LOG) && data >= GPNVM_COMPACT_MIN &&
+		h->dead * 100 >= data * h->threshold;
+}
+
+/**
+ * gpNvm_Unchanged:
+ * @h: handle of the store
+ * @staged: record to write, its check is set
+ *
+ * Test whether a record holds the data the attribute has already. A
+ * known check of the stored data that differs settles it without
+ * reading; otherwise the stored data is read and compared.
+ *
+ * Returns: non zero if writing @staged would change nothing
+ */
+static int gpNvm_Unchanged(gpNvm_Handle *h, gpNvm_Staged *staged)
+{
+	gpNvm_IndexEntry *entry = gpNvm_IndexLookup(h, staged->attrId);
+	UInt8 old[0xff];
+
+	staged->check = gpNvm_Check(&h->format, staged->value, staged->length);
+	if (!entry || entry->length != staged->length ||
+	    (entry->checked && entry->check != staged->check))
+		return 0;
+	return gpNvm_ReadData(h, entry->offset, entry->length, old) &&
+		!memcmp(old, staged->value, staged->length);
+}
+
+/**
+ * gpNvm_WriteDelta:
+ * @h: handle of the store
+ * @offset: file offset of @buf
+ * @buf: data to write
+ * @old: data in the file, for the first @known bytes
+ * @n: number of bytes of @buf
+ * @known: number of bytes of @old
+ *
+ * Write only the bytes of @buf that differ from @old, and all bytes past
+ * @known. Differing bytes less than %GPNVM_DELTA_GAP apart go in one
+ * write.
+ *
+ * Returns: number of bytes written, -1 on failure
+ */
+static long gpNvm_WriteDelta(gpNvm_Handle *h, long offset, const UInt8 *buf, const UInt8 *old, long n, long known)
+{
+	long i, start = -1, end = 0, written = 0;
+
+	for (i = 0; i <= n; i++) {
+		if (i != n && i < known && buf[i] == old[i])
+			continue;
+		if (start >= 0 && (i == n || i - end >= GPNVM_DELTA_GAP)) {
+			if (!gpNvm_WriteAt(h, offset + start, buf + start, end - start))
+				return -1;
+			written += end - start;
+			start = -1;
+		}
+		if (i == n)
+			break;
+		if (start < 0)
+			start = i;
+		end = i + 1;
+	}
+	return written;
+}
+
+/**
+ * gpNvm_WriteRecords:
+ * @h: handle of the store
+ * @staged: records to write, reordered by offset
+ * @count: number of records
+ *
+ * Write a set of records as one unit. Records that hold the data their
+ * attribute has already are left out and moved to the end of the set,
+ * counted as suppressed; if none are left nothing is written or
+ * flushed. The others are placed and checked before anything is
+ * written, then written in file order, contiguous records in a single
+ * write of the bytes that differ from the file, see gpNvm_WriteDelta(),
+ * followed by one flush.
+ *
+ * A single record replaces that of its attribute in place, or if its
+ * length changed goes in free space, see gpNvm_FreeTake(), or is
+ * appended. More records go in one block, in free space or appended,
+ * behind a pending marker that hides them from a scan; once they are
+ * flushed the marker is committed with a one byte write and flush, see
+ * gpNvm_PackMark(). In the log format everything is appended with the
+ * next sequence numbers. Then the old records of the attributes are
+ * freed, their labels flushed together, and declared attributes of the
+ * static layout are written back where the schema puts them.
+ *
+ * If a write or flush before the commit fails, the records replaced in
+ * place are restored from their old image and the appended tail is cut
+ * off again, so the file and the index either hold all records or none.
+ * A crash leaves the file the same: a scan finds the set complete or
+ * not at all.
+ *
+ * Returns: 0 if success
+ */
+static int gpNvm_WriteRecords(gpNvm_Handle *h, gpNvm_Staged *staged, int count)
+{
+	UInt8 scratch[2 * GPNVM_RECORD_MAX], *buf = scratch, *undo;
+	UInt8 mark[GPNVM_RECORD_MAX], markUndo[GPNVM_RECORD_MAX];
+	gpNvm_Extent scratchFreed[8], *freed = scratchFreed;
+	gpNvm_IndexEntry *entry;
+	gpNvm_Staged swap;
+	long end, size = 0, written, saved = 0, delta, label, first = -1, last = 0;
+	long block = -1, start, markSize = 0;
+	int i, j, log, fresh, placed, atomic, fixed = 0, reused = 0, version = h->format.version, ret = 1;
+
+  /* leave out the records that change nothing */
+	for (i = 0, j = count; i != j; ) {
+		if (!gpNvm_Unchanged(h, &staged[i])) {
+			i++;
+			continue;
+		}
+		saved += gpNvm_RecordSize(&h->format, staged[i].length);
+		swap = staged[i];
+		staged[i] = staged[--j];
+		staged[j] = swap;
+	}
+	if (j != count) {
+		__atomic_add_fetch(&h->counters.suppressed, count - j, __ATOMIC_RELAXED);
+		__atomic_add_fetch(&h->counters.bytesSaved, saved, __ATOMIC_RELAXED);
+		saved = 0;
+		count = j;
+	}
+	if (!count)
+		return 0;
+
+	for (i = 0, fresh = 0, placed = 0; i != count; i++) {
+		entry = gpNvm_IndexLookup(h, staged[i].attrId);
+		if (entry && entry->length != staged[i].length && gpNvm_StaticFind(h, staged[i].attrId))
+			return 1;
+		fresh += !entry;
+		placed += !entry || entry->length != staged[i].length;
+	}
+	if (gpNvm_Migrate(h) || gpNvm_TocReserve(h, fresh) || gpNvm_IndexReserve(h, count))
+		return 1;
+	if (count >= (int)(sizeof scratchFreed / sizeof *scratchFreed) &&
+	    !(freed = malloc((count + 1) * sizeof *freed)))
+		return 1;
+	log = h->format.flags & GPNVM_FMT_LOG;
+	atomic = count > 1;
+	if (!log && (placed || atomic) && !h->holesKnown)
+		gpNvm_FreeBuild(h);
+	end = h->end;
+
+  /* place all records before touching the file, more than one in a
+   * block behind its marker */
+	if (atomic) {
+		for (i = 0; i != count; i++)
+			size += gpNvm_RecordSize(&h->format, staged[i].length);
+		markSize = gpNvm_RecordSize(&h->format, GPNVM_MARK_DATA);
+		block = !log && h->holesKnown ? gpNvm_FreeTake(h, markSize + size) : -1;
+		if (block >= 0) {
+			reused += count;
+		} else {
+			block = end;
+			end += markSize + size;
+		}
+		size = 0;
+	}
+	for (i = 0; i != count; i++) {
+		long n = gpNvm_RecordSize(&h->format, staged[i].length);
+
+		entry = gpNvm_IndexLookup(h, staged[i].attrId);
+		if (h->format.version != version)
+			staged[i].check = gpNvm_Check(&h->format, staged[i].value, staged[i].length);
+		staged[i].seq = h->seq + i;
+		if (atomic) {
+			staged[i].offset = block + markSize + size;
+		} else if (!log && entry && entry->length == staged[i].length) {
+			staged[i].offset = entry->offset;
+		} else if (!log && h->holesKnown && (staged[i].offset = gpNvm_FreeTake(h, n)) >= 0) {
+			reused++;
+		} else {
+			staged[i].offset = end;
+			end += n;
+		}
+		size += n;
+	}
+	qsort(staged, count, sizeof *staged, gpNvm_CompareOffset);
+	start = atomic ? block : staged[0].offset;
+
+	if (2 * size > sizeof scratch && !(buf = malloc(2 * size)))
+		goto out;
+	undo = buf + size;
+
+  /* assemble in file order and keep the old image of replaced records */
+	for (i = 0, written = 0; i != count; i++) {
+		int n = gpNvm_PackRecord(&h->format, buf + written, &staged[i]);
+
+		if (staged[i].offset < h->end &&
+		    !gpNvm_ReadAt(h, staged[i].offset, undo + written, n))
+			goto out;
+		written += n;
+	}
+	if (atomic) {
+		gpNvm_PackMark(&h->format, mark, markSize + size, h->seq + count);
+		if (block < h->end && !gpNvm_ReadAt(h, block, markUndo, markSize))
+			goto out;
+	}
+
+  /* the marker first: until it is written the records of the block
+   * follow the header of the free space or the erased tail it replaces,
+   * which hide them as well */
+	if (atomic && !gpNvm_WriteAt(h, block, mark, markSize))
+		goto rollback;
+
+  /* write runs of contiguous records in one go, of those replaced in
+   * place only what changed */
+	for (i = 0, written = 0; i != count; i = j) {
+		long offset = staged[i].offset, n = 0, known;
+
+		for (j = i; j != count && staged[j].offset == offset + n; j++)
+			n += gpNvm_RecordSize(&h->format, staged[j].length);
+		known = h->end - offset < n ? h->end - offset : n;
+		delta = gpNvm_WriteDelta(h, offset, buf + written, undo + written, n, known > 0 ? known : 0);
+		if (delta < 0)
+			goto rollback;
+		saved += n - delta;
+		written += n;
+	}
+
+  /* flush to make certain the kernel schedules the write to storage */
+	if (gpNvm_SyncAt(h, start, (end > h->end ? end : h->end) - start))
+		goto rollback;
+
+  /* commit the block: from here on a scan takes its records */
+	if (atomic) {
+		mark[0] = GPNVM_TAG_COMMIT;
+		if (!gpNvm_WriteAt(h, block, mark, 1) || gpNvm_SyncAt(h, block, 1))
+			goto rollback;
+	}
+
+  /* keep the index in sync with the file */
+	h->end = end;
+	for (i = 0; i != count; i++) {
+		entry = gpNvm_IndexSlot(h, staged[i].attrId);
+		if (log && entry->valid)
+			h->dead += gpNvm_RecordSize(&h->format, entry->length);
+		freed[i].offset = !log && entry->valid && entry->offset != staged[i].offset ? entry->offset : -1;
+		freed[i].size = gpNvm_RecordSize(&h->format, entry->length);
+		fixed += freed[i].offset >= 0 && h->staticOk && gpNvm_StaticFind(h, staged[i].attrId);
+		gpNvm_TocUpdate(h, entry, &staged[i]);
+		gpNvm_IndexSet(h, entry, &staged[i]);
+		entry->check = staged[i].check;
+		entry->checked = 1;
+		if (gpNvm_Notifying(h))
+			gpNvm_NotifyNote(h, staged[i].attrId);
+	}
+	if (log && atomic)
+		h->dead += markSize;
+	h->seq += count + atomic;
+
+  /* write the declared attributes back over their old records, once
+   * the table of contents has them in the block; their copies in the
+   * block are freed instead. If that fails they stay in the block and
+   * the next write lays the file out again */
+	if (fixed) {
+		gpNvm_TocCommit(h);
+		for (i = 0, written = 0; i != count; written += gpNvm_RecordSize(&h->format, staged[i++].length)) {
+			if (freed[i].offset >= 0 && gpNvm_StaticFind(h, staged[i].attrId) &&
+			    !gpNvm_WriteAt(h, freed[i].offset, buf + written, freed[i].size))
+				fixed = 0;
+		}
+		if (!fixed || gpNvm_SyncAt(h, h->staticBase, h->staticEnd - h->staticBase)) {
+			h->staticOk = 0;
+			fixed = 0;
+		}
+		for (i = 0; i != count; i++) {
+			if (freed[i].offset < 0 || !gpNvm_StaticFind(h, staged[i].attrId))
+				continue;
+			if (!fixed) {
+				freed[i].offset = -1;
+				continue;
+			}
+			entry = gpNvm_IndexSlot(h, staged[i].attrId);
+			swap = staged[i];
+			swap.offset = freed[i].offset;
+			freed[i].offset = staged[i].offset;
+			gpNvm_TocUpdate(h, entry, &swap);
+			gpNvm_IndexSet(h, entry, &swap);
+			entry->check = swap.check;
+			entry->checked = 1;
+		}
+	}
+
+  /* free the records of the attributes that moved and the marker of the
+   * block before, and sync their labels at once */
+	freed[count].offset = h->batchMark;
+	freed[count].size = gpNvm_RecordSize(&h->format, GPNVM_MARK_DATA);
+	for (i = 0; i <= count; i++) {
+		if (freed[i].offset < 0)
+			continue;
+		if (gpNvm_FreeAdd(h, freed[i].offset, freed[i].size, &label)) {
+			h->holesKnown = 0;
+		} else if (label >= 0) {
+			first = first < 0 || label < first ? label : first;
+			last = label > last ? label : last;
+		}
+	}
+	if (first >= 0)
+		gpNvm_SyncAt(h, first, last + gpNvm_HeaderSize(&h->format) - first);
+	h->batchMark = atomic && !log ? block : -1;
+	gpNvm_TocCommit(h);
+	__atomic_add_fetch(&h->counters.records, count, __ATOMIC_RELAXED);
+	__atomic_add_fetch(&h->counters.flushes, 1, __ATOMIC_RELAXED);
+	__atomic_add_fetch(&h->counters.bytesSaved, saved, __ATOMIC_RELAXED);
+	__atomic_add_fetch(&h->counters.reused, reused, __ATOMIC_RELAXED);
+	__atomic_add_fetch(&h->commitWritten, 1, __ATOMIC_RELEASE);
+	ret = 0;
+
+  /* compact the log once dead records pass the threshold; the records
+   * are safely written, a failed compaction does not fail the write */
+	if (gpNvm_CompactDue(h))
+		gpNvm_Rewrite(h);
+	goto out;
+
+rollback:
+	if (atomic && block < h->end)
+		gpNvm_WriteAt(h, block, markUndo, markSize);
+	for (i = 0, j = 0; i != count; i++) {
+		int n = gpNvm_RecordSize(&h->format, staged[i].length);
+
+		if (staged[i].offset < h->end)
+			gpNvm_WriteAt(h, staged[i].offset, undo + j, n);
+		j += n;
+	}
+	if (end > h->end)
+		h->backend->erase(h->ctx, h->end, end - h->end);
+	gpNvm_SyncAt(h, start, end - start);
+out:
+  /* records placed in free space took it, find it again */
+	if (ret)
+		h->holesKnown = 0;
+	if (buf != scratch)
+		free(buf);
+	if (freed != scratchFreed)
+		free(freed);
+	return ret;
+}
+
+/**
+ * gpNvm_FindStaged:
+ * @set: staged records
+ * @attrId: attribute ID (key)
+ *
+ * Returns: the record staged for @attrId in @set, or NULL
+ */
+static gpNvm_Staged *gpNvm_FindStaged(gpNvm_StagedSet *set, gpNvm_AttrId attrId)
+{
+	int i;
+
+	for (i = 0; i != set->count; i++)
+		if (set->records[i].attrId == attrId)
+			return &set->records[i];
+
+	return NULL;
+}
+
+/**
+ * gpNvm_Unstage:
+ * @set: staged records
+ * @attrId: attribute ID (key)
+ *
+ * Drop the record staged for @attrId from @set.
+ *
+ * Returns: 0 if one was staged
+ */
+static int gpNvm_Unstage(gpNvm_StagedSet *set, gpNvm_AttrId attrId)
+{
+	gpNvm_Staged *staged = gpNvm_FindStaged(set, attrId);
+
+	if (!staged)
+		return 1;
+	if (staged != &set->records[set->count - 1])
+		*staged = set->records[set->count - 1];
+	set->count--;
+	return 0;
+}
+
+/**
+ * gpNvm_Stage:
+ * @h: handle of the store
+ * @set: staged records
+ * @attrId: attribute ID (key)
+ * @length: length of the data
+ * @pValue: data
+ *
+ * Stage a record in @set, a later value replaces an earlier one; that
+ * is counted as a coalesced write.
+ *
+ * Returns: 0 if success
+ */
+static int gpNvm_Stage(gpNvm_Handle *h, gpNvm_StagedSet *set, gpNvm_AttrId attrId, UInt8 length, const UInt8 *pValue)
+{
+	gpNvm_Staged *staged = gpNvm_FindStaged(set, attrId);
+
+	if (staged) {
+		__atomic_add_fetch(&h->counters.coalesced, 1, __ATOMIC_RELAXED);
+	} else {
+		if (set->count == set->size) {
+			int size = set->size ? 2 * set->size : 16;
+			gpNvm_Staged *records = realloc(set->records, size * sizeof *records);
+
+			if (!records)
+				return 1;
+			set->records = records;
+			set->size = size;
+		}
+		staged = &set->records[set->count++];
+		staged->attrId = attrId;
+	}
+	staged->length = length;
+	memcpy(staged->value, pValue, length);
+	return 0;
+}
+
+/**
+ * gpNvm_FindPending:
+ * @h: handle of the store
+ * @attrId: attribute ID (key)
+ *
+ * Returns: the newest record of @attrId that is not written yet, staged
+ * by the open batch or dirty in the write-back cache, or NULL
+ */
+static gpNvm_Staged *gpNvm_FindPending(gpNvm_Handle *h, gpNvm_AttrId attrId)
+{
+	gpNvm_Staged *staged = NULL;
+
+	if (h->batching)
+		staged = gpNvm_FindStaged(&h->batch, attrId);
+	if (!staged && h->dirty.count)
+		staged = gpNvm_FindStaged(&h->dirty, attrId);
+	return staged;
+}
+
+/**
+ * gpNvm_BeginBatch:
+ * @handle: handle of the store, NULL for the store of gpNvm_OpenFile()
+ *
+ * Start a batch: until gpNvm_CommitBatch() or gpNvm_AbortBatch(),
+ * gpNvm_Set() only stages its record in memory. Reads see the staged
+ * values.
+ *
+ * Returns: 0 if success, 1 if no file is open or a batch is already open
+ */
+gpNvm_Result gpNvm_BeginBatch(gpNvm_Handle *handle)
+{
+	gpNvm_Handle *h = gpNvm_Resolve(handle);
+	gpNvm_Result ret = 1;
+
+	if (!h)
+		return 1;
+
+	pthread_rwlock_wrlock(&h->lock);
+	if (h->ctx && !h->batching) {
+		h->batching = 1;
+		h->batch.count = 0;
+		ret = 0;
+	}
+	pthread_rwlock_unlock(&h->lock);
+	return ret;
+}
+
+/**
+ * gpNvm_CommitBatch:
+ * @handle: handle of the store, NULL for the store of gpNvm_OpenFile()
+ *
+ * Write all staged records in one ordered pass, committed as one unit,
+ * see gpNvm_WriteRecords(): a failure or a crash leaves all of them or
+ * none. With the write-back cache the batch joins the dirty records and
+ * all are flushed in that pass. The batch is closed whatever the
+ * outcome.
+ *
+ * Returns: 0 if all records are written, 1 if none are
+ */
+gpNvm_Result gpNvm_CommitBatch(gpNvm_Handle *handle)
+{
+	gpNvm_Handle *h = gpNvm_Resolve(handle);
+	unsigned long before, ticket;
+	gpNvm_Result ret;
+
+	if (!h)
+		return 1;
+
+	if (gpNvm_WriteLock(h) || !h->ctx || !h->batching) {
+		gpNvm_WriteUnlock(h);
+		return 1;
+	}
+	before = gpNvm_Written(h);
+	if (h->flags & GPNVM_OPEN_WRITEBACK) {
+		int i;
+
+		for (i = 0, ret = 0; i != h->batch.count && !ret; i++)
+			ret = gpNvm_Stage(h, &h->dirty, h->batch.records[i].attrId,
+				h->batch.records[i].length, h->batch.records[i].value);
+		ret |= gpNvm_FlushDirty(h);
+	} else {
+		ret = h->batch.count ? gpNvm_WriteRecords(h, h->batch.records, h->batch.count) : 0;
+	}
+	h->batching = 0;
+	h->batch.count = 0;
+	ticket = gpNvm_Written(h);
+	gpNvm_WriteUnlock(h);
+
+	if (!ret && ticket != before)
+		ret = gpNvm_Commit(h, ticket, h->durability);
+	return ret;
+}
+
+/**
+ * gpNvm_AbortBatch:
+ * @handle: handle of the store, NULL for the store of gpNvm_OpenFile()
+ *
+ * Drop all staged records and close the batch.
+ *
+ * Returns: 0 if success, 1 if no batch is open
+ */
+gpNvm_Result gpNvm_AbortBatch(gpNvm_Handle *handle)
+{
+	gpNvm_Handle *h = gpNvm_Resolve(handle);
+	gpNvm_Result ret;
+
+	if (!h)
+		return 1;
+
+	pthread_rwlock_wrlock(&h->lock);
+	ret = !h->batching;
+
+	free(h->batch.records);
+	memset(&h->batch, 0, sizeof h->batch);
+	h->batching = 0;
+	pthread_rwlock_unlock(&h->lock);
+	return ret;
+}
+
+/**
+ * gpNvm_FlushDirty:
+ * @h: handle of the store
+ *
+ * Write the dirty records of the write-back cache in one pass, see
+ * gpNvm_WriteRecords(). They stay dirty if the pass fails. To be called
+ * with the structure lock held exclusive.
+ *
+ * Returns: 0 if success
+ */
+static int gpNvm_FlushDirty(gpNvm_Handle *h)
+{
+	if (!h->dirty.count)
+		return 0;
+	if (gpNvm_WriteRecords(h, h->dirty.records, h->dirty.count))
+		return 1;
+
+	h->dirty.count = 0;
+	h->pending = 0;
+	return 0;
+}
+
+/**
+ * gpNvm_FlusherRun:
+ * @arg: handle of the store
+ *
+ * Flusher thread: flush the write-back cache every flushMs milliseconds
+ * until asked to stop.
+ *
+ * Returns: NULL
+ */
+static void *gpNvm_FlusherRun(void *arg)
+{
+	gpNvm_Handle *h = arg;
+	unsigned long ticket;
+	struct timespec ts;
+
+	pthread_mutex_lock(&h->flusherMutex);
+	while (!h->flusherStop) {
+		clock_gettime(CLOCK_MONOTONIC, &ts);
+		ts.tv_sec += h->flushMs / 1000;
+		ts.tv_nsec += (h->flushMs % 1000) * 1000000L;
+		if (ts.tv_nsec >= 1000000000L) {
+			ts.tv_sec++;
+			ts.tv_nsec -= 1000000000L;
+		}
+		pthread_cond_timedwait(&h->flusherCond, &h->flusherMutex, &ts);
+		if (h->flusherStop)
+			break;
+
+		pthread_mutex_unlock(&h->flusherMutex);
+		if (!gpNvm_WriteLock(h) && h->ctx)
+			gpNvm_FlushDirty(h);
+		ticket = gpNvm_Written(h);
+		gpNvm_WriteUnlock(h);
+		gpNvm_Commit(h, ticket, h->durability);
+		pthread_mutex_lock(&h->flusherMutex);
+	}
+	pthread_mutex_unlock(&h->flusherMutex);
+
+	return NULL;
+}
+
+/**
+ * gpNvm_FlusherStart:
+ * @h: handle of the store
+ *
+ * Start the flusher thread of a write-back store with a time based flush
+ * policy; other stores have none.
+ *
+ * Returns: 0 if success
+ */
+static int gpNvm_FlusherStart(gpNvm_Handle *h)
+{
+	pthread_condattr_t attr;
+
+	if (!(h->flags & GPNVM_OPEN_WRITEBACK) || !h->flushMs)
+		return 0;
+
+	pthread_condattr_init(&attr);
+	pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+	pthread_cond_init(&h->flusherCond, &attr);
+	pthread_condattr_destroy(&attr);
+	pthread_mutex_init(&h->flusherMutex, NULL);
+
+	if (pthread_create(&h->flusher, NULL, gpNvm_FlusherRun, h)) {
+		pthread_cond_destroy(&h->flusherCond);
+		pthread_mutex_destroy(&h->flusherMutex);
+		return 1;
+	}
+	h->flusherRunning = 1;
+	return 0;
+}
+
+/**
+ * gpNvm_FlusherStop:
+ * @h: handle of the store
+ *
+ * Stop and join the flusher thread, if there is one.
+ */
+static void gpNvm_FlusherStop(gpNvm_Handle *h)
+{
+	if (!h->flusherRunning)
+		return;
+
+	pthread_mutex_lock(&h->flusherMutex);
+	h->flusherStop = 1;
+	pthread_cond_signal(&h->flusherCond);
+	pthread_mutex_unlock(&h->flusherMutex);
+	pthread_join(h->flusher, NULL);
+
+	pthread_cond_destroy(&h->flusherCond);
+	pthread_mutex_destroy(&h->flusherMutex);
+	h->flusherRunning = 0;
+}
+
+/**
+ * gpNvm_Sync:
+ * @handle: handle of the store, NULL for the store of gpNvm_OpenFile()
+ *
+ * Write the records held by the write-back cache now, in one pass with
+ * a single flush, then make all writes so far fully durable, whatever
+ * the durability level of the store: a store opened with less can so
+ * have its own points of durability.
+ *
+ * Returns: 0 if success
+ */
+gpNvm_Result gpNvm_Sync(gpNvm_Handle *handle)
+{
+	gpNvm_Handle *h = gpNvm_Resolve(handle);
+	unsigned long ticket;
+	gpNvm_Result ret;
+
+	if (!h)
+		return 1;
+
+	ret = gpNvm_WriteLock(h) || !h->ctx || gpNvm_FlushDirty(h);
+	ticket = gpNvm_Written(h);
+	gpNvm_WriteUnlock(h);
+
+	return ret || gpNvm_Commit(h, ticket, GPNVM_DURABILITY_FULL);
+}
+
+/**
+ * gpNvm_GetWriteCounters:
+ * @handle: handle of the store, NULL for the store of gpNvm_OpenFile()
+ * @counters: returns the counters
+ *
+ * Counters since the store was opened. The write amplification avoided
+ * by the write-back cache is @counters->writes against
+ * @counters->records, @counters->flushes passes to storage and
+ * @counters->persists the persists shared by the writes that waited.
+ * @counters->suppressed writes changed nothing and were not written,
+ * @counters->bytesSaved counts the bytes they and the partial writes of
+ * records replaced in place left out. @counters->reused records went to
+ * free space instead of the end of the file.
+ *
+ * Returns: 0 if success
+ */
+gpNvm_Result gpNvm_GetWriteCounters(gpNvm_Handle *handle, gpNvm_WriteCounters *counters)
+{
+	gpNvm_Handle *h = gpNvm_Resolve(handle);
+
+	if (!h || !counters)
+		return 1;
+
+	counters->writes = __atomic_load_n(&h->counters.writes, __ATOMIC_RELAXED);
+	counters->records = __atomic_load_n(&h->counters.records, __ATOMIC_RELAXED);
+	counters->flushes = __atomic_load_n(&h->counters.flushes, __ATOMIC_RELAXED);
+	counters->coalesced = __atomic_load_n(&h->counters.coalesced, __ATOMIC_RELAXED);
+	counters->persists = __atomic_load_n(&h->counters.persists, __ATOMIC_RELAXED);
+	counters->bytes = __atomic_load_n(&h->counters.bytes, __ATOMIC_RELAXED);
+	counters->suppressed = __atomic_load_n(&h->counters.suppressed, __ATOMIC_RELAXED);
+	counters->bytesSaved = __atomic_load_n(&h->counters.bytesSaved, __ATOMIC_RELAXED);
+	counters->deletes = __atomic_load_n(&h->counters.deletes, __ATOMIC_RELAXED);
+	counters->reused = __atomic_load_n(&h->counters.reused, __ATOMIC_RELAXED);
+	return 0;
+}
+
+/**
+ * gpNvm_GetStats:
+ * @handle: handle of the store, NULL for the store of gpNvm_OpenFile()
+ * @stats: returns the statistics
+ *
+ * Statistics since the store was opened or gpNvm_ResetStats(). Each
+ * counter is read on its own, so a snapshot taken under load need not
+ * be consistent across counters.
+ *
+ * Returns: 0 if success, 1 as well if built with GPNVM_STATS set to 0
+ */
+gpNvm_Result gpNvm_GetStats(gpNvm_Handle *handle, gpNvm_Stats *stats)
+{
+	gpNvm_Handle *h = gpNvm_Resolve(handle);
+#if GPNVM_STATS
+	unsigned long *from, *to;
+	int i;
+#endif
+
+	if (!stats)
+		return 1;
+
+	memset(stats, 0, sizeof *stats);
+#if GPNVM_STATS
+	if (!h)
+		return 1;
+
+  /* the statistics are all unsigned long */
+	from = (unsigned long *)&h->stats;
+	to = (unsigned long *)stats;
+	for (i = 0; i != sizeof *stats / sizeof *to; i++)
+		to[i] = __atomic_load_n(&from[i], __ATOMIC_RELAXED);
+	return 0;
+#else
+	(void)h;
+	return 1;
+#endif
+}
+
+/**
+ * gpNvm_ResetStats:
+ * @handle: handle of the store, NULL for the store of gpNvm_OpenFile()
+ *
+ * Set all statistics back to zero.
+ *
+ * Returns: 0 if success
+ */
+gpNvm_Result gpNvm_ResetStats(gpNvm_Handle *handle)
+{
+	gpNvm_Handle *h = gpNvm_Resolve(handle);
+#if GPNVM_STATS
+	unsigned long *stats;
+	int i;
+#endif
+
+	if (!h)
+		return 1;
+
+#if GPNVM_STATS
+	stats = (unsigned long *)&h->stats;
+	for (i = 0; i != sizeof h->stats / sizeof *stats; i++)
+		__atomic_store_n(&stats[i], 0, __ATOMIC_RELAXED);
+#endif
+	return 0;
+}
+
+/**
+ * gpNvm_GetLocked:
+ * @h: handle of the store
+ * @attrId: attribute ID (key)
+ * @length: length of data to read
+ * @pValue: pointer to memory
+ *
+ * Read an attribute, with the structure lock held at least shared.
+ *
+ * Returns: 0 if success
+ */
+static int gpNvm_GetLocked(gpNvm_Handle *h, gpNvm_AttrId attrId, UInt8 length, UInt8 *pValue)
+{
+	gpNvm_IndexEntry *entry = gpNvm_IndexLookup(h, attrId);
+	gpNvm_Staged *staged, queued;
+	int ret;
+
+	if (!h->ctx)
+		return 1;
+
+  /* a value not written yet takes precedence, the queued one first */
+	if ((staged = gpNvm_QueueFind(h, attrId, &queued)) ||
+	    (staged = gpNvm_FindPending(h, attrId))) {
+		if (staged->length != length)
+			return 1;
+		memcpy(pValue, staged->value, length);
+		return 0;
+	}
+
+  /* look up attribute, read data and test its check */
+	if (!entry || entry->length != length)
+		return 1;
+
+	pthread_rwlock_rdlock(gpNvm_Stripe(h, attrId));
+	ret = !gpNvm_ReadData(h, entry->offset, length, pValue);
+	pthread_rwlock_unlock(gpNvm_Stripe(h, attrId));
+	return ret;
+}
+
+/**
+ * gpNvm_Get:
+ * @handle: handle of the store, NULL for the store of gpNvm_OpenFile()
+ * @attrId: attribute ID (key)
+ * @Length: length of data to read
+ * @pValue: pointer to memory
+ *
+ * Reads can be done from any number of threads at once: they only share
+ * the locks of the store, and read at a given offset without a file
+ * position. A read of a shared store that overlaps a write of another
+ * handle is done again.
+ *
+ * Returns: 0 if success
+ */
+gpNvm_Result gpNvm_Get(gpNvm_Handle *handle, gpNvm_AttrId attrId, UInt8 *pLength, UInt8 *pValue)
+{
+	gpNvm_Handle *h = gpNvm_Resolve(handle);
+	long now = GPNVM_STATS_NOW();
+	unsigned long gen;
+	gpNvm_Result ret;
+
+	if (!pLength || !*pLength || !pValue || !h)
+		return 1;
+
+	do {
+		gen = gpNvm_SharedBegin(h);
+		pthread_rwlock_rdlock(&h->lock);
+		ret = gpNvm_GetLocked(h, attrId, *pLength, pValue);
+		pthread_rwlock_unlock(&h->lock);
+	} while (gpNvm_SharedRetry(h, gen));
+	GPNVM_STATS_TIME(h, getLatency, now);
+	return ret;
+}
+
+/**
+ * gpNvm_ViewLoad:
+ * @h: handle of the store
+ * @entry: index entry of the attribute
+ *
+ * Check the data of a record and set it as the view of its entry. If the
+ * storage is in memory the view is the data in place, otherwise a copy.
+ * Readers may race to load the same view; the first one wins.
+ *
+ * Returns: the view, NULL if the data can not be read or is damaged
+ */
+static UInt8 *gpNvm_ViewLoad(gpNvm_Handle *h, gpNvm_IndexEntry *entry)
+{
+	long data = entry->offset + gpNvm_HeaderSize(&h->format);
+	UInt8 check[sizeof(UInt32)];
+	UInt8 *view, *found = NULL;
+
+	if (h->image) {
+		view = h->image + data;
+		if (!gpNvm_ReadAt(h, data + entry->length, check, gpNvm_CheckSize(&h->format)))
+			return NULL;
+		if (gpNvm_GetCheck(&h->format, check) != gpNvm_Check(&h->format, view, entry->length)) {
+			GPNVM_STATS_ADD(h, checkFailures, 1);
+			return NULL;
+		}
+	} else {
+		view = malloc(entry->length);
+		if (!view || !gpNvm_ReadData(h, entry->offset, entry->length, view)) {
+			free(view);
+			return NULL;
+		}
+	}
+
+	if (!__atomic_compare_exchange_n(&entry->view, &found, view, 0,
+			__ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+		if (!h->image)
+			free(view);
+		view = found;
+	}
+	return view;
+}
+
+/**
+ * gpNvm_ViewLocked:
+ * @h: handle of the store
+ * @attrId: attribute ID (key)
+ * @ppValue: returns a pointer to the data
+ * @pLength: returns the length of the data
+ *
+ * Look up the view of an attribute, with the structure lock held at
+ * least shared.
+ *
+ * Returns: 0 if success
+ */
+static int gpNvm_ViewLocked(gpNvm_Handle *h, gpNvm_AttrId attrId, const UInt8 **ppValue, UInt8 *pLength)
+{
+	gpNvm_IndexEntry *entry;
+	gpNvm_Staged *staged;
+	UInt8 *view;
+
+	if (!h->ctx)
+		return 1;
+
+  /* a value not written yet takes precedence */
+	if ((staged = gpNvm_FindPending(h, attrId))) {
+		*ppValue = staged->value;
+		*pLength = staged->length;
+		return 0;
+	}
+
+	entry = gpNvm_IndexLookup(h, attrId);
+	if (!entry)
+		return 1;
+
+	pthread_rwlock_rdlock(gpNvm_Stripe(h, attrId));
+	view = __atomic_load_n(&entry->view, __ATOMIC_ACQUIRE);
+	if (!view)
+		view = gpNvm_ViewLoad(h, entry);
+	pthread_rwlock_unlock(gpNvm_Stripe(h, attrId));
+
+	if (!view)
+		return 1;
+	*ppValue = view;
+	*pLength = entry->length;
+	return 0;
+}
+
+/**
+ * gpNvm_GetView:
+ * @handle: handle of the store, NULL for the store of gpNvm_OpenFile()
+ * @attrId: attribute ID (key)
+ * @ppValue: returns a pointer to the data
+ * @pLength: returns the length of the data
+ *
+ * Read an attribute without copying it out. The data is checked once;
+ * the pointer is into the mapping in memory mapped mode or into the
+ * buffer of the memory backend, and to a copy held by the store
+ * otherwise, so later views of the attribute cost a
+ * lookup only.
+ *
+ * The data must not be modified. It stays valid until the next write to
+ * the attribute, and at most until the store is compacted, migrated or
+ * closed. A value staged by an open batch or held by the write-back
+ * cache is returned until the next gpNvm_Set(), the end of the batch or
+ * the flush. A value queued by gpNvm_SetAsync() is waited for. A shared
+ * store hands out no views, another process may write the attribute at
+ * any time.
+ *
+ * Returns: 0 if success
+ */
+gpNvm_Result gpNvm_GetView(gpNvm_Handle *handle, gpNvm_AttrId attrId, const UInt8 **ppValue, UInt8 *pLength)
+{
+	gpNvm_Handle *h = gpNvm_Resolve(handle);
+	long now = GPNVM_STATS_NOW();
+	gpNvm_Result ret;
+
+	if (!ppValue || !pLength || !h || h->shared)
+		return 1;
+
+  /* a queued value has no stable copy to point to, wait until it is
+   * written */
+	if (gpNvm_QueueFind(h, attrId, NULL))
+		gpNvm_Flush(h);
+
+	pthread_rwlock_rdlock(&h->lock);
+	ret = gpNvm_ViewLocked(h, attrId, ppValue, pLength);
+	pthread_rwlock_unlock(&h->lock);
+	GPNVM_STATS_TIME(h, getLatency, now);
+	return ret;
+}
+
+/**
+ * gpNvm_GetLength:
+ * @handle: handle of the store, NULL for the store of gpNvm_OpenFile()
+ * @attrId: attribute ID (key)
+ * @pLength: returns the length of the data
+ *
+ * Length of an attribute, to size the buffer of gpNvm_Get(). The length
+ * comes from the index, the data is not read.
+ *
+ * Returns: 0 if success, 1 if the attribute is not present
+ */
+gpNvm_Result gpNvm_GetLength(gpNvm_Handle *handle, gpNvm_AttrId attrId, UInt8 *pLength)
+{
+	gpNvm_Handle *h = gpNvm_Resolve(handle);
+	gpNvm_IndexEntry *entry;
+	gpNvm_Staged *staged, queued;
+	unsigned long gen;
+	gpNvm_Result ret;
+
+	if (!pLength || !h)
+		return 1;
+
+	do {
+		gen = gpNvm_SharedBegin(h);
+		ret = 1;
+		pthread_rwlock_rdlock(&h->lock);
+		if (h->ctx && ((staged = gpNvm_QueueFind(h, attrId, &queued)) ||
+		    (staged = gpNvm_FindPending(h, attrId)))) {
+			*pLength = staged->length;
+			ret = 0;
+		} else if (h->ctx && (entry = gpNvm_IndexLookup(h, attrId))) {
+			*pLength = entry->length;
+			ret = 0;
+		}
+		pthread_rwlock_unlock(&h->lock);
+	} while (gpNvm_SharedRetry(h, gen));
+	return ret;
+}
+
+/**
+ * gpNvm_StaticRead:
+ * @h: handle of the store, with the static layout
+ * @attrId: attribute ID (key)
+ * @offset: file offset of the record
+ * @size: length of the data
+ * @pValue: returns the data
+ *
+ * Read a declared attribute at the offset of its record, in one read or
+ * in place, without a lookup. The ID and length in the record make sure
+ * it is the one asked for, the data is checked as always.
+ *
+ * Returns: 0 if success
+ */
+static int gpNvm_StaticRead(gpNvm_Handle *h, gpNvm_AttrId attrId, long offset, UInt8 size, UInt8 *pValue)
+{
+	int header = gpNvm_HeaderSize(&h->format);
+	long n = gpNvm_RecordSize(&h->format, size);
+	UInt8 buf[GPNVM_RECORD_MAX];
+	const UInt8 *record = buf;
+
+	if (offset < h->staticBase || offset + n > h->staticEnd)
+		return 1;
+	if (h->image)
+		record = h->image + offset;
+	else if (!gpNvm_ReadAt(h, offset, buf, n))
+		return 1;
+
+	if (gpNvm_GetId(&h->format, record + 1) != attrId || record[1 + gpNvm_IdSize(&h->format)] != size)
+		return 1;
+	if (gpNvm_GetCheck(&h->format, record + header + size) != gpNvm_Check(&h->format, record + header, size)) {
+		GPNVM_STATS_ADD(h, checkFailures, 1);
+		return 1;
+	}
+	memcpy(pValue, record + header, size);
+	return 0;
+}
+
+/**
+ * gpNvm_StaticGet:
+ * @handle: handle of the store, NULL for the store of gpNvm_OpenFile()
+ * @attrId: attribute ID (key)
+ * @offset: offset of its record in the static layout
+ * @size: declared size of the attribute
+ * @pValue: returns the data
+ *
+ * Read a declared attribute, see GPNVM_STATIC_GET() in gpnvm_static.h.
+ * If the store has the static layout the record is read at its offset;
+ * otherwise, or while a value not written yet may take precedence, this
+ * is gpNvm_Get().
+ *
+ * Returns: 0 if success
+ */
+gpNvm_Result gpNvm_StaticGet(gpNvm_Handle *handle, gpNvm_AttrId attrId, UInt32 offset, UInt8 size, void *pValue)
+{
+	gpNvm_Handle *h = gpNvm_Resolve(handle);
+	long now = GPNVM_STATS_NOW();
+	unsigned long gen;
+	gpNvm_Result ret;
+
+	if (!size || !pValue || !h)
+		return 1;
+
+	do {
+		gen = gpNvm_SharedBegin(h);
+		pthread_rwlock_rdlock(&h->lock);
+		if (!h->ctx || !h->staticOk || h->batching || h->dirty.count || gpNvm_QueueFind(h, attrId, NULL)) {
+			ret = gpNvm_GetLocked(h, attrId, size, pValue);
+		} else {
+			pthread_rwlock_rdlock(gpNvm_Stripe(h, attrId));
+			ret = gpNvm_StaticRead(h, attrId, h->staticBase + offset, size, pValue);
+			pthread_rwlock_unlock(gpNvm_Stripe(h, attrId));
+		}
+		pthread_rwlock_unlock(&h->lock);
+	} while (gpNvm_SharedRetry(h, gen));
+	GPNVM_STATS_TIME(h, getLatency, now);
+	return ret;
+}
+
+/**
+ * gpNvm_CompareFetch:
+ * @a: first read
+ * @b: second read
+ *
+ * qsort() helper ordering the reads of gpNvm_GetMany() by file offset.
+ *
+ * Returns: <0, 0 or >0
+ */
+static int gpNvm_CompareFetch(const void *a, const void *b)
+{
+	long ao = ((const gpNvm_Fetch *)a)->offset;
+	long bo = ((const gpNvm_Fetch *)b)->offset;
+
+	return (ao > bo) - (ao < bo);
+}
+
+/**
+ * gpNvm_FetchRun:
+ * @h: handle of the store
+ * @fetch: reads, in file order unless the storage is in memory
+ * @count: number of reads
+ * @values: buffers of the reads, by entry
+ * @results: returns the result of the reads, by entry
+ *
+ * Read records that lie close together in one go, gaps included, and
+ * check and copy out each of them. The record locks of all of them are
+ * held meanwhile. To be called with the structure lock held at
+ * least shared.
+ *
+ * Returns: number of reads done, at least one
+ */
+static int gpNvm_FetchRun(gpNvm_Handle *h, const gpNvm_Fetch *fetch, int count, UInt8 **values, gpNvm_Result *results)
+{
+	UInt8 buf[GPNVM_READ_RUN], locked[GPNVM_LOCK_STRIPES] = { 0 };
+	long start = fetch[0].offset, end = start;
+	const UInt8 *run;
+	int header = gpNvm_HeaderSize(&h->format), i, n, ok;
+
+  /* extend the run while the next record is close and fits in the
+   * buffer; storage in memory is taken in one run, in any order */
+	for (n = 0; n != count; n++) {
+		long next = fetch[n].offset + gpNvm_RecordSize(&h->format, fetch[n].length);
+
+		if (n && !h->image && (fetch[n].offset > end + GPNVM_RECORD_MAX ||
+		    next - start > (long)sizeof buf))
+			break;
+		if (fetch[n].offset < start)
+			start = fetch[n].offset;
+		if (next > end)
+			end = next;
+		locked[fetch[n].attrId % GPNVM_LOCK_STRIPES] = 1;
+	}
+
+  /* storage in memory is checked in place, without the copy */
+	for (i = 0; i != GPNVM_LOCK_STRIPES; i++)
+		if (locked[i])
+			pthread_rwlock_rdlock(&h->stripes[i]);
+	run = h->image ? h->image + start : buf;
+	ok = h->image ? end <= h->end : gpNvm_ReadAt(h, start, buf, end - start);
+
+	for (i = 0; ok && i != n; i++) {
+		const UInt8 *data = run + fetch[i].offset - start + header;
+
+		if (gpNvm_GetCheck(&h->format, data + fetch[i].length) !=
+		    gpNvm_Check(&h->format, data, fetch[i].length)) {
+			GPNVM_STATS_ADD(h, checkFailures, 1);
+			continue;
+		}
+		memcpy(values[fetch[i].entry], data, fetch[i].length);
+		results[fetch[i].entry] = 0;
+	}
+	for (i = 0; i != GPNVM_LOCK_STRIPES; i++)
+		if (locked[i])
+			pthread_rwlock_unlock(&h->stripes[i]);
+	return n;
+}
+
+/**
+ * gpNvm_GetMany:
+ * @handle: handle of the store, NULL for the store of gpNvm_OpenFile()
+ * @count: number of attributes
+ * @attrIds: attribute IDs (keys)
+ * @lengths: length of data to read, per attribute
+ * @values: pointers to memory, per attribute
+ * @results: returns the result per attribute, 0 if success; NULL if
+ * only the overall result is of interest
+ *
+ * Read a number of attributes under one lock, as gpNvm_Get() would
+ * read each of them. All are looked up in the index first, then the
+ * records are read in file order, those close together in a single
+ * read. Storage in memory is read in place, in one go.
+ *
+ * Returns: 0 if all attributes are read
+ */
+gpNvm_Result gpNvm_GetMany(gpNvm_Handle *handle, int count, const gpNvm_AttrId *attrIds, const UInt8 *lengths, UInt8 **values, gpNvm_Result *results)
+{
+	gpNvm_Handle *h = gpNvm_Resolve(handle);
+	gpNvm_Fetch scratch[64], *fetch = scratch;
+	gpNvm_Result scratchResults[64], *result = results;
+	gpNvm_IndexEntry *entry;
+	gpNvm_Staged *staged, queued;
+	unsigned long gen;
+	int i, n, ret = 0;
+
+	if (!h || count < 0 || (count && (!attrIds || !lengths || !values)))
+		return 1;
+	if (count > 64 && !(fetch = malloc(count * sizeof *fetch)))
+		return 1;
+	if (!result && count > 64 && !(result = malloc(count * sizeof *result))) {
+		free(fetch);
+		return 1;
+	}
+	if (!result)
+		result = scratchResults;
+
+	do {
+		gen = gpNvm_SharedBegin(h);
+		pthread_rwlock_rdlock(&h->lock);
+		for (i = 0, n = 0; i != count; i++) {
+			result[i] = 1;
+			if (!h->ctx || !lengths[i] || !values[i])
+				continue;
+
+  /* a value not written yet takes precedence, the queued one first */
+			if ((staged = gpNvm_QueueFind(h, attrIds[i], &queued)) ||
+			    (staged = gpNvm_FindPending(h, attrIds[i]))) {
+				if (staged->length == lengths[i]) {
+					memcpy(values[i], staged->value, lengths[i]);
+					result[i] = 0;
+				}
+				continue;
+			}
+
+			entry = gpNvm_IndexLookup(h, attrIds[i]);
+			if (!entry || entry->length != lengths[i])
+				continue;
+			fetch[n].offset = entry->offset;
+			fetch[n].attrId = attrIds[i];
+			fetch[n].length = lengths[i];
+			fetch[n].entry = i;
+			n++;
+		}
+
+		if (!h->image)
+			qsort(fetch, n, sizeof *fetch, gpNvm_CompareFetch);
+		for (i = 0; i != n; )
+			i += gpNvm_FetchRun(h, fetch + i, n - i, values, result);
+		pthread_rwlock_unlock(&h->lock);
+	} while (gpNvm_SharedRetry(h, gen));
+
+	for (i = 0; i != count; i++)
+		ret |= result[i];
+	if (fetch != scratch)
+		free(fetch);
+	if (result != results && result != scratchResults)
+		free(result);
+	return ret;
+}
+
+/**
+ * gpNvm_WriteInPlace:
+ * @h: handle of the store
+ * @entry: index entry of the record to replace
+ * @staged: new record, of the same length
+ *
+ * Replace one record in place and flush it. On failure the old image of
+ * the record is written back. Only the view of the record and no other
+ * part of the index changes, nor does the end of the file, so this only
+ * needs the record lock exclusive.
+ *
+ * A record identical to the one in the file is not written at all,
+ * counted as suppressed; of any other only the bytes that changed are
+ * written, see gpNvm_WriteDelta(), and the change is noted for the
+ * notifications.
+ *
+ * Returns: 0 if success
+ */
+static int gpNvm_WriteInPlace(gpNvm_Handle *h, gpNvm_IndexEntry *entry, const gpNvm_Staged *staged)
+{
+	UInt8 record[GPNVM_RECORD_MAX], undo[GPNVM_RECORD_MAX];
+	int n = gpNvm_PackRecord(&h->format, record, staged);
+	long written;
+
+	if (!gpNvm_ReadAt(h, entry->offset, undo, n))
+		return 1;
+	if (!memcmp(undo, record, n)) {
+		__atomic_add_fetch(&h->counters.suppressed, 1, __ATOMIC_RELAXED);
+		__atomic_add_fetch(&h->counters.bytesSaved, n, __ATOMIC_RELAXED);
+		return 0;
+	}
+
+	gpNvm_ViewDrop(h, entry);
+	written = gpNvm_WriteDelta(h, entry->offset, record, undo, n, n);
+	if (written >= 0 && !gpNvm_SyncAt(h, entry->offset, n)) {
+		entry->check = gpNvm_GetCheck(&h->format, record + n - gpNvm_CheckSize(&h->format));
+		entry->checked = 1;
+		if (gpNvm_Notifying(h))
+			gpNvm_NotifyNote(h, staged->attrId);
+		__atomic_add_fetch(&h->counters.records, 1, __ATOMIC_RELAXED);
+		__atomic_add_fetch(&h->counters.flushes, 1, __ATOMIC_RELAXED);
+		__atomic_add_fetch(&h->counters.bytesSaved, n - written, __ATOMIC_RELAXED);
+		__atomic_add_fetch(&h->commitWritten, 1, __ATOMIC_RELEASE);
+		return 0;
+	}
+
+	gpNvm_WriteAt(h, entry->offset, undo, n);
+	gpNvm_SyncAt(h, entry->offset, n);
+	return 1;
+}
+
+/**
+ * gpNvm_CanSet:
+ * @h: handle of the store
+ * @attrId: attribute ID (key)
+ * @length: length of data to write
+ *
+ * Test whether a record can be written, with the structure lock held.
+ *
+ * Returns: non zero if it can
+ */
+static int gpNvm_CanSet(gpNvm_Handle *h, gpNvm_AttrId attrId, UInt8 length)
+{
+	gpNvm_IndexEntry *entry = gpNvm_IndexLookup(h, attrId);
+
+	if (!h->ctx || length > gpNvm_MaxLength(&h->want))
+		return 0;
+
+  /* replace in place if present with the same length, place anew
+   * otherwise; the declared attributes of a static layout keep theirs */
+	return !entry || entry->length == length || !gpNvm_StaticFind(h, attrId);
+}
+
+/**
+ * gpNvm_SetLocked:
+ * @h: handle of the store
+ * @attrId: attribute ID (key)
+ * @length: length of data to write
+ * @pValue: pointer to memory
+ *
+ * Write or stage an attribute, with the structure lock held exclusive.
+ *
+ * Returns: 0 if success
+ */
+static int gpNvm_SetLocked(gpNvm_Handle *h, gpNvm_AttrId attrId, UInt8 length, UInt8 *pValue)
+{
+	gpNvm_Staged one;
+
+	if (!gpNvm_CanSet(h, attrId, length))
+		return 1;
+
+  /* stage in the open batch */
+	if (h->batching)
+		return gpNvm_Stage(h, &h->batch, attrId, length, pValue);
+
+  /* keep in the write-back cache, flush when the policy says so */
+	if (h->flags & GPNVM_OPEN_WRITEBACK) {
+		if (gpNvm_Stage(h, &h->dirty, attrId, length, pValue))
+			return 1;
+		if (h->flushWrites && ++h->pending >= h->flushWrites)
+			return gpNvm_FlushDirty(h);
+		return 0;
+	}
+
+	one.attrId = attrId;
+	one.length = length;
+	memcpy(one.value, pValue, length);
+	return gpNvm_WriteRecords(h, &one, 1);
+}
+
+/**
+ * gpNvm_Set:
+ * @handle: handle of the store, NULL for the store of gpNvm_OpenFile()
+ * @attrId: attribute ID (key)
+ * @length: length of data to write
+ * @pValue: pointer to memory
+ *
+ * Write settings to storage, or stage them while a batch is open. With
+ * %GPNVM_OPEN_WRITEBACK they are kept in memory and written when the
+ * flush policy of the store says so, see gpNvm_Sync(). A value the
+ * attribute has already is not written and needs no flush; of a value
+ * replaced in place only the bytes that changed are written.
+ *
+ * An attribute that is present with the same length, in a file that
+ * needs no migration and is not a log, is replaced in place under its
+ * record lock: reads of other attributes go on meanwhile, but for a
+ * shared store. Any other write takes the store exclusive. A write of
+ * an attribute with a write queued by gpNvm_SetAsync() first waits for
+ * the queue, see gpNvm_Flush(). A value of another length than the one
+ * stored moves the attribute, to free space if some fits, and frees its
+ * old record; only the declared attributes of a static layout can not
+ * change length.
+ *
+ * Returns: 0 if success
+ */
+gpNvm_Result gpNvm_Set(gpNvm_Handle *handle, gpNvm_AttrId attrId, UInt8 length, UInt8 *pValue)
+{
+	gpNvm_Handle *h = gpNvm_Resolve(handle);
+	gpNvm_IndexEntry *entry;
+	long now = GPNVM_STATS_NOW();
+	unsigned long before, ticket;
+	gpNvm_Staged one;
+	gpNvm_Result ret;
+
+	if (!length || !pValue || !h)
+		return 1;
+
+  /* a queued write of the attribute must not land after this one */
+	if (gpNvm_QueueFind(h, attrId, NULL))
+		gpNvm_Flush(h);
+
+	pthread_rwlock_rdlock(&h->lock);
+	entry = gpNvm_IndexLookup(h, attrId);
+	if (h->ctx && !h->batching && !(h->flags & GPNVM_OPEN_WRITEBACK) && !h->shared &&
+	    entry && entry->length == length &&
+	    gpNvm_Current(h) && !(h->format.flags & GPNVM_FMT_LOG)) {
+		one.attrId = attrId;
+		one.length = length;
+		one.seq = 0;
+		memcpy(one.value, pValue, length);
+		pthread_rwlock_wrlock(gpNvm_Stripe(h, attrId));
+		before = gpNvm_Written(h);
+		ret = gpNvm_WriteInPlace(h, entry, &one);
+		ticket = gpNvm_Written(h);
+		pthread_rwlock_unlock(gpNvm_Stripe(h, attrId));
+		pthread_rwlock_unlock(&h->lock);
+		gpNvm_NotifyDeliver(h);
+	} else {
+		pthread_rwlock_unlock(&h->lock);
+
+		ret = gpNvm_WriteLock(h);
+		before = gpNvm_Written(h);
+		ret = ret || gpNvm_SetLocked(h, attrId, length, pValue);
+		ticket = gpNvm_Written(h);
+		gpNvm_WriteUnlock(h);
+	}
+
+  /* staged writes are made durable when they are written */
+	if (!ret && ticket != before)
+		ret = gpNvm_Commit(h, ticket, h->durability);
+	if (!ret) {
+		__atomic_add_fetch(&h->counters.writes, 1, __ATOMIC_RELAXED);
+		__atomic_add_fetch(&h->counters.bytes, length, __ATOMIC_RELAXED);
+	}
+	GPNVM_STATS_TIME(h, setLatency, now);
+	return ret;
+}
+
+/**
+ * gpNvm_SetMany:
+ * @handle: handle of the store, NULL for the store of gpNvm_OpenFile()
+ * @count: number of attributes
+ * @attrIds: attribute IDs (keys)
+ * @lengths: length of data to write, per attribute
+ * @values: pointers to memory, per attribute
+ * @results: returns the result per attribute, 0 if success; NULL if
+ * only the overall result is of interest
+ *
+ * Write a number of attributes under one lock. Those that can be
+ * written are written in one pass in file order, committed as one unit,
+ * see gpNvm_WriteRecords(): they all succeed or all fail, across a
+ * crash as well. An attribute that can not be written, for a length
+ * that does not fit, fails on its own. If an attribute comes more than
+ * once the last value is written. While a batch is open, or with
+ * %GPNVM_OPEN_WRITEBACK, the attributes are staged as gpNvm_Set() would.
+ *
+ * Returns: 0 if all attributes are written
+ */
+gpNvm_Result gpNvm_SetMany(gpNvm_Handle *handle, int count, const gpNvm_AttrId *attrIds, const UInt8 *lengths, UInt8 **values, gpNvm_Result *results)
+{
+	gpNvm_Handle *h = gpNvm_Resolve(handle);
+	gpNvm_StagedSet set = { 0 };
+	gpNvm_Result scratchResults[64], *result = results;
+	unsigned long before, ticket;
+	int i, queued = 0, ret = 0, written, locked;
+
+	if (!h || count < 0 || (count && (!attrIds || !lengths || !values)))
+		return 1;
+	if (!result && count > 64 && !(result = malloc(count * sizeof *result)))
+		return 1;
+	if (!result)
+		result = scratchResults;
+
+  /* queued writes of the attributes must not land after these */
+	for (i = 0; i != count && !queued; i++)
+		queued = gpNvm_QueueFind(h, attrIds[i], NULL) != NULL;
+	if (queued)
+		gpNvm_Flush(h);
+
+	locked = !gpNvm_WriteLock(h);
+	before = gpNvm_Written(h);
+	for (i = 0; i != count; i++) {
+		result[i] = 1;
+		if (!locked || !lengths[i] || !values[i])
+			continue;
+		if (h->batching || (h->flags & GPNVM_OPEN_WRITEBACK))
+			result[i] = gpNvm_SetLocked(h, attrIds[i], lengths[i], values[i]);
+		else if (gpNvm_CanSet(h, attrIds[i], lengths[i]))
+			result[i] = gpNvm_Stage(h, &set, attrIds[i], lengths[i], values[i]);
+	}
+	written = !set.count || !gpNvm_WriteRecords(h, set.records, set.count);
+	ticket = gpNvm_Written(h);
+	gpNvm_WriteUnlock(h);
+	free(set.records);
+	if (ticket != before && gpNvm_Commit(h, ticket, h->durability))
+		written = 0;
+
+	for (i = 0; i != count; i++) {
+		if (!result[i] && !written)
+			result[i] = 1;
+		if (!result[i]) {
+			__atomic_add_fetch(&h->counters.writes, 1, __ATOMIC_RELAXED);
+			__atomic_add_fetch(&h->counters.bytes, lengths[i], __ATOMIC_RELAXED);
+		}
+		ret |= result[i];
+	}
+	if (result != results && result != scratchResults)
+		free(result);
+	return ret;
+}
+
+/**
+ * gpNvm_DeleteLocked:
+ * @h: handle of the store
+ * @attrId: attribute ID (key)
+ *
+ * Delete an attribute, with the structure lock held exclusive. In the
+ * log format a tombstone is appended; otherwise the attribute leaves
+ * the table of contents first, so it never points at free space, and
+ * then its record is freed.
+ *
+ * Returns: 0 if success
+ */
+static int gpNvm_DeleteLocked(gpNvm_Handle *h, gpNvm_AttrId attrId)
+{
+	UInt8 tombstone[GPNVM_RECORD_MAX];
+	gpNvm_IndexEntry *entry;
+	long offset, size, end;
+	int n, cached;
+
+	if (!h->ctx || h->batching || gpNvm_StaticFind(h, attrId))
+		return 1;
+
+  /* a value in the write-back cache goes, as it would be written over */
+	cached = !gpNvm_Unstage(&h->dirty, attrId);
+	if (!gpNvm_IndexLookup(h, attrId))
+		return !cached;
+	if (gpNvm_Migrate(h) || !(entry = gpNvm_IndexLookup(h, attrId)))
+		return 1;
+	offset = entry->offset;
+	size = gpNvm_RecordSize(&h->format, entry->length);
+	end = h->end;
+
+	if (h->format.flags & GPNVM_FMT_LOG) {
+		n = gpNvm_PackFree(&h->format, tombstone, attrId, gpNvm_RecordSize(&h->format, 0), h->seq);
+		if (!gpNvm_WriteAt(h, h->end, tombstone, n) || gpNvm_SyncAt(h, h->end, n)) {
+			h->backend->erase(h->ctx, h->end, n);
+			return 1;
+		}
+		h->end += n;
+		h->seq++;
+		h->dead += size + n;
+		gpNvm_TocRemove(h, entry);
+		gpNvm_IndexRemove(h, entry);
+	} else {
+		if (!h->holesKnown)
+			gpNvm_FreeBuild(h);
+		gpNvm_TocRemove(h, entry);
+		gpNvm_TocCommit(h);
+		gpNvm_IndexRemove(h, entry);
+		if (gpNvm_FreeAdd(h, offset, size, &offset) ||
+		    (offset >= 0 && gpNvm_SyncAt(h, offset, gpNvm_HeaderSize(&h->format)))) {
+			h->holesKnown = 0;
+			return 1;
+		}
+	}
+	if (h->end != end)
+		gpNvm_TocCommit(h);
+
+	if (gpNvm_Notifying(h))
+		gpNvm_NotifyNote(h, attrId);
+	__atomic_add_fetch(&h->counters.deletes, 1, __ATOMIC_RELAXED);
+	__atomic_add_fetch(&h->commitWritten, 1, __ATOMIC_RELEASE);
+
+  /* as after a write, a failed compaction does not fail the delete */
+	if (gpNvm_CompactDue(h))
+		gpNvm_Rewrite(h);
+	return 0;
+}
+
+/**
+ * gpNvm_Delete:
+ * @handle: handle of the store, NULL for the store of gpNvm_OpenFile()
+ * @attrId: attribute ID (key)
+ *
+ * Delete an attribute. In the in-place format its record becomes free
+ * space: merged with the free space next to it and taken by later
+ * writes, best fit, before the file grows; free space that ends the
+ * records is given back at once. In the log format a tombstone is
+ * appended, the record is dead space until compaction. A write of the
+ * attribute queued by gpNvm_SetAsync() is written first, a value in the
+ * write-back cache dropped. Subscribers are told of the change.
+ *
+ * Returns: 0 if success, 1 if the attribute is not present, is declared
+ * in a static layout or a batch is open
+ */
+gpNvm_Result gpNvm_Delete(gpNvm_Handle *handle, gpNvm_AttrId attrId)
+{
+	gpNvm_Handle *h = gpNvm_Resolve(handle);
+	unsigned long before, ticket;
+	gpNvm_Result ret;
+
+	if (!h)
+		return 1;
+
+  /* a queued write of the attribute must not land after the delete */
+	if (gpNvm_QueueFind(h, attrId, NULL))
+		gpNvm_Flush(h);
+
+	ret = gpNvm_WriteLock(h);
+	before = gpNvm_Written(h);
+	ret = ret || gpNvm_DeleteLocked(h, attrId);
+	ticket = gpNvm_Written(h);
+	gpNvm_WriteUnlock(h);
+
+	if (!ret && ticket != before)
+		ret = gpNvm_Commit(h, ticket, h->durability);
+	return ret;
+}
+
+/**
+ * gpNvm_QueueFind:
+ * @h: handle of the store
+ * @attrId: attribute ID (key)
+ * @copy: returns a copy of the queued record, NULL to only test for it
+ *
+ * Look up the newest value queued by gpNvm_SetAsync() for an attribute.
+ * A copy is taken under the queue mutex, as the queue moves when it
+ * grows or is drained.
+ *
+ * Returns: @copy, or a non NULL value if @copy is NULL, if a value is
+ * queued, NULL otherwise
+ */
+static gpNvm_Staged *gpNvm_QueueFind(gpNvm_Handle *h, gpNvm_AttrId attrId, gpNvm_Staged *copy)
+{
+	gpNvm_Staged *staged;
+
+  /* nothing queued: skip the mutex */
+	if (__atomic_load_n(&h->queued, __ATOMIC_ACQUIRE) ==
+	    __atomic_load_n(&h->drained, __ATOMIC_ACQUIRE))
+		return NULL;
+
+	pthread_mutex_lock(&h->queueMutex);
+	staged = gpNvm_FindStaged(&h->queue.records, attrId);
+	if (staged && copy) {
+		copy->attrId = staged->attrId;
+		copy->length = staged->length;
+		memcpy(copy->value, staged->value, staged->length);
+		staged = copy;
+	}
+	pthread_mutex_unlock(&h->queueMutex);
+	return staged;
+}
+
+/**
+ * gpNvm_DrainLocked:
+ * @h: handle of the store
+ *
+ * Write the records of the drain set in one pass, see
+ * gpNvm_WriteRecords(), or stage them in the open batch or write-back
+ * cache. Records that can not be written are moved to the end of the
+ * set first, so they do not fail the others. To be called with the
+ * structure lock held exclusive.
+ *
+ * Returns: number of records at the start of the set that are written
+ */
+static int gpNvm_DrainLocked(gpNvm_Handle *h)
+{
+	gpNvm_StagedSet *set = &h->drain.records;
+	int staging = h->batching || (h->flags & GPNVM_OPEN_WRITEBACK);
+	gpNvm_Staged swap;
+	int i, count = set->count;
+
+	for (i = 0; i != count; ) {
+		gpNvm_Staged *staged = &set->records[i];
+
+		if (staging ? !gpNvm_SetLocked(h, staged->attrId, staged->length, staged->value) :
+		    gpNvm_CanSet(h, staged->attrId, staged->length)) {
+			i++;
+			continue;
+		}
+		swap = *staged;
+		*staged = set->records[--count];
+		set->records[count] = swap;
+	}
+
+	if (staging || !count)
+		return count;
+	return gpNvm_WriteRecords(h, set->records, count) ? 0 : count;
+}
+
+/**
+ * gpNvm_DrainComplete:
+ * @h: handle of the store
+ * @written: number of records at the start of the drain set written
+ *
+ * Call the completions of the drain set in call order, and empty it.
+ *
+ * Returns: 0 if all writes succeeded
+ */
+static int gpNvm_DrainComplete(gpNvm_Handle *h, int written)
+{
+	gpNvm_Completion *completion;
+	gpNvm_Result result;
+	int i, ret = 0;
+
+	for (i = 0; i != h->drain.count; i++) {
+		completion = &h->drain.completions[i];
+		result = gpNvm_FindStaged(&h->drain.records, completion->attrId) -
+			h->drain.records.records >= written;
+		if (!result) {
+			__atomic_add_fetch(&h->counters.writes, 1, __ATOMIC_RELAXED);
+			__atomic_add_fetch(&h->counters.bytes, completion->length, __ATOMIC_RELAXED);
+		}
+		if (completion->callback)
+			completion->callback(h, completion->attrId, result, completion->arg);
+		ret |= result;
+	}
+	h->drain.records.count = 0;
+	h->drain.count = 0;
+	return ret;
+}
+
+/**
+ * gpNvm_WorkerRun:
+ * @arg: handle of the store
+ *
+ * Worker thread: write out the queue of asynchronous writes whenever it
+ * is not empty, and call the completions, until asked to stop. The
+ * queue is written out before the worker stops.
+ *
+ * Returns: NULL
+ */
+static void *gpNvm_WorkerRun(void *arg)
+{
+	gpNvm_Handle *h = arg;
+	gpNvm_Queue swap;
+	unsigned long ticket, before, commit;
+	int written, ret;
+
+	pthread_mutex_lock(&h->queueMutex);
+	for (;;) {
+		while (!h->queue.count && !h->workerStop)
+			pthread_cond_wait(&h->queueCond, &h->queueMutex);
+		if (!h->queue.count)
+			break;
+		pthread_mutex_unlock(&h->queueMutex);
+
+  /* swap under the structure lock, so reads find each value either
+   * queued or written */
+		ret = gpNvm_WriteLock(h);
+		pthread_mutex_lock(&h->queueMutex);
+		swap = h->drain;
+		h->drain = h->queue;
+		h->queue = swap;
+		ticket = h->queued;
+		pthread_mutex_unlock(&h->queueMutex);
+		before = gpNvm_Written(h);
+		written = ret ? 0 : gpNvm_DrainLocked(h);
+		commit = gpNvm_Written(h);
+		gpNvm_WriteUnlock(h);
+
+  /* completions report the writes durable at the level of the store */
+		if (commit != before && gpNvm_Commit(h, commit, h->durability))
+			written = 0;
+
+		ret = gpNvm_DrainComplete(h, written);
+
+		pthread_mutex_lock(&h->queueMutex);
+		h->queueFailed |= ret;
+		__atomic_store_n(&h->drained, ticket, __ATOMIC_RELEASE);
+		pthread_cond_broadcast(&h->drainCond);
+	}
+	pthread_mutex_unlock(&h->queueMutex);
+
+	return NULL;
+}
+
+/**
+ * gpNvm_WorkerStop:
+ * @h: handle of the store
+ *
+ * Stop and join the worker thread, if there is one, once it has written
+ * out the queue.
+ */
+static void gpNvm_WorkerStop(gpNvm_Handle *h)
+{
+	int running;
+
+	pthread_mutex_lock(&h->queueMutex);
+	running = h->workerRunning;
+	h->workerStop = 1;
+	pthread_cond_signal(&h->queueCond);
+	pthread_mutex_unlock(&h->queueMutex);
+
+	if (running)
+		pthread_join(h->worker, NULL);
+}
+
+/**
+ * gpNvm_SetAsync:
+ * @handle: handle of the store, NULL for the store of gpNvm_OpenFile()
+ * @attrId: attribute ID (key)
+ * @length: length of data to write
+ * @pValue: pointer to memory, copied before the call returns
+ * @callback: called with the result once the write is done, NULL for none
+ * @arg: passed to @callback
+ *
+ * Queue a write and return without waiting for storage. A worker thread,
+ * started by the first call, writes the queue out in call order: all
+ * writes queued meanwhile go in one pass with a single flush, and a
+ * later write of an attribute still queued replaces the earlier value,
+ * counted as coalesced. Every call gets its own completion, in call
+ * order. Reads see a queued value at once; see gpNvm_Flush() to wait
+ * for the queue. While a batch is open, or with %GPNVM_OPEN_WRITEBACK,
+ * the write completes once it is staged, as gpNvm_Set() would return.
+ *
+ * Returns: 0 if the write is queued
+ */
+gpNvm_Result gpNvm_SetAsync(gpNvm_Handle *handle, gpNvm_AttrId attrId, UInt8 length, UInt8 *pValue, gpNvm_Callback callback, void *arg)
+{
+	gpNvm_Handle *h = gpNvm_Resolve(handle);
+	gpNvm_Completion *completion;
+	gpNvm_Result ret = 1;
+
+	if (!length || !pValue || !h)
+		return 1;
+
+	pthread_mutex_lock(&h->queueMutex);
+	if (h->workerStop)
+		goto out;
+	if (!h->workerRunning) {
+		if (pthread_create(&h->worker, NULL, gpNvm_WorkerRun, h))
+			goto out;
+		h->workerRunning = 1;
+	}
+
+	if (h->queue.count == h->queue.size) {
+		int size = h->queue.size ? 2 * h->queue.size : 16;
+
+		completion = realloc(h->queue.completions, size * sizeof *completion);
+		if (!completion)
+			goto out;
+		h->queue.completions = completion;
+		h->queue.size = size;
+	}
+	if (gpNvm_Stage(h, &h->queue.records, attrId, length, pValue))
+		goto out;
+
+	completion = &h->queue.completions[h->queue.count++];
+	completion->callback = callback;
+	completion->arg = arg;
+	completion->attrId = attrId;
+	completion->length = length;
+	__atomic_add_fetch(&h->queued, 1, __ATOMIC_RELEASE);
+	pthread_cond_signal(&h->queueCond);
+	ret = 0;
+out:
+	pthread_mutex_unlock(&h->queueMutex);
+	return ret;
+}
+
+/**
+ * gpNvm_Flush:
+ * @handle: handle of the store, NULL for the store of gpNvm_OpenFile()
+ *
+ * Wait until every write queued by gpNvm_SetAsync() before the call is
+ * done, then flush the write-back cache, see gpNvm_Sync(). Must not be
+ * called from a completion.
+ *
+ * Returns: 0 if success, 1 if a queued write failed since the last flush
+ */
+gpNvm_Result gpNvm_Flush(gpNvm_Handle *handle)
+{
+	gpNvm_Handle *h = gpNvm_Resolve(handle);
+	unsigned long ticket;
+	gpNvm_Result ret;
+
+	if (!h)
+		return 1;
+
+	pthread_mutex_lock(&h->queueMutex);
+	if (h->workerRunning && pthread_equal(h->worker, pthread_self())) {
+		pthread_mutex_unlock(&h->queueMutex);
+		return 1;
+	}
+	ticket = h->queued;
+	while (h->drained != ticket)
+		pthread_cond_wait(&h->drainCond, &h->queueMutex);
+	ret = h->queueFailed;
+	h->queueFailed = 0;
+	pthread_mutex_unlock(&h->queueMutex);
+
+	return gpNvm_Sync(h) || ret;
+}
+
+/**
+ * gpNvm_Subscribe:
+ * @handle: handle of the store, NULL for the store of gpNvm_OpenFile()
+ * @attrId: attribute ID (key)
+ * @notify: called for every change of the attribute
+ * @arg: passed to @notify
+ *
+ * Be told of the changes of an attribute written through this handle,
+ * instead of reading it over and over. @notify is called once per
+ * write that gives the attribute a new value, once the write is done:
+ * by gpNvm_Set(), by gpNvm_CommitBatch() for a batch, by the worker for
+ * queued writes and by the flush for the write-back cache. A write of
+ * the value the attribute already has is not a change. An import calls
+ * every subscription once. The writes of other processes sharing the
+ * store are not seen, see gpNvm_GetNotifyFd() for those.
+ *
+ * Returns: 0 if success
+ */
+gpNvm_Result gpNvm_Subscribe(gpNvm_Handle *handle, gpNvm_AttrId attrId, gpNvm_Notify notify, void *arg)
+{
+	gpNvm_Handle *h = gpNvm_Resolve(handle);
+	gpNvm_Result ret = 1;
+
+	if (!h || !notify)
+		return 1;
+
+	pthread_mutex_lock(&h->notifyMutex);
+	if (h->subCount == h->subSize) {
+		int size = h->subSize ? 2 * h->subSize : 8;
+		gpNvm_Subscription *subs = realloc(h->subs, size * sizeof *subs);
+
+		if (!subs)
+			goto out;
+		h->subs = subs;
+		h->subSize = size;
+	}
+	h->subs[h->subCount].notify = notify;
+	h->subs[h->subCount].arg = arg;
+	h->subs[h->subCount].attrId = attrId;
+	__atomic_store_n(&h->subCount, h->subCount + 1, __ATOMIC_RELAXED);
+	ret = 0;
+out:
+	pthread_mutex_unlock(&h->notifyMutex);
+	return ret;
+}
+
+/**
+ * gpNvm_Unsubscribe:
+ * @handle: handle of the store, NULL for the store of gpNvm_OpenFile()
+ * @attrId: attribute ID (key)
+ * @notify: callback given to gpNvm_Subscribe()
+ * @arg: argument given to gpNvm_Subscribe()
+ *
+ * Drop a subscription. A delivery already under way in another thread
+ * may still call it.
+ *
+ * Returns: 0 if success, 1 if there is no such subscription
+ */
+gpNvm_Result gpNvm_Unsubscribe(gpNvm_Handle *handle, gpNvm_AttrId attrId, gpNvm_Notify notify, void *arg)
+{
+	gpNvm_Handle *h = gpNvm_Resolve(handle);
+	gpNvm_Result ret = 1;
+	int i;
+
+	if (!h)
+		return 1;
+
+	pthread_mutex_lock(&h->notifyMutex);
+	for (i = 0; i != h->subCount; i++) {
+		gpNvm_Subscription *sub = &h->subs[i];
+
+		if (sub->attrId == attrId && sub->notify == notify && sub->arg == arg) {
+			*sub = h->subs[h->subCount - 1];
+			__atomic_store_n(&h->subCount, h->subCount - 1, __ATOMIC_RELAXED);
+			ret = 0;
+			break;
+		}
+	}
+	pthread_mutex_unlock(&h->notifyMutex);
+	return ret;
+}
+
+/**
+ * gpNvm_GetNotifyFd:
+ * @handle: handle of the store, NULL for the store of gpNvm_OpenFile()
+ * @pFd: returns the descriptor, owned by the handle
+ *
+ * Get a descriptor that becomes readable when attributes change, to wait
+ * on with poll() or epoll instead of reading them over and over; see
+ * gpNvm_ReadChanges() for what changed. It is woken once per write that
+ * changes anything, a batch or a pass of queued writes counting as one
+ * write; writes of values already there do not wake it. It sees the
+ * writes through this handle and, in shared mode, those of every process
+ * sharing the store: it is then an inotify descriptor on the segment.
+ * The changes are kept from the first call on.
+ *
+ * Returns: 0 if success, 1 if the system has no such descriptors
+ */
+gpNvm_Result gpNvm_GetNotifyFd(gpNvm_Handle *handle, int *pFd)
+{
+	gpNvm_Handle *h = gpNvm_Resolve(handle);
+	gpNvm_Result ret = 1;
+	char *name;
+	int fd;
+
+	if (!h || !pFd || !GPNVM_NOTIFY_FDS)
+		return 1;
+
+	pthread_mutex_lock(&h->notifyMutex);
+	if (h->notifyFd >= 0) {
+		*pFd = h->notifyFd;
+		ret = 0;
+		goto out;
+	}
+#if GPNVM_NOTIFY_FDS
+	if (h->shared) {
+		name = malloc(strlen(h->path) + sizeof GPNVM_SHARED_SUFFIX);
+		fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+		if (name && fd >= 0) {
+			sprintf(name, "%s" GPNVM_SHARED_SUFFIX, h->path);
+			if (inotify_add_watch(fd, name, IN_MODIFY) < 0) {
+				close(fd);
+				fd = -1;
+			}
+		}
+		free(name);
+	} else {
+		fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	}
+	if (fd < 0)
+		goto out;
+
+  /* writes in other processes start noting their changes from here */
+	if (h->shared)
+		__atomic_add_fetch(&h->shared->watchers, 1, __ATOMIC_RELAXED);
+	h->notifyRead = __atomic_load_n(&h->ring->count, __ATOMIC_ACQUIRE);
+	__atomic_store_n(&h->notifyFd, fd, __ATOMIC_RELAXED);
+	*pFd = fd;
+	ret = 0;
+#else
+	(void)name;
+	(void)fd;
+#endif
+out:
+	pthread_mutex_unlock(&h->notifyMutex);
+	return ret;
+}
+
+/**
+ * gpNvm_ReadChanges:
+ * @handle: handle of the store, NULL for the store of gpNvm_OpenFile()
+ * @attrIds: returns the attributes changed, in the order they were
+ * written; one written several times comes several times
+ * @pCount: number of @attrIds on entry, returns the number of changes,
+ * or -1 if changes were lost: anything may have changed
+ *
+ * Take the changes since the last call, or since gpNvm_GetNotifyFd(),
+ * and empty the descriptor. Changes are lost after an import, or when
+ * more than %GPNVM_NOTIFY_RING were made since the last call. If the
+ * changes fill @attrIds, call it again before waiting on the descriptor.
+ *
+ * Returns: 0 if success, 1 if the handle has no descriptor
+ */
+gpNvm_Result gpNvm_ReadChanges(gpNvm_Handle *handle, gpNvm_AttrId *attrIds, int *pCount)
+{
+	gpNvm_Handle *h = gpNvm_Resolve(handle);
+	gpNvm_NotifyRing *ring;
+	unsigned long pos, count;
+	UInt8 drain[4096] __attribute__((aligned(8)));
+	int n = 0;
+
+	if (!h || !pCount || *pCount < 0 || (*pCount && !attrIds))
+		return 1;
+
+	pthread_mutex_lock(&h->notifyMutex);
+	if (h->notifyFd < 0) {
+		pthread_mutex_unlock(&h->notifyMutex);
+		return 1;
+	}
+
+  /* empty the descriptor first, a change made meanwhile wakes it again */
+	while (read(h->notifyFd, drain, sizeof drain) > 0)
+		;
+
+	ring = h->ring;
+	pos = h->notifyRead;
+	count = __atomic_load_n(&ring->count, __ATOMIC_ACQUIRE);
+	for (; pos != count && n != *pCount; pos++)
+		attrIds[n++] = __atomic_load_n(&ring->ids[pos % GPNVM_NOTIFY_RING], __ATOMIC_RELAXED);
+
+  /* the IDs copied hold if the ring did not wrap over them meanwhile */
+	GPNVM_SHARED_FENCE(&ring->count);
+	count = __atomic_load_n(&ring->count, __ATOMIC_ACQUIRE);
+	if (count - h->notifyRead > GPNVM_NOTIFY_RING ||
+	    __atomic_load_n(&ring->reset, __ATOMIC_RELAXED) > h->notifyRead) {
+		n = -1;
+		pos = count;
+	}
+	h->notifyRead = pos;
+	pthread_mutex_unlock(&h->notifyMutex);
+
+	*pCount = n;
+	return 0;
+}
+
+/**
+ * gpNvm_GetAttribute:
+ * @attrId: attribute ID (key)
+ * @Length: length of data to read
+ * @pValue: pointer to memory
+ *
+ * Read from the store of gpNvm_OpenFile(), see gpNvm_Get().
+ *
+ * Returns: 0 if success
+ */
+gpNvm_Result gpNvm_GetAttribute(gpNvm_AttrId attrId, UInt8 *pLength, UInt8 *pValue)
+{
+	return gpNvm_Get(NULL, attrId, pLength, pValue);
+}
+
+/**
+ * gpNvm_GetAttributeView:
+ * @attrId: attribute ID (key)
+ * @ppValue: returns a pointer to the data
+ * @pLength: returns the length of the data
+ *
+ * Read from the store of gpNvm_OpenFile() without a copy, see
+ * gpNvm_GetView().
+ *
+ * Returns: 0 if success
+ */
+gpNvm_Result gpNvm_GetAttributeView(gpNvm_AttrId attrId, const UInt8 **ppValue, UInt8 *pLength)
+{
+	return gpNvm_GetView(NULL, attrId, ppValue, pLength);
+}
+
+/**
+ * gpNvm_GetAttributeLength:
+ * @attrId: attribute ID (key)
+ * @pLength: returns the length of the data
+ *
+ * Length of an attribute of the store of gpNvm_OpenFile(), see
+ * gpNvm_GetLength().
+ *
+ * Returns: 0 if success
+ */
+gpNvm_Result gpNvm_GetAttributeLength(gpNvm_AttrId attrId, UInt8 *pLength)
+{
+	return gpNvm_GetLength(NULL, attrId, pLength);
+}
+
+/**
+ * gpNvm_SubscribeAttribute:
+ * @attrId: attribute ID (key)
+ * @notify: called for every change of the attribute
+ * @arg: passed to @notify
+ *
+ * Be told of the changes of an attribute of the store of
+ * gpNvm_OpenFile(), see gpNvm_Subscribe().
+ *
+ * Returns: 0 if success
+ */
+gpNvm_Result gpNvm_SubscribeAttribute(gpNvm_AttrId attrId, gpNvm_Notify notify, void *arg)
+{
+	return gpNvm_Subscribe(NULL, attrId, notify, arg);
+}
+
+/**
+ * gpNvm_UnsubscribeAttribute:
+ * @attrId: attribute ID (key)
+ * @notify: callback given to gpNvm_SubscribeAttribute()
+ * @arg: argument given to gpNvm_SubscribeAttribute()
+ *
+ * Drop a subscription, see gpNvm_Unsubscribe().
+ *
+ * Returns: 0 if success, 1 if there is no such subscription
+ */
+gpNvm_Result gpNvm_UnsubscribeAttribute(gpNvm_AttrId attrId, gpNvm_Notify notify, void *arg)
+{
+	return gpNvm_Unsubscribe(NULL, attrId, notify, arg);
+}
+
+/**
+ * gpNvm_SetAttribute:
+ * @attrId: attribute ID (key)
+ * @length: length of data to write
+ * @pValue: pointer to memory
+ *
+ * Write to the store of gpNvm_OpenFile(), see gpNvm_Set().
+ *
+ * Returns: 0 if success
+ */
+gpNvm_Result gpNvm_SetAttribute(gpNvm_AttrId attrId, UInt8 length, UInt8 *pValue)
+{
+	return gpNvm_Set(NULL, attrId, length, pValue);
+}
+
+/**
+ * gpNvm_DeleteAttribute:
+ * @attrId: attribute ID (key)
+ *
+ * Delete an attribute of the store of gpNvm_OpenFile(), see
+ * gpNvm_Delete().
+ *
+ * Returns: 0 if success
+ */
+gpNvm_Result gpNvm_DeleteAttribute(gpNvm_AttrId attrId)
+{
+	return gpNvm_Delete(NULL, attrId);
+}
+
+/**
+ * gpNvm_SetAttributeAsync:
+ * @attrId: attribute ID (key)
+ * @length: length of data to write
+ * @pValue: pointer to memory
+ * @callback: called with the result once the write is done, NULL for none
+ * @arg: passed to @callback
+ *
+ * Queue a write to the store of gpNvm_OpenFile(), see gpNvm_SetAsync().
+ *
+ * Returns: 0 if the write is queued
+ */
+gpNvm_Result gpNvm_SetAttributeAsync(gpNvm_AttrId attrId, UInt8 length, UInt8 *pValue, gpNvm_Callback callback, void *arg)
+{
+	return gpNvm_SetAsync(NULL, attrId, length, pValue, callback, arg);
+}
+
+/**
+ * gpNvm_GetAttributes:
+ * @count: number of attributes
+ * @attrIds: attribute IDs (keys)
+ * @lengths: length of data to read, per attribute
+ * @values: pointers to memory, per attribute
+ * @results: returns the result per attribute, 0 if success, or NULL
+ *
+ * Read a number of attributes of the store of gpNvm_OpenFile(), see
+ * gpNvm_GetMany().
+ *
+ * Returns: 0 if all attributes are read
+ */
+gpNvm_Result gpNvm_GetAttributes(int count, const gpNvm_AttrId *attrIds, const UInt8 *lengths, UInt8 **values, gpNvm_Result *results)
+{
+	return gpNvm_GetMany(NULL, count, attrIds, lengths, values, results);
+}
+
+/**
+ * gpNvm_SetAttributes:
+ * @count: number of attributes
+ * @attrIds: attribute IDs (keys)
+ * @lengths: length of data to write, per attribute
+ * @values: pointers to memory, per attribute
+ * @results: returns the result per attribute, 0 if success, or NULL
+ *
+ * Write a number of attributes to the store of gpNvm_OpenFile(), see
+ * gpNvm_SetMany().
+ *
+ * Returns: 0 if all attributes are written
+ */
+gpNvm_Result gpNvm_SetAttributes(int count, const gpNvm_AttrId *attrIds, const UInt8 *lengths, UInt8 **values, gpNvm_Result *results)
+{
+	return gpNvm_SetMany(NULL, count, attrIds, lengths, values, results);
 }
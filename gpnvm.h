@@ -3,14 +3,224 @@
 
 typedef unsigned char UInt8;
 typedef unsigned short UInt16;
+typedef unsigned int UInt32;
 
+/* width of attribute IDs in bits: 8, 16 or 32. Set it the same for the
+ * library and its users; a store is read by builds with IDs at least as
+ * wide as its own and rewritten in the width of the build on the first
+ * write */
+#ifndef GPNVM_ATTRID_BITS
+#define GPNVM_ATTRID_BITS 8
+#endif
+
+#if GPNVM_ATTRID_BITS == 32
+typedef UInt32 gpNvm_AttrId;
+#elif GPNVM_ATTRID_BITS == 16
+typedef UInt16 gpNvm_AttrId;
+#elif GPNVM_ATTRID_BITS == 8
 typedef UInt8 gpNvm_AttrId;
+#else
+#error "GPNVM_ATTRID_BITS must be 8, 16 or 32"
+#endif
 typedef UInt8 gpNvm_Result;
 
+typedef struct gpNvm_Handle gpNvm_Handle;
+
+/* storage of a store, see gpnvm_backend.h */
+typedef struct gpNvm_Backend gpNvm_Backend;
+
+/* map the file and access attributes in memory instead of through stdio */
+#define GPNVM_OPEN_MMAP 0x01
+/* log-structured: append every update, compact when dead space builds up */
+#define GPNVM_OPEN_LOG 0x02
+/* write-back: keep writes in memory, write them per the flush policy */
+#define GPNVM_OPEN_WRITEBACK 0x04
+/* repair: rewrite the file without the damage the scan at open found */
+#define GPNVM_OPEN_REPAIR 0x08
+/* table of contents: keep the location of every record in a table at the
+ * start of the file, so open need not scan the records */
+#define GPNVM_OPEN_TOC 0x10
+/* shared: several processes open the same file, writers take turns under
+ * a file lock and the index lives in a segment they all map */
+#define GPNVM_OPEN_SHARED 0x20
+
+/* durability of a write once it returns: handed to the kernel, mapped
+ * pages pushed with msync; fdatasync; fsync and a sync of the directory */
+#define GPNVM_DURABILITY_NONE 0
+#define GPNVM_DURABILITY_DATA 1
+#define GPNVM_DURABILITY_FULL 2
+
+/* attribute of a static schema, see gpnvm_static.h: its record is at
+ * @offset from the first record and holds @size bytes */
+typedef struct {
+	gpNvm_AttrId attrId;
+	UInt32 offset;
+	UInt8 size;
+} gpNvm_StaticAttr;
+
+typedef struct {
+	UInt32 flags;
+	/* log: percentage of dead space that triggers compaction, 0 default */
+	UInt8 compactThreshold;
+	/* write-back: flush after this many writes, 0 for no limit */
+	UInt32 flushWrites;
+	/* write-back: flush this many milliseconds apart, 0 for never; the
+	 * cache is also flushed by gpNvm_Sync() and on close */
+	UInt32 flushMs;
+	/* storage the store lives in, NULL for &gpNvm_FileBackend, and the
+	 * argument its open function takes */
+	const gpNvm_Backend *backend;
+	void *backendArg;
+	/* static layout: the declared attributes, in layout order, NULL for
+	 * none; set with GPNVM_STATIC_OPTIONS(), it must outlive the store */
+	const gpNvm_StaticAttr *schema;
+	int schemaCount;
+	/* GPNVM_DURABILITY_* level of every write, none by default */
+	UInt8 durability;
+} gpNvm_Options;
+
+/* completion of gpNvm_SetAsync(): @result is 0 if the write succeeded.
+ * Called from the worker thread of the store, with no lock held; it may
+ * read and queue writes, but not wait for the store with gpNvm_Flush()
+ * or gpNvm_Close() */
+typedef void (*gpNvm_Callback)(gpNvm_Handle *handle, gpNvm_AttrId attrId, gpNvm_Result result, void *arg);
+
+/* change notification of gpNvm_Subscribe(): @attrId was written with a
+ * new value, or deleted. Called once the write is done, from the thread
+ * that wrote it with no lock held; it may read and write the store */
+typedef void (*gpNvm_Notify)(gpNvm_Handle *handle, gpNvm_AttrId attrId, void *arg);
+
+/* counted per store since it was opened */
+typedef struct {
+	/* successful gpNvm_Set() and gpNvm_SetAsync() calls */
+	unsigned long writes;
+	/* records written to the file */
+	unsigned long records;
+	/* write passes, each ending in one flush to storage */
+	unsigned long flushes;
+	/* writes that replaced a value not written yet */
+	unsigned long coalesced;
+	/* syncs made for the durability level, each one covering all writes
+	 * done before it started */
+	unsigned long persists;
+	/* data bytes of successful gpNvm_Set() and gpNvm_SetAsync() calls */
+	unsigned long bytes;
+	/* records not written as they held the data already there */
+	unsigned long suppressed;
+	/* record bytes not written: those of suppressed records, and the
+	 * bytes of records replaced in place that did not change */
+	unsigned long bytesSaved;
+	/* successful gpNvm_Delete() calls */
+	unsigned long deletes;
+	/* records written to the free space of deleted and moved records
+	 * instead of growing the file */
+	unsigned long reused;
+} gpNvm_WriteCounters;
+
+/* runtime statistics, set to 0 to compile them out */
+#ifndef GPNVM_STATS
+#define GPNVM_STATS 1
+#endif
+
+/* latency histograms: bucket i counts operations that took 2^i up to
+ * 2^(i+1) nanoseconds, the last bucket all longer ones */
+#define GPNVM_STATS_BUCKETS 32
+
+/* time one in this many reads and writes of each thread, 1 to time them
+ * all; flushes are all timed */
+#ifndef GPNVM_STATS_SAMPLE
+#define GPNVM_STATS_SAMPLE 16
+#endif
+
+/* counted per store since it was opened or the statistics were reset */
+typedef struct {
+	/* index lookups, and the slots they probed */
+	unsigned long lookups;
+	unsigned long probes;
+	/* record headers read scanning the file */
+	unsigned long scanned;
+	/* bytes moved from and to storage */
+	unsigned long bytesRead;
+	unsigned long bytesWritten;
+	/* data that failed its checksum */
+	unsigned long checkFailures;
+	/* headers that failed their check, and the bytes skipped past them to
+	 * the next intact record */
+	unsigned long headerFailures;
+	unsigned long skipped;
+	/* flushes to storage */
+	unsigned long flushes;
+	/* shared mode: index copies taken from the segment after another
+	 * process changed it, and reads done again as one wrote meanwhile */
+	unsigned long sharedRefreshes;
+	unsigned long sharedRetries;
+	unsigned long getLatency[GPNVM_STATS_BUCKETS];
+	unsigned long setLatency[GPNVM_STATS_BUCKETS];
+	unsigned long flushLatency[GPNVM_STATS_BUCKETS];
+} gpNvm_Stats;
+
+/* original API, on one process wide store */
 gpNvm_Result gpNvm_OpenFile(const char *filename);
+gpNvm_Result gpNvm_OpenFileEx(const char *filename, const gpNvm_Options *options);
 gpNvm_Result gpNvm_CloseFile(void);
 
 gpNvm_Result gpNvm_GetAttribute(gpNvm_AttrId attrId, UInt8 *pLength, UInt8 *pValue);
 gpNvm_Result gpNvm_SetAttribute(gpNvm_AttrId attrId, UInt8 length, UInt8 *pValue);
+/* bulk access: per attribute results, read or written in file order */
+gpNvm_Result gpNvm_GetAttributes(int count, const gpNvm_AttrId *attrIds, const UInt8 *lengths, UInt8 **values, gpNvm_Result *results);
+gpNvm_Result gpNvm_SetAttributes(int count, const gpNvm_AttrId *attrIds, const UInt8 *lengths, UInt8 **values, gpNvm_Result *results);
+
+gpNvm_Result gpNvm_SetAttributeAsync(gpNvm_AttrId attrId, UInt8 length, UInt8 *pValue, gpNvm_Callback callback, void *arg);
+gpNvm_Result gpNvm_DeleteAttribute(gpNvm_AttrId attrId);
+
+/* zero copy read: the data stays valid until the attribute is written
+ * or deleted */
+gpNvm_Result gpNvm_GetAttributeView(gpNvm_AttrId attrId, const UInt8 **ppValue, UInt8 *pLength);
+gpNvm_Result gpNvm_GetAttributeLength(gpNvm_AttrId attrId, UInt8 *pLength);
+
+gpNvm_Result gpNvm_SubscribeAttribute(gpNvm_AttrId attrId, gpNvm_Notify notify, void *arg);
+gpNvm_Result gpNvm_UnsubscribeAttribute(gpNvm_AttrId attrId, gpNvm_Notify notify, void *arg);
+
+/* handle API: any number of stores side by side; where a handle is
+ * taken, NULL selects the store of the original API */
+gpNvm_Result gpNvm_Open(gpNvm_Handle **pHandle, const char *path, const gpNvm_Options *options);
+gpNvm_Result gpNvm_Close(gpNvm_Handle *handle);
+
+gpNvm_Result gpNvm_Get(gpNvm_Handle *handle, gpNvm_AttrId attrId, UInt8 *pLength, UInt8 *pValue);
+gpNvm_Result gpNvm_Set(gpNvm_Handle *handle, gpNvm_AttrId attrId, UInt8 length, UInt8 *pValue);
+gpNvm_Result gpNvm_GetView(gpNvm_Handle *handle, gpNvm_AttrId attrId, const UInt8 **ppValue, UInt8 *pLength);
+gpNvm_Result gpNvm_GetLength(gpNvm_Handle *handle, gpNvm_AttrId attrId, UInt8 *pLength);
+/* read a declared attribute at its fixed offset, see gpnvm_static.h */
+gpNvm_Result gpNvm_StaticGet(gpNvm_Handle *handle, gpNvm_AttrId attrId, UInt32 offset, UInt8 size, void *pValue);
+gpNvm_Result gpNvm_GetMany(gpNvm_Handle *handle, int count, const gpNvm_AttrId *attrIds, const UInt8 *lengths, UInt8 **values, gpNvm_Result *results);
+gpNvm_Result gpNvm_SetMany(gpNvm_Handle *handle, int count, const gpNvm_AttrId *attrIds, const UInt8 *lengths, UInt8 **values, gpNvm_Result *results);
+/* delete: the record becomes free space, reused before the file grows */
+gpNvm_Result gpNvm_Delete(gpNvm_Handle *handle, gpNvm_AttrId attrId);
+
+/* asynchronous write: queued, written in order by a worker thread */
+gpNvm_Result gpNvm_SetAsync(gpNvm_Handle *handle, gpNvm_AttrId attrId, UInt8 length, UInt8 *pValue, gpNvm_Callback callback, void *arg);
+gpNvm_Result gpNvm_Flush(gpNvm_Handle *handle);
+
+gpNvm_Result gpNvm_BeginBatch(gpNvm_Handle *handle);
+gpNvm_Result gpNvm_CommitBatch(gpNvm_Handle *handle);
+gpNvm_Result gpNvm_AbortBatch(gpNvm_Handle *handle);
+
+/* change notification: callbacks per attribute in this process, and a
+ * descriptor to wait on with poll or epoll for the writes of any process */
+gpNvm_Result gpNvm_Subscribe(gpNvm_Handle *handle, gpNvm_AttrId attrId, gpNvm_Notify notify, void *arg);
+gpNvm_Result gpNvm_Unsubscribe(gpNvm_Handle *handle, gpNvm_AttrId attrId, gpNvm_Notify notify, void *arg);
+gpNvm_Result gpNvm_GetNotifyFd(gpNvm_Handle *handle, int *pFd);
+gpNvm_Result gpNvm_ReadChanges(gpNvm_Handle *handle, gpNvm_AttrId *attrIds, int *pCount);
+
+gpNvm_Result gpNvm_Compact(gpNvm_Handle *handle);
+
+/* whole store snapshots, for provisioning and backup */
+gpNvm_Result gpNvm_ExportSnapshot(gpNvm_Handle *handle, const char *path);
+gpNvm_Result gpNvm_ImportSnapshot(gpNvm_Handle *handle, const char *path);
+
+gpNvm_Result gpNvm_Sync(gpNvm_Handle *handle);
+gpNvm_Result gpNvm_GetWriteCounters(gpNvm_Handle *handle, gpNvm_WriteCounters *counters);
+gpNvm_Result gpNvm_GetStats(gpNvm_Handle *handle, gpNvm_Stats *stats);
+gpNvm_Result gpNvm_ResetStats(gpNvm_Handle *handle);
 
 #endif /* __GPNVM_H_20180325__ */
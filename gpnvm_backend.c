@@ -0,0 +1,699 @@
+#define _GNU_SOURCE
+
+#include "gpnvm_backend.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+
+/** SECTION: gpnvm_backend
+ * @title: Storage backends
+ *
+ * The storage a store reads and writes its records from, behind the
+ * gpNvm_Backend functions: a file, accessed with pread/pwrite or memory
+ * mapped, and a buffer in memory for stores that need not outlive the
+ * process.
+ */
+
+/* the mapped file grows in steps of this many bytes */
+#ifndef GPNVM_MAP_STEP
+#define GPNVM_MAP_STEP (64 * 1024)
+#endif
+
+/* address space reserved for the mapping or the memory buffer, the
+ * storage can not grow beyond */
+#ifndef GPNVM_MAP_RESERVE
+#define GPNVM_MAP_RESERVE (64 * 1024 * 1024)
+#endif
+
+/**
+ * gpNvm_File:
+ *
+ * Context of the file backend.
+ */
+typedef struct {
+	/* file descriptor and name, the name to swap in a new image */
+	int fd;
+	char *path;
+
+	/* memory mapped mode: base of the reserved range, NULL in file mode */
+	UInt8 *map;
+	/* number of bytes of the file that are mapped, the file size */
+	long mapSize;
+	/* file size at open, the file is never truncated below it */
+	long openSize;
+	/* non zero if open created the file, until its directory entry is
+	 * made durable */
+	int created;
+} gpNvm_File;
+
+/**
+ * gpNvm_Memory:
+ *
+ * Context of the memory backend.
+ */
+typedef struct {
+	/* base of the reserved range, pages are only backed once written */
+	UInt8 *data;
+	long size;
+} gpNvm_Memory;
+
+/**
+ * gpNvm_FileGrow:
+ * @f: file backend context
+ * @size: new size of the file, larger than the mapped size
+ *
+ * Extend the file with its blocks allocated. A sparse file would take
+ * a full disk as a SIGBUS on the first store into the mapping, so the
+ * write fails here instead; ftruncate is only the fallback of file
+ * systems that can not allocate.
+ *
+ * Returns: 0 if success
+ */
+static int gpNvm_FileGrow(gpNvm_File *f, long size)
+{
+	int err = posix_fallocate(f->fd, f->mapSize, size - f->mapSize);
+
+	if (err == EOPNOTSUPP)
+		err = ftruncate(f->fd, size) != 0;
+	if (!err)
+		return 0;
+	/* the emulation of posix_fallocate may have grown the file part way */
+	err = ftruncate(f->fd, f->mapSize);
+	return 1;
+}
+
+/**
+ * gpNvm_FileMap:
+ * @f: file backend context
+ * @size: new size of the file
+ *
+ * Grow the file and map it at the start of the reserved range. The
+ * base address never moves, so pointers into the image stay stable as
+ * the file grows.
+ *
+ * Returns: 0 if success
+ */
+static int gpNvm_FileMap(gpNvm_File *f, long size)
+{
+	if (size > GPNVM_MAP_RESERVE)
+		return 1;
+	if (size > f->mapSize && gpNvm_FileGrow(f, size))
+		return 1;
+	if (size && mmap(f->map, size, PROT_READ | PROT_WRITE,
+			MAP_SHARED | MAP_FIXED, f->fd, 0) == MAP_FAILED)
+		return 1;
+
+	f->mapSize = size;
+	return 0;
+}
+
+/**
+ * gpNvm_FileMapOpen:
+ * @f: file backend context
+ *
+ * Reserve the address range and map the file as it is on disk.
+ *
+ * Returns: 0 if success
+ */
+static int gpNvm_FileMapOpen(gpNvm_File *f)
+{
+	struct stat st;
+	void *base;
+
+	if (fstat(f->fd, &st) != 0 || st.st_size > GPNVM_MAP_RESERVE)
+		return 1;
+
+	base = mmap(NULL, GPNVM_MAP_RESERVE, PROT_NONE,
+			MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+	if (base == MAP_FAILED)
+		return 1;
+
+	f->map = base;
+	f->mapSize = f->openSize = st.st_size;
+	if (gpNvm_FileMap(f, f->mapSize)) {
+		munmap(f->map, GPNVM_MAP_RESERVE);
+		f->map = NULL;
+		return 1;
+	}
+	return 0;
+}
+
+/**
+ * gpNvm_FileMapClose:
+ * @f: file backend context
+ * @keep: bytes in use
+ *
+ * Drop the mapping and trim the growth padding, keeping whatever was in
+ * the file when it was opened.
+ *
+ * Returns: 0 if success
+ */
+static int gpNvm_FileMapClose(gpNvm_File *f, long keep)
+{
+	long size = keep > f->openSize ? keep : f->openSize;
+	int ret = 0;
+
+	if (f->mapSize && msync(f->map, f->mapSize, MS_SYNC) != 0)
+		ret = 1;
+	if (munmap(f->map, GPNVM_MAP_RESERVE) != 0)
+		ret = 1;
+	if (size < f->mapSize && ftruncate(f->fd, size) != 0)
+		ret = 1;
+
+	f->map = NULL;
+	f->mapSize = f->openSize = 0;
+	return ret;
+}
+
+/**
+ * gpNvm_FileOpen:
+ * @path: file to open, created if not present
+ * @flags: open flags, %GPNVM_OPEN_MMAP maps the file
+ * @arg: not used
+ *
+ * Returns: the context, NULL on failure
+ */
+static void *gpNvm_FileOpen(const char *path, UInt32 flags, void *arg)
+{
+	gpNvm_File *f;
+
+	if (!path)
+		return NULL;
+
+	f = calloc(1, sizeof *f);
+	if (!f)
+		return NULL;
+	f->path = strdup(path);
+	if (!f->path)
+		goto fail;
+
+	f->fd = open(f->path, O_RDWR);
+	if (f->fd < 0 && errno == ENOENT) {
+		f->fd = open(f->path, O_RDWR | O_CREAT, 0666);
+		f->created = 1;
+	}
+	if (f->fd < 0)
+		goto fail;
+	if ((flags & GPNVM_OPEN_MMAP) && gpNvm_FileMapOpen(f)) {
+		close(f->fd);
+		goto fail;
+	}
+	return f;
+
+fail:
+	free(f->path);
+	free(f);
+	return NULL;
+}
+
+/**
+ * gpNvm_FileClose:
+ * @ctx: file backend context
+ * @keep: bytes in use
+ *
+ * Returns: 0 if success
+ */
+static int gpNvm_FileClose(void *ctx, long keep)
+{
+	gpNvm_File *f = ctx;
+	int ret;
+
+	ret = f->map ? gpNvm_FileMapClose(f, keep) : 0;
+	ret |= !!close(f->fd);
+	free(f->path);
+	free(f);
+	return ret;
+}
+
+/**
+ * gpNvm_FileReadAt:
+ * @ctx: file backend context
+ * @offset: file offset to read from
+ * @ptr: location to read
+ * @len: length to read
+ *
+ * Copy out of the mapping, or pread in file mode. pread does not move
+ * a shared file position, so readers on several threads do not disturb
+ * each other.
+ *
+ * Returns: 0 if all bytes are read
+ */
+static int gpNvm_FileReadAt(void *ctx, long offset, void *ptr, int len)
+{
+	gpNvm_File *f = ctx;
+
+	if (f->map) {
+		if (offset + len > f->mapSize)
+			return 1;
+		memcpy(ptr, f->map + offset, len);
+		return 0;
+	}
+
+	while (len > 0) {
+		ssize_t n = pread(f->fd, ptr, len, offset);
+
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n <= 0)
+			return 1;
+		ptr = (UInt8 *)ptr + n;
+		offset += n;
+		len -= n;
+	}
+	return 0;
+}
+
+/**
+ * gpNvm_FileWriteAt:
+ * @ctx: file backend context
+ * @offset: file offset to write to
+ * @ptr: location to the byte array to write
+ * @len: number of bytes to write
+ *
+ * Copy into the mapping, growing the file by whole steps when the write
+ * goes past its end, or pwrite in file mode.
+ *
+ * Returns: 0 if all bytes are written
+ */
+static int gpNvm_FileWriteAt(void *ctx, long offset, const void *ptr, int len)
+{
+	gpNvm_File *f = ctx;
+
+	if (f->map) {
+		long size = f->mapSize;
+
+		while (size < offset + len)
+			size += GPNVM_MAP_STEP - size % GPNVM_MAP_STEP;
+		if (size != f->mapSize && gpNvm_FileMap(f, size))
+			return 1;
+		memcpy(f->map + offset, ptr, len);
+		return 0;
+	}
+
+	while (len > 0) {
+		ssize_t n = pwrite(f->fd, ptr, len, offset);
+
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n <= 0)
+			return 1;
+		ptr = (const UInt8 *)ptr + n;
+		offset += n;
+		len -= n;
+	}
+	return 0;
+}
+
+/**
+ * gpNvm_FileSync:
+ * @ctx: file backend context
+ * @offset: file offset of the written range
+ * @len: length of the written range
+ *
+ * msync the pages the range covers. In file mode pwrite already handed
+ * the data to the kernel, nothing is left to do.
+ *
+ * Returns: 0 if success
+ */
+static int gpNvm_FileSync(void *ctx, long offset, long len)
+{
+	gpNvm_File *f = ctx;
+	long page, start;
+
+	if (!f->map)
+		return 0;
+
+	page = sysconf(_SC_PAGESIZE);
+	start = offset - offset % page;
+	return msync(f->map + start, offset + len - start, MS_SYNC) != 0;
+}
+
+/**
+ * gpNvm_FileSize:
+ * @ctx: file backend context
+ *
+ * Returns: size of the file, or of the mapping with its growth padding
+ */
+static long gpNvm_FileSize(void *ctx)
+{
+	gpNvm_File *f = ctx;
+	struct stat st;
+
+	if (f->map)
+		return f->mapSize;
+
+	return fstat(f->fd, &st) == 0 ? st.st_size : 0;
+}
+
+/**
+ * gpNvm_FileErase:
+ * @ctx: file backend context
+ * @offset: file offset of the range
+ * @len: length of the range
+ *
+ * Overwrite the part of the range within the file with zeros.
+ *
+ * Returns: 0 if success
+ */
+static int gpNvm_FileErase(void *ctx, long offset, long len)
+{
+	static const UInt8 zero[512];
+	long size = gpNvm_FileSize(ctx);
+
+	if (offset + len > size)
+		len = size - offset;
+
+	while (len > 0) {
+		int n = len < sizeof zero ? len : sizeof zero;
+
+		if (gpNvm_FileWriteAt(ctx, offset, zero, n))
+			return 1;
+		offset += n;
+		len -= n;
+	}
+	return 0;
+}
+
+/**
+ * gpNvm_SyncDir:
+ * @path: file in the directory to sync
+ *
+ * Make a rename in the directory of @path durable.
+ *
+ * Returns: 0 if success
+ */
+static int gpNvm_SyncDir(const char *path)
+{
+	const char *slash = strrchr(path, '/');
+	char *dir = slash ? strndup(path, slash - path + 1) : strdup(".");
+	int fd, ret = 1;
+
+	if (!dir)
+		return 1;
+	fd = open(dir, O_RDONLY);
+	if (fd >= 0) {
+		ret = fsync(fd) != 0;
+		close(fd);
+	}
+	free(dir);
+	return ret;
+}
+
+/**
+ * gpNvm_FileReplace:
+ * @ctx: file backend context
+ * @image: new contents of the file
+ * @size: size of @image
+ *
+ * Write the image to a fresh file and swap it in with a rename. The new
+ * file is opened, and mapped if the old one was, before the rename, so
+ * that nothing can fail after it.
+ *
+ * Returns: 0 if success
+ */
+static int gpNvm_FileReplace(void *ctx, const void *image, long size)
+{
+	gpNvm_File *f = ctx, next = *f;
+	char *tmp;
+	int ret = 1;
+
+	tmp = malloc(strlen(f->path) + sizeof ".compact");
+	if (!tmp)
+		return 1;
+	sprintf(tmp, "%s.compact", f->path);
+
+	next.fd = open(tmp, O_RDWR | O_CREAT | O_TRUNC, 0666);
+	next.map = NULL;
+	if (next.fd < 0)
+		goto out;
+	if (gpNvm_FileWriteAt(&next, 0, image, size) || fsync(next.fd) ||
+	    (f->map && gpNvm_FileMapOpen(&next))) {
+		close(next.fd);
+		unlink(tmp);
+		goto out;
+	}
+	if (rename(tmp, f->path)) {
+		if (next.map)
+			munmap(next.map, GPNVM_MAP_RESERVE);
+		close(next.fd);
+		unlink(tmp);
+		goto out;
+	}
+	/* a failed directory sync is tried again by the next full persist */
+	next.created = gpNvm_SyncDir(f->path);
+
+	if (f->map)
+		munmap(f->map, GPNVM_MAP_RESERVE);
+	close(f->fd);
+	*f = next;
+	ret = 0;
+out:
+	free(tmp);
+	return ret;
+}
+
+/**
+ * gpNvm_FileImage:
+ * @ctx: file backend context
+ *
+ * Returns: the mapping, NULL in file mode
+ */
+static UInt8 *gpNvm_FileImage(void *ctx)
+{
+	return ((gpNvm_File *)ctx)->map;
+}
+
+/**
+ * gpNvm_FilePersist:
+ * @ctx: file backend context
+ * @full: also make the metadata and the directory entry durable
+ *
+ * fdatasync the file, or fsync it; the first full persist after the file
+ * was created syncs its directory too, later ones have no entry to sync.
+ * Both work for the mapping as well, its pages are shared with the file.
+ *
+ * Returns: 0 if success
+ */
+static int gpNvm_FilePersist(void *ctx, int full)
+{
+	gpNvm_File *f = ctx;
+
+	if (!full)
+		return fdatasync(f->fd) != 0;
+	if (fsync(f->fd) != 0)
+		return 1;
+	if (f->created && gpNvm_SyncDir(f->path))
+		return 1;
+	f->created = 0;
+	return 0;
+}
+
+const gpNvm_Backend gpNvm_FileBackend = {
+	gpNvm_FileOpen,
+	gpNvm_FileClose,
+	gpNvm_FileReadAt,
+	gpNvm_FileWriteAt,
+	gpNvm_FileSync,
+	gpNvm_FileSize,
+	gpNvm_FileErase,
+	gpNvm_FileReplace,
+	gpNvm_FileImage,
+	gpNvm_FilePersist,
+};
+
+/**
+ * gpNvm_MemoryOpen:
+ * @path: not used
+ * @flags: not used
+ * @arg: not used
+ *
+ * Reserve the address range of the buffer, so it never moves.
+ *
+ * Returns: the context, NULL on failure
+ */
+static void *gpNvm_MemoryOpen(const char *path, UInt32 flags, void *arg)
+{
+	gpNvm_Memory *m = calloc(1, sizeof *m);
+	void *base;
+
+	if (!m)
+		return NULL;
+
+	base = mmap(NULL, GPNVM_MAP_RESERVE, PROT_READ | PROT_WRITE,
+			MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+	if (base == MAP_FAILED) {
+		free(m);
+		return NULL;
+	}
+	m->data = base;
+	return m;
+}
+
+/**
+ * gpNvm_MemoryClose:
+ * @ctx: memory backend context
+ * @keep: not used, the contents go
+ *
+ * Returns: 0 if success
+ */
+static int gpNvm_MemoryClose(void *ctx, long keep)
+{
+	gpNvm_Memory *m = ctx;
+	int ret;
+
+	ret = munmap(m->data, GPNVM_MAP_RESERVE) != 0;
+	free(m);
+	return ret;
+}
+
+/**
+ * gpNvm_MemoryReadAt:
+ * @ctx: memory backend context
+ * @offset: offset to read from
+ * @ptr: location to read
+ * @len: length to read
+ *
+ * Returns: 0 if all bytes are read
+ */
+static int gpNvm_MemoryReadAt(void *ctx, long offset, void *ptr, int len)
+{
+	gpNvm_Memory *m = ctx;
+
+	if (offset + len > m->size)
+		return 1;
+	memcpy(ptr, m->data + offset, len);
+	return 0;
+}
+
+/**
+ * gpNvm_MemoryWriteAt:
+ * @ctx: memory backend context
+ * @offset: offset to write to
+ * @ptr: location to the byte array to write
+ * @len: number of bytes to write
+ *
+ * Returns: 0 if all bytes are written
+ */
+static int gpNvm_MemoryWriteAt(void *ctx, long offset, const void *ptr, int len)
+{
+	gpNvm_Memory *m = ctx;
+
+	if (offset + len > GPNVM_MAP_RESERVE)
+		return 1;
+	memcpy(m->data + offset, ptr, len);
+	if (offset + len > m->size)
+		m->size = offset + len;
+	return 0;
+}
+
+/**
+ * gpNvm_MemorySync:
+ * @ctx: memory backend context
+ * @offset: offset of the written range
+ * @len: length of the written range
+ *
+ * Returns: 0, there is nothing to push
+ */
+static int gpNvm_MemorySync(void *ctx, long offset, long len)
+{
+	return 0;
+}
+
+/**
+ * gpNvm_MemorySize:
+ * @ctx: memory backend context
+ *
+ * Returns: size of the buffer in use
+ */
+static long gpNvm_MemorySize(void *ctx)
+{
+	return ((gpNvm_Memory *)ctx)->size;
+}
+
+/**
+ * gpNvm_MemoryPersist:
+ * @ctx: memory backend context
+ * @full: not used
+ *
+ * Returns: 0, the buffer is as durable as it gets
+ */
+static int gpNvm_MemoryPersist(void *ctx, int full)
+{
+	return 0;
+}
+
+/**
+ * gpNvm_MemoryErase:
+ * @ctx: memory backend context
+ * @offset: offset of the range
+ * @len: length of the range
+ *
+ * Returns: 0 if success
+ */
+static int gpNvm_MemoryErase(void *ctx, long offset, long len)
+{
+	gpNvm_Memory *m = ctx;
+
+	if (offset + len > m->size)
+		len = m->size - offset;
+	if (len > 0)
+		memset(m->data + offset, 0, len);
+	return 0;
+}
+
+/**
+ * gpNvm_MemoryReplace:
+ * @ctx: memory backend context
+ * @image: new contents of the buffer
+ * @size: size of @image
+ *
+ * Copy the image over the buffer and hand the pages it no longer needs
+ * back to the system.
+ *
+ * Returns: 0 if success
+ */
+static int gpNvm_MemoryReplace(void *ctx, const void *image, long size)
+{
+	gpNvm_Memory *m = ctx;
+	long page = sysconf(_SC_PAGESIZE);
+	long used = (size + page - 1) / page * page;
+
+	if (size > GPNVM_MAP_RESERVE)
+		return 1;
+	memcpy(m->data, image, size);
+	memset(m->data + size, 0, used - size);
+	if (m->size > used)
+		madvise(m->data + used, m->size - used, MADV_DONTNEED);
+	m->size = size;
+	return 0;
+}
+
+/**
+ * gpNvm_MemoryImage:
+ * @ctx: memory backend context
+ *
+ * Returns: the buffer
+ */
+static UInt8 *gpNvm_MemoryImage(void *ctx)
+{
+	return ((gpNvm_Memory *)ctx)->data;
+}
+
+const gpNvm_Backend gpNvm_MemoryBackend = {
+	gpNvm_MemoryOpen,
+	gpNvm_MemoryClose,
+	gpNvm_MemoryReadAt,
+	gpNvm_MemoryWriteAt,
+	gpNvm_MemorySync,
+	gpNvm_MemorySize,
+	gpNvm_MemoryErase,
+	gpNvm_MemoryReplace,
+	gpNvm_MemoryImage,
+	gpNvm_MemoryPersist,
+};
@@ -0,0 +1,94 @@
+#ifndef __GPNVM_BACKEND_H_20180325__
+#define __GPNVM_BACKEND_H_20180325__
+
+#include "gpnvm.h"
+
+/**
+ * gpNvm_Backend:
+ * @open: attach the storage named @path, with the GPNVM_OPEN_* @flags of
+ * the store and @arg, the backendArg of its options; returns the context
+ * passed to the other functions, NULL on failure
+ * @close: detach the storage, keeping at least @keep bytes of it
+ * @readAt: read @len bytes at @offset, all or fail
+ * @writeAt: write @len bytes at @offset, all or fail; writing past the
+ * end grows the storage
+ * @sync: push a written range to storage
+ * @size: returns the size of the storage in bytes
+ * @erase: wipe a range, it reads back as all zeros, or all 0xff on flash
+ * @replace: swap in a new image of @size bytes as a whole; a failure
+ * leaves the old image in place
+ * @image: returns the contents of the storage in memory, NULL if they
+ * are not addressable. The address must not change while the storage
+ * is attached, other than by @replace.
+ * @persist: make everything written so far durable: the data, and with
+ * @full set the metadata and the directory entry of the storage as well
+ *
+ * Storage the records of a store live in, set in the options of
+ * gpNvm_Open(). All functions but @size and @image return 0 if success.
+ * Reads, and writes that do not grow the storage, may run in parallel on
+ * distinct ranges; @persist may run in parallel with both. Everything
+ * else is called with the store locked exclusive.
+ */
+struct gpNvm_Backend {
+	void *(*open)(const char *path, UInt32 flags, void *arg);
+	int (*close)(void *ctx, long keep);
+	int (*readAt)(void *ctx, long offset, void *ptr, int len);
+	int (*writeAt)(void *ctx, long offset, const void *ptr, int len);
+	int (*sync)(void *ctx, long offset, long len);
+	long (*size)(void *ctx);
+	int (*erase)(void *ctx, long offset, long len);
+	int (*replace)(void *ctx, const void *image, long size);
+	UInt8 *(*image)(void *ctx);
+	int (*persist)(void *ctx, int full);
+};
+
+/* a file, read and written with pread/pwrite or, with %GPNVM_OPEN_MMAP,
+ * memory mapped; the default */
+extern const gpNvm_Backend gpNvm_FileBackend;
+
+/* a buffer in memory, the path is not used and the contents go at close */
+extern const gpNvm_Backend gpNvm_MemoryBackend;
+
+/* simulated NOR flash, the path is not used and the backendArg of the
+ * options is the gpNvm_Flash device; the contents live as long as it */
+extern const gpNvm_Backend gpNvm_FlashBackend;
+
+typedef struct gpNvm_Flash gpNvm_Flash;
+
+/* geometry and timing of a simulated flash device; zero sizes take the
+ * defaults, a typical 256 KiB SPI NOR part */
+typedef struct {
+	/* bytes per erase sector, 4096 default */
+	UInt32 sectorSize;
+	/* number of sectors, 64 default */
+	UInt32 sectors;
+	/* bytes per program operation, 256 default */
+	UInt32 pageSize;
+	/* modelled time of a sector erase and of a page program */
+	UInt32 eraseUs;
+	UInt32 programUs;
+	/* non zero to really take the modelled time, so timings show it */
+	int delay;
+} gpNvm_FlashConfig;
+
+/* counted per device since it was created */
+typedef struct {
+	/* bytes the store asked to write */
+	unsigned long written;
+	/* bytes programmed for them, including data moved by erases */
+	unsigned long programmed;
+	/* program operations, one per page */
+	unsigned long pages;
+	/* sector erases, and those of the most erased sector */
+	unsigned long erases;
+	unsigned long maxErases;
+	/* modelled time spent erasing and programming */
+	unsigned long busyUs;
+} gpNvm_FlashStats;
+
+gpNvm_Result gpNvm_FlashCreate(gpNvm_Flash **pFlash, const gpNvm_FlashConfig *config);
+void gpNvm_FlashDestroy(gpNvm_Flash *flash);
+gpNvm_Result gpNvm_FlashGetStats(gpNvm_Flash *flash, gpNvm_FlashStats *stats);
+unsigned long gpNvm_FlashEraseCount(gpNvm_Flash *flash, UInt32 sector);
+
+#endif /* __GPNVM_BACKEND_H_20180325__ */
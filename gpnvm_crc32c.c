@@ -0,0 +1,202 @@
+#include "gpnvm_crc32c.h"
+
+#include <string.h>
+#include <pthread.h>
+
+#if defined(__x86_64__)
+#include <nmmintrin.h>
+#endif
+
+/** SECTION: gpnvm_crc32c
+ * @title: CRC32C (Castagnoli)
+ *
+ * Integrity check of the records. The reflected polynomial 0x82f63b78 is
+ * the one of the SSE4.2 crc32 instruction, so the check is computed in
+ * hardware where the CPU has it and with slice-by-8 tables otherwise;
+ * both give the same result. All functions take the CRC of the preceding
+ * data, 0 to start, so a CRC can be computed in pieces.
+ */
+
+#define GPNVM_CRC32C_POLY 0x82f63b78
+
+/* slice-by-8 tables, table[0] is the plain byte wise table */
+static UInt32 gpNvm_crc32cTable[8][256];
+
+static UInt32 gpNvm_Crc32cResolve(UInt32 crc, const void *data, unsigned long length);
+
+/* implementation in use, picked on the first call */
+static UInt32 (*gpNvm_crc32cImpl)(UInt32, const void *, unsigned long) = gpNvm_Crc32cResolve;
+
+/* guards the one time set up of the tables and of the implementation */
+static pthread_once_t gpNvm_crc32cTableOnce = PTHREAD_ONCE_INIT;
+static pthread_once_t gpNvm_crc32cImplOnce = PTHREAD_ONCE_INIT;
+
+/**
+ * gpNvm_Crc32cFill:
+ *
+ * Fill the slice-by-8 tables.
+ */
+static void gpNvm_Crc32cFill(void)
+{
+	UInt32 crc;
+	int i, j;
+
+	for (i = 0; i != 256; i++) {
+		crc = i;
+		for (j = 0; j != 8; j++)
+			crc = crc & 1 ? (crc >> 1) ^ GPNVM_CRC32C_POLY : crc >> 1;
+		gpNvm_crc32cTable[0][i] = crc;
+	}
+	for (i = 0; i != 256; i++)
+		for (j = 1; j != 8; j++)
+			gpNvm_crc32cTable[j][i] = (gpNvm_crc32cTable[j - 1][i] >> 8) ^
+				gpNvm_crc32cTable[0][gpNvm_crc32cTable[j - 1][i] & 0xff];
+}
+
+/**
+ * gpNvm_Crc32cInit:
+ *
+ * Fill the slice-by-8 tables once; concurrent first calls wait until the
+ * tables are complete.
+ */
+static void gpNvm_Crc32cInit(void)
+{
+	pthread_once(&gpNvm_crc32cTableOnce, gpNvm_Crc32cFill);
+}
+
+/**
+ * gpNvm_Crc32cSlice8:
+ * @crc: CRC of the preceding data, 0 to start
+ * @data: data to compute the CRC on
+ * @length: number of bytes
+ *
+ * Table driven CRC32C, eight bytes per step on little endian hosts.
+ *
+ * Returns: CRC32C of the preceding data and @data
+ */
+UInt32 gpNvm_Crc32cSlice8(UInt32 crc, const void *data, unsigned long length)
+{
+	const UInt8 *p = data;
+	UInt32 lo, hi;
+
+	gpNvm_Crc32cInit();
+	crc = ~crc;
+
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+	for (; length >= 8; p += 8, length -= 8) {
+		memcpy(&lo, p, sizeof lo);
+		memcpy(&hi, p + 4, sizeof hi);
+		lo ^= crc;
+		crc = gpNvm_crc32cTable[7][lo & 0xff] ^
+			gpNvm_crc32cTable[6][(lo >> 8) & 0xff] ^
+			gpNvm_crc32cTable[5][(lo >> 16) & 0xff] ^
+			gpNvm_crc32cTable[4][lo >> 24] ^
+			gpNvm_crc32cTable[3][hi & 0xff] ^
+			gpNvm_crc32cTable[2][(hi >> 8) & 0xff] ^
+			gpNvm_crc32cTable[1][(hi >> 16) & 0xff] ^
+			gpNvm_crc32cTable[0][hi >> 24];
+	}
+#endif
+
+	while (length--)
+		crc = (crc >> 8) ^ gpNvm_crc32cTable[0][(crc ^ *p++) & 0xff];
+
+	return ~crc;
+}
+
+#if defined(__x86_64__)
+/**
+ * gpNvm_Crc32cSse42:
+ * @crc: CRC of the preceding data, 0 to start
+ * @data: data to compute the CRC on
+ * @length: number of bytes
+ *
+ * CRC32C with the SSE4.2 crc32 instruction, eight bytes per step once
+ * the data is aligned. Only call it if gpNvm_Crc32cHardware() says so.
+ *
+ * Returns: CRC32C of the preceding data and @data
+ */
+__attribute__((target("sse4.2")))
+UInt32 gpNvm_Crc32cSse42(UInt32 crc, const void *data, unsigned long length)
+{
+	const UInt8 *p = data;
+	unsigned long long crc64, word;
+
+	crc = ~crc;
+	for (; length && ((unsigned long)p & 7); length--)
+		crc = _mm_crc32_u8(crc, *p++);
+
+	crc64 = crc;
+	for (; length >= 8; p += 8, length -= 8) {
+		memcpy(&word, p, sizeof word);
+		crc64 = _mm_crc32_u64(crc64, word);
+	}
+	crc = crc64;
+
+	while (length--)
+		crc = _mm_crc32_u8(crc, *p++);
+
+	return ~crc;
+}
+
+/**
+ * gpNvm_Crc32cHardware:
+ *
+ * Returns: non zero if the CPU has the SSE4.2 crc32 instruction
+ */
+int gpNvm_Crc32cHardware(void)
+{
+	return __builtin_cpu_supports("sse4.2");
+}
+#else
+UInt32 gpNvm_Crc32cSse42(UInt32 crc, const void *data, unsigned long length)
+{
+	return gpNvm_Crc32cSlice8(crc, data, length);
+}
+
+int gpNvm_Crc32cHardware(void)
+{
+	return 0;
+}
+#endif
+
+/**
+ * gpNvm_Crc32cPick:
+ *
+ * Select the implementation for this CPU.
+ */
+static void gpNvm_Crc32cPick(void)
+{
+	__atomic_store_n(&gpNvm_crc32cImpl,
+		gpNvm_Crc32cHardware() ? gpNvm_Crc32cSse42 : gpNvm_Crc32cSlice8, __ATOMIC_RELEASE);
+}
+
+/**
+ * gpNvm_Crc32cResolve:
+ * @crc: CRC of the preceding data, 0 to start
+ * @data: data to compute the CRC on
+ * @length: number of bytes
+ *
+ * First call: pick the implementation for this CPU and hand over to it.
+ *
+ * Returns: CRC32C of the preceding data and @data
+ */
+static UInt32 gpNvm_Crc32cResolve(UInt32 crc, const void *data, unsigned long length)
+{
+	pthread_once(&gpNvm_crc32cImplOnce, gpNvm_Crc32cPick);
+	return gpNvm_crc32cImpl(crc, data, length);
+}
+
+/**
+ * gpNvm_Crc32c:
+ * @crc: CRC of the preceding data, 0 to start
+ * @data: data to compute the CRC on
+ * @length: number of bytes
+ *
+ * Returns: CRC32C of the preceding data and @data, computed the fastest
+ * way this CPU allows
+ */
+UInt32 gpNvm_Crc32c(UInt32 crc, const void *data, unsigned long length)
+{
+	return __atomic_load_n(&gpNvm_crc32cImpl, __ATOMIC_ACQUIRE)(crc, data, length);
+}
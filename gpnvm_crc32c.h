@@ -0,0 +1,12 @@
+#ifndef __GPNVM_CRC32C_H_20180325__
+#define __GPNVM_CRC32C_H_20180325__
+
+#include "gpnvm.h"
+
+UInt32 gpNvm_Crc32c(UInt32 crc, const void *data, unsigned long length);
+
+UInt32 gpNvm_Crc32cSlice8(UInt32 crc, const void *data, unsigned long length);
+UInt32 gpNvm_Crc32cSse42(UInt32 crc, const void *data, unsigned long length);
+int gpNvm_Crc32cHardware(void);
+
+#endif /* __GPNVM_CRC32C_H_20180325__ */
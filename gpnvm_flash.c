@@ -0,0 +1,451 @@
+#include "gpnvm_backend.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <time.h>
+
+/** SECTION: gpnvm_flash
+ * @title: Simulated NOR flash
+ *
+ * A backend that behaves like NOR flash, to see what a layout and a
+ * flush policy cost on a device before it goes on one. Erased flash
+ * reads 0xff and programming can only turn bits from 1 to 0; turning one
+ * back needs its whole sector erased, and whatever else the sector held
+ * programmed again. Every erase and program is counted, per sector for
+ * the erases to show the wear, and timed with the latencies configured.
+ *
+ * Bytes that do not change keep their value through an erase of their
+ * sector, so readers of other records in the sector never see it blank.
+ */
+
+#define GPNVM_FLASH_ERASED 0xff
+
+/* default geometry and timing, a typical SPI NOR part */
+#define GPNVM_FLASH_SECTOR_SIZE 4096
+#define GPNVM_FLASH_SECTORS 64
+#define GPNVM_FLASH_PAGE_SIZE 256
+#define GPNVM_FLASH_ERASE_US 45000
+#define GPNVM_FLASH_PROGRAM_US 700
+
+/**
+ * gpNvm_Flash:
+ *
+ * A simulated device, it outlives the stores opened on it.
+ */
+struct gpNvm_Flash {
+	gpNvm_FlashConfig config;
+
+	/* contents, sectors * sectorSize bytes */
+	UInt8 *data;
+	/* end of the programmed range, the size the store sees */
+	long used;
+
+	/* erases per sector */
+	unsigned long *erases;
+	gpNvm_FlashStats stats;
+
+	/* programs and erases are one at a time, like on the device */
+	pthread_mutex_t mutex;
+};
+
+/**
+ * gpNvm_FlashCreate:
+ * @pFlash: returns the device
+ * @config: geometry and timing, NULL for the defaults
+ *
+ * Create an erased device.
+ *
+ * Returns: 0 if success
+ */
+gpNvm_Result gpNvm_FlashCreate(gpNvm_Flash **pFlash, const gpNvm_FlashConfig *config)
+{
+	gpNvm_Flash *flash;
+	long size;
+
+	if (!pFlash)
+		return 1;
+
+	flash = calloc(1, sizeof *flash);
+	if (!flash)
+		return 1;
+	if (config) {
+		flash->config = *config;
+	} else {
+		flash->config.eraseUs = GPNVM_FLASH_ERASE_US;
+		flash->config.programUs = GPNVM_FLASH_PROGRAM_US;
+	}
+	if (!flash->config.sectorSize)
+		flash->config.sectorSize = GPNVM_FLASH_SECTOR_SIZE;
+	if (!flash->config.sectors)
+		flash->config.sectors = GPNVM_FLASH_SECTORS;
+	if (!flash->config.pageSize || flash->config.sectorSize % flash->config.pageSize)
+		flash->config.pageSize = flash->config.sectorSize < GPNVM_FLASH_PAGE_SIZE ?
+			flash->config.sectorSize : GPNVM_FLASH_PAGE_SIZE;
+
+	size = (long)flash->config.sectors * flash->config.sectorSize;
+	flash->data = malloc(size);
+	flash->erases = calloc(flash->config.sectors, sizeof *flash->erases);
+	if (!flash->data || !flash->erases) {
+		free(flash->data);
+		free(flash->erases);
+		free(flash);
+		return 1;
+	}
+	memset(flash->data, GPNVM_FLASH_ERASED, size);
+	pthread_mutex_init(&flash->mutex, NULL);
+
+	*pFlash = flash;
+	return 0;
+}
+
+/**
+ * gpNvm_FlashDestroy:
+ * @flash: device, no store may be open on it
+ */
+void gpNvm_FlashDestroy(gpNvm_Flash *flash)
+{
+	if (!flash)
+		return;
+
+	pthread_mutex_destroy(&flash->mutex);
+	free(flash->erases);
+	free(flash->data);
+	free(flash);
+}
+
+/**
+ * gpNvm_FlashGetStats:
+ * @flash: device
+ * @stats: returns the statistics
+ *
+ * Returns: 0 if success
+ */
+gpNvm_Result gpNvm_FlashGetStats(gpNvm_Flash *flash, gpNvm_FlashStats *stats)
+{
+	if (!flash || !stats)
+		return 1;
+
+	pthread_mutex_lock(&flash->mutex);
+	*stats = flash->stats;
+	pthread_mutex_unlock(&flash->mutex);
+	return 0;
+}
+
+/**
+ * gpNvm_FlashEraseCount:
+ * @flash: device
+ * @sector: sector number
+ *
+ * Returns: number of times @sector was erased
+ */
+unsigned long gpNvm_FlashEraseCount(gpNvm_Flash *flash, UInt32 sector)
+{
+	unsigned long erases;
+
+	if (!flash || sector >= flash->config.sectors)
+		return 0;
+
+	pthread_mutex_lock(&flash->mutex);
+	erases = flash->erases[sector];
+	pthread_mutex_unlock(&flash->mutex);
+	return erases;
+}
+
+/**
+ * gpNvm_FlashProgram:
+ * @flash: device
+ * @offset: start of the range
+ * @image: bytes the range holds after programming
+ * @len: length of the range, within one sector
+ *
+ * Account for programming a range: every page with a byte to program is
+ * one program operation. Bytes left erased need no programming.
+ *
+ * Returns: modelled time in microseconds
+ */
+static unsigned long gpNvm_FlashProgram(gpNvm_Flash *flash, long offset, const UInt8 *image, long len)
+{
+	long page = flash->config.pageSize, i, pages = 0, last = -1;
+
+	for (i = 0; i != len; i++) {
+		if (image[i] == GPNVM_FLASH_ERASED)
+			continue;
+		flash->stats.programmed++;
+		if ((offset + i) / page != last) {
+			last = (offset + i) / page;
+			pages++;
+		}
+	}
+	flash->stats.pages += pages;
+	return pages * flash->config.programUs;
+}
+
+/**
+ * gpNvm_FlashSector:
+ * @flash: device
+ * @offset: start of the range
+ * @ptr: new contents of the range
+ * @len: length of the range, within one sector
+ *
+ * Bring a range to the new contents. Where that takes a bit from 0 to 1
+ * the sector is erased, and its old contents outside the range are
+ * programmed again along with the range.
+ *
+ * Returns: modelled time in microseconds
+ */
+static unsigned long gpNvm_FlashSector(gpNvm_Flash *flash, long offset, const UInt8 *ptr, long len)
+{
+	long size = flash->config.sectorSize;
+	long sector = offset / size, start = sector * size;
+	UInt8 *old = flash->data + offset;
+	long i;
+
+	for (i = 0; i != len && !(ptr[i] & ~old[i]); i++)
+		;
+	memcpy(old, ptr, len);
+	if (i == len)
+		return gpNvm_FlashProgram(flash, offset, ptr, len);
+
+	flash->erases[sector]++;
+	flash->stats.erases++;
+	if (flash->erases[sector] > flash->stats.maxErases)
+		flash->stats.maxErases = flash->erases[sector];
+
+	/* all of the sector is programmed again after the erase */
+	return flash->config.eraseUs +
+		gpNvm_FlashProgram(flash, start, flash->data + start, size);
+}
+
+/**
+ * gpNvm_FlashApply:
+ * @flash: device
+ * @offset: start of the range
+ * @ptr: new contents of the range, NULL to erase it
+ * @len: length of the range
+ *
+ * Write a range sector by sector, and take the modelled time if asked
+ * for.
+ *
+ * Returns: 0 if success
+ */
+static int gpNvm_FlashApply(gpNvm_Flash *flash, long offset, const UInt8 *ptr, long len)
+{
+	long size = flash->config.sectorSize, n;
+	unsigned long us = 0;
+	UInt8 *erased = NULL;
+	struct timespec ts;
+
+	if (offset < 0 || offset + len > (long)flash->config.sectors * size)
+		return 1;
+	if (!ptr) {
+		erased = malloc(len);
+		if (!erased)
+			return 1;
+		memset(erased, GPNVM_FLASH_ERASED, len);
+		ptr = erased;
+	}
+
+	pthread_mutex_lock(&flash->mutex);
+	while (len > 0) {
+		n = size - offset % size;
+		if (n > len)
+			n = len;
+		us += gpNvm_FlashSector(flash, offset, ptr, n);
+		offset += n;
+		ptr += n;
+		len -= n;
+	}
+	flash->stats.busyUs += us;
+	if (flash->config.delay && us) {
+		ts.tv_sec = us / 1000000;
+		ts.tv_nsec = us % 1000000 * 1000;
+		nanosleep(&ts, NULL);
+	}
+	pthread_mutex_unlock(&flash->mutex);
+
+	free(erased);
+	return 0;
+}
+
+/**
+ * gpNvm_FlashOpen:
+ * @path: not used
+ * @flags: not used
+ * @arg: the device
+ *
+ * Returns: the device as context, NULL without one
+ */
+static void *gpNvm_FlashOpen(const char *path, UInt32 flags, void *arg)
+{
+	return arg;
+}
+
+/**
+ * gpNvm_FlashClose:
+ * @ctx: device
+ * @keep: not used, the device keeps all
+ *
+ * Returns: 0
+ */
+static int gpNvm_FlashClose(void *ctx, long keep)
+{
+	return 0;
+}
+
+/**
+ * gpNvm_FlashReadAt:
+ * @ctx: device
+ * @offset: offset to read from
+ * @ptr: location to read
+ * @len: length to read
+ *
+ * Reads end at the end of the programmed range, as they would at the
+ * end of a file.
+ *
+ * Returns: 0 if all bytes are read
+ */
+static int gpNvm_FlashReadAt(void *ctx, long offset, void *ptr, int len)
+{
+	gpNvm_Flash *flash = ctx;
+
+	if (offset + len > flash->used)
+		return 1;
+	memcpy(ptr, flash->data + offset, len);
+	return 0;
+}
+
+/**
+ * gpNvm_FlashWriteAt:
+ * @ctx: device
+ * @offset: offset to write to
+ * @ptr: location to the byte array to write
+ * @len: number of bytes to write
+ *
+ * Returns: 0 if all bytes are written
+ */
+static int gpNvm_FlashWriteAt(void *ctx, long offset, const void *ptr, int len)
+{
+	gpNvm_Flash *flash = ctx;
+
+	if (gpNvm_FlashApply(flash, offset, ptr, len))
+		return 1;
+
+	pthread_mutex_lock(&flash->mutex);
+	flash->stats.written += len;
+	pthread_mutex_unlock(&flash->mutex);
+	if (offset + len > flash->used)
+		flash->used = offset + len;
+	return 0;
+}
+
+/**
+ * gpNvm_FlashSync:
+ * @ctx: device
+ * @offset: offset of the written range
+ * @len: length of the written range
+ *
+ * Returns: 0, programming is done when the write returns
+ */
+static int gpNvm_FlashSync(void *ctx, long offset, long len)
+{
+	return 0;
+}
+
+/**
+ * gpNvm_FlashPersist:
+ * @ctx: device
+ * @full: not used
+ *
+ * Returns: 0, programmed data is durable
+ */
+static int gpNvm_FlashPersist(void *ctx, int full)
+{
+	return 0;
+}
+
+/**
+ * gpNvm_FlashSize:
+ * @ctx: device
+ *
+ * Returns: end of the programmed range
+ */
+static long gpNvm_FlashSize(void *ctx)
+{
+	return ((gpNvm_Flash *)ctx)->used;
+}
+
+/**
+ * gpNvm_FlashErase:
+ * @ctx: device
+ * @offset: offset of the range
+ * @len: length of the range
+ *
+ * Erase a range; the rest of the sectors it shares is programmed again.
+ *
+ * Returns: 0 if success
+ */
+static int gpNvm_FlashErase(void *ctx, long offset, long len)
+{
+	return gpNvm_FlashApply(ctx, offset, NULL, len);
+}
+
+/**
+ * gpNvm_FlashReplace:
+ * @ctx: device
+ * @image: new contents
+ * @size: size of @image
+ *
+ * Program the image over the programmed range and erase what is left of
+ * it, in one pass so no sector is erased twice. On a real device this
+ * would go through a spare area, to survive a power cut.
+ *
+ * Returns: 0 if success
+ */
+static int gpNvm_FlashReplace(void *ctx, const void *image, long size)
+{
+	gpNvm_Flash *flash = ctx;
+	long len = flash->used > size ? flash->used : size;
+	UInt8 *all;
+	int ret;
+
+	all = malloc(len);
+	if (!all)
+		return 1;
+	memcpy(all, image, size);
+	memset(all + size, GPNVM_FLASH_ERASED, len - size);
+	ret = gpNvm_FlashApply(flash, 0, all, len);
+	free(all);
+	if (ret)
+		return 1;
+
+	pthread_mutex_lock(&flash->mutex);
+	flash->stats.written += size;
+	pthread_mutex_unlock(&flash->mutex);
+	flash->used = size;
+	return 0;
+}
+
+/**
+ * gpNvm_FlashImage:
+ * @ctx: device
+ *
+ * Returns: the contents
+ */
+static UInt8 *gpNvm_FlashImage(void *ctx)
+{
+	return ((gpNvm_Flash *)ctx)->data;
+}
+
+const gpNvm_Backend gpNvm_FlashBackend = {
+	gpNvm_FlashOpen,
+	gpNvm_FlashClose,
+	gpNvm_FlashReadAt,
+	gpNvm_FlashWriteAt,
+	gpNvm_FlashSync,
+	gpNvm_FlashSize,
+	gpNvm_FlashErase,
+	gpNvm_FlashReplace,
+	gpNvm_FlashImage,
+	gpNvm_FlashPersist,
+};
@@ -0,0 +1,88 @@
+#ifndef __GPNVM_STATIC_H_20180325__
+#define __GPNVM_STATIC_H_20180325__
+
+#include "gpnvm.h"
+
+#include <stddef.h>
+
+/** SECTION: gpnvm_static
+ * @title: Static attribute layout
+ *
+ * Attributes known at build time are declared once, as a table of
+ * X(name, attribute ID, type) entries, before this header is included:
+ *
+ *   #define GPNVM_SCHEMA(X) \
+ *           X(options, 0x10, UInt32) \
+ *           X(test, 0x11, gpTestData_t)
+ *   #include "gpnvm_static.h"
+ *
+ * A store opened with the schema set by GPNVM_STATIC_OPTIONS() keeps the
+ * records of the declared attributes first in the file, in table order,
+ * each at an offset the build works out. GPNVM_STATIC_GET() reads a
+ * record straight from its offset and GPNVM_STATIC_SET() replaces it in
+ * place; both fail to compile if the value does not have the size of
+ * the declared type. The layout is written on the first write to the
+ * store, from then on declared attributes read as zeros until they are
+ * set. Only the in-place format has a static layout.
+ */
+
+#ifndef GPNVM_SCHEMA
+#error "define GPNVM_SCHEMA(X) before including gpnvm_static.h"
+#endif
+
+/* record of a declared attribute in the in-place format of this build:
+ * tag, attribute ID, length and header check, data and data check */
+#define GPNVM_STATIC_RECORD(size) (1 + sizeof(gpNvm_AttrId) + 1 + 4 + (size) + 4)
+
+/* the records in table order, a member per record: its offset is that
+ * of the record from the first one */
+#define GPNVM_STATIC_SLOT(name, id, type) UInt8 name[GPNVM_STATIC_RECORD(sizeof(type))];
+
+typedef struct {
+	GPNVM_SCHEMA(GPNVM_STATIC_SLOT)
+} gpNvm_StaticLayout;
+
+/* attribute ID and type per name, and a type that fits in a record */
+#define GPNVM_STATIC_DECLARE(name, id, type) \
+	enum { gpNvm_StaticId_##name = (id) }; \
+	typedef type gpNvm_StaticType_##name; \
+	typedef char gpNvm_StaticFits_##name[sizeof(type) <= 0xff ? 1 : -1];
+
+GPNVM_SCHEMA(GPNVM_STATIC_DECLARE)
+
+#define GPNVM_STATIC_ENTRY(name, id, type) \
+	{ (id), offsetof(gpNvm_StaticLayout, name), sizeof(type) },
+
+/**
+ * gpNvm_StaticSchema:
+ * @pCount: returns the number of declared attributes
+ *
+ * Returns: the declared attributes, for the options of gpNvm_Open()
+ */
+static inline const gpNvm_StaticAttr *gpNvm_StaticSchema(int *pCount)
+{
+	static const gpNvm_StaticAttr schema[] = { GPNVM_SCHEMA(GPNVM_STATIC_ENTRY) };
+
+	*pCount = sizeof schema / sizeof *schema;
+	return schema;
+}
+
+/* set the schema in gpNvm_Options */
+#define GPNVM_STATIC_OPTIONS(options) \
+	((options)->schema = gpNvm_StaticSchema(&(options)->schemaCount))
+
+/* fails to compile unless @pValue points to the size of the declared type */
+#define GPNVM_STATIC_CHECK(name, pValue) \
+	((void)sizeof(char[sizeof *(pValue) == sizeof(gpNvm_StaticType_##name) ? 1 : -1]))
+
+/* read or write a declared attribute, the gpNvm_Result of the call */
+#define GPNVM_STATIC_GET(handle, name, pValue) \
+	(GPNVM_STATIC_CHECK(name, pValue), \
+	 gpNvm_StaticGet((handle), gpNvm_StaticId_##name, offsetof(gpNvm_StaticLayout, name), \
+		sizeof(gpNvm_StaticType_##name), (pValue)))
+
+#define GPNVM_STATIC_SET(handle, name, pValue) \
+	(GPNVM_STATIC_CHECK(name, pValue), \
+	 gpNvm_Set((handle), gpNvm_StaticId_##name, sizeof(gpNvm_StaticType_##name), (UInt8 *)(pValue)))
+
+#endif /* __GPNVM_STATIC_H_20180325__ */
@@ -1,12 +1,35 @@
 #include "gpnvm.h"
+#include "gpnvm_backend.h"
+#include "gpnvm_crc32c.h"
 #include "CuTest.h"
 
 #include <unistd.h>
+#include <limits.h>
 #include <string.h>
 #include <stdio.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <pthread.h>
 
 static const char *gpNvm_file_Test = "test.nvm";
 
+#define MAX_LENGTH 20
+typedef struct {
+	UInt8 id;
+	UInt32 options;
+	UInt8 length;
+	UInt8 data[MAX_LENGTH];
+} gpTestData_t;
+
+/* attributes of the static layout test */
+#define GPNVM_SCHEMA(X) \
+	X(options, 0xe0, UInt32) \
+	X(test, 0xe1, gpTestData_t) \
+	X(channel, 0xe2, UInt8)
+#include "gpnvm_static.h"
+
 static void gpNvm_preliminary_Test(CuTest* tc)
 {
 	/* paranoid safety checks */
@@ -18,6 +41,10 @@ static void gpNvm_OpenCloseFile_Test(CuTest* tc)
 {
 	gpNvm_Result result;
 
+	/* delete the persistence file if exists, a build with wider IDs may
+	 * have left it behind */
+	unlink(gpNvm_file_Test);
+
 	/* is NULL file name detected? */
 	result = gpNvm_OpenFile(NULL);
 	CuAssertTrue(tc, result == 1);
@@ -165,6 +192,2569 @@ static void gpNvm_SetAttribute_Test(CuTest* tc)
 	CuAssertTrue(tc, result == 0);
 }
 
+static void gpNvm_Index_Test(CuTest* tc)
+{
+	gpNvm_AttrId attrId = 0x10;
+	gpNvm_Result result;
+	int i;
+
+	UInt8 value[] = { 0x01, 0x23, 0x45, 0x67, 0x89, 0xab, 0xcd, 0xef, };
+	UInt8 length = sizeof(value);
+
+	UInt8 newValue[sizeof(value)] = { 0xfe, 0xdc, 0xba, 0x98, 0x76, 0x54, 0x32, 0x10, };
+
+	UInt8 sameValue[sizeof(value)] = { 0 };
+	UInt8 sameLength = sizeof(sameValue);
+
+	/* delete the persistence file if exists */
+	unlink(gpNvm_file_Test);
+
+	/* is opening succeeding? */
+	result = gpNvm_OpenFile(gpNvm_file_Test);
+	CuAssertTrue(tc, result == 0);
+
+	/* are appended attributes accepted? */
+	for (i = 0; i != 16; i++) {
+		value[0] = i;
+		result = gpNvm_SetAttribute(attrId + i, length, value);
+		CuAssertTrue(tc, result == 0);
+	}
+
+	/* is an in-place overwrite accepted? */
+	result = gpNvm_SetAttribute(attrId + 3, length, newValue);
+	CuAssertTrue(tc, result == 0);
+
+	/* is an overwrite with a different length moved, and back? */
+	result = gpNvm_SetAttribute(attrId + 3, length - 1, newValue);
+	CuAssertTrue(tc, result == 0);
+	result = gpNvm_GetAttributeLength(attrId + 3, &sameLength);
+	CuAssertTrue(tc, result == 0);
+	CuAssertTrue(tc, sameLength == length - 1);
+	result = gpNvm_SetAttribute(attrId + 3, length, newValue);
+	CuAssertTrue(tc, result == 0);
+	sameLength = sizeof(sameValue);
+
+	/* is closing succeeding? */
+	result = gpNvm_CloseFile();
+	CuAssertTrue(tc, result == 0);
+
+	/* is reopening succeeding, rebuilding the index? */
+	result = gpNvm_OpenFile(gpNvm_file_Test);
+	CuAssertTrue(tc, result == 0);
+
+	/* are all attributes found at their indexed offset? */
+	for (i = 0; i != 16; i++) {
+		value[0] = i;
+		result = gpNvm_GetAttribute(attrId + i, &sameLength, sameValue);
+		CuAssertTrue(tc, result == 0);
+		CuAssertTrue(tc, memcmp(i == 3 ? newValue : value, sameValue, length) == 0);
+	}
+
+	/* does the overwrite leave the following record intact? */
+	result = gpNvm_SetAttribute(attrId + 16, length, value);
+	CuAssertTrue(tc, result == 0);
+	result = gpNvm_GetAttribute(attrId + 4, &sameLength, sameValue);
+	CuAssertTrue(tc, result == 0);
+
+	/* is a non-indexed attribute detected? */
+	result = gpNvm_GetAttribute(attrId - 1, &sameLength, sameValue);
+	CuAssertTrue(tc, result == 1);
+
+	/* is closing succeeding? */
+	result = gpNvm_CloseFile();
+	CuAssertTrue(tc, result == 0);
+}
+
+static void gpNvm_Mmap_Test(CuTest* tc)
+{
+	gpNvm_Options options = { GPNVM_OPEN_MMAP };
+	gpNvm_Result result;
+	struct stat st;
+	int i;
+
+	UInt8 value[250];
+	UInt8 length = sizeof(value);
+
+	UInt8 sameValue[sizeof(value)] = { 0 };
+	UInt8 sameLength = sizeof(sameValue);
+
+	/* delete the persistence file if exists */
+	unlink(gpNvm_file_Test);
+
+	/* is NULL file name detected? */
+	result = gpNvm_OpenFileEx(NULL, &options);
+	CuAssertTrue(tc, result == 1);
+
+	/* is mapped opening succeeding? */
+	result = gpNvm_OpenFileEx(gpNvm_file_Test, &options);
+	CuAssertTrue(tc, result == 0);
+
+	/* are attributes accepted while the mapping grows? */
+	for (i = 0; i != 256; i++) {
+		memset(value, i, length);
+		result = gpNvm_SetAttribute(i, length, value);
+		CuAssertTrue(tc, result == 0);
+	}
+
+	/* is an in-place overwrite accepted? */
+	memset(value, 0x5a, length);
+	result = gpNvm_SetAttribute(0x80, length, value);
+	CuAssertTrue(tc, result == 0);
+
+	/* are attributes read back from the mapping? */
+	result = gpNvm_GetAttribute(0x80, &sameLength, sameValue);
+	CuAssertTrue(tc, result == 0);
+	CuAssertTrue(tc, memcmp(value, sameValue, length) == 0);
+
+	/* is closing succeeding? */
+	result = gpNvm_CloseFile();
+	CuAssertTrue(tc, result == 0);
+
+	/* is the growth padding trimmed on close? */
+	CuAssertTrue(tc, stat(gpNvm_file_Test, &st) == 0);
+	CuAssertTrue(tc, st.st_size == 8 + 256 * (6 + sizeof(gpNvm_AttrId) + length + 4));
+
+	/* is the mapped file readable through stdio? */
+	result = gpNvm_OpenFile(gpNvm_file_Test);
+	CuAssertTrue(tc, result == 0);
+
+	for (i = 0; i != 256; i++) {
+		memset(value, i == 0x80 ? 0x5a : i, length);
+		result = gpNvm_GetAttribute(i, &sameLength, sameValue);
+		CuAssertTrue(tc, result == 0);
+		CuAssertTrue(tc, memcmp(value, sameValue, length) == 0);
+	}
+
+	/* is closing succeeding? */
+	result = gpNvm_CloseFile();
+	CuAssertTrue(tc, result == 0);
+
+	/* is a stdio written file readable when mapped? */
+	result = gpNvm_OpenFileEx(gpNvm_file_Test, &options);
+	CuAssertTrue(tc, result == 0);
+
+	memset(value, 0x7f, length);
+	result = gpNvm_GetAttribute(0x7f, &sameLength, sameValue);
+	CuAssertTrue(tc, result == 0);
+	CuAssertTrue(tc, memcmp(value, sameValue, length) == 0);
+
+	/* is opening again detected? */
+	result = gpNvm_OpenFileEx(gpNvm_file_Test, &options);
+	CuAssertTrue(tc, result == 1);
+
+	/* is closing succeeding? */
+	result = gpNvm_CloseFile();
+	CuAssertTrue(tc, result == 0);
+}
+
+static void gpNvm_Batch_Test(CuTest* tc)
+{
+	gpNvm_AttrId attrId = 0x20;
+	gpNvm_Result result;
+	int i;
+
+	UInt8 value[] = { 0x01, 0x23, 0x45, 0x67, 0x89, 0xab, 0xcd, 0xef, };
+	UInt8 length = sizeof(value);
+
+	UInt8 newValue[sizeof(value)] = { 0xfe, 0xdc, 0xba, 0x98, 0x76, 0x54, 0x32, 0x10, };
+
+	UInt8 sameValue[sizeof(value)] = { 0 };
+	UInt8 sameLength = sizeof(sameValue);
+
+	/* is a batch without an open file detected? */
+	result = gpNvm_BeginBatch(NULL);
+	CuAssertTrue(tc, result == 1);
+
+	/* is committing without a batch detected? */
+	result = gpNvm_CommitBatch(NULL);
+	CuAssertTrue(tc, result == 1);
+
+	/* delete the persistence file if exists */
+	unlink(gpNvm_file_Test);
+
+	/* is opening succeeding? */
+	result = gpNvm_OpenFile(gpNvm_file_Test);
+	CuAssertTrue(tc, result == 0);
+
+	result = gpNvm_SetAttribute(attrId, length, value);
+	CuAssertTrue(tc, result == 0);
+
+	/* is beginning a batch succeeding? */
+	result = gpNvm_BeginBatch(NULL);
+	CuAssertTrue(tc, result == 0);
+
+	/* is beginning a second batch detected? */
+	result = gpNvm_BeginBatch(NULL);
+	CuAssertTrue(tc, result == 1);
+
+	/* are staged values visible to reads? */
+	result = gpNvm_SetAttribute(attrId, length, newValue);
+	CuAssertTrue(tc, result == 0);
+	result = gpNvm_SetAttribute(attrId + 1, length, newValue);
+	CuAssertTrue(tc, result == 0);
+	result = gpNvm_GetAttribute(attrId + 1, &sameLength, sameValue);
+	CuAssertTrue(tc, result == 0);
+	CuAssertTrue(tc, memcmp(newValue, sameValue, length) == 0);
+
+	/* is a length change staged as well? */
+	result = gpNvm_SetAttribute(attrId, length - 1, newValue);
+	CuAssertTrue(tc, result == 0);
+
+	/* does aborting drop all staged values? */
+	result = gpNvm_AbortBatch(NULL);
+	CuAssertTrue(tc, result == 0);
+	result = gpNvm_GetAttribute(attrId, &sameLength, sameValue);
+	CuAssertTrue(tc, result == 0);
+	CuAssertTrue(tc, memcmp(value, sameValue, length) == 0);
+	result = gpNvm_GetAttribute(attrId + 1, &sameLength, sameValue);
+	CuAssertTrue(tc, result == 1);
+
+	/* is aborting without a batch detected? */
+	result = gpNvm_AbortBatch(NULL);
+	CuAssertTrue(tc, result == 1);
+
+	/* are overwrites and appends committed together? */
+	result = gpNvm_BeginBatch(NULL);
+	CuAssertTrue(tc, result == 0);
+	for (i = 15; i >= 0; i--) {
+		value[0] = i;
+		result = gpNvm_SetAttribute(attrId + i, length, value);
+		CuAssertTrue(tc, result == 0);
+	}
+	result = gpNvm_SetAttribute(attrId + 7, length, newValue);
+	CuAssertTrue(tc, result == 0);
+	result = gpNvm_CommitBatch(NULL);
+	CuAssertTrue(tc, result == 0);
+
+	/* is closing succeeding? */
+	result = gpNvm_CloseFile();
+	CuAssertTrue(tc, result == 0);
+
+	/* are all committed values persisted? */
+	result = gpNvm_OpenFile(gpNvm_file_Test);
+	CuAssertTrue(tc, result == 0);
+
+	for (i = 0; i != 16; i++) {
+		value[0] = i;
+		result = gpNvm_GetAttribute(attrId + i, &sameLength, sameValue);
+		CuAssertTrue(tc, result == 0);
+		CuAssertTrue(tc, memcmp(i == 7 ? newValue : value, sameValue, length) == 0);
+	}
+
+	/* is an empty batch committed? */
+	result = gpNvm_BeginBatch(NULL);
+	CuAssertTrue(tc, result == 0);
+	result = gpNvm_CommitBatch(NULL);
+	CuAssertTrue(tc, result == 0);
+
+	/* does closing drop an open batch? */
+	result = gpNvm_BeginBatch(NULL);
+	CuAssertTrue(tc, result == 0);
+	result = gpNvm_SetAttribute(attrId + 16, length, value);
+	CuAssertTrue(tc, result == 0);
+	result = gpNvm_CloseFile();
+	CuAssertTrue(tc, result == 0);
+
+	result = gpNvm_OpenFile(gpNvm_file_Test);
+	CuAssertTrue(tc, result == 0);
+	result = gpNvm_GetAttribute(attrId + 16, &sameLength, sameValue);
+	CuAssertTrue(tc, result == 1);
+
+	/* is closing succeeding? */
+	result = gpNvm_CloseFile();
+	CuAssertTrue(tc, result == 0);
+}
+
+static void gpNvm_Log_Test(CuTest* tc)
+{
+	gpNvm_Options options = { GPNVM_OPEN_LOG, 50 };
+	gpNvm_AttrId attrId = 0x30;
+	gpNvm_Result result;
+	struct stat st;
+	FILE *f;
+	int i;
+
+	UInt8 value[100];
+	UInt8 length = sizeof(value);
+
+	UInt8 sameValue[sizeof(value)] = { 0 };
+	UInt8 sameLength = sizeof(sameValue);
+	UInt8 shortLength = 4;
+
+	char magic[4];
+
+	/* delete the persistence file if exists */
+	unlink(gpNvm_file_Test);
+
+	/* is opening in log mode succeeding? */
+	result = gpNvm_OpenFileEx(gpNvm_file_Test, &options);
+	CuAssertTrue(tc, result == 0);
+
+	/* is a change of length accepted? */
+	memset(value, 0x11, length);
+	result = gpNvm_SetAttribute(attrId, length, value);
+	CuAssertTrue(tc, result == 0);
+	memset(value, 0x22, length);
+	result = gpNvm_SetAttribute(attrId, shortLength, value);
+	CuAssertTrue(tc, result == 0);
+	result = gpNvm_SetAttribute(attrId + 1, length, value);
+	CuAssertTrue(tc, result == 0);
+
+	/* is the newest record read? */
+	result = gpNvm_GetAttribute(attrId, &shortLength, sameValue);
+	CuAssertTrue(tc, result == 0);
+	CuAssertTrue(tc, memcmp(value, sameValue, shortLength) == 0);
+	result = gpNvm_GetAttribute(attrId, &length, sameValue);
+	CuAssertTrue(tc, result == 1);
+
+	/* is closing succeeding? */
+	result = gpNvm_CloseFile();
+	CuAssertTrue(tc, result == 0);
+
+	/* does the file carry a superblock? */
+	f = fopen(gpNvm_file_Test, "r");
+	CuAssertTrue(tc, f != NULL);
+	CuAssertTrue(tc, fread(magic, 1, sizeof(magic), f) == sizeof(magic));
+	CuAssertTrue(tc, memcmp(magic, "GPNV", sizeof(magic)) == 0);
+	fclose(f);
+
+	/* does the newest record win after reopening? */
+	result = gpNvm_OpenFileEx(gpNvm_file_Test, &options);
+	CuAssertTrue(tc, result == 0);
+	result = gpNvm_GetAttribute(attrId, &shortLength, sameValue);
+	CuAssertTrue(tc, result == 0);
+	CuAssertTrue(tc, memcmp(value, sameValue, shortLength) == 0);
+
+	/* does the dead space stay bounded by compaction? */
+	for (i = 0; i != 1000; i++) {
+		memset(value, i, length);
+		result = gpNvm_SetAttribute(attrId + 1, length, value);
+		CuAssertTrue(tc, result == 0);
+	}
+	CuAssertTrue(tc, stat(gpNvm_file_Test, &st) == 0);
+	CuAssertTrue(tc, st.st_size < 2 * 4096);
+	result = gpNvm_GetAttribute(attrId + 1, &sameLength, sameValue);
+	CuAssertTrue(tc, result == 0);
+	CuAssertTrue(tc, memcmp(value, sameValue, length) == 0);
+
+	/* is an explicit compaction succeeding? */
+	result = gpNvm_Compact(NULL);
+	CuAssertTrue(tc, result == 0);
+	CuAssertTrue(tc, stat(gpNvm_file_Test, &st) == 0);
+	CuAssertTrue(tc, st.st_size == 8 + (1 + sizeof(gpNvm_AttrId) + 1 + 4 + 4 + 4) * 2 + shortLength + length);
+	result = gpNvm_GetAttribute(attrId, &shortLength, sameValue);
+	CuAssertTrue(tc, result == 0);
+
+	/* append one more version of the attribute */
+	memset(value, 0x33, length);
+	result = gpNvm_SetAttribute(attrId + 1, length, value);
+	CuAssertTrue(tc, result == 0);
+
+	/* is closing succeeding? */
+	result = gpNvm_CloseFile();
+	CuAssertTrue(tc, result == 0);
+
+	/* damage the data of the newest record */
+	f = fopen(gpNvm_file_Test, "r+");
+	CuAssertTrue(tc, f != NULL);
+	fseek(f, -3, SEEK_END);
+	fputc(0x00, f);
+	fclose(f);
+
+	/* does the previous intact record win? */
+	result = gpNvm_OpenFileEx(gpNvm_file_Test, &options);
+	CuAssertTrue(tc, result == 0);
+	memset(value, 999 & 0xff, length);
+	result = gpNvm_GetAttribute(attrId + 1, &sameLength, sameValue);
+	CuAssertTrue(tc, result == 0);
+	CuAssertTrue(tc, memcmp(value, sameValue, length) == 0);
+
+	/* is closing succeeding? */
+	result = gpNvm_CloseFile();
+	CuAssertTrue(tc, result == 0);
+
+	/* is the log readable, and migrated on write, without log mode? */
+	result = gpNvm_OpenFile(gpNvm_file_Test);
+	CuAssertTrue(tc, result == 0);
+	result = gpNvm_GetAttribute(attrId + 1, &sameLength, sameValue);
+	CuAssertTrue(tc, result == 0);
+	CuAssertTrue(tc, memcmp(value, sameValue, length) == 0);
+	result = gpNvm_SetAttribute(attrId + 2, length, value);
+	CuAssertTrue(tc, result == 0);
+	result = gpNvm_GetAttribute(attrId, &shortLength, sameValue);
+	CuAssertTrue(tc, result == 0);
+	result = gpNvm_CloseFile();
+	CuAssertTrue(tc, result == 0);
+
+	CuAssertTrue(tc, stat(gpNvm_file_Test, &st) == 0);
+	CuAssertTrue(tc, st.st_size == 8 + 3 * (6 + sizeof(gpNvm_AttrId) + 4) + shortLength + 2 * length);
+}
+
+static void gpNvm_Crc32c_Test(CuTest* tc)
+{
+	UInt8 data[512 + 8];
+	UInt32 crc;
+	int i, offset, length;
+
+	/* is the CRC32C check value of "123456789" computed? */
+	CuAssertTrue(tc, gpNvm_Crc32c(0, "123456789", 9) == 0xe3069283);
+	CuAssertTrue(tc, gpNvm_Crc32cSlice8(0, "123456789", 9) == 0xe3069283);
+	CuAssertTrue(tc, gpNvm_Crc32cSse42(0, "123456789", 9) == 0xe3069283 ||
+		!gpNvm_Crc32cHardware());
+
+	/* is a CRC computed in pieces the same as in one go? */
+	crc = gpNvm_Crc32c(0, "1234", 4);
+	CuAssertTrue(tc, gpNvm_Crc32c(crc, "56789", 5) == 0xe3069283);
+
+	for (i = 0; i != sizeof(data); i++)
+		data[i] = i * 7 + 3;
+
+	/* do both implementations agree on all lengths and alignments? */
+	for (offset = 0; offset != 8; offset++) {
+		for (length = 0; length <= 512; length++) {
+			crc = gpNvm_Crc32cSlice8(0, data + offset, length);
+			CuAssertTrue(tc, gpNvm_Crc32c(0, data + offset, length) == crc);
+			if (gpNvm_Crc32cHardware())
+				CuAssertTrue(tc, gpNvm_Crc32cSse42(0, data + offset, length) == crc);
+		}
+	}
+}
+
+static void gpNvm_Migrate_Test(CuTest* tc)
+{
+	/* attribute 0x42 holding { 1, 2, 3 } in the original layout */
+	static const UInt8 legacy[] = { 0x42, 5, 0x47, 0x00, 1, 2, 3, 6, 0 };
+	gpNvm_AttrId attrId = 0x42;
+	gpNvm_Result result;
+	FILE *f;
+
+	UInt8 value[] = { 1, 2, 3 };
+	UInt8 length = sizeof(value);
+
+	UInt8 sameValue[sizeof(value)] = { 0 };
+	UInt8 sameLength = sizeof(sameValue);
+
+	UInt8 super[5];
+
+	/* write a store in the original layout */
+	f = fopen(gpNvm_file_Test, "w");
+	CuAssertTrue(tc, f != NULL);
+	CuAssertTrue(tc, fwrite(legacy, 1, sizeof(legacy), f) == sizeof(legacy));
+	fclose(f);
+
+	/* is the original layout still readable? */
+	result = gpNvm_OpenFile(gpNvm_file_Test);
+	CuAssertTrue(tc, result == 0);
+	result = gpNvm_GetAttribute(attrId, &sameLength, sameValue);
+	CuAssertTrue(tc, result == 0);
+	CuAssertTrue(tc, memcmp(value, sameValue, length) == 0);
+
+	/* is the first write migrating the store? */
+	result = gpNvm_SetAttribute(attrId + 1, length, value);
+	CuAssertTrue(tc, result == 0);
+	result = gpNvm_CloseFile();
+	CuAssertTrue(tc, result == 0);
+
+	f = fopen(gpNvm_file_Test, "r");
+	CuAssertTrue(tc, f != NULL);
+	CuAssertTrue(tc, fread(super, 1, sizeof(super), f) == sizeof(super));
+	CuAssertTrue(tc, memcmp(super, "GPNV\x02", sizeof(super)) == 0);
+	fclose(f);
+
+	/* are both the migrated and the new attribute readable? */
+	result = gpNvm_OpenFile(gpNvm_file_Test);
+	CuAssertTrue(tc, result == 0);
+	result = gpNvm_GetAttribute(attrId, &sameLength, sameValue);
+	CuAssertTrue(tc, result == 0);
+	CuAssertTrue(tc, memcmp(value, sameValue, length) == 0);
+	result = gpNvm_GetAttribute(attrId + 1, &sameLength, sameValue);
+	CuAssertTrue(tc, result == 0);
+	CuAssertTrue(tc, memcmp(value, sameValue, length) == 0);
+	result = gpNvm_CloseFile();
+	CuAssertTrue(tc, result == 0);
+}
+
+static void gpNvm_Handle_Test(CuTest* tc)
+{
+	static const char *files[] = { "test-0.nvm", "test-1.nvm", "test-2.nvm" };
+	gpNvm_Handle *handles[3];
+	gpNvm_Handle *handle = NULL;
+	gpNvm_AttrId attrId = 0x40;
+	gpNvm_Result result;
+	int i;
+
+	UInt8 value[] = { 0x01, 0x23, 0x45, 0x67, 0x89, 0xab, 0xcd, 0xef, };
+	UInt8 length = sizeof(value);
+
+	UInt8 sameValue[sizeof(value)] = { 0 };
+	UInt8 sameLength = sizeof(sameValue);
+
+	/* are NULL handle pointer and NULL path detected? */
+	result = gpNvm_Open(NULL, files[0], NULL);
+	CuAssertTrue(tc, result == 1);
+	result = gpNvm_Open(&handle, NULL, NULL);
+	CuAssertTrue(tc, result == 1);
+	CuAssertTrue(tc, handle == NULL);
+
+	/* is using the original API store without opening it detected? */
+	result = gpNvm_Get(NULL, attrId, &sameLength, sameValue);
+	CuAssertTrue(tc, result == 1);
+	result = gpNvm_Close(NULL);
+	CuAssertTrue(tc, result == 1);
+
+	/* are several stores opened side by side? */
+	for (i = 0; i != 3; i++) {
+		unlink(files[i]);
+		result = gpNvm_Open(&handles[i], files[i], NULL);
+		CuAssertTrue(tc, result == 0);
+	}
+
+	/* is the original API store opened next to them? */
+	unlink(gpNvm_file_Test);
+	result = gpNvm_OpenFile(gpNvm_file_Test);
+	CuAssertTrue(tc, result == 0);
+
+	/* does every store keep its own value for the same attribute? */
+	for (i = 0; i != 3; i++) {
+		value[0] = i;
+		result = gpNvm_Set(handles[i], attrId, length, value);
+		CuAssertTrue(tc, result == 0);
+	}
+	value[0] = 0xff;
+	result = gpNvm_SetAttribute(attrId, length, value);
+	CuAssertTrue(tc, result == 0);
+
+	for (i = 0; i != 3; i++) {
+		value[0] = i;
+		result = gpNvm_Get(handles[i], attrId, &sameLength, sameValue);
+		CuAssertTrue(tc, result == 0);
+		CuAssertTrue(tc, memcmp(value, sameValue, length) == 0);
+	}
+
+	/* does a NULL handle select the original API store? */
+	value[0] = 0xff;
+	result = gpNvm_Get(NULL, attrId, &sameLength, sameValue);
+	CuAssertTrue(tc, result == 0);
+	CuAssertTrue(tc, memcmp(value, sameValue, length) == 0);
+
+	/* is a batch on one store invisible to the others? */
+	result = gpNvm_BeginBatch(handles[0]);
+	CuAssertTrue(tc, result == 0);
+	result = gpNvm_Set(handles[0], attrId + 1, length, value);
+	CuAssertTrue(tc, result == 0);
+	result = gpNvm_Get(handles[1], attrId + 1, &sameLength, sameValue);
+	CuAssertTrue(tc, result == 1);
+	result = gpNvm_CommitBatch(handles[0]);
+	CuAssertTrue(tc, result == 0);
+
+	/* are all stores closed and reopened with their own content? */
+	for (i = 0; i != 3; i++) {
+		result = gpNvm_Close(handles[i]);
+		CuAssertTrue(tc, result == 0);
+	}
+	result = gpNvm_Close(NULL);
+	CuAssertTrue(tc, result == 0);
+
+	for (i = 0; i != 3; i++) {
+		result = gpNvm_Open(&handles[i], files[i], NULL);
+		CuAssertTrue(tc, result == 0);
+		value[0] = i;
+		result = gpNvm_Get(handles[i], attrId, &sameLength, sameValue);
+		CuAssertTrue(tc, result == 0);
+		CuAssertTrue(tc, memcmp(value, sameValue, length) == 0);
+		result = gpNvm_Close(handles[i]);
+		CuAssertTrue(tc, result == 0);
+		unlink(files[i]);
+	}
+}
+
+static void gpNvm_Wide_Test(CuTest* tc)
+{
+	/* as many attributes as the ID width allows, at most 20000 */
+	UInt32 count = sizeof(gpNvm_AttrId) == 1 ? 256 : 20000;
+	gpNvm_Handle *handle;
+	gpNvm_Result result;
+	struct stat st;
+	UInt32 i, sameValue;
+	UInt8 length = sizeof(i);
+	int pass;
+
+	unlink(gpNvm_file_Test);
+	result = gpNvm_Open(&handle, gpNvm_file_Test, NULL);
+	CuAssertTrue(tc, result == 0);
+
+	/* are attributes with IDs spread over the whole range accepted? */
+	for (i = 0; i != count; i++) {
+		result = gpNvm_Set(handle, (gpNvm_AttrId)(i * 2654435761u), length, (UInt8 *)&i);
+		CuAssertTrue(tc, result == 0);
+	}
+
+	/* are they all found, before and after reopening? */
+	for (pass = 0; pass != 2; pass++) {
+		for (i = 0; i != count; i++) {
+			result = gpNvm_Get(handle, (gpNvm_AttrId)(i * 2654435761u), &length, (UInt8 *)&sameValue);
+			CuAssertTrue(tc, result == 0);
+			CuAssertTrue(tc, sameValue == i);
+		}
+		if (count < (1UL << (8 * sizeof(gpNvm_AttrId)))) {
+			result = gpNvm_Get(handle, (gpNvm_AttrId)(count * 2654435761u), &length, (UInt8 *)&sameValue);
+			CuAssertTrue(tc, result == 1);
+		}
+
+		result = gpNvm_Close(handle);
+		CuAssertTrue(tc, result == 0);
+		result = gpNvm_Open(&handle, gpNvm_file_Test, NULL);
+		CuAssertTrue(tc, result == 0);
+	}
+	result = gpNvm_Close(handle);
+	CuAssertTrue(tc, result == 0);
+
+	/* are records written with IDs of the build width? */
+	CuAssertTrue(tc, stat(gpNvm_file_Test, &st) == 0);
+	CuAssertTrue(tc, st.st_size == 8 + count * (6 + sizeof(gpNvm_AttrId) + length + 4));
+}
+
+static void gpNvm_View_Test(CuTest* tc)
+{
+	static const UInt32 flags[] = { 0, GPNVM_OPEN_MMAP };
+	gpNvm_Options options = { 0 };
+	gpNvm_AttrId attrId = 0x30;
+	gpNvm_Result result;
+	const UInt8 *view, *sameView;
+	UInt8 viewLength;
+	FILE *f;
+	int i;
+
+	UInt8 value[] = { 0x01, 0x23, 0x45, 0x67, 0x89, 0xab, 0xcd, 0xef, };
+	UInt8 length = sizeof(value);
+
+	/* are NULL pointers and a closed store detected? */
+	result = gpNvm_GetAttributeView(attrId, NULL, &viewLength);
+	CuAssertTrue(tc, result == 1);
+	result = gpNvm_GetAttributeView(attrId, &view, NULL);
+	CuAssertTrue(tc, result == 1);
+	result = gpNvm_GetAttributeView(attrId, &view, &viewLength);
+	CuAssertTrue(tc, result == 1);
+	result = gpNvm_GetAttributeLength(attrId, &viewLength);
+	CuAssertTrue(tc, result == 1);
+
+	for (i = 0; i != sizeof(flags) / sizeof(*flags); i++) {
+		unlink(gpNvm_file_Test);
+		options.flags = flags[i];
+		result = gpNvm_OpenFileEx(gpNvm_file_Test, &options);
+		CuAssertTrue(tc, result == 0);
+
+		/* is a missing attribute detected? */
+		result = gpNvm_GetAttributeLength(attrId, &viewLength);
+		CuAssertTrue(tc, result == 1);
+		result = gpNvm_GetAttributeView(attrId, &view, &viewLength);
+		CuAssertTrue(tc, result == 1);
+
+		/* is the length known without reading the data? */
+		result = gpNvm_SetAttribute(attrId, length, value);
+		CuAssertTrue(tc, result == 0);
+		result = gpNvm_GetAttributeLength(attrId, &viewLength);
+		CuAssertTrue(tc, result == 0);
+		CuAssertTrue(tc, viewLength == length);
+
+		/* is the view the data, and the same view the next time? */
+		result = gpNvm_GetAttributeView(attrId, &view, &viewLength);
+		CuAssertTrue(tc, result == 0);
+		CuAssertTrue(tc, viewLength == length);
+		CuAssertTrue(tc, memcmp(view, value, length) == 0);
+		result = gpNvm_GetAttributeView(attrId, &sameView, &viewLength);
+		CuAssertTrue(tc, result == 0);
+		CuAssertTrue(tc, sameView == view);
+
+		/* does the view follow a write? */
+		value[0] ^= 0xff;
+		result = gpNvm_SetAttribute(attrId, length, value);
+		CuAssertTrue(tc, result == 0);
+		result = gpNvm_GetAttributeView(attrId, &view, &viewLength);
+		CuAssertTrue(tc, result == 0);
+		CuAssertTrue(tc, memcmp(view, value, length) == 0);
+
+		/* is a staged value viewed during a batch? */
+		result = gpNvm_BeginBatch(NULL);
+		CuAssertTrue(tc, result == 0);
+		value[1] ^= 0xff;
+		result = gpNvm_SetAttribute(attrId, length, value);
+		CuAssertTrue(tc, result == 0);
+		result = gpNvm_GetAttributeView(attrId, &view, &viewLength);
+		CuAssertTrue(tc, result == 0);
+		CuAssertTrue(tc, memcmp(view, value, length) == 0);
+		result = gpNvm_CommitBatch(NULL);
+		CuAssertTrue(tc, result == 0);
+
+		result = gpNvm_CloseFile();
+		CuAssertTrue(tc, result == 0);
+
+		/* damage the data of the record */
+		f = fopen(gpNvm_file_Test, "r+");
+		CuAssertTrue(tc, f != NULL);
+		fseek(f, -5, SEEK_END);
+		fputc(0x00, f);
+		fclose(f);
+
+		/* is damaged data refused? */
+		result = gpNvm_OpenFileEx(gpNvm_file_Test, &options);
+		CuAssertTrue(tc, result == 0);
+		result = gpNvm_GetAttributeLength(attrId, &viewLength);
+		CuAssertTrue(tc, result == 0);
+		result = gpNvm_GetAttributeView(attrId, &view, &viewLength);
+		CuAssertTrue(tc, result == 1);
+		result = gpNvm_CloseFile();
+		CuAssertTrue(tc, result == 0);
+	}
+}
+
+static void gpNvm_WriteBack_Test(CuTest* tc)
+{
+	gpNvm_Options options = { GPNVM_OPEN_WRITEBACK };
+	gpNvm_WriteCounters counters;
+	gpNvm_Handle *handle;
+	gpNvm_AttrId attrId = 0x50;
+	gpNvm_Result result;
+	struct stat st;
+	UInt32 i, sameValue;
+	UInt8 length = sizeof(i);
+
+	unlink(gpNvm_file_Test);
+	result = gpNvm_Open(&handle, gpNvm_file_Test, &options);
+	CuAssertTrue(tc, result == 0);
+
+	/* do repeated updates stay in memory, and are they read back? */
+	for (i = 0; i != 100; i++) {
+		result = gpNvm_Set(handle, attrId, length, (UInt8 *)&i);
+		CuAssertTrue(tc, result == 0);
+	}
+	CuAssertTrue(tc, stat(gpNvm_file_Test, &st) == 0);
+	CuAssertTrue(tc, st.st_size == 0);
+	result = gpNvm_Get(handle, attrId, &length, (UInt8 *)&sameValue);
+	CuAssertTrue(tc, result == 0);
+	CuAssertTrue(tc, sameValue == 99);
+
+	/* do they coalesce into a single record on sync? */
+	result = gpNvm_Sync(handle);
+	CuAssertTrue(tc, result == 0);
+	CuAssertTrue(tc, stat(gpNvm_file_Test, &st) == 0);
+	CuAssertTrue(tc, st.st_size == 8 + 6 + sizeof(gpNvm_AttrId) + length + 4);
+	result = gpNvm_GetWriteCounters(handle, &counters);
+	CuAssertTrue(tc, result == 0);
+	CuAssertTrue(tc, counters.writes == 100);
+	CuAssertTrue(tc, counters.coalesced == 99);
+	CuAssertTrue(tc, counters.records == 1);
+	CuAssertTrue(tc, counters.flushes == 1);
+
+	/* does a committed batch flush the cache with it? */
+	result = gpNvm_Set(handle, attrId + 1, length, (UInt8 *)&i);
+	CuAssertTrue(tc, result == 0);
+	result = gpNvm_BeginBatch(handle);
+	CuAssertTrue(tc, result == 0);
+	result = gpNvm_Set(handle, attrId + 2, length, (UInt8 *)&i);
+	CuAssertTrue(tc, result == 0);
+	result = gpNvm_CommitBatch(handle);
+	CuAssertTrue(tc, result == 0);
+	result = gpNvm_GetWriteCounters(handle, &counters);
+	CuAssertTrue(tc, result == 0);
+	CuAssertTrue(tc, counters.records == 3);
+	CuAssertTrue(tc, counters.flushes == 2);
+
+	/* is the cache flushed on close? */
+	i = 1234;
+	result = gpNvm_Set(handle, attrId, length, (UInt8 *)&i);
+	CuAssertTrue(tc, result == 0);
+	result = gpNvm_Close(handle);
+	CuAssertTrue(tc, result == 0);
+
+	/* does a flush follow every N writes? */
+	options.flushWrites = 10;
+	result = gpNvm_Open(&handle, gpNvm_file_Test, &options);
+	CuAssertTrue(tc, result == 0);
+	result = gpNvm_Get(handle, attrId, &length, (UInt8 *)&sameValue);
+	CuAssertTrue(tc, result == 0);
+	CuAssertTrue(tc, sameValue == 1234);
+	for (i = 0; i != 25; i++) {
+		result = gpNvm_Set(handle, attrId + i % 2, length, (UInt8 *)&i);
+		CuAssertTrue(tc, result == 0);
+	}
+	result = gpNvm_GetWriteCounters(handle, &counters);
+	CuAssertTrue(tc, result == 0);
+	CuAssertTrue(tc, counters.flushes == 2);
+	CuAssertTrue(tc, counters.records == 4);
+	result = gpNvm_Close(handle);
+	CuAssertTrue(tc, result == 0);
+
+	/* does a flush follow every T milliseconds? */
+	options.flushWrites = 0;
+	options.flushMs = 10;
+	result = gpNvm_Open(&handle, gpNvm_file_Test, &options);
+	CuAssertTrue(tc, result == 0);
+	result = gpNvm_Set(handle, attrId, length, (UInt8 *)&i);
+	CuAssertTrue(tc, result == 0);
+	for (sameValue = 0; sameValue != 100; sameValue++) {
+		result = gpNvm_GetWriteCounters(handle, &counters);
+		CuAssertTrue(tc, result == 0);
+		if (counters.flushes)
+			break;
+		usleep(10 * 1000);
+	}
+	CuAssertTrue(tc, counters.flushes == 1);
+	result = gpNvm_Close(handle);
+	CuAssertTrue(tc, result == 0);
+
+	/* are the newest values on file? */
+	result = gpNvm_Open(&handle, gpNvm_file_Test, NULL);
+	CuAssertTrue(tc, result == 0);
+	result = gpNvm_Get(handle, attrId, &length, (UInt8 *)&sameValue);
+	CuAssertTrue(tc, result == 0);
+	CuAssertTrue(tc, sameValue == 25);
+	result = gpNvm_Get(handle, attrId + 1, &length, (UInt8 *)&sameValue);
+	CuAssertTrue(tc, result == 0);
+	CuAssertTrue(tc, sameValue == 23);
+	result = gpNvm_Close(handle);
+	CuAssertTrue(tc, result == 0);
+}
+
+/* shared by the threads of gpNvm_Threads_Test() */
+typedef struct {
+	gpNvm_Handle *handle;
+	int writer;
+	int rounds;
+	int errors;
+} gpNvm_Threads_Arg;
+
+/* every value is 16 equal bytes, a torn read shows as a mix */
+static int gpNvm_Threads_Consistent(const UInt8 *value, UInt8 length)
+{
+	int i;
+
+	for (i = 1; i != length; i++)
+		if (value[i] != value[0])
+			return 0;
+	return 1;
+}
+
+static void *gpNvm_Threads_Run(void *p)
+{
+	gpNvm_Threads_Arg *arg = p;
+	UInt8 value[16];
+	UInt8 length;
+	int i;
+
+	for (i = 0; i != arg->rounds; i++) {
+		gpNvm_AttrId attrId = (i * 7 + arg->writer) % 128;
+
+		/* writers replace the first half in place and append the second */
+		if (arg->writer) {
+			memset(value, i + arg->writer, sizeof(value));
+			if (attrId < 64 && gpNvm_Set(arg->handle, attrId, sizeof(value), value))
+				arg->errors++;
+			if (attrId >= 64 && attrId % 2 == arg->writer % 2 &&
+			    gpNvm_Set(arg->handle, attrId, sizeof(value), value))
+				arg->errors++;
+			continue;
+		}
+
+		/* readers see either the old or the new value, never a mix */
+		length = sizeof(value);
+		if (!gpNvm_Get(arg->handle, attrId, &length, value)) {
+			if (!gpNvm_Threads_Consistent(value, length))
+				arg->errors++;
+		} else if (attrId < 64) {
+			arg->errors++;
+		}
+	}
+
+	return NULL;
+}
+
+static void gpNvm_Threads_Test(CuTest* tc)
+{
+	static const UInt32 flags[] = { 0, GPNVM_OPEN_MMAP };
+	gpNvm_Threads_Arg args[8];
+	pthread_t threads[8];
+	gpNvm_Options options = { 0 };
+	gpNvm_Handle *handle;
+	gpNvm_Result result;
+	UInt8 value[16];
+	UInt8 length;
+	int f, i;
+
+	for (f = 0; f != sizeof(flags) / sizeof(*flags); f++) {
+		unlink(gpNvm_file_Test);
+		options.flags = flags[f];
+		result = gpNvm_Open(&handle, gpNvm_file_Test, &options);
+		CuAssertTrue(tc, result == 0);
+
+		for (i = 0; i != 64; i++) {
+			memset(value, 0xff, sizeof(value));
+			result = gpNvm_Set(handle, i, sizeof(value), value);
+			CuAssertTrue(tc, result == 0);
+		}
+
+		/* do six readers and two writers keep every value whole? */
+		for (i = 0; i != 8; i++) {
+			args[i].handle = handle;
+			args[i].writer = i < 2 ? i + 1 : 0;
+			args[i].rounds = args[i].writer ? 2000 : 20000;
+			args[i].errors = 0;
+			result = pthread_create(&threads[i], NULL, gpNvm_Threads_Run, &args[i]);
+			CuAssertTrue(tc, result == 0);
+		}
+		for (i = 0; i != 8; i++) {
+			pthread_join(threads[i], NULL);
+			CuAssertIntEquals(tc, 0, args[i].errors);
+		}
+
+		/* are the appended attributes all there after a reopen? */
+		result = gpNvm_Close(handle);
+		CuAssertTrue(tc, result == 0);
+		result = gpNvm_Open(&handle, gpNvm_file_Test, &options);
+		CuAssertTrue(tc, result == 0);
+		for (i = 0; i != 128; i++) {
+			length = sizeof(value);
+			result = gpNvm_Get(handle, i, &length, value);
+			CuAssertTrue(tc, result == 0);
+			CuAssertTrue(tc, gpNvm_Threads_Consistent(value, length));
+		}
+		result = gpNvm_Close(handle);
+		CuAssertTrue(tc, result == 0);
+	}
+}
+
+static void gpNvm_Stats_Test(CuTest* tc)
+{
+	gpNvm_Stats stats;
+	gpNvm_Handle *handle;
+	gpNvm_AttrId attrId = 0x60;
+	gpNvm_Result result;
+	UInt32 i, sameValue = 0;
+	UInt8 length = sizeof(i);
+#if GPNVM_STATS
+	unsigned long total;
+	FILE *f;
+#endif
+
+	unlink(gpNvm_file_Test);
+	result = gpNvm_Open(&handle, gpNvm_file_Test, NULL);
+	CuAssertTrue(tc, result == 0);
+	for (i = 0; i != 10; i++) {
+		result = gpNvm_Set(handle, attrId + i, length, (UInt8 *)&i);
+		CuAssertTrue(tc, result == 0);
+	}
+	result = gpNvm_ResetStats(handle);
+	CuAssertTrue(tc, result == 0);
+
+#if GPNVM_STATS
+	/* are reads counted, and one in GPNVM_STATS_SAMPLE timed? */
+	for (i = 0; i != 10 * GPNVM_STATS_SAMPLE; i++) {
+		result = gpNvm_Get(handle, attrId + i % 10, &length, (UInt8 *)&sameValue);
+		CuAssertTrue(tc, result == 0);
+	}
+	result = gpNvm_GetStats(handle, &stats);
+	CuAssertTrue(tc, result == 0);
+	CuAssertTrue(tc, stats.lookups == 10 * GPNVM_STATS_SAMPLE);
+	CuAssertTrue(tc, stats.probes >= stats.lookups);
+	CuAssertTrue(tc, stats.bytesRead >= stats.lookups * length);
+	CuAssertTrue(tc, stats.bytesWritten == 0);
+	for (total = 0, i = 0; i != GPNVM_STATS_BUCKETS; i++)
+		total += stats.getLatency[i];
+	CuAssertTrue(tc, total == 10);
+
+	/* are writes and their flushes counted? Every byte changes, so the
+	 * whole value is written */
+	for (i = 0; i != GPNVM_STATS_SAMPLE; i++) {
+		sameValue = (i + 1) * 0x01010101u;
+		result = gpNvm_Set(handle, attrId, length, (UInt8 *)&sameValue);
+		CuAssertTrue(tc, result == 0);
+	}
+	result = gpNvm_GetStats(handle, &stats);
+	CuAssertTrue(tc, result == 0);
+	CuAssertTrue(tc, stats.bytesWritten >= GPNVM_STATS_SAMPLE * length);
+	CuAssertTrue(tc, stats.flushes >= GPNVM_STATS_SAMPLE);
+	for (total = 0, i = 0; i != GPNVM_STATS_BUCKETS; i++)
+		total += stats.setLatency[i];
+	CuAssertTrue(tc, total == 1);
+	for (total = 0, i = 0; i != GPNVM_STATS_BUCKETS; i++)
+		total += stats.flushLatency[i];
+	CuAssertTrue(tc, total == stats.flushes);
+	result = gpNvm_Close(handle);
+	CuAssertTrue(tc, result == 0);
+
+	/* damage the data of the newest record */
+	f = fopen(gpNvm_file_Test, "r+");
+	CuAssertTrue(tc, f != NULL);
+	fseek(f, -5, SEEK_END);
+	fputc(0xff, f);
+	fclose(f);
+
+	/* are the scan and the checksum failure counted? */
+	result = gpNvm_Open(&handle, gpNvm_file_Test, NULL);
+	CuAssertTrue(tc, result == 0);
+	result = gpNvm_GetStats(handle, &stats);
+	CuAssertTrue(tc, result == 0);
+	CuAssertTrue(tc, stats.scanned >= 10);
+	CuAssertTrue(tc, stats.headerFailures == 0);
+	result = gpNvm_Get(handle, attrId + 9, &length, (UInt8 *)&sameValue);
+	CuAssertTrue(tc, result == 1);
+	result = gpNvm_GetStats(handle, &stats);
+	CuAssertTrue(tc, result == 0);
+	CuAssertTrue(tc, stats.checkFailures == 1);
+#else
+	/* are the statistics refused when compiled out? */
+	result = gpNvm_Get(handle, attrId, &length, (UInt8 *)&sameValue);
+	CuAssertTrue(tc, result == 0);
+	result = gpNvm_GetStats(handle, &stats);
+	CuAssertTrue(tc, result == 1);
+	CuAssertTrue(tc, stats.lookups == 0);
+#endif
+
+	result = gpNvm_Close(handle);
+	CuAssertTrue(tc, result == 0);
+}
+
+/* syncs and image swaps seen by the counting backend */
+static int gpNvm_Backend_syncs;
+static int gpNvm_Backend_replaces;
+
+static int gpNvm_Backend_CountSync(void *ctx, long offset, long len)
+{
+	gpNvm_Backend_syncs++;
+	return gpNvm_MemoryBackend.sync(ctx, offset, len);
+}
+
+static int gpNvm_Backend_CountReplace(void *ctx, const void *image, long size)
+{
+	gpNvm_Backend_replaces++;
+	return gpNvm_MemoryBackend.replace(ctx, image, size);
+}
+
+static void gpNvm_Backend_Test(CuTest* tc)
+{
+	gpNvm_Options options = { GPNVM_OPEN_LOG };
+	gpNvm_Backend counting = gpNvm_MemoryBackend;
+	gpNvm_Handle *handle;
+	gpNvm_AttrId attrId = 0x70;
+	gpNvm_Result result;
+	struct stat st;
+	const UInt8 *view;
+	UInt32 i = 0, sameValue;
+	UInt8 length = sizeof(i), viewLength;
+
+	unlink(gpNvm_file_Test);
+
+	/* is a store in memory opened without a path? */
+	options.backend = &gpNvm_MemoryBackend;
+	result = gpNvm_Open(&handle, NULL, &options);
+	CuAssertTrue(tc, result == 0);
+	result = gpNvm_Set(handle, attrId, length, (UInt8 *)&i);
+	CuAssertTrue(tc, result == 0);
+
+	/* is nothing left on disk, nor in memory once closed? */
+	result = gpNvm_Close(handle);
+	CuAssertTrue(tc, result == 0);
+	CuAssertTrue(tc, stat(gpNvm_file_Test, &st) != 0);
+	result = gpNvm_Open(&handle, NULL, &options);
+	CuAssertTrue(tc, result == 0);
+	result = gpNvm_Get(handle, attrId, &length, (UInt8 *)&sameValue);
+	CuAssertTrue(tc, result == 1);
+	result = gpNvm_Close(handle);
+	CuAssertTrue(tc, result == 0);
+
+	/* does a backend of our own see every write flushed? */
+	counting.sync = gpNvm_Backend_CountSync;
+	counting.replace = gpNvm_Backend_CountReplace;
+	options.backend = &counting;
+	result = gpNvm_Open(&handle, NULL, &options);
+	CuAssertTrue(tc, result == 0);
+	for (i = 0; i != 1000; i++) {
+		result = gpNvm_Set(handle, attrId + i % 4, length, (UInt8 *)&i);
+		CuAssertTrue(tc, result == 0);
+	}
+	CuAssertTrue(tc, gpNvm_Backend_syncs == 1000);
+
+	/* is the log compacted by swapping in a new image, and read back? */
+	CuAssertTrue(tc, gpNvm_Backend_replaces > 0);
+	result = gpNvm_Get(handle, attrId + 3, &length, (UInt8 *)&sameValue);
+	CuAssertTrue(tc, result == 0);
+	CuAssertTrue(tc, sameValue == 999);
+
+	/* is a view handed out? */
+	result = gpNvm_GetView(handle, attrId + 2, &view, &viewLength);
+	CuAssertTrue(tc, result == 0);
+	CuAssertTrue(tc, viewLength == length);
+	CuAssertTrue(tc, memcmp(view, &(UInt32){ 998 }, length) == 0);
+	result = gpNvm_Close(handle);
+	CuAssertTrue(tc, result == 0);
+}
+
+static void gpNvm_Flash_Test(CuTest* tc)
+{
+	gpNvm_FlashConfig config = { 256, 64, 64, 1000, 100 };
+	gpNvm_Options options = { 0 };
+	gpNvm_WriteCounters counters;
+	gpNvm_FlashStats stats;
+	gpNvm_Flash *flash;
+	gpNvm_Handle *handle;
+	gpNvm_AttrId attrId = 0x80;
+	gpNvm_Result result;
+	UInt8 byte, sameByte;
+	void *ctx;
+	UInt32 i = 0x55555555, sameValue;
+	UInt8 length = sizeof(i);
+
+	result = gpNvm_FlashCreate(&flash, &config);
+	CuAssertTrue(tc, result == 0);
+
+	/* does programming only clear bits, and setting one erase the sector? */
+	ctx = gpNvm_FlashBackend.open(NULL, 0, flash);
+	CuAssertTrue(tc, ctx != NULL);
+	byte = 0xf0;
+	CuAssertTrue(tc, gpNvm_FlashBackend.writeAt(ctx, 300, &byte, 1) == 0);
+	byte = 0x30;
+	CuAssertTrue(tc, gpNvm_FlashBackend.writeAt(ctx, 300, &byte, 1) == 0);
+	CuAssertTrue(tc, gpNvm_FlashEraseCount(flash, 1) == 0);
+	byte = 0x0f;
+	CuAssertTrue(tc, gpNvm_FlashBackend.writeAt(ctx, 300, &byte, 1) == 0);
+	CuAssertTrue(tc, gpNvm_FlashEraseCount(flash, 1) == 1);
+	CuAssertTrue(tc, gpNvm_FlashBackend.readAt(ctx, 300, &sameByte, 1) == 0);
+	CuAssertTrue(tc, sameByte == 0x0f);
+	result = gpNvm_FlashGetStats(flash, &stats);
+	CuAssertTrue(tc, result == 0);
+	CuAssertTrue(tc, stats.busyUs == 3 * config.programUs + config.eraseUs);
+
+	/* does an erased range read back as 0xff? */
+	CuAssertTrue(tc, gpNvm_FlashBackend.erase(ctx, 300, 1) == 0);
+	CuAssertTrue(tc, gpNvm_FlashBackend.readAt(ctx, 300, &sameByte, 1) == 0);
+	CuAssertTrue(tc, sameByte == 0xff);
+	gpNvm_FlashBackend.close(ctx, 0);
+	gpNvm_FlashDestroy(flash);
+
+	/* is a store on a fresh device empty, and is appending free of erases? */
+	result = gpNvm_FlashCreate(&flash, &config);
+	CuAssertTrue(tc, result == 0);
+	options.backend = &gpNvm_FlashBackend;
+	options.backendArg = flash;
+	result = gpNvm_Open(&handle, NULL, &options);
+	CuAssertTrue(tc, result == 0);
+	result = gpNvm_Get(handle, attrId, &length, (UInt8 *)&sameValue);
+	CuAssertTrue(tc, result == 1);
+	result = gpNvm_Set(handle, attrId, length, (UInt8 *)&i);
+	CuAssertTrue(tc, result == 0);
+	result = gpNvm_FlashGetStats(flash, &stats);
+	CuAssertTrue(tc, result == 0);
+	CuAssertTrue(tc, stats.erases == 0);
+
+	/* does an update in place cost an erase and more programming? */
+	i = 0xaaaaaaaa;
+	result = gpNvm_Set(handle, attrId, length, (UInt8 *)&i);
+	CuAssertTrue(tc, result == 0);
+	result = gpNvm_FlashGetStats(flash, &stats);
+	CuAssertTrue(tc, result == 0);
+	CuAssertTrue(tc, stats.erases == 1);
+	CuAssertTrue(tc, gpNvm_FlashEraseCount(flash, 0) == 1);
+	result = gpNvm_GetWriteCounters(handle, &counters);
+	CuAssertTrue(tc, result == 0);
+	CuAssertTrue(tc, counters.bytes == 2 * length);
+	CuAssertTrue(tc, stats.programmed > stats.written);
+	CuAssertTrue(tc, stats.written > counters.bytes);
+	result = gpNvm_Close(handle);
+	CuAssertTrue(tc, result == 0);
+
+	/* does the device keep the store between opens? */
+	result = gpNvm_Open(&handle, NULL, &options);
+	CuAssertTrue(tc, result == 0);
+	result = gpNvm_Get(handle, attrId, &length, (UInt8 *)&sameValue);
+	CuAssertTrue(tc, result == 0);
+	CuAssertTrue(tc, sameValue == i);
+	result = gpNvm_Close(handle);
+	CuAssertTrue(tc, result == 0);
+	gpNvm_FlashDestroy(flash);
+}
+
+static void gpNvm_Recover_Test(CuTest* tc)
+{
+	gpNvm_Options options = { GPNVM_OPEN_REPAIR };
+	gpNvm_Stats stats;
+	gpNvm_Handle *handle;
+	gpNvm_AttrId attrId = 0x90;
+	gpNvm_Result result;
+	struct stat st;
+	long record;
+	UInt32 i, sameValue;
+	UInt8 length = sizeof(i);
+	FILE *f;
+
+	unlink(gpNvm_file_Test);
+	result = gpNvm_Open(&handle, gpNvm_file_Test, NULL);
+	CuAssertTrue(tc, result == 0);
+	for (i = 0; i != 10; i++) {
+		result = gpNvm_Set(handle, attrId + i, length, (UInt8 *)&i);
+		CuAssertTrue(tc, result == 0);
+	}
+	result = gpNvm_Close(handle);
+	CuAssertTrue(tc, result == 0);
+	CuAssertTrue(tc, stat(gpNvm_file_Test, &st) == 0);
+	record = (st.st_size - 8) / 10;
+
+	/* damage the header of the third record */
+	f = fopen(gpNvm_file_Test, "r+");
+	CuAssertTrue(tc, f != NULL);
+	fseek(f, 8 + 2 * record + 1, SEEK_SET);
+	fputc(0x5a, f);
+	fclose(f);
+
+	/* are the records after the damage still found? */
+	result = gpNvm_Open(&handle, gpNvm_file_Test, NULL);
+	CuAssertTrue(tc, result == 0);
+	result = gpNvm_Get(handle, attrId + 2, &length, (UInt8 *)&sameValue);
+	CuAssertTrue(tc, result == 1);
+	for (i = 3; i != 10; i++) {
+		result = gpNvm_Get(handle, attrId + i, &length, (UInt8 *)&sameValue);
+		CuAssertTrue(tc, result == 0);
+		CuAssertTrue(tc, sameValue == i);
+	}
+#if GPNVM_STATS
+	result = gpNvm_GetStats(handle, &stats);
+	CuAssertTrue(tc, result == 0);
+	CuAssertTrue(tc, stats.headerFailures == 1);
+	CuAssertTrue(tc, stats.skipped == record);
+#endif
+
+	/* is a new record appended after them, not over them? */
+	result = gpNvm_Set(handle, attrId + 2, length, (UInt8 *)&i);
+	CuAssertTrue(tc, result == 0);
+	result = gpNvm_Get(handle, attrId + 9, &length, (UInt8 *)&sameValue);
+	CuAssertTrue(tc, result == 0);
+	CuAssertTrue(tc, sameValue == 9);
+	result = gpNvm_Close(handle);
+	CuAssertTrue(tc, result == 0);
+	CuAssertTrue(tc, stat(gpNvm_file_Test, &st) == 0);
+	CuAssertTrue(tc, st.st_size == 8 + 11 * record);
+
+	/* does a repair leave a clean file? */
+	result = gpNvm_Open(&handle, gpNvm_file_Test, &options);
+	CuAssertTrue(tc, result == 0);
+	result = gpNvm_Close(handle);
+	CuAssertTrue(tc, result == 0);
+	CuAssertTrue(tc, stat(gpNvm_file_Test, &st) == 0);
+	CuAssertTrue(tc, st.st_size == 8 + 10 * record);
+	result = gpNvm_Open(&handle, gpNvm_file_Test, NULL);
+	CuAssertTrue(tc, result == 0);
+	result = gpNvm_GetStats(handle, &stats);
+	CuAssertTrue(tc, !GPNVM_STATS || stats.headerFailures == 0);
+	for (i = 0; i != 10; i++) {
+		result = gpNvm_Get(handle, attrId + i, &length, (UInt8 *)&sameValue);
+		CuAssertTrue(tc, result == 0);
+		CuAssertTrue(tc, sameValue == (i == 2 ? 10 : i));
+	}
+	result = gpNvm_Close(handle);
+	CuAssertTrue(tc, result == 0);
+}
+
+/* completions seen by gpNvm_Async_Test() */
+typedef struct {
+	int count;
+	int failed;
+	gpNvm_AttrId order[128];
+} gpNvm_Async_Done;
+
+static void gpNvm_Async_Callback(gpNvm_Handle *handle, gpNvm_AttrId attrId, gpNvm_Result result, void *arg)
+{
+	gpNvm_Async_Done *done = arg;
+
+	if (done->count < 128)
+		done->order[done->count] = attrId;
+	done->count++;
+	done->failed += result;
+}
+
+static void gpNvm_Async_Test(CuTest* tc)
+{
+	gpNvm_Async_Done done = { 0 };
+	gpNvm_Options options = { 0 };
+	gpNvm_WriteCounters counters;
+	gpNvm_Handle *handle;
+	gpNvm_AttrId attrId = 0xa0;
+	gpNvm_Result result;
+	UInt32 i, sameValue;
+	UInt8 length = sizeof(i);
+	UInt16 shorter = 0;
+
+	/* a declared attribute keeps its length, writes of another fail */
+	GPNVM_STATIC_OPTIONS(&options);
+	unlink(gpNvm_file_Test);
+	result = gpNvm_Open(&handle, gpNvm_file_Test, &options);
+	CuAssertTrue(tc, result == 0);
+
+	/* do reads see queued values at once? */
+	for (i = 0; i != 100; i++) {
+		result = gpNvm_SetAsync(handle, attrId + i % 10, length, (UInt8 *)&i,
+			gpNvm_Async_Callback, &done);
+		CuAssertTrue(tc, result == 0);
+	}
+	result = gpNvm_Get(handle, attrId + 9, &length, (UInt8 *)&sameValue);
+	CuAssertTrue(tc, result == 0);
+	CuAssertTrue(tc, sameValue == 99);
+
+	/* does every call complete, in call order, once flushed? */
+	result = gpNvm_Flush(handle);
+	CuAssertTrue(tc, result == 0);
+	CuAssertTrue(tc, done.count == 100);
+	CuAssertTrue(tc, done.failed == 0);
+	for (i = 0; i != 100; i++)
+		CuAssertTrue(tc, done.order[i] == attrId + i % 10);
+	result = gpNvm_GetWriteCounters(handle, &counters);
+	CuAssertTrue(tc, result == 0);
+	CuAssertTrue(tc, counters.writes == 100);
+	CuAssertTrue(tc, counters.records + counters.coalesced == 100);
+
+	/* does a failed write fail its completion and the flush only? */
+	result = gpNvm_SetAsync(handle, gpNvm_StaticId_options, sizeof shorter, (UInt8 *)&shorter,
+		gpNvm_Async_Callback, &done);
+	CuAssertTrue(tc, result == 0);
+	result = gpNvm_SetAsync(handle, attrId + 10, length, (UInt8 *)&i,
+		gpNvm_Async_Callback, &done);
+	CuAssertTrue(tc, result == 0);
+	result = gpNvm_Flush(handle);
+	CuAssertTrue(tc, result == 1);
+	CuAssertTrue(tc, done.count == 102);
+	CuAssertTrue(tc, done.failed == 1);
+	result = gpNvm_Flush(handle);
+	CuAssertTrue(tc, result == 0);
+
+	/* does a write after a queued one win? */
+	i = 1000;
+	result = gpNvm_SetAsync(handle, attrId + 1, length, (UInt8 *)&i, NULL, NULL);
+	CuAssertTrue(tc, result == 0);
+	i = 1001;
+	result = gpNvm_Set(handle, attrId + 1, length, (UInt8 *)&i);
+	CuAssertTrue(tc, result == 0);
+
+	/* is the queue written out at close? */
+	i = 1002;
+	result = gpNvm_SetAsync(handle, attrId + 2, length, (UInt8 *)&i, NULL, NULL);
+	CuAssertTrue(tc, result == 0);
+	result = gpNvm_Close(handle);
+	CuAssertTrue(tc, result == 0);
+
+	result = gpNvm_Open(&handle, gpNvm_file_Test, NULL);
+	CuAssertTrue(tc, result == 0);
+	for (i = 0; i != 11; i++) {
+		result = gpNvm_Get(handle, attrId + i, &length, (UInt8 *)&sameValue);
+		CuAssertTrue(tc, result == 0);
+		CuAssertTrue(tc, sameValue == (i == 1 ? 1001 : i == 2 ? 1002 : i == 10 ? 100 : 90 + i));
+	}
+	result = gpNvm_Close(handle);
+	CuAssertTrue(tc, result == 0);
+}
+
+static void gpNvm_Bulk_Test(CuTest* tc)
+{
+	gpNvm_Options modes[] = { { 0 }, { GPNVM_OPEN_MMAP } };
+	gpNvm_AttrId attrIds[41];
+	UInt8 lengths[41], *values[41];
+	UInt32 stored[41], read[41];
+	gpNvm_Result results[41];
+	gpNvm_Handle *handle;
+	gpNvm_Result result;
+	UInt16 shorter = 7;
+	int i, m;
+
+	for (m = 0; m != 2; m++) {
+		/* a declared attribute keeps its length, writes of another fail */
+		GPNVM_STATIC_OPTIONS(&modes[m]);
+		unlink(gpNvm_file_Test);
+		result = gpNvm_Open(&handle, gpNvm_file_Test, &modes[m]);
+		CuAssertTrue(tc, result == 0);
+
+		/* are all attributes written, in any order? */
+		for (i = 0; i != 40; i++) {
+			attrIds[i] = 0x40 + (i * 7) % 40;
+			stored[i] = i;
+			lengths[i] = sizeof stored[i];
+			values[i] = (UInt8 *)&stored[i];
+		}
+		result = gpNvm_SetMany(handle, 40, attrIds, lengths, values, results);
+		CuAssertTrue(tc, result == 0);
+		for (i = 0; i != 40; i++)
+			CuAssertTrue(tc, results[i] == 0);
+
+		/* does a length that does not fit fail on its own? */
+		stored[0] = 100;
+		attrIds[1] = attrIds[0];
+		stored[1] = 101;
+		attrIds[2] = gpNvm_StaticId_options;
+		lengths[2] = sizeof shorter;
+		values[2] = (UInt8 *)&shorter;
+		result = gpNvm_SetMany(handle, 3, attrIds, lengths, values, results);
+		CuAssertTrue(tc, result == 1);
+		CuAssertTrue(tc, results[0] == 0 && results[1] == 0 && results[2] == 1);
+
+		/* are all attributes read back, and a missing one reported? */
+		for (i = 0; i != 41; i++) {
+			attrIds[i] = 0x40 + i;
+			lengths[i] = sizeof read[i];
+			values[i] = (UInt8 *)&read[i];
+		}
+		result = gpNvm_GetMany(handle, 41, attrIds, lengths, values, results);
+		CuAssertTrue(tc, result == 1);
+		for (i = 0; i != 40; i++) {
+			CuAssertTrue(tc, results[i] == 0);
+			CuAssertTrue(tc, read[i] == (i == 0 ? 101 : (i * 23) % 40));
+		}
+		CuAssertTrue(tc, results[40] == 1);
+		result = gpNvm_GetMany(handle, 40, attrIds, lengths, values, NULL);
+		CuAssertTrue(tc, result == 0);
+
+		/* does a wrong length fail the read of that attribute only? */
+		lengths[5] = sizeof shorter;
+		result = gpNvm_GetMany(handle, 10, attrIds, lengths, values, results);
+		CuAssertTrue(tc, result == 1);
+		for (i = 0; i != 10; i++)
+			CuAssertTrue(tc, results[i] == (i == 5));
+
+		result = gpNvm_Close(handle);
+		CuAssertTrue(tc, result == 0);
+	}
+}
+
+static void gpNvm_Snapshot_Test(CuTest* tc)
+{
+	const char *snapshot = "test.snap";
+	gpNvm_Options log = { GPNVM_OPEN_LOG }, memory = { 0 };
+	gpNvm_Handle *handle, *other;
+	gpNvm_AttrId attrId = 0xb0;
+	gpNvm_Result result;
+	UInt32 i, sameValue;
+	UInt8 length = sizeof(i);
+	FILE *f;
+
+	memory.backend = &gpNvm_MemoryBackend;
+	unlink(gpNvm_file_Test);
+	result = gpNvm_Open(&handle, gpNvm_file_Test, &log);
+	CuAssertTrue(tc, result == 0);
+	for (i = 0; i != 40; i++) {
+		result = gpNvm_Set(handle, attrId + i % 20, length, (UInt8 *)&i);
+		CuAssertTrue(tc, result == 0);
+	}
+	i = 1000;
+	result = gpNvm_SetAsync(handle, attrId, length, (UInt8 *)&i, NULL, NULL);
+	CuAssertTrue(tc, result == 0);
+
+	/* does the snapshot hold the live values, the queued one too? */
+	result = gpNvm_ExportSnapshot(handle, snapshot);
+	CuAssertTrue(tc, result == 0);
+	result = gpNvm_Close(handle);
+	CuAssertTrue(tc, result == 0);
+
+	result = gpNvm_Open(&other, NULL, &memory);
+	CuAssertTrue(tc, result == 0);
+	i = 7;
+	result = gpNvm_Set(other, attrId + 20, length, (UInt8 *)&i);
+	CuAssertTrue(tc, result == 0);
+	result = gpNvm_ImportSnapshot(other, snapshot);
+	CuAssertTrue(tc, result == 0);
+	for (i = 0; i != 20; i++) {
+		result = gpNvm_Get(other, attrId + i, &length, (UInt8 *)&sameValue);
+		CuAssertTrue(tc, result == 0);
+		CuAssertTrue(tc, sameValue == (i ? 20 + i : 1000));
+	}
+
+	/* does the import replace the store as a whole? */
+	result = gpNvm_Get(other, attrId + 20, &length, (UInt8 *)&sameValue);
+	CuAssertTrue(tc, result == 1);
+
+	/* is a log snapshot written to after the import? */
+	i = 2000;
+	result = gpNvm_Set(other, attrId + 1, length, (UInt8 *)&i);
+	CuAssertTrue(tc, result == 0);
+	result = gpNvm_Get(other, attrId + 1, &length, (UInt8 *)&sameValue);
+	CuAssertTrue(tc, result == 0);
+	CuAssertTrue(tc, sameValue == 2000);
+
+	/* is a damaged snapshot refused, and the store left alone? */
+	f = fopen(snapshot, "r+");
+	CuAssertTrue(tc, f != NULL);
+	fseek(f, 20, SEEK_SET);
+	fputc(0x5a, f);
+	fclose(f);
+	result = gpNvm_ImportSnapshot(other, snapshot);
+	CuAssertTrue(tc, result == 1);
+	result = gpNvm_Get(other, attrId + 1, &length, (UInt8 *)&sameValue);
+	CuAssertTrue(tc, result == 0);
+	CuAssertTrue(tc, sameValue == 2000);
+	result = gpNvm_ImportSnapshot(other, "missing.snap");
+	CuAssertTrue(tc, result == 1);
+
+	result = gpNvm_Close(other);
+	CuAssertTrue(tc, result == 0);
+	unlink(snapshot);
+}
+
+static void gpNvm_Toc_Test(CuTest* tc)
+{
+	gpNvm_Options options[2] = { { GPNVM_OPEN_TOC | GPNVM_OPEN_LOG }, { GPNVM_OPEN_TOC } };
+	gpNvm_Handle *handle;
+	gpNvm_AttrId attrId = 0xc0;
+	gpNvm_Result result;
+	UInt32 i, sameValue;
+	UInt8 length = sizeof(i), saved[36 + 64 * 13];
+	FILE *f;
+	int m;
+#if GPNVM_STATS
+	gpNvm_Stats stats;
+#endif
+
+	for (m = 0; m != 2; m++) {
+		unlink(gpNvm_file_Test);
+		result = gpNvm_Open(&handle, gpNvm_file_Test, &options[m]);
+		CuAssertTrue(tc, result == 0);
+		for (i = 0; i != 40; i++) {
+			result = gpNvm_Set(handle, attrId + i % 20, length, (UInt8 *)&i);
+			CuAssertTrue(tc, result == 0);
+		}
+		result = gpNvm_Close(handle);
+		CuAssertTrue(tc, result == 0);
+
+		/* does open trust the table of contents, without a scan? */
+		result = gpNvm_Open(&handle, gpNvm_file_Test, &options[m]);
+		CuAssertTrue(tc, result == 0);
+#if GPNVM_STATS
+		result = gpNvm_GetStats(handle, &stats);
+		CuAssertTrue(tc, result == 0);
+		CuAssertTrue(tc, stats.scanned == 0);
+#endif
+		for (i = 0; i != 20; i++) {
+			result = gpNvm_Get(handle, attrId + i, &length, (UInt8 *)&sameValue);
+			CuAssertTrue(tc, result == 0);
+			CuAssertTrue(tc, sameValue == 20 + i);
+		}
+
+		/* are records written after the table was are found by the tail scan? */
+		f = fopen(gpNvm_file_Test, "rb");
+		CuAssertTrue(tc, f != NULL);
+		CuAssertTrue(tc, fread(saved, sizeof saved, 1, f) == 1);
+		fclose(f);
+		i = 100;
+		result = gpNvm_Set(handle, attrId + 1, length, (UInt8 *)&i);
+		CuAssertTrue(tc, result == 0);
+		result = gpNvm_Set(handle, attrId + 20, length, (UInt8 *)&i);
+		CuAssertTrue(tc, result == 0);
+		result = gpNvm_Close(handle);
+		CuAssertTrue(tc, result == 0);
+		f = fopen(gpNvm_file_Test, "r+b");
+		CuAssertTrue(tc, f != NULL);
+		CuAssertTrue(tc, fwrite(saved, sizeof saved, 1, f) == 1);
+		fclose(f);
+
+		result = gpNvm_Open(&handle, gpNvm_file_Test, &options[m]);
+		CuAssertTrue(tc, result == 0);
+		for (i = 0; i != 21; i++) {
+			result = gpNvm_Get(handle, attrId + i, &length, (UInt8 *)&sameValue);
+			CuAssertTrue(tc, result == 0);
+			CuAssertTrue(tc, sameValue == (i == 1 || i == 20 ? 100 : 20 + i));
+		}
+		result = gpNvm_Close(handle);
+		CuAssertTrue(tc, result == 0);
+
+		/* does a damaged table fall back to a full scan, and is it rebuilt? */
+		f = fopen(gpNvm_file_Test, "r+b");
+		CuAssertTrue(tc, f != NULL);
+		fseek(f, 36 + 5, SEEK_SET);
+		fputc(0x5a, f);
+		fclose(f);
+		result = gpNvm_Open(&handle, gpNvm_file_Test, &options[m]);
+		CuAssertTrue(tc, result == 0);
+#if GPNVM_STATS
+		result = gpNvm_GetStats(handle, &stats);
+		CuAssertTrue(tc, result == 0);
+		CuAssertTrue(tc, stats.scanned != 0);
+#endif
+		for (i = 0; i != 21; i++) {
+			result = gpNvm_Get(handle, attrId + i, &length, (UInt8 *)&sameValue);
+			CuAssertTrue(tc, result == 0);
+			CuAssertTrue(tc, sameValue == (i == 1 || i == 20 ? 100 : 20 + i));
+		}
+
+		/* does the table grow past its first size? */
+		for (i = 0; i != 100; i++) {
+			result = gpNvm_Set(handle, 1 + i, length, (UInt8 *)&i);
+			CuAssertTrue(tc, result == 0);
+		}
+		result = gpNvm_Close(handle);
+		CuAssertTrue(tc, result == 0);
+
+		result = gpNvm_Open(&handle, gpNvm_file_Test, &options[m]);
+		CuAssertTrue(tc, result == 0);
+#if GPNVM_STATS
+		result = gpNvm_GetStats(handle, &stats);
+		CuAssertTrue(tc, result == 0);
+		CuAssertTrue(tc, stats.scanned == 0);
+#endif
+		for (i = 0; i != 100; i++) {
+			result = gpNvm_Get(handle, 1 + i, &length, (UInt8 *)&sameValue);
+			CuAssertTrue(tc, result == 0);
+			CuAssertTrue(tc, sameValue == i);
+		}
+		result = gpNvm_Get(handle, attrId + 1, &length, (UInt8 *)&sameValue);
+		CuAssertTrue(tc, result == 0);
+		CuAssertTrue(tc, sameValue == 100);
+		result = gpNvm_Close(handle);
+		CuAssertTrue(tc, result == 0);
+	}
+
+	/* is a file without a table of contents migrated to one? */
+	unlink(gpNvm_file_Test);
+	result = gpNvm_Open(&handle, gpNvm_file_Test, NULL);
+	CuAssertTrue(tc, result == 0);
+	for (i = 0; i != 10; i++) {
+		result = gpNvm_Set(handle, attrId + i, length, (UInt8 *)&i);
+		CuAssertTrue(tc, result == 0);
+	}
+	result = gpNvm_Close(handle);
+	CuAssertTrue(tc, result == 0);
+	result = gpNvm_Open(&handle, gpNvm_file_Test, &options[1]);
+	CuAssertTrue(tc, result == 0);
+	result = gpNvm_Set(handle, attrId, length, (UInt8 *)&i);
+	CuAssertTrue(tc, result == 0);
+	result = gpNvm_Close(handle);
+	CuAssertTrue(tc, result == 0);
+	result = gpNvm_Open(&handle, gpNvm_file_Test, &options[1]);
+	CuAssertTrue(tc, result == 0);
+#if GPNVM_STATS
+	result = gpNvm_GetStats(handle, &stats);
+	CuAssertTrue(tc, result == 0);
+	CuAssertTrue(tc, stats.scanned == 0);
+#endif
+	for (i = 1; i != 10; i++) {
+		result = gpNvm_Get(handle, attrId + i, &length, (UInt8 *)&sameValue);
+		CuAssertTrue(tc, result == 0);
+		CuAssertTrue(tc, sameValue == i);
+	}
+	result = gpNvm_Close(handle);
+	CuAssertTrue(tc, result == 0);
+}
+
+static void gpNvm_Static_Test(CuTest* tc)
+{
+	gpNvm_Options options = { 0 }, logged = { GPNVM_OPEN_LOG };
+	gpNvm_Handle *handle;
+	gpNvm_Result result;
+	gpTestData_t test = { 1, 0x12345678, 3, { 1, 2, 3 } }, sameTest;
+	UInt32 value = 0x55aa, sameValue;
+	UInt8 channel = 11, length;
+	long at = 8 + offsetof(gpNvm_StaticLayout, test) + 1 + sizeof(gpNvm_AttrId) + 1 + 4;
+	FILE *f;
+
+	GPNVM_STATIC_OPTIONS(&options);
+	GPNVM_STATIC_OPTIONS(&logged);
+
+	/* is a schema refused for the log format? */
+	unlink(gpNvm_file_Test);
+	result = gpNvm_Open(&handle, gpNvm_file_Test, &logged);
+	CuAssertTrue(tc, result == 1);
+
+	/* is a file written without the schema laid out on the first write,
+	 * keeping the values? */
+	result = gpNvm_Open(&handle, gpNvm_file_Test, NULL);
+	CuAssertTrue(tc, result == 0);
+	result = gpNvm_Set(handle, 0x10, sizeof value, (UInt8 *)&value);
+	CuAssertTrue(tc, result == 0);
+	result = gpNvm_Set(handle, 0xe1, sizeof test, (UInt8 *)&test);
+	CuAssertTrue(tc, result == 0);
+	result = gpNvm_Close(handle);
+	CuAssertTrue(tc, result == 0);
+
+	result = gpNvm_Open(&handle, gpNvm_file_Test, &options);
+	CuAssertTrue(tc, result == 0);
+	result = GPNVM_STATIC_GET(handle, test, &sameTest);
+	CuAssertTrue(tc, result == 0);
+	CuAssertTrue(tc, memcmp(&test, &sameTest, sizeof test) == 0);
+	result = GPNVM_STATIC_SET(handle, channel, &channel);
+	CuAssertTrue(tc, result == 0);
+
+	/* are the other declared attributes there, as zeros? */
+	result = GPNVM_STATIC_GET(handle, options, &sameValue);
+	CuAssertTrue(tc, result == 0);
+	CuAssertTrue(tc, sameValue == 0);
+	result = gpNvm_GetLength(handle, 0xe0, &length);
+	CuAssertTrue(tc, result == 0);
+	CuAssertTrue(tc, length == sizeof(UInt32));
+
+	/* is a declared attribute refused at another size? */
+	result = gpNvm_Set(handle, 0xe0, 2, (UInt8 *)&value);
+	CuAssertTrue(tc, result == 1);
+
+	/* does the static read see a value staged by a batch? */
+	result = gpNvm_BeginBatch(handle);
+	CuAssertTrue(tc, result == 0);
+	result = GPNVM_STATIC_SET(handle, options, &value);
+	CuAssertTrue(tc, result == 0);
+	result = GPNVM_STATIC_GET(handle, options, &sameValue);
+	CuAssertTrue(tc, result == 0);
+	CuAssertTrue(tc, sameValue == value);
+	result = gpNvm_CommitBatch(handle);
+	CuAssertTrue(tc, result == 0);
+	result = gpNvm_Close(handle);
+	CuAssertTrue(tc, result == 0);
+
+	/* is the record where the build put it? */
+	f = fopen(gpNvm_file_Test, "rb");
+	CuAssertTrue(tc, f != NULL);
+	fseek(f, at, SEEK_SET);
+	CuAssertTrue(tc, fread(&sameTest, sizeof test, 1, f) == 1);
+	fclose(f);
+	CuAssertTrue(tc, memcmp(&sameTest, &test, sizeof test) == 0);
+
+	/* are all values read back, the undeclared one too? */
+	result = gpNvm_Open(&handle, gpNvm_file_Test, &options);
+	CuAssertTrue(tc, result == 0);
+	result = GPNVM_STATIC_GET(handle, channel, &length);
+	CuAssertTrue(tc, result == 0);
+	CuAssertTrue(tc, length == channel);
+	result = GPNVM_STATIC_GET(handle, options, &sameValue);
+	CuAssertTrue(tc, result == 0);
+	CuAssertTrue(tc, sameValue == value);
+	length = sizeof sameValue;
+	result = gpNvm_Get(handle, 0x10, &length, (UInt8 *)&sameValue);
+	CuAssertTrue(tc, result == 0);
+	CuAssertTrue(tc, sameValue == value);
+
+	/* is a damaged declared record detected? */
+	result = gpNvm_Close(handle);
+	CuAssertTrue(tc, result == 0);
+	f = fopen(gpNvm_file_Test, "r+b");
+	CuAssertTrue(tc, f != NULL);
+	fseek(f, at + 4, SEEK_SET);
+	fputc(0x5a, f);
+	fclose(f);
+	result = gpNvm_Open(&handle, gpNvm_file_Test, &options);
+	CuAssertTrue(tc, result == 0);
+	result = GPNVM_STATIC_GET(handle, test, &sameTest);
+	CuAssertTrue(tc, result == 1);
+	result = GPNVM_STATIC_SET(handle, test, &test);
+	CuAssertTrue(tc, result == 0);
+	result = GPNVM_STATIC_GET(handle, test, &sameTest);
+	CuAssertTrue(tc, result == 0);
+	CuAssertTrue(tc, memcmp(&test, &sameTest, sizeof test) == 0);
+	result = gpNvm_Close(handle);
+	CuAssertTrue(tc, result == 0);
+}
+
+/* persists seen by the counting backend of gpNvm_Durability_Test() */
+static int gpNvm_Durability_persists;
+static int gpNvm_Durability_full;
+static int gpNvm_Durability_fail;
+
+static int gpNvm_Durability_Persist(void *ctx, int full)
+{
+	__atomic_add_fetch(&gpNvm_Durability_persists, 1, __ATOMIC_RELAXED);
+	if (full)
+		__atomic_add_fetch(&gpNvm_Durability_full, 1, __ATOMIC_RELAXED);
+	/* slow enough for writers to queue up behind it */
+	usleep(1000);
+	return gpNvm_Durability_fail;
+}
+
+static void *gpNvm_Durability_Run(void *p)
+{
+	gpNvm_Threads_Arg *arg = p;
+	UInt32 i;
+
+	for (i = 0; i != (UInt32)arg->rounds; i++)
+		if (gpNvm_Set(arg->handle, arg->writer, sizeof(i), (UInt8 *)&i))
+			arg->errors++;
+	return NULL;
+}
+
+static void gpNvm_Durability_Test(CuTest* tc)
+{
+	gpNvm_Options options = { 0 };
+	gpNvm_Backend counting = gpNvm_MemoryBackend;
+	gpNvm_WriteCounters counters;
+	gpNvm_Threads_Arg args[8];
+	pthread_t threads[8];
+	gpNvm_Handle *handle;
+	gpNvm_AttrId attrId = 0x40;
+	gpNvm_Result result;
+	UInt32 i;
+	int total;
+
+	counting.persist = gpNvm_Durability_Persist;
+	options.backend = &counting;
+
+	/* is an unknown level refused? */
+	options.durability = GPNVM_DURABILITY_FULL + 1;
+	result = gpNvm_Open(&handle, NULL, &options);
+	CuAssertTrue(tc, result == 1);
+
+	/* does the default level leave persisting to gpNvm_Sync()? */
+	options.durability = GPNVM_DURABILITY_NONE;
+	result = gpNvm_Open(&handle, NULL, &options);
+	CuAssertTrue(tc, result == 0);
+	for (i = 0; i != 10; i++) {
+		result = gpNvm_Set(handle, attrId, sizeof(i), (UInt8 *)&i);
+		CuAssertTrue(tc, result == 0);
+	}
+	CuAssertIntEquals(tc, 0, gpNvm_Durability_persists);
+	result = gpNvm_Sync(handle);
+	CuAssertTrue(tc, result == 0);
+	CuAssertIntEquals(tc, 1, gpNvm_Durability_persists);
+	CuAssertIntEquals(tc, 1, gpNvm_Durability_full);
+
+	/* is a second sync with nothing written in between free? */
+	result = gpNvm_Sync(handle);
+	CuAssertTrue(tc, result == 0);
+	CuAssertIntEquals(tc, 1, gpNvm_Durability_persists);
+	result = gpNvm_Close(handle);
+	CuAssertTrue(tc, result == 0);
+
+	/* is every write persisted before it returns, data only? */
+	gpNvm_Durability_persists = gpNvm_Durability_full = 0;
+	options.durability = GPNVM_DURABILITY_DATA;
+	result = gpNvm_Open(&handle, NULL, &options);
+	CuAssertTrue(tc, result == 0);
+	for (i = 0; i != 10; i++) {
+		result = gpNvm_Set(handle, attrId, sizeof(i), (UInt8 *)&i);
+		CuAssertTrue(tc, result == 0);
+	}
+	CuAssertIntEquals(tc, 10, gpNvm_Durability_persists);
+	CuAssertIntEquals(tc, 0, gpNvm_Durability_full);
+	result = gpNvm_GetWriteCounters(handle, &counters);
+	CuAssertTrue(tc, result == 0);
+	CuAssertTrue(tc, counters.persists == 10);
+
+	/* do concurrent writers share their persists? */
+	gpNvm_Durability_persists = 0;
+	for (i = 0; i != 8; i++) {
+		args[i].handle = handle;
+		args[i].writer = attrId + 1 + i;
+		args[i].rounds = 50;
+		args[i].errors = 0;
+		result = pthread_create(&threads[i], NULL, gpNvm_Durability_Run, &args[i]);
+		CuAssertTrue(tc, result == 0);
+	}
+	for (i = 0; i != 8; i++) {
+		pthread_join(threads[i], NULL);
+		CuAssertIntEquals(tc, 0, args[i].errors);
+	}
+	total = gpNvm_Durability_persists;
+	CuAssertTrue(tc, total > 0);
+	CuAssertTrue(tc, total < 8 * 50);
+
+	/* does a failed persist fail the write? */
+	gpNvm_Durability_fail = 1;
+	result = gpNvm_Set(handle, attrId, sizeof(i), (UInt8 *)&i);
+	CuAssertTrue(tc, result == 1);
+
+	/* and do the writes after it persist again? */
+	gpNvm_Durability_fail = 0;
+	result = gpNvm_Set(handle, attrId + 1, sizeof(i), (UInt8 *)&i);
+	CuAssertTrue(tc, result == 0);
+	result = gpNvm_Close(handle);
+	CuAssertTrue(tc, result == 0);
+
+	/* is the metadata persisted as well at the full level? */
+	gpNvm_Durability_persists = gpNvm_Durability_full = 0;
+	options.durability = GPNVM_DURABILITY_FULL;
+	result = gpNvm_Open(&handle, NULL, &options);
+	CuAssertTrue(tc, result == 0);
+	result = gpNvm_Set(handle, attrId, sizeof(i), (UInt8 *)&i);
+	CuAssertTrue(tc, result == 0);
+	CuAssertIntEquals(tc, 1, gpNvm_Durability_full);
+	result = gpNvm_Close(handle);
+	CuAssertTrue(tc, result == 0);
+}
+
+static void gpNvm_Shared_Test(CuTest* tc)
+{
+	static const char *segment = "test.nvm.shm";
+	gpNvm_Options options = { GPNVM_OPEN_SHARED };
+	gpNvm_Handle *a, *b;
+	gpNvm_Result result;
+	const UInt8 *view;
+	UInt8 value[16], length;
+	unsigned long gen;
+	int i, fd, status, errors;
+	pid_t pid;
+#if GPNVM_STATS
+	gpNvm_Stats stats;
+#endif
+
+	unlink(gpNvm_file_Test);
+	unlink(segment);
+
+	/* is shared mode refused where a process can not follow the file? */
+	options.flags = GPNVM_OPEN_SHARED | GPNVM_OPEN_MMAP;
+	result = gpNvm_Open(&a, gpNvm_file_Test, &options);
+	CuAssertTrue(tc, result == 1);
+	options.flags = GPNVM_OPEN_SHARED;
+	options.backend = &gpNvm_MemoryBackend;
+	result = gpNvm_Open(&a, NULL, &options);
+	CuAssertTrue(tc, result == 1);
+	options.backend = NULL;
+
+	/* does a second handle see what the first one appends? */
+	result = gpNvm_Open(&a, gpNvm_file_Test, &options);
+	CuAssertTrue(tc, result == 0);
+	result = gpNvm_Open(&b, gpNvm_file_Test, &options);
+	CuAssertTrue(tc, result == 0);
+	for (i = 0; i != 32; i++) {
+		memset(value, 0xff, sizeof value);
+		result = gpNvm_Set(a, i, sizeof value, value);
+		CuAssertTrue(tc, result == 0);
+	}
+	length = sizeof value;
+	result = gpNvm_Get(b, 31, &length, value);
+	CuAssertTrue(tc, result == 0);
+	CuAssertTrue(tc, value[0] == 0xff);
+#if GPNVM_STATS
+	result = gpNvm_GetStats(b, &stats);
+	CuAssertTrue(tc, result == 0);
+	CuAssertTrue(tc, stats.sharedRefreshes >= 1);
+#endif
+
+	/* and the first one what the second writes in place? */
+	memset(value, 0x11, sizeof value);
+	result = gpNvm_Set(b, 7, sizeof value, value);
+	CuAssertTrue(tc, result == 0);
+	result = gpNvm_Get(a, 7, &length, value);
+	CuAssertTrue(tc, result == 0);
+	CuAssertTrue(tc, value[0] == 0x11);
+	result = gpNvm_GetLength(a, 7, &length);
+	CuAssertTrue(tc, result == 0);
+	CuAssertTrue(tc, length == sizeof value);
+
+	/* are views refused, as another process may write at any time? */
+	result = gpNvm_GetView(a, 7, &view, &length);
+	CuAssertTrue(tc, result == 1);
+
+	/* do reads in one process see every value whole while another one
+	 * writes in place and appends? */
+	pid = fork();
+	CuAssertTrue(tc, pid >= 0);
+	if (pid == 0) {
+		gpNvm_Handle *child;
+
+		errors = gpNvm_Open(&child, gpNvm_file_Test, &options);
+		for (i = 0; !errors && i != 2000; i++) {
+			memset(value, i, sizeof value);
+			errors += gpNvm_Set(child, i % 64, sizeof value, value);
+		}
+		errors += gpNvm_Close(child);
+		_exit(errors != 0);
+	}
+	for (i = 0, errors = 0; waitpid(pid, &status, WNOHANG) == 0; i++) {
+		length = sizeof value;
+		if (gpNvm_Get(a, i % 32, &length, value) ||
+		    !gpNvm_Threads_Consistent(value, length))
+			errors++;
+	}
+	CuAssertIntEquals(tc, 0, errors);
+	CuAssertTrue(tc, WIFEXITED(status) && WEXITSTATUS(status) == 0);
+	for (i = 0; i != 64; i++) {
+		length = sizeof value;
+		result = gpNvm_Get(b, i, &length, value);
+		CuAssertTrue(tc, result == 0);
+		CuAssertTrue(tc, gpNvm_Threads_Consistent(value, length));
+	}
+
+	/* does a read take over from a writer that died part way through? The
+	 * generation is the first 64-bit field of the segment, at byte 16 */
+	fd = open(segment, O_RDWR);
+	CuAssertTrue(tc, fd >= 0);
+	CuAssertTrue(tc, pread(fd, &gen, sizeof gen, 16) == sizeof gen);
+	gen |= 1;
+	CuAssertTrue(tc, pwrite(fd, &gen, sizeof gen, 16) == sizeof gen);
+	length = sizeof value;
+	result = gpNvm_Get(a, 40, &length, value);
+	CuAssertTrue(tc, result == 0);
+	CuAssertTrue(tc, gpNvm_Threads_Consistent(value, length));
+	CuAssertTrue(tc, pread(fd, &gen, sizeof gen, 16) == sizeof gen);
+	CuAssertTrue(tc, (gen & 1) == 0);
+	close(fd);
+
+	/* and does the other handle still read after it? */
+	result = gpNvm_Get(b, 40, &length, value);
+	CuAssertTrue(tc, result == 0);
+	result = gpNvm_Close(b);
+	CuAssertTrue(tc, result == 0);
+	result = gpNvm_Close(a);
+	CuAssertTrue(tc, result == 0);
+
+	/* is the file whole for a handle that does not share? */
+	options.flags = 0;
+	result = gpNvm_Open(&a, gpNvm_file_Test, &options);
+	CuAssertTrue(tc, result == 0);
+	for (i = 0; i != 64; i++) {
+		length = sizeof value;
+		result = gpNvm_Get(a, i, &length, value);
+		CuAssertTrue(tc, result == 0);
+		CuAssertTrue(tc, gpNvm_Threads_Consistent(value, length));
+	}
+	result = gpNvm_Close(a);
+	CuAssertTrue(tc, result == 0);
+	unlink(segment);
+}
+
+/* notifications seen by gpNvm_Notify_Test(), per attribute */
+typedef struct {
+	int count[256];
+} gpNvm_Notify_Seen;
+
+static void gpNvm_Notify_Callback(gpNvm_Handle *handle, gpNvm_AttrId attrId, void *arg)
+{
+	gpNvm_Notify_Seen *seen = arg;
+
+	seen->count[attrId & 0xff]++;
+}
+
+static void gpNvm_Notify_Test(CuTest* tc)
+{
+	static const char *segment = "test.nvm.shm";
+	gpNvm_Options options = { GPNVM_OPEN_SHARED };
+	gpNvm_Notify_Seen seen = { { 0 } };
+	gpNvm_AttrId ids[8];
+	gpNvm_Handle *handle;
+	gpNvm_Result result;
+	struct pollfd pfd;
+	UInt8 value[4] = { 1, 2, 3, 4 };
+	int i, fd, count, status;
+	pid_t pid;
+
+	unlink(gpNvm_file_Test);
+	result = gpNvm_Open(&handle, gpNvm_file_Test, NULL);
+	CuAssertTrue(tc, result == 0);
+	result = gpNvm_Subscribe(handle, 1, NULL, NULL);
+	CuAssertTrue(tc, result == 1);
+	result = gpNvm_Subscribe(handle, 1, gpNvm_Notify_Callback, &seen);
+	CuAssertTrue(tc, result == 0);
+	result = gpNvm_Subscribe(handle, 2, gpNvm_Notify_Callback, &seen);
+	CuAssertTrue(tc, result == 0);
+
+	/* is a subscription told of a new value, but not of the same one? */
+	result = gpNvm_Set(handle, 1, sizeof value, value);
+	CuAssertTrue(tc, result == 0);
+	CuAssertIntEquals(tc, 1, seen.count[1]);
+	result = gpNvm_Set(handle, 1, sizeof value, value);
+	CuAssertTrue(tc, result == 0);
+	CuAssertIntEquals(tc, 1, seen.count[1]);
+	value[0] = 5;
+	result = gpNvm_Set(handle, 1, sizeof value, value);
+	CuAssertTrue(tc, result == 0);
+	CuAssertIntEquals(tc, 2, seen.count[1]);
+	result = gpNvm_Set(handle, 3, sizeof value, value);
+	CuAssertTrue(tc, result == 0);
+	CuAssertIntEquals(tc, 0, seen.count[3]);
+
+	/* is the descriptor quiet until something changes? */
+	result = gpNvm_ReadChanges(handle, ids, &count);
+	CuAssertTrue(tc, result == 1);
+	result = gpNvm_GetNotifyFd(handle, &fd);
+	CuAssertTrue(tc, result == 0);
+	pfd.fd = fd;
+	pfd.events = POLLIN;
+	CuAssertIntEquals(tc, 0, poll(&pfd, 1, 0));
+	result = gpNvm_Set(handle, 1, sizeof value, value);
+	CuAssertTrue(tc, result == 0);
+	CuAssertIntEquals(tc, 0, poll(&pfd, 1, 0));
+
+	/* is a batch told once, with only the attributes it changed? */
+	result = gpNvm_BeginBatch(handle);
+	CuAssertTrue(tc, result == 0);
+	value[0] = 6;
+	result = gpNvm_Set(handle, 1, sizeof value, value);
+	CuAssertTrue(tc, result == 0);
+	result = gpNvm_Set(handle, 2, sizeof value, value);
+	CuAssertTrue(tc, result == 0);
+	value[0] = 5;
+	result = gpNvm_Set(handle, 3, sizeof value, value);
+	CuAssertTrue(tc, result == 0);
+	CuAssertIntEquals(tc, 0, poll(&pfd, 1, 0));
+	result = gpNvm_CommitBatch(handle);
+	CuAssertTrue(tc, result == 0);
+	CuAssertIntEquals(tc, 3, seen.count[1]);
+	CuAssertIntEquals(tc, 1, seen.count[2]);
+	CuAssertIntEquals(tc, 1, poll(&pfd, 1, 0));
+	count = 8;
+	result = gpNvm_ReadChanges(handle, ids, &count);
+	CuAssertTrue(tc, result == 0);
+	CuAssertIntEquals(tc, 2, count);
+	CuAssertTrue(tc, (ids[0] == 1 && ids[1] == 2) || (ids[0] == 2 && ids[1] == 1));
+	CuAssertIntEquals(tc, 0, poll(&pfd, 1, 0));
+	count = 8;
+	result = gpNvm_ReadChanges(handle, ids, &count);
+	CuAssertTrue(tc, result == 0);
+	CuAssertIntEquals(tc, 0, count);
+
+	/* and queued writes once they are written? */
+	result = gpNvm_SetAsync(handle, 2, sizeof value, value, NULL, NULL);
+	CuAssertTrue(tc, result == 0);
+	result = gpNvm_Flush(handle);
+	CuAssertTrue(tc, result == 0);
+	CuAssertIntEquals(tc, 2, seen.count[2]);
+
+	/* does a reader that fell behind learn it lost changes? */
+	for (i = 0; i != 300; i++) {
+		value[0] = i;
+		result = gpNvm_Set(handle, 4, sizeof value, value);
+		CuAssertTrue(tc, result == 0);
+	}
+	count = 8;
+	result = gpNvm_ReadChanges(handle, ids, &count);
+	CuAssertTrue(tc, result == 0);
+	CuAssertIntEquals(tc, -1, count);
+
+	/* is a dropped subscription quiet? */
+	result = gpNvm_Unsubscribe(handle, 1, gpNvm_Notify_Callback, &seen);
+	CuAssertTrue(tc, result == 0);
+	result = gpNvm_Unsubscribe(handle, 1, gpNvm_Notify_Callback, &seen);
+	CuAssertTrue(tc, result == 1);
+	value[0] = 7;
+	result = gpNvm_Set(handle, 1, sizeof value, value);
+	CuAssertTrue(tc, result == 0);
+	CuAssertIntEquals(tc, 3, seen.count[1]);
+
+	/* does an import tell every subscription and every descriptor? */
+	result = gpNvm_ExportSnapshot(handle, "test.snap");
+	CuAssertTrue(tc, result == 0);
+	count = 8;
+	result = gpNvm_ReadChanges(handle, ids, &count);
+	CuAssertTrue(tc, result == 0);
+	result = gpNvm_ImportSnapshot(handle, "test.snap");
+	CuAssertTrue(tc, result == 0);
+	CuAssertIntEquals(tc, 3, seen.count[2]);
+	count = 8;
+	result = gpNvm_ReadChanges(handle, ids, &count);
+	CuAssertTrue(tc, result == 0);
+	CuAssertIntEquals(tc, -1, count);
+	unlink("test.snap");
+	result = gpNvm_Close(handle);
+	CuAssertTrue(tc, result == 0);
+
+	/* does the descriptor of a shared store see the writes of another
+	 * process, but not those that change nothing? */
+	unlink(gpNvm_file_Test);
+	unlink(segment);
+	result = gpNvm_Open(&handle, gpNvm_file_Test, &options);
+	CuAssertTrue(tc, result == 0);
+	result = gpNvm_GetNotifyFd(handle, &fd);
+	CuAssertTrue(tc, result == 0);
+	pfd.fd = fd;
+	for (i = 0; i != 2; i++) {
+		pid = fork();
+		CuAssertTrue(tc, pid >= 0);
+		if (pid == 0) {
+			gpNvm_Handle *child;
+
+			status = gpNvm_Open(&child, gpNvm_file_Test, &options);
+			status |= gpNvm_Set(child, 9, sizeof value, value);
+			status |= gpNvm_Close(child);
+			_exit(status != 0);
+		}
+		CuAssertTrue(tc, waitpid(pid, &status, 0) == pid);
+		CuAssertTrue(tc, WIFEXITED(status) && WEXITSTATUS(status) == 0);
+		CuAssertIntEquals(tc, !i, poll(&pfd, 1, 0));
+		count = 8;
+		result = gpNvm_ReadChanges(handle, ids, &count);
+		CuAssertTrue(tc, result == 0);
+		CuAssertIntEquals(tc, !i, count);
+		CuAssertTrue(tc, i || ids[0] == 9);
+	}
+	result = gpNvm_Close(handle);
+	CuAssertTrue(tc, result == 0);
+	unlink(segment);
+}
+
+static void gpNvm_Delta_Test(CuTest* tc)
+{
+	gpNvm_Options options = { GPNVM_OPEN_LOG };
+	gpNvm_WriteCounters before, after;
+	gpNvm_Handle *handle;
+	gpNvm_Result result;
+	UInt8 value[200], copy[200], length;
+	struct stat st;
+	off_t size;
+	int i;
+#if GPNVM_STATS
+	gpNvm_Stats stats;
+#endif
+
+	for (i = 0; i != sizeof value; i++)
+		value[i] = i;
+	unlink(gpNvm_file_Test);
+	result = gpNvm_Open(&handle, gpNvm_file_Test, NULL);
+	CuAssertTrue(tc, result == 0);
+	result = gpNvm_Set(handle, 1, sizeof value, value);
+	CuAssertTrue(tc, result == 0);
+	result = gpNvm_Set(handle, 2, sizeof value, value);
+	CuAssertTrue(tc, result == 0);
+
+	/* is a write of the value already there suppressed, without a flush? */
+	gpNvm_GetWriteCounters(handle, &before);
+	result = gpNvm_Set(handle, 1, sizeof value, value);
+	CuAssertTrue(tc, result == 0);
+	gpNvm_GetWriteCounters(handle, &after);
+	CuAssertTrue(tc, after.writes == before.writes + 1);
+	CuAssertTrue(tc, after.suppressed == before.suppressed + 1);
+	CuAssertTrue(tc, after.records == before.records);
+	CuAssertTrue(tc, after.flushes == before.flushes);
+	CuAssertTrue(tc, after.bytesSaved > before.bytesSaved + sizeof value);
+
+	/* is only the changed range and the check written of a changed value? */
+	gpNvm_ResetStats(handle);
+	before = after;
+	value[190] ^= 0xff;
+	result = gpNvm_Set(handle, 1, sizeof value, value);
+	CuAssertTrue(tc, result == 0);
+	gpNvm_GetWriteCounters(handle, &after);
+	CuAssertTrue(tc, after.records == before.records + 1);
+	CuAssertTrue(tc, after.suppressed == before.suppressed);
+	CuAssertTrue(tc, after.bytesSaved >= before.bytesSaved + sizeof value - 16);
+#if GPNVM_STATS
+	result = gpNvm_GetStats(handle, &stats);
+	CuAssertTrue(tc, result == 0);
+	CuAssertTrue(tc, stats.bytesWritten > 0 && stats.bytesWritten <= 16);
+#endif
+
+	/* does a batch write only the records that changed? */
+	before = after;
+	result = gpNvm_BeginBatch(handle);
+	CuAssertTrue(tc, result == 0);
+	result = gpNvm_Set(handle, 1, sizeof value, value);
+	CuAssertTrue(tc, result == 0);
+	value[0] ^= 0xff;
+	result = gpNvm_Set(handle, 2, sizeof value, value);
+	CuAssertTrue(tc, result == 0);
+	result = gpNvm_CommitBatch(handle);
+	CuAssertTrue(tc, result == 0);
+	gpNvm_GetWriteCounters(handle, &after);
+	CuAssertTrue(tc, after.records == before.records + 1);
+	CuAssertTrue(tc, after.suppressed == before.suppressed + 1);
+
+	/* and does the file hold the values, their checks intact? */
+	result = gpNvm_Close(handle);
+	CuAssertTrue(tc, result == 0);
+	result = gpNvm_Open(&handle, gpNvm_file_Test, NULL);
+	CuAssertTrue(tc, result == 0);
+	length = sizeof copy;
+	result = gpNvm_Get(handle, 2, &length, copy);
+	CuAssertTrue(tc, result == 0);
+	CuAssertTrue(tc, memcmp(copy, value, sizeof value) == 0);
+	value[0] ^= 0xff;
+	length = sizeof copy;
+	result = gpNvm_Get(handle, 1, &length, copy);
+	CuAssertTrue(tc, result == 0);
+	CuAssertTrue(tc, memcmp(copy, value, sizeof value) == 0);
+	result = gpNvm_Close(handle);
+	CuAssertTrue(tc, result == 0);
+
+	/* does a log leave out a record that changes nothing? */
+	unlink(gpNvm_file_Test);
+	result = gpNvm_Open(&handle, gpNvm_file_Test, &options);
+	CuAssertTrue(tc, result == 0);
+	result = gpNvm_Set(handle, 1, sizeof value, value);
+	CuAssertTrue(tc, result == 0);
+	CuAssertTrue(tc, stat(gpNvm_file_Test, &st) == 0);
+	size = st.st_size;
+	result = gpNvm_Set(handle, 1, sizeof value, value);
+	CuAssertTrue(tc, result == 0);
+	CuAssertTrue(tc, stat(gpNvm_file_Test, &st) == 0);
+	CuAssertTrue(tc, st.st_size == size);
+	value[0] ^= 0xff;
+	result = gpNvm_Set(handle, 1, sizeof value, value);
+	CuAssertTrue(tc, result == 0);
+	CuAssertTrue(tc, stat(gpNvm_file_Test, &st) == 0);
+	CuAssertTrue(tc, st.st_size > size);
+	result = gpNvm_Close(handle);
+	CuAssertTrue(tc, result == 0);
+}
+
+/* size of the test file, -1 if there is none */
+static long gpNvm_Free_Size(void)
+{
+	struct stat st;
+
+	return stat(gpNvm_file_Test, &st) ? -1 : (long)st.st_size;
+}
+
+static void gpNvm_Free_Test(CuTest* tc)
+{
+	static const gpNvm_Options modes[] = { { 0 }, { GPNVM_OPEN_TOC }, { GPNVM_OPEN_LOG } };
+	gpNvm_Options options = { 0 };
+	gpNvm_Backend counting = gpNvm_MemoryBackend;
+	gpNvm_WriteCounters counters;
+	gpNvm_Handle *handle;
+	gpNvm_Result result, results[8];
+	gpNvm_AttrId attrIds[8];
+	UInt8 value[64] = { 0 }, sameValue[64], length, lengths[8], *values[8];
+	UInt8 merged = GPNVM_STATIC_RECORD(8) + 8;
+	int syncs;
+	UInt32 sameOptions = 5;
+	long size;
+	int i, m;
+#if GPNVM_STATS
+	gpNvm_Stats stats;
+#endif
+
+	for (m = 0; m != 3; m++) {
+		unlink(gpNvm_file_Test);
+		result = gpNvm_Open(&handle, gpNvm_file_Test, &modes[m]);
+		CuAssertTrue(tc, result == 0);
+		for (i = 0; i != 16; i++) {
+			value[0] = i;
+			result = gpNvm_Set(handle, 0x10 + i, 8, value);
+			CuAssertTrue(tc, result == 0);
+		}
+
+		/* is a deleted attribute gone, and a second delete detected? */
+		result = gpNvm_Delete(handle, 0x14);
+		CuAssertTrue(tc, result == 0);
+		length = 8;
+		result = gpNvm_Get(handle, 0x14, &length, sameValue);
+		CuAssertTrue(tc, result == 1);
+		result = gpNvm_Delete(handle, 0x14);
+		CuAssertTrue(tc, result == 1);
+		result = gpNvm_Delete(handle, 0x15);
+		CuAssertTrue(tc, result == 0);
+
+		/* do the others keep their values, and the deletes survive a
+		 * reopen? */
+		result = gpNvm_Close(handle);
+		CuAssertTrue(tc, result == 0);
+		result = gpNvm_Open(&handle, gpNvm_file_Test, &modes[m]);
+		CuAssertTrue(tc, result == 0);
+#if GPNVM_STATS
+		/* is the table of contents kept, the last entries moved into
+		 * the place of those deleted? */
+		result = gpNvm_GetStats(handle, &stats);
+		CuAssertTrue(tc, result == 0);
+		CuAssertTrue(tc, m != 1 || stats.scanned == 0);
+#endif
+		for (i = 0; i != 16; i++) {
+			length = 8;
+			result = gpNvm_Get(handle, 0x10 + i, &length, sameValue);
+			CuAssertTrue(tc, result == (i == 4 || i == 5));
+			CuAssertTrue(tc, result || sameValue[0] == i);
+		}
+
+		/* does an attribute come back once written again? */
+		value[0] = 0x55;
+		result = gpNvm_Set(handle, 0x14, 8, value);
+		CuAssertTrue(tc, result == 0);
+		length = 8;
+		result = gpNvm_Get(handle, 0x14, &length, sameValue);
+		CuAssertTrue(tc, result == 0 && sameValue[0] == 0x55);
+		result = gpNvm_Close(handle);
+		CuAssertTrue(tc, result == 0);
+	}
+
+	/* do the records of the in-place format go in the free space, the
+	 * file not growing? */
+	unlink(gpNvm_file_Test);
+	result = gpNvm_Open(&handle, gpNvm_file_Test, NULL);
+	CuAssertTrue(tc, result == 0);
+	for (i = 0; i != 16; i++) {
+		value[0] = i;
+		result = gpNvm_Set(handle, 0x10 + i, 8, value);
+		CuAssertTrue(tc, result == 0);
+	}
+	size = gpNvm_Free_Size();
+	for (i = 4; i != 8; i++) {
+		result = gpNvm_Delete(handle, 0x10 + i);
+		CuAssertTrue(tc, result == 0);
+	}
+	for (i = 0; i != 2; i++) {
+		result = gpNvm_Set(handle, 0x30 + i, 8, value);
+		CuAssertTrue(tc, result == 0);
+	}
+	gpNvm_GetWriteCounters(handle, &counters);
+	CuAssertTrue(tc, counters.deletes == 4);
+	CuAssertTrue(tc, counters.reused == 2);
+	CuAssertTrue(tc, gpNvm_Free_Size() == size);
+
+	/* are adjacent holes merged, to take a record as long as both? */
+	result = gpNvm_Set(handle, 0x32, merged, value);
+	CuAssertTrue(tc, result == 0);
+	gpNvm_GetWriteCounters(handle, &counters);
+	CuAssertTrue(tc, counters.reused == 3);
+	CuAssertTrue(tc, gpNvm_Free_Size() == size);
+
+	/* does a value of another length move the attribute, freeing its
+	 * record for the next one? */
+	value[0] = 0x77;
+	result = gpNvm_Set(handle, 0x10, merged, value);
+	CuAssertTrue(tc, result == 0);
+	result = gpNvm_GetLength(handle, 0x10, &length);
+	CuAssertTrue(tc, result == 0 && length == merged);
+	size = gpNvm_Free_Size();
+	result = gpNvm_Set(handle, 0x33, 8, value);
+	CuAssertTrue(tc, result == 0);
+	gpNvm_GetWriteCounters(handle, &counters);
+	CuAssertTrue(tc, counters.reused == 4);
+	CuAssertTrue(tc, gpNvm_Free_Size() == size);
+
+	/* is free space at the end given back, and kept over a reopen? */
+	result = gpNvm_Delete(handle, 0x10);
+	CuAssertTrue(tc, result == 0);
+	result = gpNvm_Delete(handle, 0x1f);
+	CuAssertTrue(tc, result == 0);
+	result = gpNvm_Close(handle);
+	CuAssertTrue(tc, result == 0);
+	result = gpNvm_Open(&handle, gpNvm_file_Test, NULL);
+	CuAssertTrue(tc, result == 0);
+	result = gpNvm_Set(handle, 0x34, merged, value);
+	CuAssertTrue(tc, result == 0);
+	result = gpNvm_Set(handle, 0x35, 8, value);
+	CuAssertTrue(tc, result == 0);
+	CuAssertTrue(tc, gpNvm_Free_Size() == size);
+	for (i = 0; i != 6; i++) {
+		length = i == 2 || i == 4 ? merged : 8;
+		result = gpNvm_Get(handle, 0x30 + i, &length, sameValue);
+		CuAssertTrue(tc, result == 0);
+	}
+	result = gpNvm_Close(handle);
+	CuAssertTrue(tc, result == 0);
+
+	/* is deleting a declared attribute refused? */
+	GPNVM_STATIC_OPTIONS(&options);
+	result = gpNvm_Open(&handle, gpNvm_file_Test, &options);
+	CuAssertTrue(tc, result == 0);
+	result = GPNVM_STATIC_SET(handle, options, &sameOptions);
+	CuAssertTrue(tc, result == 0);
+	result = gpNvm_Delete(handle, gpNvm_StaticId_options);
+	CuAssertTrue(tc, result == 1);
+	result = gpNvm_Delete(handle, 0x30);
+	CuAssertTrue(tc, result == 0);
+	result = gpNvm_Close(handle);
+	CuAssertTrue(tc, result == 0);
+
+	/* are the records that moved in one write freed with one sync, after
+	 * those of the records written and of their commit? */
+	counting.sync = gpNvm_Backend_CountSync;
+	options.backend = &counting;
+	options.schema = NULL;
+	options.schemaCount = 0;
+	result = gpNvm_Open(&handle, NULL, &options);
+	CuAssertTrue(tc, result == 0);
+	for (i = 0; i != 8; i++) {
+		attrIds[i] = 0x40 + i;
+		lengths[i] = 4;
+		values[i] = value;
+		result = gpNvm_Set(handle, attrIds[i], 8, value);
+		CuAssertTrue(tc, result == 0);
+	}
+	syncs = gpNvm_Backend_syncs;
+	result = gpNvm_SetMany(handle, 8, attrIds, lengths, values, results);
+	CuAssertTrue(tc, result == 0);
+	CuAssertTrue(tc, gpNvm_Backend_syncs - syncs == 3);
+	result = gpNvm_Close(handle);
+	CuAssertTrue(tc, result == 0);
+}
+
+/* operations the cut backend lets through; the one after them writes
+ * half its bytes and fails, as do all later ones, as if power were lost
+ * there */
+static int gpNvm_Cut_left = INT_MAX;
+
+static int gpNvm_Cut_WriteAt(void *ctx, long offset, const void *ptr, int len)
+{
+	if (gpNvm_Cut_left-- > 0)
+		return gpNvm_FileBackend.writeAt(ctx, offset, ptr, len);
+	if (gpNvm_Cut_left == -1)
+		gpNvm_FileBackend.writeAt(ctx, offset, ptr, len / 2);
+	return 1;
+}
+
+static int gpNvm_Cut_Sync(void *ctx, long offset, long len)
+{
+	return gpNvm_Cut_left-- > 0 ? gpNvm_FileBackend.sync(ctx, offset, len) : 1;
+}
+
+static int gpNvm_Cut_Erase(void *ctx, long offset, long len)
+{
+	return gpNvm_Cut_left-- > 0 ? gpNvm_FileBackend.erase(ctx, offset, len) : 1;
+}
+
+static void gpNvm_Cut_Test(CuTest* tc)
+{
+	gpNvm_Options modes[] = { { 0 }, { GPNVM_OPEN_TOC }, { GPNVM_OPEN_LOG }, { 0 } }, options;
+	static const gpNvm_AttrId attrIds[] = { gpNvm_StaticId_options, 0x51, 0x52, 0x53, 0x54 };
+	gpNvm_Backend cut = gpNvm_FileBackend;
+	gpNvm_Handle *handle;
+	gpNvm_Result result;
+	UInt8 value[100], sameValue[8], length;
+	int i, m, n, done, fresh;
+
+	cut.writeAt = gpNvm_Cut_WriteAt;
+	cut.sync = gpNvm_Cut_Sync;
+	cut.erase = gpNvm_Cut_Erase;
+	GPNVM_STATIC_OPTIONS(&modes[3]);
+
+	for (m = 0; m != 4; m++) {
+		for (n = 0, done = 0; !done; n++) {
+			unlink(gpNvm_file_Test);
+			result = gpNvm_Open(&handle, gpNvm_file_Test, &modes[m]);
+			CuAssertTrue(tc, result == 0);
+			memset(value, 0x11, sizeof value);
+			result = gpNvm_Set(handle, 0x55, sizeof value, value);
+			CuAssertTrue(tc, result == 0);
+			for (i = 0; i != 4; i++) {
+				result = gpNvm_Set(handle, attrIds[i], 4, value);
+				CuAssertTrue(tc, result == 0);
+			}
+			result = gpNvm_Delete(handle, 0x55);
+			CuAssertTrue(tc, result == 0);
+			result = gpNvm_Close(handle);
+			CuAssertTrue(tc, result == 0);
+
+			/* commit a batch that replaces, resizes and adds attributes,
+			 * in the free space the delete left if the format reuses
+			 * it, cut short after n operations */
+			options = modes[m];
+			options.backend = &cut;
+			result = gpNvm_Open(&handle, gpNvm_file_Test, &options);
+			CuAssertTrue(tc, result == 0);
+			memset(value, 0x22, sizeof value);
+			result = gpNvm_BeginBatch(handle);
+			CuAssertTrue(tc, result == 0);
+			result = gpNvm_Set(handle, attrIds[0], 4, value);
+			CuAssertTrue(tc, result == 0);
+			result = gpNvm_Set(handle, attrIds[1], 8, value);
+			CuAssertTrue(tc, result == 0);
+			result = gpNvm_Set(handle, attrIds[2], 4, value);
+			CuAssertTrue(tc, result == 0);
+			result = gpNvm_Set(handle, attrIds[4], 8, value);
+			CuAssertTrue(tc, result == 0);
+			gpNvm_Cut_left = n;
+			result = gpNvm_CommitBatch(handle);
+			done = gpNvm_Cut_left >= 0;
+			CuAssertTrue(tc, !done || result == 0);
+			gpNvm_Close(handle);
+			gpNvm_Cut_left = INT_MAX;
+
+			/* does the reopened store hold the whole batch or none of
+			 * it? */
+			result = gpNvm_Open(&handle, gpNvm_file_Test, &modes[m]);
+			CuAssertTrue(tc, result == 0);
+			length = sizeof sameValue;
+			fresh = gpNvm_Get(handle, attrIds[4], &length, sameValue) == 0;
+			CuAssertTrue(tc, !done || fresh);
+			for (i = 0; i != 4; i++) {
+				memset(value, fresh && i != 3 ? 0x22 : 0x11, 8);
+				length = fresh && i == 1 ? 8 : 4;
+				result = gpNvm_Get(handle, attrIds[i], &length, sameValue);
+				CuAssertTrue(tc, result == 0);
+				CuAssertTrue(tc, memcmp(sameValue, value, length) == 0);
+			}
+			result = gpNvm_Close(handle);
+			CuAssertTrue(tc, result == 0);
+		}
+	}
+}
+
 static int RunAllTests(void)
 {
 	int failCount = 0;
@@ -176,6 +2766,32 @@ static int RunAllTests(void)
 	SUITE_ADD_TEST(suite, gpNvm_OpenCloseFile_Test);
 	SUITE_ADD_TEST(suite, gpNvm_GetAttribute_Test);
 	SUITE_ADD_TEST(suite, gpNvm_SetAttribute_Test);
+	SUITE_ADD_TEST(suite, gpNvm_Index_Test);
+	SUITE_ADD_TEST(suite, gpNvm_Mmap_Test);
+	SUITE_ADD_TEST(suite, gpNvm_Batch_Test);
+	SUITE_ADD_TEST(suite, gpNvm_Log_Test);
+	SUITE_ADD_TEST(suite, gpNvm_Crc32c_Test);
+	SUITE_ADD_TEST(suite, gpNvm_Migrate_Test);
+	SUITE_ADD_TEST(suite, gpNvm_Handle_Test);
+	SUITE_ADD_TEST(suite, gpNvm_Wide_Test);
+	SUITE_ADD_TEST(suite, gpNvm_Threads_Test);
+	SUITE_ADD_TEST(suite, gpNvm_View_Test);
+	SUITE_ADD_TEST(suite, gpNvm_WriteBack_Test);
+	SUITE_ADD_TEST(suite, gpNvm_Stats_Test);
+	SUITE_ADD_TEST(suite, gpNvm_Backend_Test);
+	SUITE_ADD_TEST(suite, gpNvm_Flash_Test);
+	SUITE_ADD_TEST(suite, gpNvm_Recover_Test);
+	SUITE_ADD_TEST(suite, gpNvm_Async_Test);
+	SUITE_ADD_TEST(suite, gpNvm_Bulk_Test);
+	SUITE_ADD_TEST(suite, gpNvm_Snapshot_Test);
+	SUITE_ADD_TEST(suite, gpNvm_Toc_Test);
+	SUITE_ADD_TEST(suite, gpNvm_Static_Test);
+	SUITE_ADD_TEST(suite, gpNvm_Durability_Test);
+	SUITE_ADD_TEST(suite, gpNvm_Shared_Test);
+	SUITE_ADD_TEST(suite, gpNvm_Notify_Test);
+	SUITE_ADD_TEST(suite, gpNvm_Delta_Test);
+	SUITE_ADD_TEST(suite, gpNvm_Free_Test);
+	SUITE_ADD_TEST(suite, gpNvm_Cut_Test);
 
 	CuSuiteRun(suite);
 	failCount = suite->failCount;